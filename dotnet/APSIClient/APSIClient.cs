@@ -13,6 +13,8 @@ namespace Microsoft.Research.APSI.Client
     /// </summary>
     public class APSIClient : NativeObject
     {
+        private static readonly Func<IntPtr, uint> ReleaseNativePointer = NativeMethods.APSIClient_ReleaseNativePointer;
+
         /// <summary>
         /// Create an APSIClient object
         /// </summary>
@@ -38,6 +40,36 @@ namespace Microsoft.Research.APSI.Client
             HRESULT.ThrowIfFailed(hr, "Set parameters on APSIClient");
         }
 
+        /// <summary>
+        /// Set parameters on the current APSIClient, optionally reusing keys.
+        /// 
+        /// Generating keys is a large part of the cost of setting parameters. When reuseKeys is true, keys are
+        /// taken from a process-wide cache keyed by the parameters, so only the first client with a given
+        /// parameter set generates them. All clients that reuse keys for the same parameters share them until
+        /// <see cref="ClearKeyCache"/> is called.
+        /// </summary>
+        /// <param name="parameters">Parameters received from the server</param>
+        /// <param name="reuseKeys">Whether to reuse cached keys for these parameters</param>
+        /// <exception cref="ArgumentNullException"></exception>
+        public void SetParameters(byte[] parameters, bool reuseKeys)
+        {
+            if (parameters == null)
+                throw new ArgumentNullException(nameof(parameters));
+
+            uint hr = NativeMethods.APSIClient_SetParameters2(NativePtr, (ulong)parameters.LongLength, parameters, reuseKeys ? 1 : 0);
+            HRESULT.ThrowIfFailed(hr, "Set parameters on APSIClient");
+        }
+
+        /// <summary>
+        /// Drop the keys cached by <see cref="SetParameters(byte[], bool)"/>. Clients that already use
+        /// them are not affected; the next client that reuses keys generates new ones.
+        /// </summary>
+        public static void ClearKeyCache()
+        {
+            uint hr = NativeMethods.APSIClient_ClearKeyCache();
+            HRESULT.ThrowIfFailed(hr, "Clear key cache");
+        }
+
         /// <summary>
         /// Create an OPRF request
         /// </summary>
@@ -59,12 +91,25 @@ namespace Microsoft.Research.APSI.Client
             uint hr = NativeMethods.APSIClient_CreateOPRFRequest(NativePtr, itemCount, items, ref oprfRequestSize, ref oprfRequestPtr);
             HRESULT.ThrowIfFailed(hr, "Create OPRF request");
 
-            byte[] oprfRequest = new byte[oprfRequestSize];
-            Marshal.Copy(oprfRequestPtr, oprfRequest, startIndex: 0, length: (int)oprfRequestSize);
-            hr = NativeMethods.APSIClient_ReleaseNativePointer(oprfRequestPtr);
-            HRESULT.ThrowIfFailed(hr, "Release OPRF request");
+            return ToByteArray(oprfRequestSize, oprfRequestPtr, "Release OPRF request");
+        }
+
+        /// <summary>
+        /// Create an OPRF request without copying the items or the request to managed arrays
+        /// </summary>
+        /// <param name="items">Items to query, as consecutive pairs of ulongs</param>
+        /// <returns>Native buffer with the request to send to the APSI server</returns>
+        /// <exception cref="ArgumentException"></exception>
+        public NativeBuffer CreateOPRFRequest(ReadOnlySpan<ulong> items)
+        {
+            CheckItemPairs(items, nameof(items));
 
-            return oprfRequest;
+            ulong oprfRequestSize = 0;
+            IntPtr oprfRequestPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClient_CreateOPRFRequest(NativePtr, (ulong)items.Length / 2, ref MemoryMarshal.GetReference(items), ref oprfRequestSize, ref oprfRequestPtr);
+            HRESULT.ThrowIfFailed(hr, "Create OPRF request");
+
+            return ToNativeBuffer(oprfRequestSize, oprfRequestPtr);
         }
 
         /// <summary>
@@ -83,20 +128,23 @@ namespace Microsoft.Research.APSI.Client
             uint hr = NativeMethods.APSIClient_ExtractHashes(NativePtr, (ulong)oprfResponse.LongLength, oprfResponse, ref hashedItemCount, ref hashedItemsPtr);
             HRESULT.ThrowIfFailed(hr, "Extract hashes");
 
-            int hashedItemsBytesLength = (int)hashedItemCount * sizeof(ulong) * 2;
-            byte[] hashedItemsBytes = new byte[hashedItemsBytesLength];
-            Marshal.Copy(hashedItemsPtr, hashedItemsBytes, startIndex: 0, length: hashedItemsBytesLength);
-            hr = NativeMethods.APSIClient_ReleaseNativePointer(hashedItemsPtr);
-            HRESULT.ThrowIfFailed(hr, "Release hashed items");
+            return ToHashedItems(hashedItemCount, hashedItemsPtr);
+        }
 
-            ulong[,] hashedItems = new ulong[hashedItemCount, 2];
-            for (int idx = 0; idx < (int)hashedItemCount; idx++)
-            {
-                hashedItems[idx, 0] = BitConverter.ToUInt64(hashedItemsBytes, sizeof(ulong) * (idx * 2));
-                hashedItems[idx, 1] = BitConverter.ToUInt64(hashedItemsBytes, sizeof(ulong) * (idx * 2 + 1));
-            }
+        /// <summary>
+        /// Extract hashed items from an OPRF response without copying the response or the items to managed arrays
+        /// </summary>
+        /// <param name="oprfResponse">OPRF Response received from an APSI server</param>
+        /// <returns>Native buffer with the hashed items as consecutive pairs of ulongs, see
+        /// <see cref="NativeBuffer.AsSpan{T}"/></returns>
+        public NativeBuffer ExtractHashes(ReadOnlySpan<byte> oprfResponse)
+        {
+            ulong hashedItemCount = 0;
+            IntPtr hashedItemsPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClient_ExtractHashes(NativePtr, (ulong)oprfResponse.Length, ref MemoryMarshal.GetReference(oprfResponse), ref hashedItemCount, ref hashedItemsPtr);
+            HRESULT.ThrowIfFailed(hr, "Extract hashes");
 
-            return hashedItems;
+            return ToNativeBuffer(hashedItemCount * sizeof(ulong) * 2, hashedItemsPtr);
         }
 
         /// <summary>
@@ -107,6 +155,22 @@ namespace Microsoft.Research.APSI.Client
         /// <exception cref="ArgumentNullException"></exception>
         /// <exception cref="ArgumentException"></exception>
         public byte[] CreateQuery(ulong[,] items)
+        {
+            return CreateQuery(items, includeRelinKeys: true);
+        }
+
+        /// <summary>
+        /// Create an APSI query to send to an APSI server, optionally without the relinearization keys.
+        ///
+        /// The keys are several MB and do not change. A server that caches them per session only needs them
+        /// in the first query of the session; see APSIServer.Query(byte[], ulong).
+        /// </summary>
+        /// <param name="items">Hashed items</param>
+        /// <param name="includeRelinKeys">Whether to include the relinearization keys in the query</param>
+        /// <returns>Byte array containing the encrypted query to send to an APSI server</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        /// <exception cref="ArgumentException"></exception>
+        public byte[] CreateQuery(ulong[,] items, bool includeRelinKeys)
         {
             if (null == items)
                 throw new ArgumentNullException(nameof(items));
@@ -116,15 +180,118 @@ namespace Microsoft.Research.APSI.Client
             ulong itemCount = (ulong)items.GetLongLength(dimension: 0);
             ulong queryBufferSize = 0;
             IntPtr encryptedQueryPtr = IntPtr.Zero;
-            uint hr = NativeMethods.APSIClient_CreateQuery(NativePtr, itemCount, items, ref queryBufferSize, ref encryptedQueryPtr);
+            uint hr = NativeMethods.APSIClient_CreateQuery2(NativePtr, itemCount, items, includeRelinKeys ? 1 : 0, ref queryBufferSize, ref encryptedQueryPtr);
             HRESULT.ThrowIfFailed(hr, "Create query");
 
-            byte[] encryptedQuery = new byte[queryBufferSize];
-            Marshal.Copy(encryptedQueryPtr, encryptedQuery, startIndex: 0, length: (int)queryBufferSize);
-            hr = NativeMethods.APSIClient_ReleaseNativePointer(encryptedQueryPtr);
-            HRESULT.ThrowIfFailed(hr, "Release encrypted query");
+            return ToByteArray(queryBufferSize, encryptedQueryPtr, "Release encrypted query");
+        }
 
-            return encryptedQuery;
+        /// <summary>
+        /// Create an APSI query to send to an APSI server with the given compression instead of the one set with
+        /// <see cref="SetCompression"/>
+        /// </summary>
+        /// <param name="items">Hashed items</param>
+        /// <param name="includeRelinKeys">Whether to include the relinearization keys in the query</param>
+        /// <param name="compression">Compression of the query, and by default of its result</param>
+        /// <returns>Byte array containing the encrypted query to send to an APSI server</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        /// <exception cref="ArgumentException"></exception>
+        public byte[] CreateQuery(ulong[,] items, bool includeRelinKeys, Compression compression)
+        {
+            if (null == items)
+                throw new ArgumentNullException(nameof(items));
+            if (items.GetLength(dimension: 1) != 2)
+                throw new ArgumentException($"{nameof(items)} should be an array of pairs of ulongs");
+
+            ulong itemCount = (ulong)items.GetLongLength(dimension: 0);
+            ulong queryBufferSize = 0;
+            IntPtr encryptedQueryPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClient_CreateQuery3(NativePtr, itemCount, items, includeRelinKeys ? 1 : 0, (int)compression, ref queryBufferSize, ref encryptedQueryPtr);
+            HRESULT.ThrowIfFailed(hr, "Create query");
+
+            return ToByteArray(queryBufferSize, encryptedQueryPtr, "Release encrypted query");
+        }
+
+        /// <summary>
+        /// Create an APSI query without copying the hashed items or the query to managed arrays.
+        /// The query of a large batch is several MB, and would otherwise land on the large object heap.
+        /// </summary>
+        /// <param name="items">Hashed items, as consecutive pairs of ulongs</param>
+        /// <param name="includeRelinKeys">Whether to include the relinearization keys in the query</param>
+        /// <returns>Native buffer with the encrypted query to send to an APSI server</returns>
+        /// <exception cref="ArgumentException"></exception>
+        public NativeBuffer CreateQuery(ReadOnlySpan<ulong> items, bool includeRelinKeys = true)
+        {
+            CheckItemPairs(items, nameof(items));
+
+            ulong queryBufferSize = 0;
+            IntPtr encryptedQueryPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClient_CreateQuery2(NativePtr, (ulong)items.Length / 2, ref MemoryMarshal.GetReference(items), includeRelinKeys ? 1 : 0, ref queryBufferSize, ref encryptedQueryPtr);
+            HRESULT.ThrowIfFailed(hr, "Create query");
+
+            return ToNativeBuffer(queryBufferSize, encryptedQueryPtr);
+        }
+
+        /// <summary>
+        /// Create an APSI query with the given compression without copying the hashed items or the query to managed arrays
+        /// </summary>
+        /// <param name="items">Hashed items, as consecutive pairs of ulongs</param>
+        /// <param name="compression">Compression of the query, and by default of its result</param>
+        /// <param name="includeRelinKeys">Whether to include the relinearization keys in the query</param>
+        /// <returns>Native buffer with the encrypted query to send to an APSI server</returns>
+        /// <exception cref="ArgumentException"></exception>
+        public NativeBuffer CreateQuery(ReadOnlySpan<ulong> items, Compression compression, bool includeRelinKeys = true)
+        {
+            CheckItemPairs(items, nameof(items));
+
+            ulong queryBufferSize = 0;
+            IntPtr encryptedQueryPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClient_CreateQuery3(NativePtr, (ulong)items.Length / 2, ref MemoryMarshal.GetReference(items), includeRelinKeys ? 1 : 0, (int)compression, ref queryBufferSize, ref encryptedQueryPtr);
+            HRESULT.ThrowIfFailed(hr, "Create query");
+
+            return ToNativeBuffer(queryBufferSize, encryptedQueryPtr);
+        }
+
+        /// <summary>
+        /// Set the compression of the queries of this client and of the sessions it creates afterwards.
+        /// The default is Zstd when SEAL is built with it.
+        ///
+        /// A server compresses each result like its query, unless it was given its own compression with
+        /// APSIServer.SetResultCompression. OPRF requests are random curve points and are never compressed.
+        /// </summary>
+        /// <param name="compression">Compression of the queries</param>
+        /// <exception cref="InvalidOperationException">The native library does not support the compression</exception>
+        public void SetCompression(Compression compression)
+        {
+            uint hr = NativeMethods.APSIClient_SetCompression(NativePtr, (int)compression);
+            HRESULT.ThrowIfFailed(hr, "Set compression");
+        }
+
+        /// <summary>
+        /// Create an APSI query, writing it directly to the given destination if it fits
+        /// </summary>
+        /// <param name="items">Hashed items, as consecutive pairs of ulongs</param>
+        /// <param name="destination">Buffer that receives the encrypted query to send to an APSI server</param>
+        /// <param name="querySize">Size of the query</param>
+        /// <param name="leasedQuery">Native buffer with the query if it did not fit in the destination, null otherwise</param>
+        /// <param name="includeRelinKeys">Whether to include the relinearization keys in the query</param>
+        /// <returns>False if the destination is too small for the query, which is then in <paramref name="leasedQuery"/></returns>
+        /// <exception cref="ArgumentException"></exception>
+        public unsafe bool CreateQueryInto(ReadOnlySpan<ulong> items, Span<byte> destination, out int querySize, out NativeBuffer leasedQuery, bool includeRelinKeys = true)
+        {
+            CheckItemPairs(items, nameof(items));
+
+            fixed (byte* destinationPtr = destination)
+            {
+                ulong queryBufferSize = 0;
+                IntPtr encryptedQueryPtr = IntPtr.Zero;
+                uint hr = NativeMethods.APSIClient_CreateQueryInto(NativePtr, (ulong)items.Length / 2, ref MemoryMarshal.GetReference(items), includeRelinKeys ? 1 : 0, (ulong)destination.Length, new IntPtr(destinationPtr), ref queryBufferSize, ref encryptedQueryPtr);
+                HRESULT.ThrowIfFailed(hr, "Create query");
+
+                querySize = (int)queryBufferSize;
+                leasedQuery = IntPtr.Zero == encryptedQueryPtr ? null : ToNativeBuffer(queryBufferSize, encryptedQueryPtr);
+                return null == leasedQuery;
+            }
         }
 
         /// <summary>
@@ -143,19 +310,197 @@ namespace Microsoft.Research.APSI.Client
             uint hr = NativeMethods.APSIClient_ProcessResult(NativePtr, (ulong)encryptedResult.LongLength, encryptedResult, ref intersectionSize, ref intersectionPtr);
             HRESULT.ThrowIfFailed(hr, "Process result");
 
-            bool[] intersection = new bool[intersectionSize];
-            byte[] intersectionBt = new byte[intersectionSize];
-            Marshal.Copy(intersectionPtr, intersectionBt, startIndex: 0, length: intersectionBt.Length);
-            hr = NativeMethods.APSIClient_ReleaseNativePointer(intersectionPtr);
-            HRESULT.ThrowIfFailed(hr, "Release intersection");
+            return ToIntersection(intersectionSize, intersectionPtr);
+        }
+
+        /// <summary>
+        /// Process the encrypted result of a Query response without copying the result or the intersection
+        /// </summary>
+        /// <param name="encryptedResult">Encrypted result to process</param>
+        /// <returns>Native buffer with one byte per queried item, 1 if the item was found and 0 otherwise</returns>
+        public NativeBuffer ProcessResult(ReadOnlySpan<byte> encryptedResult)
+        {
+            ulong intersectionSize = 0;
+            IntPtr intersectionPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClient_ProcessResult(NativePtr, (ulong)encryptedResult.Length, ref MemoryMarshal.GetReference(encryptedResult), ref intersectionSize, ref intersectionPtr);
+            HRESULT.ThrowIfFailed(hr, "Process result");
+
+            return ToNativeBuffer(intersectionSize, intersectionPtr);
+        }
+
+        /// <summary>
+        /// Process the encrypted result of a Query response received from an APSI server with a labeled database
+        /// </summary>
+        /// <param name="encryptedResult">Encrypted result to process</param>
+        /// <param name="labels">Labels of the queried items, one after another in the order of the query.
+        /// Labels of items that were not found are all zeros.</param>
+        /// <param name="labelByteCount">Size in bytes of each label</param>
+        /// <returns>Array with the intersection result</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        public bool[] ProcessResult(byte[] encryptedResult, out byte[] labels, out int labelByteCount)
+        {
+            if (null == encryptedResult)
+                throw new ArgumentNullException(nameof(encryptedResult));
+
+            ulong intersectionSize = 0;
+            IntPtr intersectionPtr = IntPtr.Zero;
+            ulong nativeLabelByteCount = 0;
+            IntPtr labelsPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClient_ProcessLabeledResult(NativePtr, (ulong)encryptedResult.LongLength, encryptedResult, ref intersectionSize, ref intersectionPtr, ref nativeLabelByteCount, ref labelsPtr);
+            HRESULT.ThrowIfFailed(hr, "Process labeled result");
+
+            labelByteCount = (int)nativeLabelByteCount;
+            labels = ToLabels(intersectionSize * nativeLabelByteCount, labelsPtr);
+            return ToIntersection(intersectionSize, intersectionPtr);
+        }
+
+        /// <summary>
+        /// Process part of the encrypted result of a Query response as soon as it is received from an APSI server.
+        /// 
+        /// The first part must be the response header, followed by the result parts in the order they were
+        /// produced by the server. Each part is decrypted right away; call <see cref="FinalizeResult()"/> after
+        /// the last part to get the intersection.
+        /// </summary>
+        /// <param name="resultPart">Part of the encrypted result to process</param>
+        /// <exception cref="ArgumentNullException"></exception>
+        public void ProcessResultPart(byte[] resultPart)
+        {
+            if (null == resultPart)
+                throw new ArgumentNullException(nameof(resultPart));
+
+            uint hr = NativeMethods.APSIClient_ProcessResultPart(NativePtr, (ulong)resultPart.LongLength, resultPart);
+            HRESULT.ThrowIfFailed(hr, "Process result part");
+        }
+
+        /// <summary>
+        /// Get the intersection once all result parts have been given to <see cref="ProcessResultPart"/>
+        /// </summary>
+        /// <returns>Array with the intersection result</returns>
+        public bool[] FinalizeResult()
+        {
+            ulong intersectionSize = 0;
+            IntPtr intersectionPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClient_FinalizeResult(NativePtr, ref intersectionSize, ref intersectionPtr);
+            HRESULT.ThrowIfFailed(hr, "Finalize result");
+
+            return ToIntersection(intersectionSize, intersectionPtr);
+        }
+
+        /// <summary>
+        /// Get the intersection and the labels once all result parts of a query against a labeled database
+        /// have been given to <see cref="ProcessResultPart"/>
+        /// </summary>
+        /// <param name="labels">Labels of the queried items, one after another in the order of the query.
+        /// Labels of items that were not found are all zeros.</param>
+        /// <param name="labelByteCount">Size in bytes of each label</param>
+        /// <returns>Array with the intersection result</returns>
+        public bool[] FinalizeResult(out byte[] labels, out int labelByteCount)
+        {
+            ulong intersectionSize = 0;
+            IntPtr intersectionPtr = IntPtr.Zero;
+            ulong nativeLabelByteCount = 0;
+            IntPtr labelsPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClient_FinalizeLabeledResult(NativePtr, ref intersectionSize, ref intersectionPtr, ref nativeLabelByteCount, ref labelsPtr);
+            HRESULT.ThrowIfFailed(hr, "Finalize labeled result");
+
+            labelByteCount = (int)nativeLabelByteCount;
+            labels = ToLabels(intersectionSize * nativeLabelByteCount, labelsPtr);
+            return ToIntersection(intersectionSize, intersectionPtr);
+        }
+
+        /// <summary>
+        /// Create a session that shares the keys of this client.
+        /// 
+        /// Each session holds the state of its own query, so several queries can be in flight at once
+        /// without generating new keys for each of them. Parameters must have been set before creating
+        /// a session; a session keeps using the parameters and keys that were current when it was created.
+        /// </summary>
+        /// <returns>A new session, which must be disposed when no longer needed</returns>
+        public APSIClientSession CreateSession()
+        {
+            uint hr = NativeMethods.APSIClient_CreateSession(NativePtr, out IntPtr sessionPtr);
+            HRESULT.ThrowIfFailed(hr, "Create session");
+
+            return new APSIClientSession(sessionPtr);
+        }
+
+        /// <summary>
+        /// Set the total size of the query and result buffers that are kept for reuse once released,
+        /// 256 MB by default. The buffers come from a native pool shared by all clients in the process.
+        /// </summary>
+        /// <param name="maxRetainedBytes">Total size in bytes, 0 to free every buffer when it is released</param>
+        public static void SetBufferPoolLimit(ulong maxRetainedBytes)
+        {
+            uint hr = NativeMethods.APSIClient_SetBufferPoolLimit(maxRetainedBytes);
+            HRESULT.ThrowIfFailed(hr, "Set buffer pool limit");
+        }
+
+        internal static byte[] ToByteArray(ulong size, IntPtr nativeBuffer, string releaseDescription)
+        {
+            byte[] buffer = new byte[size];
+            Marshal.Copy(nativeBuffer, buffer, startIndex: 0, length: (int)size);
+            uint hr = NativeMethods.APSIClient_ReleaseNativePointer(nativeBuffer);
+            HRESULT.ThrowIfFailed(hr, releaseDescription);
 
-            int intersectionIndex = 0;
-            foreach (byte bt in intersectionBt)
+            return buffer;
+        }
+
+        internal static NativeBuffer ToNativeBuffer(ulong size, IntPtr nativeBuffer)
+        {
+            return new NativeBuffer(nativeBuffer, size, ReleaseNativePointer);
+        }
+
+        internal static ulong[,] ToHashedItems(ulong hashedItemCount, IntPtr hashedItemsPtr)
+        {
+            using (NativeBuffer hashedItemsBuffer = ToNativeBuffer(hashedItemCount * sizeof(ulong) * 2, hashedItemsPtr))
             {
-                intersection[intersectionIndex++] = (bt == 1);
+                Span<ulong> hashedItemsValues = hashedItemsBuffer.AsSpan<ulong>();
+
+                ulong[,] hashedItems = new ulong[hashedItemCount, 2];
+                for (int idx = 0; idx < (int)hashedItemCount; idx++)
+                {
+                    hashedItems[idx, 0] = hashedItemsValues[idx * 2];
+                    hashedItems[idx, 1] = hashedItemsValues[idx * 2 + 1];
+                }
+
+                return hashedItems;
             }
+        }
 
-            return intersection;
+        internal static byte[] ToLabels(ulong labelsSize, IntPtr labelsPtr)
+        {
+            byte[] labels = new byte[labelsSize];
+            if (labelsSize > 0)
+            {
+                Marshal.Copy(labelsPtr, labels, startIndex: 0, length: labels.Length);
+            }
+            uint hr = NativeMethods.APSIClient_ReleaseNativePointer(labelsPtr);
+            HRESULT.ThrowIfFailed(hr, "Release labels");
+
+            return labels;
+        }
+
+        internal static bool[] ToIntersection(ulong intersectionSize, IntPtr intersectionPtr)
+        {
+            // Read the native result in place instead of copying it to a byte array first
+            using (NativeBuffer intersectionBuffer = ToNativeBuffer(intersectionSize, intersectionPtr))
+            {
+                Span<byte> found = intersectionBuffer.Span;
+
+                bool[] intersection = new bool[found.Length];
+                for (int idx = 0; idx < found.Length; idx++)
+                {
+                    intersection[idx] = (found[idx] == 1);
+                }
+
+                return intersection;
+            }
+        }
+
+        internal static void CheckItemPairs(ReadOnlySpan<ulong> items, string paramName)
+        {
+            if (items.Length % 2 != 0)
+                throw new ArgumentException($"{paramName} should be consecutive pairs of ulongs", paramName);
         }
 
         /// <summary>
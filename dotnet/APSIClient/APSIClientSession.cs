@@ -0,0 +1,243 @@
+﻿// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.using System;
+
+using Microsoft.Research.APSI.Common;
+using System;
+
+namespace Microsoft.Research.APSI.Client
+{
+    /// <summary>
+    /// A single query created through <see cref="APSIClient.CreateSession"/>.
+    ///
+    /// All sessions of a client share its keys. Different sessions can be used from different
+    /// threads at the same time, but a single session must only be used by one thread at a time.
+    /// </summary>
+    public class APSIClientSession : NativeObject
+    {
+        internal APSIClientSession(IntPtr nativePtr)
+            : base(nativePtr)
+        {
+        }
+
+        /// <summary>
+        /// Create an OPRF request
+        /// </summary>
+        /// <param name="items">Items to query</param>
+        /// <returns>Byte array to send to APSI server</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        /// <exception cref="ArgumentException"></exception>
+        public byte[] CreateOPRFRequest(ulong[,] items)
+        {
+            if (items == null)
+                throw new ArgumentNullException(nameof(items));
+            if (items.GetLength(dimension: 1) != 2)
+                throw new ArgumentException($"{nameof(items)} should be an array of pairs of ulongs");
+
+            ulong itemCount = (ulong)items.GetLongLength(dimension: 0);
+            ulong oprfRequestSize = 0;
+            IntPtr oprfRequestPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClientSession_CreateOPRFRequest(NativePtr, itemCount, items, ref oprfRequestSize, ref oprfRequestPtr);
+            HRESULT.ThrowIfFailed(hr, "Create OPRF request");
+
+            return APSIClient.ToByteArray(oprfRequestSize, oprfRequestPtr, "Release OPRF request");
+        }
+
+        /// <summary>
+        /// Extract hashed items from an OPRF response received from an APSI server
+        /// </summary>
+        /// <param name="oprfResponse">OPRF Response received from an APSI server</param>
+        /// <returns>Hashed items that should be used to create an APSI query</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        public ulong[,] ExtractHashes(byte[] oprfResponse)
+        {
+            if (null == oprfResponse)
+                throw new ArgumentNullException(nameof(oprfResponse));
+
+            ulong hashedItemCount = 0;
+            IntPtr hashedItemsPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClientSession_ExtractHashes(NativePtr, (ulong)oprfResponse.LongLength, oprfResponse, ref hashedItemCount, ref hashedItemsPtr);
+            HRESULT.ThrowIfFailed(hr, "Extract hashes");
+
+            return APSIClient.ToHashedItems(hashedItemCount, hashedItemsPtr);
+        }
+
+        /// <summary>
+        /// Create an APSI query to send to an APSI server
+        /// </summary>
+        /// <param name="items">Hashed items</param>
+        /// <returns>Byte array containing the encrypted query to send to an APSI server</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        /// <exception cref="ArgumentException"></exception>
+        public byte[] CreateQuery(ulong[,] items)
+        {
+            return CreateQuery(items, includeRelinKeys: true);
+        }
+
+        /// <summary>
+        /// Create an APSI query to send to an APSI server, optionally without the relinearization keys.
+        ///
+        /// The keys are several MB and do not change. A server that caches them per session only needs them
+        /// in the first query of the session; see APSIServer.Query(byte[], ulong).
+        /// </summary>
+        /// <param name="items">Hashed items</param>
+        /// <param name="includeRelinKeys">Whether to include the relinearization keys in the query</param>
+        /// <returns>Byte array containing the encrypted query to send to an APSI server</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        /// <exception cref="ArgumentException"></exception>
+        public byte[] CreateQuery(ulong[,] items, bool includeRelinKeys)
+        {
+            if (null == items)
+                throw new ArgumentNullException(nameof(items));
+            if (items.GetLength(dimension: 1) != 2)
+                throw new ArgumentException($"{nameof(items)} should be an array of pairs of ulongs");
+
+            ulong itemCount = (ulong)items.GetLongLength(dimension: 0);
+            ulong queryBufferSize = 0;
+            IntPtr encryptedQueryPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClientSession_CreateQuery2(NativePtr, itemCount, items, includeRelinKeys ? 1 : 0, ref queryBufferSize, ref encryptedQueryPtr);
+            HRESULT.ThrowIfFailed(hr, "Create query");
+
+            return APSIClient.ToByteArray(queryBufferSize, encryptedQueryPtr, "Release encrypted query");
+        }
+
+        /// <summary>
+        /// Create an APSI query to send to an APSI server with the given compression instead of the one of the session
+        /// </summary>
+        /// <param name="items">Hashed items</param>
+        /// <param name="includeRelinKeys">Whether to include the relinearization keys in the query</param>
+        /// <param name="compression">Compression of the query, and by default of its result</param>
+        /// <returns>Byte array containing the encrypted query to send to an APSI server</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        /// <exception cref="ArgumentException"></exception>
+        public byte[] CreateQuery(ulong[,] items, bool includeRelinKeys, Compression compression)
+        {
+            if (null == items)
+                throw new ArgumentNullException(nameof(items));
+            if (items.GetLength(dimension: 1) != 2)
+                throw new ArgumentException($"{nameof(items)} should be an array of pairs of ulongs");
+
+            ulong itemCount = (ulong)items.GetLongLength(dimension: 0);
+            ulong queryBufferSize = 0;
+            IntPtr encryptedQueryPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClientSession_CreateQuery3(NativePtr, itemCount, items, includeRelinKeys ? 1 : 0, (int)compression, ref queryBufferSize, ref encryptedQueryPtr);
+            HRESULT.ThrowIfFailed(hr, "Create query");
+
+            return APSIClient.ToByteArray(queryBufferSize, encryptedQueryPtr, "Release encrypted query");
+        }
+
+        /// <summary>
+        /// Set the compression of the queries of this session. See <see cref="APSIClient.SetCompression"/>.
+        /// </summary>
+        /// <param name="compression">Compression of the queries</param>
+        /// <exception cref="InvalidOperationException">The native library does not support the compression</exception>
+        public void SetCompression(Compression compression)
+        {
+            uint hr = NativeMethods.APSIClientSession_SetCompression(NativePtr, (int)compression);
+            HRESULT.ThrowIfFailed(hr, "Set compression");
+        }
+
+        /// <summary>
+        /// Process the encrypted result of a Query response received from an APSI server
+        /// </summary>
+        /// <param name="encryptedResult">Encrypted result to process</param>
+        /// <returns>Array with the intersection result</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        public bool[] ProcessResult(byte[] encryptedResult)
+        {
+            if (null == encryptedResult)
+                throw new ArgumentNullException(nameof(encryptedResult));
+
+            ulong intersectionSize = 0;
+            IntPtr intersectionPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClientSession_ProcessResult(NativePtr, (ulong)encryptedResult.LongLength, encryptedResult, ref intersectionSize, ref intersectionPtr);
+            HRESULT.ThrowIfFailed(hr, "Process result");
+
+            return APSIClient.ToIntersection(intersectionSize, intersectionPtr);
+        }
+
+        /// <summary>
+        /// Process the encrypted result of a Query response received from an APSI server with a labeled database
+        /// </summary>
+        /// <param name="encryptedResult">Encrypted result to process</param>
+        /// <param name="labels">Labels of the queried items, one after another in the order of the query.
+        /// Labels of items that were not found are all zeros.</param>
+        /// <param name="labelByteCount">Size in bytes of each label</param>
+        /// <returns>Array with the intersection result</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        public bool[] ProcessResult(byte[] encryptedResult, out byte[] labels, out int labelByteCount)
+        {
+            if (null == encryptedResult)
+                throw new ArgumentNullException(nameof(encryptedResult));
+
+            ulong intersectionSize = 0;
+            IntPtr intersectionPtr = IntPtr.Zero;
+            ulong nativeLabelByteCount = 0;
+            IntPtr labelsPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClientSession_ProcessLabeledResult(NativePtr, (ulong)encryptedResult.LongLength, encryptedResult, ref intersectionSize, ref intersectionPtr, ref nativeLabelByteCount, ref labelsPtr);
+            HRESULT.ThrowIfFailed(hr, "Process labeled result");
+
+            labelByteCount = (int)nativeLabelByteCount;
+            labels = APSIClient.ToLabels(intersectionSize * nativeLabelByteCount, labelsPtr);
+            return APSIClient.ToIntersection(intersectionSize, intersectionPtr);
+        }
+
+        /// <summary>
+        /// Process part of the encrypted result of a Query response as soon as it is received from an APSI server.
+        /// See <see cref="APSIClient.ProcessResultPart"/>.
+        /// </summary>
+        /// <param name="resultPart">Part of the encrypted result to process</param>
+        /// <exception cref="ArgumentNullException"></exception>
+        public void ProcessResultPart(byte[] resultPart)
+        {
+            if (null == resultPart)
+                throw new ArgumentNullException(nameof(resultPart));
+
+            uint hr = NativeMethods.APSIClientSession_ProcessResultPart(NativePtr, (ulong)resultPart.LongLength, resultPart);
+            HRESULT.ThrowIfFailed(hr, "Process result part");
+        }
+
+        /// <summary>
+        /// Get the intersection once all result parts have been given to <see cref="ProcessResultPart"/>
+        /// </summary>
+        /// <returns>Array with the intersection result</returns>
+        public bool[] FinalizeResult()
+        {
+            ulong intersectionSize = 0;
+            IntPtr intersectionPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClientSession_FinalizeResult(NativePtr, ref intersectionSize, ref intersectionPtr);
+            HRESULT.ThrowIfFailed(hr, "Finalize result");
+
+            return APSIClient.ToIntersection(intersectionSize, intersectionPtr);
+        }
+
+        /// <summary>
+        /// Get the intersection and the labels once all result parts of a query against a labeled database
+        /// have been given to <see cref="ProcessResultPart"/>
+        /// </summary>
+        /// <param name="labels">Labels of the queried items, one after another in the order of the query.
+        /// Labels of items that were not found are all zeros.</param>
+        /// <param name="labelByteCount">Size in bytes of each label</param>
+        /// <returns>Array with the intersection result</returns>
+        public bool[] FinalizeResult(out byte[] labels, out int labelByteCount)
+        {
+            ulong intersectionSize = 0;
+            IntPtr intersectionPtr = IntPtr.Zero;
+            ulong nativeLabelByteCount = 0;
+            IntPtr labelsPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIClientSession_FinalizeLabeledResult(NativePtr, ref intersectionSize, ref intersectionPtr, ref nativeLabelByteCount, ref labelsPtr);
+            HRESULT.ThrowIfFailed(hr, "Finalize labeled result");
+
+            labelByteCount = (int)nativeLabelByteCount;
+            labels = APSIClient.ToLabels(intersectionSize * nativeLabelByteCount, labelsPtr);
+            return APSIClient.ToIntersection(intersectionSize, intersectionPtr);
+        }
+
+        /// <summary>
+        /// Release native instance
+        /// </summary>
+        protected override void DestroyNativeObject()
+        {
+            NativeMethods.APSIClientSession_Destroy(NativePtr);
+        }
+    }
+}
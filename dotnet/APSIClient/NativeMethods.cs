@@ -24,19 +24,100 @@ namespace Microsoft.Research.APSI.Client
         [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
         internal static extern uint APSIClient_SetParameters(IntPtr thisptr, ulong paramsSize, byte[] parameters);
 
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_SetParameters2(IntPtr thisptr, ulong paramsSize, byte[] parameters, int reuseKeys);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_ClearKeyCache();
+
         [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
         internal static extern uint APSIClient_CreateOPRFRequest(IntPtr thisptr, ulong itemCount, ulong[,] items, ref ulong oprfRequestSize, ref IntPtr oprfRequest);
 
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_CreateOPRFRequest(IntPtr thisptr, ulong itemCount, ref ulong items, ref ulong oprfRequestSize, ref IntPtr oprfRequest);
+
         [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
         internal static extern uint APSIClient_ExtractHashes(IntPtr thisptr, ulong oprfResponseSize, byte[] oprfResponse, ref ulong hashedItemCount, ref IntPtr hashedItems);
 
         [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
-        internal static extern uint APSIClient_CreateQuery(IntPtr thisptr, ulong itemCount, ulong[,] items, ref ulong encryptedQuerySize, ref IntPtr encryptedQuery);
+        internal static extern uint APSIClient_ExtractHashes(IntPtr thisptr, ulong oprfResponseSize, ref byte oprfResponse, ref ulong hashedItemCount, ref IntPtr hashedItems);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_CreateQuery2(IntPtr thisptr, ulong itemCount, ulong[,] items, int includeRelinKeys, ref ulong encryptedQuerySize, ref IntPtr encryptedQuery);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_CreateQuery2(IntPtr thisptr, ulong itemCount, ref ulong items, int includeRelinKeys, ref ulong encryptedQuerySize, ref IntPtr encryptedQuery);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_CreateQueryInto(IntPtr thisptr, ulong itemCount, ref ulong items, int includeRelinKeys, ulong destinationCapacity, IntPtr destination, ref ulong encryptedQuerySize, ref IntPtr leasedQuery);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_CreateQuery3(IntPtr thisptr, ulong itemCount, ulong[,] items, int includeRelinKeys, int comprMode, ref ulong encryptedQuerySize, ref IntPtr encryptedQuery);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_CreateQuery3(IntPtr thisptr, ulong itemCount, ref ulong items, int includeRelinKeys, int comprMode, ref ulong encryptedQuerySize, ref IntPtr encryptedQuery);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_SetCompression(IntPtr thisptr, int comprMode);
 
         [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
         internal static extern uint APSIClient_ProcessResult(IntPtr thisptr, ulong encryptedResultSize, byte[] encrptedResult, ref ulong intersectionSize, ref IntPtr intersection);
 
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_ProcessResult(IntPtr thisptr, ulong encryptedResultSize, ref byte encrptedResult, ref ulong intersectionSize, ref IntPtr intersection);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_ProcessLabeledResult(IntPtr thisptr, ulong encryptedResultSize, byte[] encryptedResult, ref ulong intersectionSize, ref IntPtr intersection, ref ulong labelByteCount, ref IntPtr labels);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_ProcessResultPart(IntPtr thisptr, ulong resultPartSize, byte[] resultPart);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_FinalizeResult(IntPtr thisptr, ref ulong intersectionSize, ref IntPtr intersection);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_FinalizeLabeledResult(IntPtr thisptr, ref ulong intersectionSize, ref IntPtr intersection, ref ulong labelByteCount, ref IntPtr labels);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_CreateSession(IntPtr thisptr, out IntPtr session);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClientSession_Destroy(IntPtr thisptr);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClientSession_CreateOPRFRequest(IntPtr thisptr, ulong itemCount, ulong[,] items, ref ulong oprfRequestSize, ref IntPtr oprfRequest);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClientSession_ExtractHashes(IntPtr thisptr, ulong oprfResponseSize, byte[] oprfResponse, ref ulong hashedItemCount, ref IntPtr hashedItems);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClientSession_CreateQuery2(IntPtr thisptr, ulong itemCount, ulong[,] items, int includeRelinKeys, ref ulong encryptedQuerySize, ref IntPtr encryptedQuery);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClientSession_CreateQuery3(IntPtr thisptr, ulong itemCount, ulong[,] items, int includeRelinKeys, int comprMode, ref ulong encryptedQuerySize, ref IntPtr encryptedQuery);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClientSession_SetCompression(IntPtr thisptr, int comprMode);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClientSession_ProcessResult(IntPtr thisptr, ulong encryptedResultSize, byte[] encryptedResult, ref ulong intersectionSize, ref IntPtr intersection);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClientSession_ProcessLabeledResult(IntPtr thisptr, ulong encryptedResultSize, byte[] encryptedResult, ref ulong intersectionSize, ref IntPtr intersection, ref ulong labelByteCount, ref IntPtr labels);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClientSession_ProcessResultPart(IntPtr thisptr, ulong resultPartSize, byte[] resultPart);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClientSession_FinalizeResult(IntPtr thisptr, ref ulong intersectionSize, ref IntPtr intersection);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClientSession_FinalizeLabeledResult(IntPtr thisptr, ref ulong intersectionSize, ref IntPtr intersection, ref ulong labelByteCount, ref IntPtr labels);
+
         [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
         internal static extern uint APSIClient_ReleaseNativePointer(IntPtr nativePointer);
+
+        [DllImport(APSIClientNative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIClient_SetBufferPoolLimit(ulong maxRetainedBytes);
     }
 }
@@ -0,0 +1,26 @@
+﻿// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.using System;
+
+namespace Microsoft.Research.APSI.Common
+{
+    /// <summary>
+    /// Compression of queries and results. Compression trades CPU time for bytes on the wire.
+    /// </summary>
+    public enum Compression
+    {
+        /// <summary>
+        /// No compression
+        /// </summary>
+        None = 0,
+
+        /// <summary>
+        /// zlib compression
+        /// </summary>
+        Zlib = 1,
+
+        /// <summary>
+        /// Zstandard compression, the default when SEAL is built with it
+        /// </summary>
+        Zstd = 2
+    }
+}
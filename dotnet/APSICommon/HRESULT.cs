@@ -31,6 +31,11 @@ namespace Microsoft.Research.APSI.Common
         /// </summary>
         public const uint E_POINTER = 0x80004003;
 
+        /// <summary>
+        /// HRESULT indicating an operation was aborted
+        /// </summary>
+        public const uint E_ABORT = 0x80004004;
+
         /// <summary>
         /// HRESULT indicating a general failure
         /// </summary>
@@ -41,6 +46,26 @@ namespace Microsoft.Research.APSI.Common
         /// </summary>
         public const uint E_NOT_VALID_STATE = 0x8007139F;
 
+        /// <summary>
+        /// HRESULT indicating a value that was not set or was not found
+        /// </summary>
+        public const uint E_NOT_SET = 0x80070490;
+
+        /// <summary>
+        /// HRESULT indicating a buffer is too small
+        /// </summary>
+        public const uint E_NOT_SUFFICIENT_BUFFER = 0x8007007A;
+
+        /// <summary>
+        /// HRESULT indicating a resource is too busy to take more work
+        /// </summary>
+        public const uint E_BUSY = 0x800700AA;
+
+        /// <summary>
+        /// HRESULT indicating an operation did not complete in time
+        /// </summary>
+        public const uint E_TIMEOUT = 0x800705B4;
+
         /// <summary>
         /// Indicates whether the given HRESULT is a successful result
         /// </summary>
@@ -102,12 +127,27 @@ namespace Microsoft.Research.APSI.Common
                 case E_POINTER:
                     return "Received a null pointer";
 
+                case E_ABORT:
+                    return "Operation aborted";
+
                 case E_FAIL:
                     return "General failure";
 
                 case E_NOT_VALID_STATE:
                     return "State is not valid";
 
+                case E_NOT_SET:
+                    return "Value not set";
+
+                case E_NOT_SUFFICIENT_BUFFER:
+                    return "Buffer is too small";
+
+                case E_BUSY:
+                    return "Too busy";
+
+                case E_TIMEOUT:
+                    return "Operation timed out";
+
                 default:
                     return "Unknown error";
             }
@@ -0,0 +1,85 @@
+﻿// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.using System;
+
+using System;
+using System.Runtime.InteropServices;
+
+namespace Microsoft.Research.APSI.Common
+{
+    /// <summary>
+    /// Buffer returned by the native library, used in place instead of being copied to a managed array.
+    ///
+    /// Large results stay out of the managed large object heap. The memory is released when the buffer is
+    /// disposed or finalized, so spans obtained from it must not be used afterwards.
+    /// </summary>
+    public sealed class NativeBuffer : SafeHandle
+    {
+        private readonly Func<IntPtr, uint> release_;
+
+        internal NativeBuffer(IntPtr buffer, ulong length, Func<IntPtr, uint> release)
+            : base(IntPtr.Zero, ownsHandle: true)
+        {
+            SetHandle(buffer);
+            Length = length;
+            release_ = release;
+        }
+
+        /// <summary>
+        /// Size of the buffer in bytes
+        /// </summary>
+        public ulong Length { get; }
+
+        /// <summary>
+        /// Whether the buffer was released or never allocated
+        /// </summary>
+        public override bool IsInvalid => IntPtr.Zero == handle;
+
+        /// <summary>
+        /// Contents of the buffer
+        /// </summary>
+        /// <exception cref="ObjectDisposedException"></exception>
+        /// <exception cref="InvalidOperationException">The buffer is too large for a span</exception>
+        public unsafe Span<byte> Span
+        {
+            get
+            {
+                if (IsClosed)
+                    throw new ObjectDisposedException(nameof(NativeBuffer));
+                if (Length > int.MaxValue)
+                    throw new InvalidOperationException("Buffer is too large for a span");
+                if (IsInvalid)
+                    return Span<byte>.Empty;
+
+                return new Span<byte>(handle.ToPointer(), (int)Length);
+            }
+        }
+
+        /// <summary>
+        /// Contents of the buffer as values of the given type, e.g. the pairs of ulongs of hashed items
+        /// </summary>
+        /// <typeparam name="T">Type of the values</typeparam>
+        /// <returns>Values in the buffer</returns>
+        public Span<T> AsSpan<T>() where T : struct
+        {
+            return MemoryMarshal.Cast<byte, T>(Span);
+        }
+
+        /// <summary>
+        /// Copy the contents of the buffer to a new array
+        /// </summary>
+        /// <returns>Copy of the buffer</returns>
+        public byte[] ToArray()
+        {
+            return Span.ToArray();
+        }
+
+        /// <summary>
+        /// Return the buffer to the native library
+        /// </summary>
+        /// <returns>Whether the native library released the buffer</returns>
+        protected override bool ReleaseHandle()
+        {
+            return HRESULT.Succeeded(release_(handle));
+        }
+    }
+}
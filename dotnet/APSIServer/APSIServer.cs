@@ -3,8 +3,13 @@
 
 using Microsoft.Research.APSI.Common;
 using System;
+using System.Collections.Generic;
 using System.IO;
+using System.Runtime.CompilerServices;
 using System.Runtime.InteropServices;
+using System.Threading;
+using System.Threading.Channels;
+using System.Threading.Tasks;
 
 namespace Microsoft.Research.APSI.Server
 {
@@ -13,6 +18,22 @@ namespace Microsoft.Research.APSI.Server
     /// </summary>
     public class APSIServer : NativeObject
     {
+        private static readonly Func<IntPtr, uint> ReleasePointer = NativeMethods.APSIServer_ReleasePointer;
+
+        // Stay below the large object heap threshold
+        private const ulong CopyChunkSize = 64 * 1024;
+
+        // Result parts of QueryParts that may wait for the caller
+        private const int MaxPendingParts = 4;
+
+        /// <summary>
+        /// Default number of items inserted at once by <see cref="AppendData(ulong[,])"/>
+        /// </summary>
+        public const int DefaultBatchSize = 1 << 20;
+
+        // Label size of the database being built through AppendData
+        private int appendLabelByteCount_;
+
         /// <summary>
         /// Create an instance of an APSIServer object
         /// </summary>
@@ -89,6 +110,496 @@ namespace Microsoft.Research.APSI.Server
             return resultBuffer;
         }
 
+        /// <summary>
+        /// Process an encrypted query without copying the query or the result to managed arrays.
+        /// Results are several MB, and would otherwise land on the large object heap.
+        /// </summary>
+        /// <param name="encryptedQuery">Encrypted query to process</param>
+        /// <returns>Native buffer with the result that must be sent to the client</returns>
+        public NativeBuffer Query(ReadOnlySpan<byte> encryptedQuery)
+        {
+            ulong resultSize = 0;
+            IntPtr nativeBuffer = IntPtr.Zero;
+
+            uint hr = NativeMethods.APSIServer_Query(NativePtr, (ulong)encryptedQuery.Length, ref MemoryMarshal.GetReference(encryptedQuery), ref resultSize, ref nativeBuffer);
+            HRESULT.ThrowIfFailed(hr, "Query");
+
+            return ToNativeBuffer(resultSize, nativeBuffer);
+        }
+
+        /// <summary>
+        /// Process an encrypted query, writing the result directly to the given destination.
+        ///
+        /// The results of a database barely vary in size, so a destination sized after an earlier result
+        /// usually fits. If it does not, the result is returned in a native buffer instead.
+        /// </summary>
+        /// <param name="encryptedQuery">Encrypted query to process</param>
+        /// <param name="destination">Buffer that receives the result that must be sent to the client</param>
+        /// <param name="resultSize">Size of the result</param>
+        /// <param name="leasedResult">Native buffer with the result if it did not fit in the destination, null otherwise</param>
+        /// <returns>False if the destination is too small for the result, which is then in <paramref name="leasedResult"/></returns>
+        public unsafe bool QueryInto(ReadOnlySpan<byte> encryptedQuery, Span<byte> destination, out int resultSize, out NativeBuffer leasedResult)
+        {
+            fixed (byte* destinationPtr = destination)
+            {
+                ulong nativeResultSize = 0;
+                IntPtr nativeBuffer = IntPtr.Zero;
+
+                uint hr = NativeMethods.APSIServer_QueryInto(NativePtr, (ulong)encryptedQuery.Length, ref MemoryMarshal.GetReference(encryptedQuery), (ulong)destination.Length, new IntPtr(destinationPtr), ref nativeResultSize, ref nativeBuffer);
+                HRESULT.ThrowIfFailed(hr, "Query");
+
+                resultSize = (int)nativeResultSize;
+                leasedResult = IntPtr.Zero == nativeBuffer ? null : ToNativeBuffer(nativeResultSize, nativeBuffer);
+                return null == leasedResult;
+            }
+        }
+
+        /// <summary>
+        /// Process an encrypted query if the admission limits allow it. See <see cref="SetAdmissionLimits"/>.
+        /// </summary>
+        /// <param name="encryptedQuery">Encrypted query to process</param>
+        /// <param name="result">Byte array that must be sent to the client as a result, null if the query was rejected</param>
+        /// <returns>False if the query was rejected because the server is too busy</returns>
+        public bool TryQuery(byte[] encryptedQuery, out byte[] result)
+        {
+            if (null == encryptedQuery)
+                throw new ArgumentNullException(nameof(encryptedQuery));
+
+            result = null;
+            ulong resultSize = 0;
+            IntPtr nativeBuffer = IntPtr.Zero;
+
+            uint hr = NativeMethods.APSIServer_Query(NativePtr, (ulong)encryptedQuery.LongLength, encryptedQuery, ref resultSize, ref nativeBuffer);
+            if (HRESULT.E_BUSY == hr || HRESULT.E_TIMEOUT == hr)
+                return false;
+            HRESULT.ThrowIfFailed(hr, "Query");
+
+            result = new byte[resultSize];
+
+            Marshal.Copy(nativeBuffer, result, startIndex: 0, length: (int)resultSize);
+
+            hr = NativeMethods.APSIServer_ReleasePointer(nativeBuffer);
+            HRESULT.ThrowIfFailed(hr, "Release query response");
+
+            return true;
+        }
+
+        /// <summary>
+        /// Get a snapshot of the query counters, latencies and database size of this server
+        /// </summary>
+        /// <returns>Current metrics</returns>
+        public ServerMetrics GetMetrics()
+        {
+            NativeMethods.ServerMetrics metrics = new NativeMethods.ServerMetrics();
+            uint hr = NativeMethods.APSIServer_GetMetrics(NativePtr, ref metrics);
+            HRESULT.ThrowIfFailed(hr, "Get metrics");
+
+            return new ServerMetrics(metrics);
+        }
+
+        /// <summary>
+        /// Estimate the cost of the queries needed for the given number of items against the current database.
+        ///
+        /// The cost is counted in plaintext-ciphertext multiplications. Every query covers the whole hash table
+        /// of the client, so its cost depends on the database and the parameters, and more items than the table
+        /// has room for take several queries.
+        /// </summary>
+        /// <param name="itemCount">Number of items the client queries</param>
+        /// <returns>Estimated cost</returns>
+        public ulong EstimateQueryCost(ulong itemCount)
+        {
+            ulong cost = 0;
+            uint hr = NativeMethods.APSIServer_EstimateQueryCost(NativePtr, itemCount, ref cost);
+            HRESULT.ThrowIfFailed(hr, "Estimate query cost");
+
+            return cost;
+        }
+
+        /// <summary>
+        /// Limit the queries that run at the same time.
+        ///
+        /// A query runs once the number of running queries and their total cost (see <see cref="EstimateQueryCost"/>)
+        /// stay within the limits; a query that costs more than maxCost alone runs once no other query is running.
+        /// Other queries wait in order in a queue. A query that does not fit in the queue or waits longer than the
+        /// queue timeout is rejected: <see cref="TryQuery"/> returns false, and the other query methods throw.
+        /// </summary>
+        /// <param name="maxConcurrentQueries">Maximum number of queries that run at the same time, 0 for no limit</param>
+        /// <param name="maxCost">Maximum total cost of the queries that run at the same time, 0 for no limit</param>
+        /// <param name="maxQueuedQueries">Maximum number of queries that wait to run, 0 to reject every query
+        /// that cannot run right away, or -1 for no limit</param>
+        /// <param name="queueTimeout">Time a query waits before it is rejected, or <see cref="Timeout.InfiniteTimeSpan"/></param>
+        /// <exception cref="ArgumentOutOfRangeException"></exception>
+        public void SetAdmissionLimits(int maxConcurrentQueries, ulong maxCost, int maxQueuedQueries, TimeSpan queueTimeout)
+        {
+            if (maxConcurrentQueries < 0)
+                throw new ArgumentOutOfRangeException(nameof(maxConcurrentQueries));
+            if (maxQueuedQueries < -1)
+                throw new ArgumentOutOfRangeException(nameof(maxQueuedQueries));
+            if (queueTimeout < TimeSpan.Zero && queueTimeout != Timeout.InfiniteTimeSpan)
+                throw new ArgumentOutOfRangeException(nameof(queueTimeout));
+
+            ulong maxQueued = (-1 == maxQueuedQueries) ? ulong.MaxValue : (ulong)maxQueuedQueries;
+            ulong queueTimeoutMs = (queueTimeout == Timeout.InfiniteTimeSpan) ? 0 : Math.Max(1, (ulong)queueTimeout.TotalMilliseconds);
+
+            uint hr = NativeMethods.APSIServer_SetAdmissionLimits(NativePtr, (ulong)maxConcurrentQueries, maxCost, maxQueued, queueTimeoutMs);
+            HRESULT.ThrowIfFailed(hr, "Set admission limits");
+        }
+
+        /// <summary>
+        /// Process an encrypted query of a client session.
+        ///
+        /// Sessions are identified by tokens that this server issues. A query that includes relinearization
+        /// keys registers them for the session, and queries created without them (see
+        /// APSIClient.CreateQuery(ulong[,], bool)) use the registered keys.
+        /// </summary>
+        /// <param name="encryptedQuery">Encrypted query to process</param>
+        /// <param name="sessionToken">Token of the client session, or 0 to start a new one. When the query
+        /// includes keys and the token does not name a cached session, a new token is issued and returned here.</param>
+        /// <returns>Byte array that must be sent to the client as a result, null if the query has no
+        /// relinearization keys and none are cached for the session. The client must then send a query
+        /// that includes its keys.</returns>
+        public byte[] Query(byte[] encryptedQuery, ref ulong sessionToken)
+        {
+            if (null == encryptedQuery)
+                throw new ArgumentNullException(nameof(encryptedQuery));
+
+            ulong resultSize = 0;
+            IntPtr nativeBuffer = IntPtr.Zero;
+
+            uint hr = NativeMethods.APSIServer_QueryWithSession(NativePtr, ref sessionToken, (ulong)encryptedQuery.LongLength, encryptedQuery, ref resultSize, ref nativeBuffer);
+            if (HRESULT.E_NOT_SET == hr)
+                return null;
+            HRESULT.ThrowIfFailed(hr, "Query with session");
+
+            byte[] resultBuffer = new byte[resultSize];
+
+            Marshal.Copy(nativeBuffer, resultBuffer, startIndex: 0, length: (int)resultSize);
+
+            hr = NativeMethods.APSIServer_ReleasePointer(nativeBuffer);
+            HRESULT.ThrowIfFailed(hr, "Release query response");
+
+            return resultBuffer;
+        }
+
+        /// <summary>
+        /// Limit the memory used by cached session keys. Keys that are not used for the given
+        /// time expire, and the least recently used keys are evicted when the budget is exceeded.
+        /// By default the cache holds up to 256 MB of keys that expire after 10 minutes.
+        /// </summary>
+        /// <param name="maxBytes">Maximum size of the cached keys in bytes</param>
+        /// <param name="timeToLive">Time after which unused keys expire</param>
+        /// <exception cref="ArgumentOutOfRangeException"></exception>
+        public void SetKeyCacheLimits(long maxBytes, TimeSpan timeToLive)
+        {
+            if (maxBytes < 0)
+                throw new ArgumentOutOfRangeException(nameof(maxBytes));
+            if (timeToLive < TimeSpan.Zero)
+                throw new ArgumentOutOfRangeException(nameof(timeToLive));
+
+            uint hr = NativeMethods.APSIServer_SetKeyCacheLimits(NativePtr, (ulong)maxBytes, (ulong)timeToLive.TotalSeconds);
+            HRESULT.ThrowIfFailed(hr, "Set key cache limits");
+        }
+
+        /// <summary>
+        /// Set the compression of the results of this server. By default each result is compressed like its
+        /// query, so the client chooses the compression; see APSIClient.SetCompression.
+        /// </summary>
+        /// <param name="compression">Compression of the results, or null to compress them like their queries</param>
+        /// <exception cref="InvalidOperationException">The native library does not support the compression</exception>
+        public void SetResultCompression(Compression? compression)
+        {
+            int comprMode = compression.HasValue ? (int)compression.Value : -1;
+            uint hr = NativeMethods.APSIServer_SetResultCompression(NativePtr, comprMode);
+            HRESULT.ThrowIfFailed(hr, "Set result compression");
+        }
+
+        /// <summary>
+        /// Remove the cached keys of a client session
+        /// </summary>
+        /// <param name="sessionToken">Token of the client session</param>
+        public void RemoveSessionKeys(ulong sessionToken)
+        {
+            uint hr = NativeMethods.APSIServer_RemoveSessionKeys(NativePtr, sessionToken);
+            HRESULT.ThrowIfFailed(hr, "Remove session keys");
+        }
+
+        /// <summary>
+        /// Process an encrypted query and write the result to the given stream.
+        /// 
+        /// The result is copied from native memory to the stream in small chunks, so no managed
+        /// buffer the size of the whole result is allocated.
+        /// </summary>
+        /// <param name="encryptedQuery">Encrypted query to process</param>
+        /// <param name="output">Stream where the result that must be sent to the client is written</param>
+        public void Query(byte[] encryptedQuery, Stream output)
+        {
+            if (null == encryptedQuery)
+                throw new ArgumentNullException(nameof(encryptedQuery));
+            if (null == output)
+                throw new ArgumentNullException(nameof(output));
+
+            ulong resultSize = 0;
+            IntPtr nativeBuffer = IntPtr.Zero;
+
+            uint hr = NativeMethods.APSIServer_Query(NativePtr, (ulong)encryptedQuery.LongLength, encryptedQuery, ref resultSize, ref nativeBuffer);
+            HRESULT.ThrowIfFailed(hr, "Query");
+
+            try
+            {
+                CopyToStream(nativeBuffer, resultSize, output);
+            }
+            finally
+            {
+                hr = NativeMethods.APSIServer_ReleasePointer(nativeBuffer);
+            }
+            HRESULT.ThrowIfFailed(hr, "Release query response");
+        }
+
+        /// <summary>
+        /// Process an encrypted query without blocking the calling thread.
+        /// </summary>
+        /// <param name="encryptedQuery">Encrypted query to process</param>
+        /// <param name="cancellationToken">Token to cancel the query</param>
+        /// <returns>Byte array that must be sent to the client as a result</returns>
+        public Task<byte[]> QueryAsync(byte[] encryptedQuery, CancellationToken cancellationToken = default)
+        {
+            return QueryAsync(encryptedQuery, Timeout.InfiniteTimeSpan, cancellationToken);
+        }
+
+        /// <summary>
+        /// Process an encrypted query without blocking the calling thread.
+        /// 
+        /// The query runs on one of the native worker threads of the server, one per hardware thread.
+        /// Once it is cancelled or the timeout passes, the server stops working on it at the next
+        /// checkpoint: while it waits for admission, before and after the query is parsed, before it
+        /// is evaluated, and before each result package is serialized. Disposing the server waits for
+        /// the queries that were started.
+        /// </summary>
+        /// <param name="encryptedQuery">Encrypted query to process</param>
+        /// <param name="timeout">Time after which the query is abandoned, or <see cref="Timeout.InfiniteTimeSpan"/></param>
+        /// <param name="cancellationToken">Token to cancel the query</param>
+        /// <returns>Byte array that must be sent to the client as a result. The task is canceled when the
+        /// query is cancelled, and fails with a <see cref="TimeoutException"/> when the timeout passes.</returns>
+        public Task<byte[]> QueryAsync(byte[] encryptedQuery, TimeSpan timeout, CancellationToken cancellationToken = default)
+        {
+            if (null == encryptedQuery)
+                throw new ArgumentNullException(nameof(encryptedQuery));
+            if (timeout < TimeSpan.Zero && timeout != Timeout.InfiniteTimeSpan)
+                throw new ArgumentOutOfRangeException(nameof(timeout));
+
+            if (cancellationToken.IsCancellationRequested)
+                return Task.FromCanceled<byte[]>(cancellationToken);
+
+            ulong timeoutMs = (timeout == Timeout.InfiniteTimeSpan) ? 0 : Math.Max(1, (ulong)timeout.TotalMilliseconds);
+            TaskCompletionSource<byte[]> completion = new TaskCompletionSource<byte[]>(TaskCreationOptions.RunContinuationsAsynchronously);
+
+            // The native side calls the callback exactly once, so it is kept alive until then
+            GCHandle callbackHandle = default;
+            NativeMethods.QueryCompletedCallback callback = (IntPtr context, uint status, ulong resultSize, IntPtr result) =>
+            {
+                try
+                {
+                    if (HRESULT.E_ABORT == status)
+                    {
+                        completion.TrySetCanceled(cancellationToken);
+                    }
+                    else if (HRESULT.E_TIMEOUT == status)
+                    {
+                        completion.TrySetException(new TimeoutException("Query did not complete in time"));
+                    }
+                    else
+                    {
+                        HRESULT.ThrowIfFailed(status, "Query");
+
+                        byte[] resultBuffer = new byte[resultSize];
+                        Marshal.Copy(result, resultBuffer, startIndex: 0, length: (int)resultSize);
+
+                        status = NativeMethods.APSIServer_ReleasePointer(result);
+                        HRESULT.ThrowIfFailed(status, "Release query response");
+
+                        completion.TrySetResult(resultBuffer);
+                    }
+                }
+                catch (Exception ex)
+                {
+                    completion.TrySetException(ex);
+                }
+                finally
+                {
+                    callbackHandle.Free();
+                }
+            };
+            callbackHandle = GCHandle.Alloc(callback);
+
+            uint hr = NativeMethods.APSIServer_QueryAsync(NativePtr, (ulong)encryptedQuery.LongLength, encryptedQuery, timeoutMs, callback, IntPtr.Zero, out IntPtr queryHandle);
+            if (HRESULT.Failed(hr))
+            {
+                callbackHandle.Free();
+                HRESULT.ThrowIfFailed(hr, "Query async");
+            }
+
+            return WaitForQuery(completion.Task, queryHandle, cancellationToken);
+        }
+
+        private static async Task<byte[]> WaitForQuery(Task<byte[]> query, IntPtr queryHandle, CancellationToken cancellationToken)
+        {
+            CancellationTokenRegistration registration = cancellationToken.Register(() => NativeMethods.APSIServer_CancelQuery(queryHandle));
+            try
+            {
+                return await query.ConfigureAwait(false);
+            }
+            finally
+            {
+                // Disposing the registration first guarantees that the cancellation callback does not use the handle anymore
+                registration.Dispose();
+                NativeMethods.APSIServer_ReleaseQuery(queryHandle);
+            }
+        }
+
+        /// <summary>
+        /// Process an encrypted query, returning the result in parts as soon as they are computed.
+        /// 
+        /// The first part is the response header, and every following part is the result for one
+        /// bin bundle. The parts can be sent to the client as they arrive; concatenated, they are
+        /// identical to the result of <see cref="Query(byte[])"/>. Only a few parts are buffered, so the
+        /// query waits while the caller is not reading them.
+        /// </summary>
+        /// <param name="encryptedQuery">Encrypted query to process</param>
+        /// <param name="cancellationToken">Token to stop receiving result parts. The remaining parts are dropped
+        /// once it is cancelled or the enumeration stops early.</param>
+        /// <returns>Result parts that must be sent to the client in order</returns>
+        public async IAsyncEnumerable<byte[]> QueryParts(byte[] encryptedQuery, [EnumeratorCancellation] CancellationToken cancellationToken = default)
+        {
+            if (null == encryptedQuery)
+                throw new ArgumentNullException(nameof(encryptedQuery));
+
+            // A caller that falls behind holds the native worker back instead of letting parts pile up
+            Channel<byte[]> parts = Channel.CreateBounded<byte[]>(new BoundedChannelOptions(MaxPendingParts) { SingleReader = true, SingleWriter = true });
+            CancellationTokenSource stop = CancellationTokenSource.CreateLinkedTokenSource(cancellationToken);
+            CancellationToken stopToken = stop.Token;
+
+            NativeMethods.ResultPartCallback callback = (IntPtr context, ulong partSize, IntPtr part) =>
+            {
+                try
+                {
+                    byte[] partBuffer = new byte[partSize];
+                    Marshal.Copy(part, partBuffer, startIndex: 0, length: (int)partSize);
+                    parts.Writer.WriteAsync(partBuffer, stopToken).AsTask().GetAwaiter().GetResult();
+                    return HRESULT.S_OK;
+                }
+                catch (OperationCanceledException)
+                {
+                    return HRESULT.E_ABORT;
+                }
+                catch (Exception)
+                {
+                    return HRESULT.E_FAIL;
+                }
+            };
+
+            Task query = Task.Run(() =>
+            {
+                try
+                {
+                    uint hr = NativeMethods.APSIServer_QueryStreamed(NativePtr, (ulong)encryptedQuery.LongLength, encryptedQuery, callback, IntPtr.Zero);
+                    GC.KeepAlive(callback);
+                    HRESULT.ThrowIfFailed(hr, "Query");
+                    parts.Writer.TryComplete();
+                }
+                catch (Exception ex)
+                {
+                    parts.Writer.TryComplete(ex);
+                }
+            });
+
+            try
+            {
+                while (await parts.Reader.WaitToReadAsync(cancellationToken).ConfigureAwait(false))
+                {
+                    while (parts.Reader.TryRead(out byte[] part))
+                    {
+                        yield return part;
+                    }
+                }
+            }
+            finally
+            {
+                // Fail the callback if the caller stopped enumerating early, which drops the remaining parts
+                stop.Cancel();
+                _ = query.ContinueWith(_ => stop.Dispose(), TaskScheduler.Default);
+            }
+
+            await query.ConfigureAwait(false);
+        }
+
+        /// <summary>
+        /// Process several encrypted queries at once.
+        /// 
+        /// The queries share the server's worker threads, so running them as a batch keeps all
+        /// threads busy without starting more threads than configured through <see cref="SetThreads"/>.
+        /// </summary>
+        /// <param name="encryptedQueries">Encrypted queries to process</param>
+        /// <returns>One result per query, in the same order, holding either the response or why the query failed</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        /// <exception cref="ArgumentException"></exception>
+        public QueryBatchResult[] QueryBatch(byte[][] encryptedQueries)
+        {
+            if (null == encryptedQueries)
+                throw new ArgumentNullException(nameof(encryptedQueries));
+
+            int queryCount = encryptedQueries.Length;
+            foreach (byte[] query in encryptedQueries)
+            {
+                if (null == query)
+                    throw new ArgumentException("Queries cannot be null", nameof(encryptedQueries));
+            }
+
+            // Queries are read in place instead of being copied into a combined buffer
+            GCHandle[] queryHandles = new GCHandle[queryCount];
+            ulong[] querySizes = new ulong[queryCount];
+            IntPtr[] queries = new IntPtr[queryCount];
+            ulong[] resultSizes = new ulong[queryCount];
+            IntPtr[] nativeBuffers = new IntPtr[queryCount];
+            uint[] queryResults = new uint[queryCount];
+            try
+            {
+                for (int i = 0; i < queryCount; i++)
+                {
+                    queryHandles[i] = GCHandle.Alloc(encryptedQueries[i], GCHandleType.Pinned);
+                    queries[i] = queryHandles[i].AddrOfPinnedObject();
+                    querySizes[i] = (ulong)encryptedQueries[i].LongLength;
+                }
+
+                uint hr = NativeMethods.APSIServer_QueryBatch(NativePtr, (ulong)queryCount, querySizes, queries, resultSizes, nativeBuffers, queryResults);
+                HRESULT.ThrowIfFailed(hr, "Query batch");
+
+                QueryBatchResult[] results = new QueryBatchResult[queryCount];
+                for (int i = 0; i < queryCount; i++)
+                {
+                    byte[] result = null;
+                    if (IntPtr.Zero != nativeBuffers[i])
+                    {
+                        result = new byte[resultSizes[i]];
+                        Marshal.Copy(nativeBuffers[i], result, startIndex: 0, length: result.Length);
+                    }
+
+                    results[i] = new QueryBatchResult(result, queryResults[i]);
+                }
+
+                return results;
+            }
+            finally
+            {
+                for (int i = 0; i < queryCount; i++)
+                {
+                    if (queryHandles[i].IsAllocated)
+                        queryHandles[i].Free();
+                    if (IntPtr.Zero != nativeBuffers[i])
+                        NativeMethods.APSIServer_ReleasePointer(nativeBuffers[i]);
+                }
+            }
+        }
+
         /// <summary>
         /// Set the data for the server.
         /// 
@@ -98,21 +609,209 @@ namespace Microsoft.Research.APSI.Server
         /// <param name="data">Data to set</param>
         public void SetData(ulong[,] data)
         {
-            if (null == data)
-            {
-                throw new ArgumentNullException(nameof(data));
-            }
-            if (2 != data.GetLength(dimension: 1))
-            {
-                throw new ArgumentException("Second dimension of data array needs to be size 2");
-            }
+            SetData(data, updatable: false);
+        }
+
+        /// <summary>
+        /// Set the data for the server.
+        /// 
+        /// This method assumes data has not been processed for OPRF, and will perform
+        /// the preprocessing with the OPRF key given in the constructor.
+        /// </summary>
+        /// <param name="data">Data to set</param>
+        /// <param name="updatable">If true, the database is kept in a state where items can later be
+        /// inserted or removed through <see cref="InsertOrAssign(ulong[,])"/> and <see cref="Remove"/>. An updatable
+        /// database uses more memory, and when saved it contains the OPRF key. Call <see cref="Strip"/>
+        /// once no more updates are needed.</param>
+        public void SetData(ulong[,] data, bool updatable)
+        {
+            CheckItems(data, nameof(data));
 
             long count = data.GetLongLength(dimension: 0);
 
-            uint hr = NativeMethods.APSIServer_SetData(NativePtr, (ulong)count, data);
+            uint hr = NativeMethods.APSIServer_SetData2(NativePtr, (ulong)count, data, updatable ? 1 : 0);
+            HRESULT.ThrowIfFailed(hr, "Set data");
+        }
+
+        /// <summary>
+        /// Set the data for the server from items given as consecutive pairs of ulongs, e.g. a slice of a
+        /// larger buffer, without copying them. See <see cref="SetData(ulong[,], bool)"/>.
+        /// </summary>
+        /// <param name="data">Data to set, two ulongs per item</param>
+        /// <param name="updatable">Whether items can later be inserted or removed</param>
+        /// <exception cref="ArgumentException"></exception>
+        public void SetData(ReadOnlySpan<ulong> data, bool updatable = false)
+        {
+            if (data.Length % 2 != 0)
+                throw new ArgumentException("Data needs to be consecutive pairs of ulongs", nameof(data));
+
+            uint hr = NativeMethods.APSIServer_SetData2(NativePtr, (ulong)data.Length / 2, ref MemoryMarshal.GetReference(data), updatable ? 1 : 0);
             HRESULT.ThrowIfFailed(hr, "Set data");
         }
 
+        /// <summary>
+        /// Set the data for the server, with a label for each item.
+        /// 
+        /// A query against a labeled database returns the label of every item that is found.
+        /// This method assumes data has not been processed for OPRF, and will perform
+        /// the preprocessing with the OPRF key given in the constructor.
+        /// </summary>
+        /// <param name="data">Data to set</param>
+        /// <param name="labels">Labels of the items, one after another in the same order as <paramref name="data"/></param>
+        /// <param name="labelByteCount">Size in bytes of each label</param>
+        /// <param name="updatable">If true, the database is kept in a state where items can later be
+        /// inserted or removed. See <see cref="SetData(ulong[,], bool)"/>.</param>
+        public void SetData(ulong[,] data, byte[] labels, int labelByteCount, bool updatable = false)
+        {
+            CheckItems(data, nameof(data));
+            CheckLabels(data, labels, labelByteCount);
+
+            long count = data.GetLongLength(dimension: 0);
+
+            uint hr = NativeMethods.APSIServer_SetLabeledData(NativePtr, (ulong)count, data, (ulong)labelByteCount, labels, updatable ? 1 : 0);
+            HRESULT.ThrowIfFailed(hr, "Set labeled data");
+        }
+
+        /// <summary>
+        /// Start building a new database from chunks of items given to <see cref="AppendData(ulong[,])"/>.
+        /// 
+        /// Items are preprocessed for OPRF and inserted in the background in batches, while further chunks
+        /// are appended, so the whole data set never has to be in memory at once. The current database keeps
+        /// serving queries until <see cref="FinalizeData"/> replaces it.
+        /// </summary>
+        /// <param name="updatable">If true, the database is kept in a state where items can later be
+        /// inserted or removed. See <see cref="SetData(ulong[,], bool)"/>.</param>
+        /// <param name="batchSize">Number of items inserted at once. Larger batches are faster to insert,
+        /// smaller batches use less memory.</param>
+        public void BeginData(bool updatable = false, int batchSize = DefaultBatchSize)
+        {
+            BeginData(labelByteCount: 0, updatable, batchSize);
+        }
+
+        /// <summary>
+        /// Start building a new labeled database from chunks of items and labels given to
+        /// <see cref="AppendData(ulong[,], byte[])"/>. See <see cref="BeginData(bool, int)"/>.
+        /// </summary>
+        /// <param name="labelByteCount">Size in bytes of each label</param>
+        /// <param name="updatable">If true, the database is kept in a state where items can later be
+        /// inserted or removed. See <see cref="SetData(ulong[,], bool)"/>.</param>
+        /// <param name="batchSize">Number of items inserted at once</param>
+        public void BeginData(int labelByteCount, bool updatable, int batchSize = DefaultBatchSize)
+        {
+            if (labelByteCount < 0)
+                throw new ArgumentOutOfRangeException(nameof(labelByteCount));
+            if (batchSize <= 0)
+                throw new ArgumentOutOfRangeException(nameof(batchSize));
+
+            uint hr = NativeMethods.APSIServer_BeginData(NativePtr, (ulong)labelByteCount, (ulong)batchSize, updatable ? 1 : 0);
+            HRESULT.ThrowIfFailed(hr, "Begin data");
+            appendLabelByteCount_ = labelByteCount;
+        }
+
+        /// <summary>
+        /// Append a chunk of items to the database started by <see cref="BeginData(bool, int)"/>.
+        /// 
+        /// Chunks can be appended from several threads at once.
+        /// </summary>
+        /// <param name="data">Items to append</param>
+        public void AppendData(ulong[,] data)
+        {
+            CheckItems(data, nameof(data));
+
+            uint hr = NativeMethods.APSIServer_AppendData(NativePtr, (ulong)data.GetLongLength(dimension: 0), data, labels: null);
+            HRESULT.ThrowIfFailed(hr, "Append data");
+        }
+
+        /// <summary>
+        /// Append a chunk of items and their labels to the database started by <see cref="BeginData(int, bool, int)"/>.
+        /// 
+        /// Chunks can be appended from several threads at once.
+        /// </summary>
+        /// <param name="data">Items to append</param>
+        /// <param name="labels">Labels of the items, one after another in the same order as <paramref name="data"/></param>
+        public void AppendData(ulong[,] data, byte[] labels)
+        {
+            CheckItems(data, nameof(data));
+            CheckLabels(data, labels, appendLabelByteCount_);
+
+            uint hr = NativeMethods.APSIServer_AppendData(NativePtr, (ulong)data.GetLongLength(dimension: 0), data, labels);
+            HRESULT.ThrowIfFailed(hr, "Append labeled data");
+        }
+
+        /// <summary>
+        /// Finish the database started by <see cref="BeginData(bool, int)"/> and use it to answer queries
+        /// </summary>
+        public void FinalizeData()
+        {
+            uint hr = NativeMethods.APSIServer_FinalizeData(NativePtr);
+            HRESULT.ThrowIfFailed(hr, "Finalize data");
+        }
+
+        /// <summary>
+        /// Insert the given items in the database. Items that are already present are left as they are.
+        /// 
+        /// Only the given items are preprocessed for OPRF, so the cost of this method depends on the
+        /// number of items given and not on the size of the database. The database must have been
+        /// created as updatable.
+        /// </summary>
+        /// <param name="data">Items to insert</param>
+        public void InsertOrAssign(ulong[,] data)
+        {
+            CheckItems(data, nameof(data));
+
+            long count = data.GetLongLength(dimension: 0);
+
+            uint hr = NativeMethods.APSIServer_InsertOrAssign(NativePtr, (ulong)count, data);
+            HRESULT.ThrowIfFailed(hr, "Insert or assign");
+        }
+
+        /// <summary>
+        /// Insert the given items with their labels in a labeled database. Items that are already present
+        /// get the new label.
+        /// 
+        /// The database must have been created as updatable, with labels of the same size.
+        /// </summary>
+        /// <param name="data">Items to insert</param>
+        /// <param name="labels">Labels of the items, one after another in the same order as <paramref name="data"/></param>
+        /// <param name="labelByteCount">Size in bytes of each label</param>
+        public void InsertOrAssign(ulong[,] data, byte[] labels, int labelByteCount)
+        {
+            CheckItems(data, nameof(data));
+            CheckLabels(data, labels, labelByteCount);
+
+            long count = data.GetLongLength(dimension: 0);
+
+            uint hr = NativeMethods.APSIServer_InsertOrAssignLabeled(NativePtr, (ulong)count, data, (ulong)labelByteCount, labels);
+            HRESULT.ThrowIfFailed(hr, "Insert or assign labeled");
+        }
+
+        /// <summary>
+        /// Remove the given items from the database. All items must be present in the database.
+        /// 
+        /// The database must have been created as updatable.
+        /// </summary>
+        /// <param name="data">Items to remove</param>
+        public void Remove(ulong[,] data)
+        {
+            CheckItems(data, nameof(data));
+
+            long count = data.GetLongLength(dimension: 0);
+
+            uint hr = NativeMethods.APSIServer_Remove(NativePtr, (ulong)count, data);
+            HRESULT.ThrowIfFailed(hr, "Remove");
+        }
+
+        /// <summary>
+        /// Release all data that is not needed to answer queries, including the OPRF key.
+        /// 
+        /// After this call the database cannot be updated anymore.
+        /// </summary>
+        public void Strip()
+        {
+            uint hr = NativeMethods.APSIServer_Strip(NativePtr);
+            HRESULT.ThrowIfFailed(hr, "Strip");
+        }
+
         /// <summary>
         /// Load database from the given byte array
         /// </summary>
@@ -148,6 +847,72 @@ namespace Microsoft.Research.APSI.Server
             return new APSIServer(thisPtr);
         }
 
+        /// <summary>
+        /// Load database from the given file path, optionally deserializing it directly
+        /// from a read-only memory mapping of the file
+        /// 
+        /// Mapping the file only skips the copy through a stream buffer. The database is still
+        /// fully loaded into memory and the mapping is closed afterwards, so it is neither loaded
+        /// lazily nor shared with other processes through the page cache.
+        /// </summary>
+        /// <param name="filePath">Full path to the file where to load the DB from</param>
+        /// <param name="memoryMapped">Whether to memory-map the file instead of reading it through a stream</param>
+        /// <returns>A new instance of APSIServer initialized from the given file</returns>
+        public static APSIServer LoadDB(string filePath, bool memoryMapped)
+        {
+            if (!memoryMapped)
+                return LoadDB(filePath);
+
+            if (null == filePath)
+                throw new ArgumentNullException(nameof(filePath));
+
+            if (!File.Exists(filePath))
+                throw new ArgumentException($"File '{filePath}' does not exist.");
+
+            uint hr = NativeMethods.APSIServer_LoadDBMapped(out IntPtr thisPtr, filePath);
+            HRESULT.ThrowIfFailed(hr, "Load DB mapped");
+
+            return new APSIServer(thisPtr);
+        }
+
+        /// <summary>
+        /// Replace the database of this server with the one saved in the given file.
+        /// 
+        /// Queries are answered with the current database while the new one is loaded, so this can be
+        /// called from a background thread on a server that is in use. Queries that started before the
+        /// switch finish on the previous database, which is freed once the last of them completes.
+        /// </summary>
+        /// <param name="filePath">Full path to the file where to load the DB from</param>
+        /// <param name="memoryMapped">Whether to memory-map the file instead of reading it through a stream</param>
+        public void ReloadDB(string filePath, bool memoryMapped = false)
+        {
+            if (null == filePath)
+                throw new ArgumentNullException(nameof(filePath));
+
+            if (!File.Exists(filePath))
+                throw new ArgumentException($"File '{filePath}' does not exist.");
+
+            uint hr = NativeMethods.APSIServer_ReloadDB(NativePtr, filePath, memoryMapped ? 1 : 0);
+            HRESULT.ThrowIfFailed(hr, "Reload DB");
+        }
+
+        /// <summary>
+        /// Exchange the databases of this server and another one.
+        /// 
+        /// A new database can be built in a second server with <see cref="SetData(ulong[,])"/> while this
+        /// one keeps answering queries, and then swapped in. Each server switches atomically, as in
+        /// <see cref="ReloadDB"/>.
+        /// </summary>
+        /// <param name="other">Server to exchange databases with</param>
+        public void SwapDB(APSIServer other)
+        {
+            if (null == other)
+                throw new ArgumentNullException(nameof(other));
+
+            uint hr = NativeMethods.APSIServer_SwapDB(NativePtr, other.NativePtr);
+            HRESULT.ThrowIfFailed(hr, "Swap DB");
+        }
+
         /// <summary>
         /// Save database to the given stream
         /// </summary>
@@ -157,17 +922,30 @@ namespace Microsoft.Research.APSI.Server
             if (null == stream)
                 throw new ArgumentNullException(nameof(stream));
 
-            ulong dbSize = 0;
-            IntPtr dbBufferPtr = new IntPtr();
-            uint hr = NativeMethods.APSIServer_SaveDB(NativePtr, ref dbSize, ref dbBufferPtr);
-            HRESULT.ThrowIfFailed(hr, "Save DB");
+            // The database is written in chunks while it is being serialized,
+            // so it is never held in memory as a whole.
+            Exception writeException = null;
+            NativeMethods.WriteCallback callback = (IntPtr context, ulong chunkSize, IntPtr chunk) =>
+            {
+                try
+                {
+                    CopyToStream(chunk, chunkSize, stream);
+                    return HRESULT.S_OK;
+                }
+                catch (Exception ex)
+                {
+                    writeException = ex;
+                    return HRESULT.E_FAIL;
+                }
+            };
 
-            byte[] dbBuffer = new byte[dbSize];
-            Marshal.Copy(dbBufferPtr, dbBuffer, startIndex: 0, length: (int)dbSize);
-            hr = NativeMethods.APSIServer_ReleasePointer(dbBufferPtr);
-            HRESULT.ThrowIfFailed(hr, "Release DB buffer");
+            uint hr = NativeMethods.APSIServer_SaveDBStreamed(NativePtr, callback, IntPtr.Zero);
+            GC.KeepAlive(callback);
 
-            stream.Write(dbBuffer, offset: 0, count: (int)dbSize);
+            if (null != writeException)
+                throw new IOException("Failed to write DB to stream", writeException);
+
+            HRESULT.ThrowIfFailed(hr, "Save DB");
         }
 
         /// <summary>
@@ -185,6 +963,9 @@ namespace Microsoft.Research.APSI.Server
 
         /// <summary>
         /// Set the number of threads that will be used to preprocess data and respond to queries.
+        /// 
+        /// The threads form a single pool shared by all server instances in the process. Clients
+        /// in the same process do not use or resize this pool.
         /// </summary>
         /// <param name="threadCount">Number of threads to use.</param>
         public static void SetThreads(uint threadCount)
@@ -193,6 +974,65 @@ namespace Microsoft.Research.APSI.Server
             HRESULT.ThrowIfFailed(hr, "Set threads");
         }
 
+        /// <summary>
+        /// Set the total size of the result buffers that are kept for reuse once released, 256 MB by default.
+        ///
+        /// Results are written to buffers from a native pool shared by all servers in the process, so that
+        /// answering many queries does not allocate new multi-MB buffers for each of them.
+        /// </summary>
+        /// <param name="maxRetainedBytes">Total size in bytes, 0 to free every buffer when it is released</param>
+        public static void SetBufferPoolLimit(ulong maxRetainedBytes)
+        {
+            uint hr = NativeMethods.APSIServer_SetBufferPoolLimit(maxRetainedBytes);
+            HRESULT.ThrowIfFailed(hr, "Set buffer pool limit");
+        }
+
+        private static void CopyToStream(IntPtr nativeBuffer, ulong size, Stream output)
+        {
+            byte[] chunk = new byte[(int)Math.Min(size, CopyChunkSize)];
+            ulong offset = 0;
+            while (offset < size)
+            {
+                int count = (int)Math.Min(size - offset, (ulong)chunk.Length);
+                Marshal.Copy(new IntPtr(nativeBuffer.ToInt64() + (long)offset), chunk, startIndex: 0, length: count);
+                output.Write(chunk, offset: 0, count: count);
+                offset += (ulong)count;
+            }
+        }
+
+        internal static NativeBuffer ToNativeBuffer(ulong size, IntPtr nativeBuffer)
+        {
+            return new NativeBuffer(nativeBuffer, size, ReleasePointer);
+        }
+
+        internal static void CheckItems(ulong[,] data, string paramName)
+        {
+            if (null == data)
+            {
+                throw new ArgumentNullException(paramName);
+            }
+            if (2 != data.GetLength(dimension: 1))
+            {
+                throw new ArgumentException("Second dimension of data array needs to be size 2", paramName);
+            }
+        }
+
+        internal static void CheckLabels(ulong[,] data, byte[] labels, int labelByteCount)
+        {
+            if (null == labels)
+            {
+                throw new ArgumentNullException(nameof(labels));
+            }
+            if (labelByteCount <= 0)
+            {
+                throw new ArgumentException("Label size needs to be positive", nameof(labelByteCount));
+            }
+            if (labels.LongLength != data.GetLongLength(dimension: 0) * labelByteCount)
+            {
+                throw new ArgumentException("Labels array needs to hold one label for each item", nameof(labels));
+            }
+        }
+
         /// <summary>
         /// Destroy native object
         /// </summary>
@@ -0,0 +1,216 @@
+﻿// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.using System;
+
+using Microsoft.Research.APSI.Common;
+using System;
+using System.IO;
+using System.Runtime.InteropServices;
+
+namespace Microsoft.Research.APSI.Server
+{
+    /// <summary>
+    /// An APSI Server whose database is split into shards.
+    ///
+    /// Every item belongs to one shard, chosen by a hash of its value. Shards are built, saved and loaded
+    /// independently, and a query is run against all shards. The result is a single response that clients
+    /// process exactly like the response of an <see cref="APSIServer"/>.
+    /// </summary>
+    public class APSIShardedServer : NativeObject
+    {
+        /// <summary>
+        /// Create an instance of an APSIShardedServer object
+        /// </summary>
+        /// <param name="parameters">APSI parameters, used by every shard</param>
+        /// <param name="oprfKey">OPRF key used to preprocess the data</param>
+        /// <param name="shardCount">Number of shards</param>
+        public APSIShardedServer(APSIParams parameters, OPRFKey oprfKey, int shardCount)
+        {
+            if (null == parameters)
+                throw new ArgumentNullException(nameof(parameters));
+            if (null == oprfKey)
+                throw new ArgumentNullException(nameof(oprfKey));
+            if (shardCount <= 0)
+                throw new ArgumentOutOfRangeException(nameof(shardCount));
+
+            uint hr = NativeMethods.APSIShardedServer_Create(out IntPtr thisptr, oprfKey.NativePtr, parameters.NativePtr, (ulong)shardCount);
+            HRESULT.ThrowIfFailed(hr, "Create APSIShardedServer");
+            NativePtr = thisptr;
+        }
+
+        private APSIShardedServer(IntPtr thisPtr)
+        {
+            NativePtr = thisPtr;
+        }
+
+        /// <summary>
+        /// Number of shards
+        /// </summary>
+        public int ShardCount
+        {
+            get
+            {
+                ulong shardCount = 0;
+                uint hr = NativeMethods.APSIShardedServer_GetShardCount(NativePtr, ref shardCount);
+                HRESULT.ThrowIfFailed(hr, "Get shard count");
+                return (int)shardCount;
+            }
+        }
+
+        /// <summary>
+        /// Get the parameters for the current instance
+        /// </summary>
+        /// <returns>Parameters in a byte array</returns>
+        public byte[] GetParameters()
+        {
+            ulong paramsSize = 0;
+            IntPtr paramsPtr = IntPtr.Zero;
+            uint hr = NativeMethods.APSIShardedServer_GetParameters(NativePtr, ref paramsSize, ref paramsPtr);
+            HRESULT.ThrowIfFailed(hr, "Get parameters");
+
+            return CopyAndRelease(paramsSize, paramsPtr, "Release parameters");
+        }
+
+        /// <summary>
+        /// Set the data of all shards. The shards are built in parallel.
+        /// </summary>
+        /// <param name="data">Data to set</param>
+        public void SetData(ulong[,] data)
+        {
+            APSIServer.CheckItems(data, nameof(data));
+
+            uint hr = NativeMethods.APSIShardedServer_SetData(NativePtr, (ulong)data.GetLongLength(dimension: 0), data, labelByteCount: 0, labels: null);
+            HRESULT.ThrowIfFailed(hr, "Set data");
+        }
+
+        /// <summary>
+        /// Set the data of all shards, with a label for each item. The shards are built in parallel.
+        /// </summary>
+        /// <param name="data">Data to set</param>
+        /// <param name="labels">Labels of the items, one after another in the same order as <paramref name="data"/></param>
+        /// <param name="labelByteCount">Size in bytes of each label</param>
+        public void SetData(ulong[,] data, byte[] labels, int labelByteCount)
+        {
+            APSIServer.CheckItems(data, nameof(data));
+            APSIServer.CheckLabels(data, labels, labelByteCount);
+
+            uint hr = NativeMethods.APSIShardedServer_SetData(NativePtr, (ulong)data.GetLongLength(dimension: 0), data, (ulong)labelByteCount, labels);
+            HRESULT.ThrowIfFailed(hr, "Set labeled data");
+        }
+
+        /// <summary>
+        /// Set the data of a single shard. Only the items that belong to the shard are kept, so the
+        /// same full data set can be given to build each shard separately, e.g. on different machines.
+        /// </summary>
+        /// <param name="shardIndex">Shard to build</param>
+        /// <param name="data">Data to set</param>
+        public void SetShardData(int shardIndex, ulong[,] data)
+        {
+            APSIServer.CheckItems(data, nameof(data));
+
+            uint hr = NativeMethods.APSIShardedServer_SetShardData(NativePtr, CheckShardIndex(shardIndex), (ulong)data.GetLongLength(dimension: 0), data, labelByteCount: 0, labels: null);
+            HRESULT.ThrowIfFailed(hr, "Set shard data");
+        }
+
+        /// <summary>
+        /// Set the data of a single shard, with a label for each item. See <see cref="SetShardData(int, ulong[,])"/>.
+        /// </summary>
+        /// <param name="shardIndex">Shard to build</param>
+        /// <param name="data">Data to set</param>
+        /// <param name="labels">Labels of the items, one after another in the same order as <paramref name="data"/></param>
+        /// <param name="labelByteCount">Size in bytes of each label</param>
+        public void SetShardData(int shardIndex, ulong[,] data, byte[] labels, int labelByteCount)
+        {
+            APSIServer.CheckItems(data, nameof(data));
+            APSIServer.CheckLabels(data, labels, labelByteCount);
+
+            uint hr = NativeMethods.APSIShardedServer_SetShardData(NativePtr, CheckShardIndex(shardIndex), (ulong)data.GetLongLength(dimension: 0), data, (ulong)labelByteCount, labels);
+            HRESULT.ThrowIfFailed(hr, "Set labeled shard data");
+        }
+
+        /// <summary>
+        /// Save the database of a shard to the given file path
+        /// </summary>
+        /// <param name="shardIndex">Shard to save</param>
+        /// <param name="filePath">Full path to the file that will hold the saved shard</param>
+        public void SaveShard(int shardIndex, string filePath)
+        {
+            if (null == filePath)
+                throw new ArgumentNullException(nameof(filePath));
+
+            uint hr = NativeMethods.APSIShardedServer_SaveShard(NativePtr, CheckShardIndex(shardIndex), filePath);
+            HRESULT.ThrowIfFailed(hr, "Save shard");
+        }
+
+        /// <summary>
+        /// Load a sharded server from the files of its shards. The shards are loaded in parallel.
+        /// </summary>
+        /// <param name="filePaths">Full paths of the files saved by <see cref="SaveShard"/>, in shard order</param>
+        /// <returns>A new instance of APSIShardedServer initialized from the given files</returns>
+        public static APSIShardedServer Load(string[] filePaths)
+        {
+            if (null == filePaths)
+                throw new ArgumentNullException(nameof(filePaths));
+            if (0 == filePaths.Length)
+                throw new ArgumentException("At least one shard is needed", nameof(filePaths));
+
+            foreach (string filePath in filePaths)
+            {
+                if (null == filePath)
+                    throw new ArgumentException("File paths cannot be null", nameof(filePaths));
+                if (!File.Exists(filePath))
+                    throw new ArgumentException($"File '{filePath}' does not exist.");
+            }
+
+            uint hr = NativeMethods.APSIShardedServer_Load(out IntPtr thisPtr, (ulong)filePaths.Length, filePaths);
+            HRESULT.ThrowIfFailed(hr, "Load shards");
+
+            return new APSIShardedServer(thisPtr);
+        }
+
+        /// <summary>
+        /// Process an encrypted query against all shards.
+        /// </summary>
+        /// <param name="encryptedQuery">Encrypted query to process</param>
+        /// <returns>Byte array that must be sent to the client as a result</returns>
+        public byte[] Query(byte[] encryptedQuery)
+        {
+            if (null == encryptedQuery)
+                throw new ArgumentNullException(nameof(encryptedQuery));
+
+            ulong resultSize = 0;
+            IntPtr nativeBuffer = IntPtr.Zero;
+
+            uint hr = NativeMethods.APSIShardedServer_Query(NativePtr, (ulong)encryptedQuery.LongLength, encryptedQuery, ref resultSize, ref nativeBuffer);
+            HRESULT.ThrowIfFailed(hr, "Query");
+
+            return CopyAndRelease(resultSize, nativeBuffer, "Release query response");
+        }
+
+        private ulong CheckShardIndex(int shardIndex)
+        {
+            if (shardIndex < 0 || shardIndex >= ShardCount)
+                throw new ArgumentOutOfRangeException(nameof(shardIndex));
+
+            return (ulong)shardIndex;
+        }
+
+        private static byte[] CopyAndRelease(ulong size, IntPtr nativeBuffer, string releaseDescription)
+        {
+            byte[] buffer = new byte[size];
+            Marshal.Copy(nativeBuffer, buffer, startIndex: 0, length: (int)size);
+
+            uint hr = NativeMethods.APSIServer_ReleasePointer(nativeBuffer);
+            HRESULT.ThrowIfFailed(hr, releaseDescription);
+
+            return buffer;
+        }
+
+        /// <summary>
+        /// Destroy native object
+        /// </summary>
+        protected override void DestroyNativeObject()
+        {
+            NativeMethods.APSIShardedServer_Destroy(NativePtr);
+        }
+    }
+}
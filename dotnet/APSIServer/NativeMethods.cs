@@ -21,30 +21,201 @@ namespace Microsoft.Research.APSI.Server
         [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
         internal static extern uint APSIServer_Query(IntPtr thisptr, ulong encryptedQuerySize, byte[] encryptedQuery, ref ulong resultBufferSize, ref IntPtr resultBuffer);
 
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_Query(IntPtr thisptr, ulong encryptedQuerySize, ref byte encryptedQuery, ref ulong resultBufferSize, ref IntPtr resultBuffer);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_QueryInto(IntPtr thisptr, ulong encryptedQuerySize, ref byte encryptedQuery, ulong destinationCapacity, IntPtr destination, ref ulong resultSize, ref IntPtr leasedResult);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_QueryWithSession(IntPtr thisptr, ref ulong sessionToken, ulong encryptedQuerySize, byte[] encryptedQuery, ref ulong resultBufferSize, ref IntPtr resultBuffer);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_SetKeyCacheLimits(IntPtr thisptr, ulong maxBytes, ulong ttlSeconds);
+
+        internal const int MetricsBucketCount = 32;
+
+        internal const int CompressionModeCount = 3;
+
+        [StructLayout(LayoutKind.Sequential)]
+        internal struct LatencyHistogram
+        {
+            public ulong Count;
+            public ulong TotalUs;
+            [MarshalAs(UnmanagedType.ByValArray, SizeConst = MetricsBucketCount)]
+            public ulong[] Buckets;
+        }
+
+        [StructLayout(LayoutKind.Sequential)]
+        internal struct CompressionMetrics
+        {
+            public ulong QueryCount;
+            public ulong QueryBytes;
+            public ulong DeserializeUs;
+            public ulong ResponseCount;
+            public ulong ResponseBytes;
+            public ulong SerializeUs;
+        }
+
+        [StructLayout(LayoutKind.Sequential)]
+        internal struct ServerMetrics
+        {
+            public ulong UptimeUs;
+            public ulong QueriesCompleted;
+            public ulong QueriesFailed;
+            public ulong QueriesRejected;
+            public ulong ActiveQueries;
+            public ulong QueuedQueries;
+            public ulong BytesIn;
+            public ulong BytesOut;
+            public ulong ItemCount;
+            public ulong BinBundleCount;
+            public ulong ThreadCount;
+            public ulong BusyUs;
+            public LatencyHistogram Deserialize;
+            public LatencyHistogram Evaluate;
+            public LatencyHistogram Serialize;
+            public LatencyHistogram Total;
+            [MarshalAs(UnmanagedType.ByValArray, SizeConst = CompressionModeCount)]
+            public CompressionMetrics[] Compression;
+        }
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_GetMetrics(IntPtr thisptr, ref ServerMetrics metrics);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_EstimateQueryCost(IntPtr thisptr, ulong itemCount, ref ulong cost);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_SetAdmissionLimits(IntPtr thisptr, ulong maxQueries, ulong maxCost, ulong maxQueuedQueries, ulong queueTimeoutMs);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_RemoveSessionKeys(IntPtr thisptr, ulong sessionToken);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_SetResultCompression(IntPtr thisptr, int comprMode);
+
+        [UnmanagedFunctionPointer(CallingConvention.StdCall)]
+        internal delegate uint ResultPartCallback(IntPtr context, ulong partSize, IntPtr part);
+
+        [UnmanagedFunctionPointer(CallingConvention.StdCall)]
+        internal delegate uint WriteCallback(IntPtr context, ulong chunkSize, IntPtr chunk);
+
+        [UnmanagedFunctionPointer(CallingConvention.StdCall)]
+        internal delegate void QueryCompletedCallback(IntPtr context, uint hr, ulong resultSize, IntPtr result);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_QueryAsync(IntPtr thisptr, ulong encryptedQuerySize, byte[] encryptedQuery, ulong timeoutMs, QueryCompletedCallback callback, IntPtr context, out IntPtr queryHandle);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_CancelQuery(IntPtr queryHandle);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_ReleaseQuery(IntPtr queryHandle);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_QueryBatch(IntPtr thisptr, ulong queryCount, ulong[] encryptedQuerySizes, IntPtr[] encryptedQueries, [Out] ulong[] resultBufferSizes, [Out] IntPtr[] resultBuffers, [Out] uint[] queryResults);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_QueryStreamed(IntPtr thisptr, ulong encryptedQuerySize, byte[] encryptedQuery, ResultPartCallback callback, IntPtr context);
+
         [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
         internal static extern uint APSIServer_ReleasePointer(IntPtr ptr);
 
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_SetBufferPoolLimit(ulong maxRetainedBytes);
+
         [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
         internal static extern uint APSIServer_SetData(IntPtr thisptr, ulong count, ulong[,] data);
 
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_SetData2(IntPtr thisptr, ulong count, ulong[,] data, int updatable);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_SetData2(IntPtr thisptr, ulong count, ref ulong data, int updatable);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_SetLabeledData(IntPtr thisptr, ulong count, ulong[,] data, ulong labelByteCount, byte[] labels, int updatable);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_BeginData(IntPtr thisptr, ulong labelByteCount, ulong batchSize, int updatable);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_AppendData(IntPtr thisptr, ulong count, ulong[,] data, byte[] labels);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_FinalizeData(IntPtr thisptr);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_InsertOrAssign(IntPtr thisptr, ulong count, ulong[,] data);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_InsertOrAssignLabeled(IntPtr thisptr, ulong count, ulong[,] data, ulong labelByteCount, byte[] labels);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_Remove(IntPtr thisptr, ulong count, ulong[,] data);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_Strip(IntPtr thisptr);
+
         [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, CharSet = CharSet.Ansi, PreserveSig = true)]
         internal static extern uint APSIServer_Create(out IntPtr thisptr, IntPtr oprf_key, IntPtr parameters);
 
         [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
         internal static extern uint APSIServer_Destroy(IntPtr thisptr);
 
-        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, EntryPoint = "APSIServer_SaveDB1", PreserveSig = true)]
-        internal static extern uint APSIServer_SaveDB(IntPtr thisptr, ref ulong dbBufferSize, ref IntPtr dbBuffer);
-
         [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, EntryPoint = "APSIServer_SaveDB2", CharSet = CharSet.Ansi, PreserveSig = true)]
         internal static extern uint APSIServer_SaveDB(IntPtr thisptr, string filePath);
 
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_SaveDBStreamed(IntPtr thisptr, WriteCallback callback, IntPtr context);
+
         [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, EntryPoint = "APSIServer_LoadDB1", PreserveSig = true)]
         internal static extern uint APSIServer_LoadDB(out IntPtr thisptr, ulong dbBufferSize, byte[] dbBuffer);
 
         [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, EntryPoint = "APSIServer_LoadDB2", CharSet = CharSet.Ansi, PreserveSig = true)]
         internal static extern uint APSIServer_LoadDB(out IntPtr thisptr, string filePath);
 
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, EntryPoint = "APSIServer_LoadDBMapped", CharSet = CharSet.Ansi, PreserveSig = true)]
+        internal static extern uint APSIServer_LoadDBMapped(out IntPtr thisptr, string filePath);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, CharSet = CharSet.Ansi, PreserveSig = true)]
+        internal static extern uint APSIServer_ReloadDB(IntPtr thisptr, string filePath, int memoryMapped);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIServer_SwapDB(IntPtr thisptr, IntPtr other);
+
+        #endregion
+
+        #region APSIShardedServer methods
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIShardedServer_Create(out IntPtr thisptr, IntPtr oprfKey, IntPtr parameters, ulong shardCount);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIShardedServer_Destroy(IntPtr thisptr);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIShardedServer_GetShardCount(IntPtr thisptr, ref ulong shardCount);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIShardedServer_GetParameters(IntPtr thisptr, ref ulong parametersSize, ref IntPtr parametersPtr);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIShardedServer_SetData(IntPtr thisptr, ulong count, ulong[,] data, ulong labelByteCount, byte[] labels);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIShardedServer_SetShardData(IntPtr thisptr, ulong shardIndex, ulong count, ulong[,] data, ulong labelByteCount, byte[] labels);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, CharSet = CharSet.Ansi, PreserveSig = true)]
+        internal static extern uint APSIShardedServer_SaveShard(IntPtr thisptr, ulong shardIndex, string filePath);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, CharSet = CharSet.Ansi, PreserveSig = true)]
+        internal static extern uint APSIShardedServer_Load(out IntPtr thisptr, ulong shardCount, string[] filePaths);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint APSIShardedServer_Query(IntPtr thisptr, ulong encryptedQuerySize, byte[] encryptedQuery, ref ulong resultBufferSize, ref IntPtr resultBuffer);
+
         #endregion
 
         #region OPRFKey methods
@@ -68,6 +239,12 @@ namespace Microsoft.Research.APSI.Server
         [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
         internal static extern uint OPRFSender_RunOPRF(ulong encodedItemsSize, byte[] encodedItems, IntPtr oprfKey, ref ulong resultBufferSize, ref IntPtr resultBuffer);
 
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint OPRFSender_RunOPRF(ulong encodedItemsSize, ref byte encodedItems, IntPtr oprfKey, ref ulong resultBufferSize, ref IntPtr resultBuffer);
+
+        [DllImport(APSINative, CallingConvention = CallingConvention.StdCall, PreserveSig = true)]
+        internal static extern uint OPRFSender_RunOPRFBatch(ulong requestCount, ulong[] oprfRequestSizes, IntPtr[] oprfRequests, IntPtr oprfKey, ulong threadCount, ulong[] responseBufferSizes, IntPtr[] responseBuffers, IntPtr[] leasedResponses, uint[] requestResults);
+
         #endregion
 
         #region APSIParams methods
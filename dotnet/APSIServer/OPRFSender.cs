@@ -39,5 +39,98 @@ namespace Microsoft.Research.APSI.Server
 
             return resultBuffer;
         }
+
+        /// <summary>
+        /// Run OPRF on the given encoded items without copying the request or the response to managed arrays
+        /// </summary>
+        /// <param name="oprfRequest">Items encoded by an APSIClient</param>
+        /// <param name="oprfKey">OPRF key used to preprocess the encoded items</param>
+        /// <returns>Native buffer with the response that must be sent to the client</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        public static NativeBuffer RunOPRF(ReadOnlySpan<byte> oprfRequest, OPRFKey oprfKey)
+        {
+            if (null == oprfKey)
+                throw new ArgumentNullException(nameof(oprfKey));
+
+            ulong resultSize = 0;
+            IntPtr nativeBuffer = IntPtr.Zero;
+
+            uint hr = NativeMethods.OPRFSender_RunOPRF((ulong)oprfRequest.Length, ref MemoryMarshal.GetReference(oprfRequest), oprfKey.NativePtr, ref resultSize, ref nativeBuffer);
+            HRESULT.ThrowIfFailed(hr, "Run OPRF");
+
+            return APSIServer.ToNativeBuffer(resultSize, nativeBuffer);
+        }
+
+        /// <summary>
+        /// Run OPRF on the requests of several clients at once
+        /// </summary>
+        /// <param name="oprfRequests">Requests created by APSIClients</param>
+        /// <param name="oprfKey">OPRF key used to preprocess the encoded items</param>
+        /// <param name="threadCount">Number of threads to use, including the calling thread, 0 for one per hardware
+        /// thread. Threads other than the calling one come from a pool shared by all batches.</param>
+        /// <returns>One response per request, in the same order. The response to a request that failed is null.</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        /// <exception cref="ArgumentException"></exception>
+        /// <exception cref="ArgumentOutOfRangeException"></exception>
+        public static byte[][] RunOPRFBatch(byte[][] oprfRequests, OPRFKey oprfKey, int threadCount = 0)
+        {
+            if (null == oprfRequests)
+                throw new ArgumentNullException(nameof(oprfRequests));
+            if (null == oprfKey)
+                throw new ArgumentNullException(nameof(oprfKey));
+            if (threadCount < 0)
+                throw new ArgumentOutOfRangeException(nameof(threadCount));
+
+            int requestCount = oprfRequests.Length;
+            foreach (byte[] request in oprfRequests)
+            {
+                if (null == request)
+                    throw new ArgumentException("Requests cannot be null", nameof(oprfRequests));
+            }
+
+            // Requests are read in place and responses are returned in native buffers, so nothing is copied
+            // into a combined buffer and each response is copied once
+            GCHandle[] requestHandles = new GCHandle[requestCount];
+            ulong[] requestSizes = new ulong[requestCount];
+            IntPtr[] requests = new IntPtr[requestCount];
+            ulong[] responseSizes = new ulong[requestCount];
+            IntPtr[] responseBuffers = new IntPtr[requestCount];
+            IntPtr[] leasedResponses = new IntPtr[requestCount];
+            uint[] requestResults = new uint[requestCount];
+            try
+            {
+                for (int i = 0; i < requestCount; i++)
+                {
+                    requestHandles[i] = GCHandle.Alloc(oprfRequests[i], GCHandleType.Pinned);
+                    requests[i] = requestHandles[i].AddrOfPinnedObject();
+                    requestSizes[i] = (ulong)oprfRequests[i].LongLength;
+                }
+
+                uint hr = NativeMethods.OPRFSender_RunOPRFBatch((ulong)requestCount, requestSizes, requests, oprfKey.NativePtr, (ulong)threadCount, responseSizes, responseBuffers, leasedResponses, requestResults);
+                HRESULT.ThrowIfFailed(hr, "Run OPRF batch");
+
+                byte[][] results = new byte[requestCount][];
+                for (int i = 0; i < requestCount; i++)
+                {
+                    if (HRESULT.Succeeded(requestResults[i]))
+                    {
+                        results[i] = new byte[responseSizes[i]];
+                        Marshal.Copy(leasedResponses[i], results[i], startIndex: 0, length: results[i].Length);
+                    }
+                }
+
+                return results;
+            }
+            finally
+            {
+                for (int i = 0; i < requestCount; i++)
+                {
+                    if (requestHandles[i].IsAllocated)
+                        requestHandles[i].Free();
+                    if (IntPtr.Zero != leasedResponses[i])
+                        NativeMethods.APSIServer_ReleasePointer(leasedResponses[i]);
+                }
+            }
+        }
     }
 }
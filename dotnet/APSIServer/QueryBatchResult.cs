@@ -0,0 +1,46 @@
+﻿// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.using System;
+
+using Microsoft.Research.APSI.Common;
+using System;
+
+namespace Microsoft.Research.APSI.Server
+{
+    /// <summary>
+    /// Outcome of one query of a batch run with <see cref="APSIServer.QueryBatch"/>
+    /// </summary>
+    public class QueryBatchResult
+    {
+        internal QueryBatchResult(byte[] result, uint hr)
+        {
+            Result = result;
+            if (null != result)
+                return;
+
+            Rejected = HRESULT.E_BUSY == hr || HRESULT.E_TIMEOUT == hr;
+            HRESULT.Failed(hr, out string error);
+            Error = new InvalidOperationException($"FAILED: Query: {hr}: {error}");
+        }
+
+        /// <summary>
+        /// Byte array that must be sent to the client as a result, null if the query failed
+        /// </summary>
+        public byte[] Result { get; }
+
+        /// <summary>
+        /// Why the query failed, null if it succeeded
+        /// </summary>
+        public Exception Error { get; }
+
+        /// <summary>
+        /// True if the query failed because the admission limits rejected it, in which case it can be retried
+        /// later. See <see cref="APSIServer.SetAdmissionLimits"/>.
+        /// </summary>
+        public bool Rejected { get; }
+
+        /// <summary>
+        /// True if the query succeeded
+        /// </summary>
+        public bool Succeeded => null != Result;
+    }
+}
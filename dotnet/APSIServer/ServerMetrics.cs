@@ -0,0 +1,226 @@
+﻿// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.using System;
+
+using Microsoft.Research.APSI.Common;
+using System;
+using System.Collections.Generic;
+
+namespace Microsoft.Research.APSI.Server
+{
+    /// <summary>
+    /// Durations recorded by a server, in buckets of powers of two microseconds
+    /// </summary>
+    public class LatencyHistogram
+    {
+        internal LatencyHistogram(NativeMethods.LatencyHistogram histogram)
+        {
+            Count = histogram.Count;
+            Total = TimeSpan.FromTicks((long)histogram.TotalUs * 10);
+            Buckets = histogram.Buckets;
+        }
+
+        /// <summary>
+        /// Number of recorded durations
+        /// </summary>
+        public ulong Count { get; }
+
+        /// <summary>
+        /// Sum of the recorded durations
+        /// </summary>
+        public TimeSpan Total { get; }
+
+        /// <summary>
+        /// Bucket i counts durations of at least 2^(i - 1) and less than 2^i microseconds. Bucket 0 counts
+        /// durations below one microsecond, and the last bucket all longer durations.
+        /// </summary>
+        public ulong[] Buckets { get; }
+
+        /// <summary>
+        /// Upper bound of the duration below which the given fraction of the recorded durations falls
+        /// </summary>
+        /// <param name="quantile">Fraction between 0 and 1</param>
+        /// <returns>Upper bound of the bucket that holds the quantile</returns>
+        /// <exception cref="ArgumentOutOfRangeException"></exception>
+        public TimeSpan GetQuantile(double quantile)
+        {
+            if (quantile < 0 || quantile > 1)
+                throw new ArgumentOutOfRangeException(nameof(quantile));
+
+            double rank = quantile * Count;
+            ulong seen = 0;
+            for (int i = 0; i < Buckets.Length; i++)
+            {
+                seen += Buckets[i];
+                if (seen > 0 && seen >= rank)
+                    return TimeSpan.FromTicks((1L << i) * 10);
+            }
+
+            return TimeSpan.Zero;
+        }
+    }
+
+    /// <summary>
+    /// Traffic of a server with one compression mode. Queries are counted under the compression they were
+    /// sent with, results under the compression they were returned with.
+    /// </summary>
+    public class CompressionMetrics
+    {
+        internal CompressionMetrics(NativeMethods.CompressionMetrics metrics)
+        {
+            QueryCount = metrics.QueryCount;
+            QueryBytes = metrics.QueryBytes;
+            Deserialize = TimeSpan.FromTicks((long)metrics.DeserializeUs * 10);
+            ResultCount = metrics.ResponseCount;
+            ResultBytes = metrics.ResponseBytes;
+            Serialize = TimeSpan.FromTicks((long)metrics.SerializeUs * 10);
+        }
+
+        /// <summary>
+        /// Number of completed queries sent with this compression
+        /// </summary>
+        public ulong QueryCount { get; }
+
+        /// <summary>
+        /// Total size of these queries
+        /// </summary>
+        public ulong QueryBytes { get; }
+
+        /// <summary>
+        /// Time spent parsing and decompressing these queries
+        /// </summary>
+        public TimeSpan Deserialize { get; }
+
+        /// <summary>
+        /// Number of results returned with this compression
+        /// </summary>
+        public ulong ResultCount { get; }
+
+        /// <summary>
+        /// Total size of these results
+        /// </summary>
+        public ulong ResultBytes { get; }
+
+        /// <summary>
+        /// Time spent serializing and compressing results with this compression, summed over the worker threads
+        /// </summary>
+        public TimeSpan Serialize { get; }
+    }
+
+    /// <summary>
+    /// Snapshot of the metrics of a server. Counters and histograms accumulate since the server was created.
+    /// </summary>
+    public class ServerMetrics
+    {
+        internal ServerMetrics(NativeMethods.ServerMetrics metrics)
+        {
+            Uptime = TimeSpan.FromTicks((long)metrics.UptimeUs * 10);
+            QueriesCompleted = metrics.QueriesCompleted;
+            QueriesFailed = metrics.QueriesFailed;
+            QueriesRejected = metrics.QueriesRejected;
+            ActiveQueries = metrics.ActiveQueries;
+            QueuedQueries = metrics.QueuedQueries;
+            BytesIn = metrics.BytesIn;
+            BytesOut = metrics.BytesOut;
+            ItemCount = metrics.ItemCount;
+            BinBundleCount = metrics.BinBundleCount;
+            ThreadCount = metrics.ThreadCount;
+            Busy = TimeSpan.FromTicks((long)metrics.BusyUs * 10);
+            Deserialize = new LatencyHistogram(metrics.Deserialize);
+            Evaluate = new LatencyHistogram(metrics.Evaluate);
+            Serialize = new LatencyHistogram(metrics.Serialize);
+            Total = new LatencyHistogram(metrics.Total);
+
+            var compression = new Dictionary<Compression, CompressionMetrics>();
+            for (int i = 0; i < metrics.Compression.Length; i++)
+            {
+                compression.Add((Compression)i, new CompressionMetrics(metrics.Compression[i]));
+            }
+            Compression = compression;
+        }
+
+        /// <summary>
+        /// Time since the server was created
+        /// </summary>
+        public TimeSpan Uptime { get; }
+
+        /// <summary>
+        /// Number of queries that returned a result
+        /// </summary>
+        public ulong QueriesCompleted { get; }
+
+        /// <summary>
+        /// Number of admitted queries that failed or were cancelled
+        /// </summary>
+        public ulong QueriesFailed { get; }
+
+        /// <summary>
+        /// Number of queries rejected by admission control. See <see cref="APSIServer.SetAdmissionLimits"/>.
+        /// </summary>
+        public ulong QueriesRejected { get; }
+
+        /// <summary>
+        /// Number of queries running now
+        /// </summary>
+        public ulong ActiveQueries { get; }
+
+        /// <summary>
+        /// Number of queries waiting to be admitted now
+        /// </summary>
+        public ulong QueuedQueries { get; }
+
+        /// <summary>
+        /// Total size of the received queries
+        /// </summary>
+        public ulong BytesIn { get; }
+
+        /// <summary>
+        /// Total size of the returned results
+        /// </summary>
+        public ulong BytesOut { get; }
+
+        /// <summary>
+        /// Number of items in the current database
+        /// </summary>
+        public ulong ItemCount { get; }
+
+        /// <summary>
+        /// Number of bin bundles in the current database
+        /// </summary>
+        public ulong BinBundleCount { get; }
+
+        /// <summary>
+        /// Number of threads that evaluate queries
+        /// </summary>
+        public ulong ThreadCount { get; }
+
+        /// <summary>
+        /// Time during which at least one query was running
+        /// </summary>
+        public TimeSpan Busy { get; }
+
+        /// <summary>
+        /// Time spent parsing queries
+        /// </summary>
+        public LatencyHistogram Deserialize { get; }
+
+        /// <summary>
+        /// Time spent evaluating queries, including the serialization of their results
+        /// </summary>
+        public LatencyHistogram Evaluate { get; }
+
+        /// <summary>
+        /// Time spent serializing each part of the results, on the worker threads
+        /// </summary>
+        public LatencyHistogram Serialize { get; }
+
+        /// <summary>
+        /// Time taken by whole queries that returned a result
+        /// </summary>
+        public LatencyHistogram Total { get; }
+
+        /// <summary>
+        /// Queries and results by compression, to weigh the bytes saved against the time spent compressing
+        /// </summary>
+        public IReadOnlyDictionary<Compression, CompressionMetrics> Compression { get; }
+    }
+}
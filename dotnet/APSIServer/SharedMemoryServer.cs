@@ -0,0 +1,485 @@
+﻿// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.using System;
+
+using Microsoft.Research.APSI.Common;
+using System;
+using System.Collections.Concurrent;
+using System.Diagnostics;
+using System.IO;
+using System.IO.MemoryMappedFiles;
+using System.Runtime.InteropServices;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace Microsoft.Research.APSI.Server
+{
+    /// <summary>
+    /// Serves a database from an APSIServerDaemon worker process, exchanging requests and responses with it
+    /// through a pair of single-producer single-consumer rings in shared memory.
+    ///
+    /// The worker runs the queries outside of this process, so a crash or an out-of-memory condition in the
+    /// native code does not take the managed process down, and query bodies are read by the worker directly
+    /// from the shared memory. Requests can be sent from several threads at the same time.
+    /// </summary>
+    public class SharedMemoryServer : DisposableObject
+    {
+        /// <summary>
+        /// Default size in bytes of each of the request and response rings
+        /// </summary>
+        public const long DefaultRingSize = 64L * 1024 * 1024;
+
+        // Layout shared with SharedRegionHeader in apsiserverdaemon.cpp
+        private const long Magic = 0x314D485349535041;
+        private const int Version = 1;
+        private const int MagicOffset = 0;
+        private const int VersionOffset = 8;
+        private const int RequestRingOffsetOffset = 16;
+        private const int RequestRingSizeOffset = 24;
+        private const int ResponseRingOffsetOffset = 32;
+        private const int ResponseRingSizeOffset = 40;
+        private const int WorkerStateOffset = 48;
+        private const int StopRequestedOffset = 52;
+        private const int HeaderSize = 128;
+
+        private const int WorkerStarting = 0;
+        private const int WorkerReady = 1;
+
+        private const uint GetParametersRequest = 1;
+        private const uint RunOPRFRequest = 2;
+        private const uint RunQueryRequest = 3;
+
+        private readonly string path_;
+        private readonly MemoryMappedFile file_;
+        private readonly MemoryMappedViewAccessor view_;
+        private readonly IntPtr region_;
+        private readonly SharedRing requests_;
+        private readonly SharedRing responses_;
+        private readonly Process worker_;
+        private readonly Thread reader_;
+
+        private readonly object writeLock_ = new object();
+        private readonly ConcurrentDictionary<ulong, TaskCompletionSource<byte[]>> pending_ = new ConcurrentDictionary<ulong, TaskCompletionSource<byte[]>>();
+        private long nextRequestId_;
+        private volatile bool stopping_;
+        private volatile bool readerStopped_;
+
+        /// <summary>
+        /// Start a worker process serving the given database
+        /// </summary>
+        /// <remarks>
+        /// On Linux the worker is stopped when the thread that created this object exits, so it should be created
+        /// from a thread that lives at least as long as the object, not from a thread pool thread.
+        /// </remarks>
+        /// <param name="workerPath">Path of the APSIServerDaemon executable</param>
+        /// <param name="dbFile">Database saved with <see cref="APSIServer.SaveDB(string)"/></param>
+        /// <param name="oprfKeyFile">OPRF key saved with <see cref="OPRFKey.Save(Stream)"/>, or null if the
+        /// worker should not answer OPRF requests</param>
+        /// <param name="ringSize">Size in bytes of each of the request and response rings. Must be a power of
+        /// two; a request or a response must fit in half of it.</param>
+        /// <exception cref="ArgumentNullException"></exception>
+        /// <exception cref="ArgumentOutOfRangeException"></exception>
+        /// <exception cref="InvalidOperationException">The worker failed to start</exception>
+        public SharedMemoryServer(string workerPath, string dbFile, string oprfKeyFile = null, long ringSize = DefaultRingSize)
+        {
+            if (null == workerPath)
+                throw new ArgumentNullException(nameof(workerPath));
+            if (null == dbFile)
+                throw new ArgumentNullException(nameof(dbFile));
+            if (ringSize < 64 * 1024 || ringSize > 1L << 30 || (ringSize & (ringSize - 1)) != 0)
+                throw new ArgumentOutOfRangeException(nameof(ringSize), "Ring size must be a power of two between 64 KB and 1 GB");
+
+            string directory = Directory.Exists("/dev/shm") ? "/dev/shm" : Path.GetTempPath();
+            path_ = Path.Combine(directory, $"apsi-{Guid.NewGuid():N}");
+
+            long requestRingOffset = HeaderSize;
+            long responseRingOffset = requestRingOffset + SharedRing.ControlSize + ringSize;
+            long regionSize = responseRingOffset + SharedRing.ControlSize + ringSize;
+
+            try
+            {
+                file_ = MemoryMappedFile.CreateFromFile(path_, FileMode.CreateNew, mapName: null, regionSize, MemoryMappedFileAccess.ReadWrite);
+                view_ = file_.CreateViewAccessor(0, regionSize, MemoryMappedFileAccess.ReadWrite);
+
+                bool added = false;
+                view_.SafeMemoryMappedViewHandle.DangerousAddRef(ref added);
+                region_ = view_.SafeMemoryMappedViewHandle.DangerousGetHandle() + (int)view_.PointerOffset;
+
+                Marshal.WriteInt64(region_, MagicOffset, Magic);
+                Marshal.WriteInt32(region_, VersionOffset, Version);
+                Marshal.WriteInt64(region_, RequestRingOffsetOffset, requestRingOffset);
+                Marshal.WriteInt64(region_, RequestRingSizeOffset, ringSize);
+                Marshal.WriteInt64(region_, ResponseRingOffsetOffset, responseRingOffset);
+                Marshal.WriteInt64(region_, ResponseRingSizeOffset, ringSize);
+                Thread.MemoryBarrier();
+
+                requests_ = new SharedRing(region_ + (int)requestRingOffset, ringSize);
+                responses_ = new SharedRing(region_ + (int)responseRingOffset, ringSize);
+
+                string arguments = $"--db \"{dbFile}\" --shm \"{path_}\" --mapped";
+                if (null != oprfKeyFile)
+                    arguments += $" --oprf-key \"{oprfKeyFile}\"";
+
+                worker_ = Process.Start(new ProcessStartInfo(workerPath, arguments) { UseShellExecute = false });
+                WaitForWorker();
+
+                reader_ = new Thread(ReadResponses) { IsBackground = true, Name = "APSI shared memory reader" };
+                reader_.Start();
+            }
+            catch
+            {
+                Shutdown();
+                throw;
+            }
+        }
+
+        /// <summary>
+        /// Get the parameters of the served database, to send to clients
+        /// </summary>
+        /// <returns>Serialized parameters</returns>
+        public byte[] GetParameters()
+        {
+            return Wait(SendAsync(GetParametersRequest, new byte[0]));
+        }
+
+        /// <summary>
+        /// Run an OPRF request received from a client
+        /// </summary>
+        /// <param name="oprfRequest">OPRF request</param>
+        /// <returns>OPRF response to send to the client</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        /// <exception cref="ArgumentException">The request does not fit in the ring</exception>
+        /// <exception cref="InvalidOperationException"></exception>
+        public byte[] RunOPRF(byte[] oprfRequest)
+        {
+            return Wait(RunOPRFAsync(oprfRequest));
+        }
+
+        /// <summary>
+        /// Run an OPRF request received from a client without blocking the calling thread
+        /// </summary>
+        /// <param name="oprfRequest">OPRF request</param>
+        /// <returns>Task that completes with the OPRF response to send to the client</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        /// <exception cref="ArgumentException">The request does not fit in the ring</exception>
+        public Task<byte[]> RunOPRFAsync(byte[] oprfRequest)
+        {
+            if (null == oprfRequest)
+                throw new ArgumentNullException(nameof(oprfRequest));
+
+            return SendAsync(RunOPRFRequest, oprfRequest);
+        }
+
+        /// <summary>
+        /// Process an encrypted query
+        /// </summary>
+        /// <param name="encryptedQuery">Encrypted query to process</param>
+        /// <returns>Encrypted result to send to the client</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        /// <exception cref="ArgumentException">The query does not fit in the ring</exception>
+        /// <exception cref="InvalidOperationException"></exception>
+        public byte[] Query(byte[] encryptedQuery)
+        {
+            return Wait(QueryAsync(encryptedQuery));
+        }
+
+        /// <summary>
+        /// Process an encrypted query without blocking the calling thread
+        /// </summary>
+        /// <param name="encryptedQuery">Encrypted query to process</param>
+        /// <returns>Task that completes with the encrypted result to send to the client</returns>
+        /// <exception cref="ArgumentNullException"></exception>
+        /// <exception cref="ArgumentException">The query does not fit in the ring</exception>
+        public Task<byte[]> QueryAsync(byte[] encryptedQuery)
+        {
+            if (null == encryptedQuery)
+                throw new ArgumentNullException(nameof(encryptedQuery));
+
+            return SendAsync(RunQueryRequest, encryptedQuery);
+        }
+
+        /// <summary>
+        /// Stop the worker and remove the shared memory
+        /// </summary>
+        protected override void DisposeManagedResources()
+        {
+            base.DisposeManagedResources();
+            Shutdown();
+        }
+
+        private Task<byte[]> SendAsync(uint requestType, byte[] body)
+        {
+            if (IsDisposed)
+                throw new ObjectDisposedException(nameof(SharedMemoryServer));
+            if (!requests_.Fits(body.Length))
+                throw new ArgumentException("Request does not fit in the shared memory ring", nameof(body));
+
+            ulong requestId = (ulong)Interlocked.Increment(ref nextRequestId_);
+            TaskCompletionSource<byte[]> completion = new TaskCompletionSource<byte[]>(TaskCreationOptions.RunContinuationsAsynchronously);
+            pending_[requestId] = completion;
+
+            // Once the reader stopped, nothing completes the request anymore
+            if (readerStopped_)
+            {
+                pending_.TryRemove(requestId, out _);
+                throw new InvalidOperationException("APSI worker process is not running");
+            }
+
+            lock (writeLock_)
+            {
+                SpinWait wait = new SpinWait();
+                while (!requests_.TryWrite(requestType, requestId, body))
+                {
+                    if (stopping_ || readerStopped_)
+                    {
+                        pending_.TryRemove(requestId, out _);
+                        throw new InvalidOperationException("APSI worker process is not running");
+                    }
+
+                    if (wait.NextSpinWillYield)
+                        Thread.Sleep(1);
+                    else
+                        wait.SpinOnce();
+                }
+            }
+
+            return completion.Task;
+        }
+
+        private void ReadResponses()
+        {
+            SpinWait wait = new SpinWait();
+            try
+            {
+                while (!stopping_)
+                {
+                    if (responses_.TryRead(out uint code, out ulong requestId, out byte[] body))
+                    {
+                        wait.Reset();
+                        Complete(code, requestId, body);
+                        continue;
+                    }
+
+                    if (!wait.NextSpinWillYield)
+                    {
+                        wait.SpinOnce();
+                        continue;
+                    }
+
+                    // Responses written by the worker before it exited are still delivered
+                    if (worker_.HasExited)
+                    {
+                        while (responses_.TryRead(out code, out requestId, out body))
+                            Complete(code, requestId, body);
+                        break;
+                    }
+
+                    Thread.Sleep(1);
+                }
+            }
+            catch (InvalidDataException)
+            {
+                // A corrupted ring cannot be resynchronized: stop reading and fail what is pending
+            }
+
+            readerStopped_ = true;
+            FailPending();
+        }
+
+        private void Complete(uint code, ulong requestId, byte[] body)
+        {
+            if (pending_.TryRemove(requestId, out TaskCompletionSource<byte[]> completion))
+            {
+                if (HRESULT.Failed(code))
+                    completion.TrySetException(new InvalidOperationException($"Shared memory request failed: 0x{code:X8}"));
+                else
+                    completion.TrySetResult(body);
+            }
+        }
+
+        private void WaitForWorker()
+        {
+            while (Marshal.ReadInt32(region_, WorkerStateOffset) == WorkerStarting)
+            {
+                if (worker_.HasExited)
+                    throw new InvalidOperationException($"APSI worker process exited with code {worker_.ExitCode}");
+
+                Thread.Sleep(10);
+            }
+
+            if (Marshal.ReadInt32(region_, WorkerStateOffset) != WorkerReady)
+                throw new InvalidOperationException("APSI worker process stopped");
+        }
+
+        private void Shutdown()
+        {
+            stopping_ = true;
+
+            if (null != worker_)
+            {
+                Marshal.WriteInt32(region_, StopRequestedOffset, 1);
+                Thread.MemoryBarrier();
+                if (!worker_.WaitForExit(5000))
+                    worker_.Kill();
+                worker_.Dispose();
+            }
+
+            reader_?.Join();
+            FailPending();
+
+            if (null != view_)
+            {
+                view_.SafeMemoryMappedViewHandle.DangerousRelease();
+                view_.Dispose();
+            }
+            file_?.Dispose();
+
+            if (File.Exists(path_))
+                File.Delete(path_);
+        }
+
+        private void FailPending()
+        {
+            foreach (ulong requestId in pending_.Keys)
+            {
+                if (pending_.TryRemove(requestId, out TaskCompletionSource<byte[]> completion))
+                    completion.TrySetException(new InvalidOperationException("APSI worker process is not running"));
+            }
+        }
+
+        private static byte[] Wait(Task<byte[]> task)
+        {
+            return task.GetAwaiter().GetResult();
+        }
+
+        /// <summary>
+        /// Managed side of SharedRing in apsiserverdaemon.cpp. Positions are only written by their owner, and
+        /// the barriers order them with the frames they publish.
+        /// </summary>
+        private class SharedRing
+        {
+            public const int ControlSize = 128;
+
+            private const int FrameHeaderSize = 16;
+            private const uint WrapMarker = 0xFFFFFFFF;
+
+            private readonly IntPtr control_;
+            private readonly IntPtr data_;
+            private readonly long size_;
+
+            public SharedRing(IntPtr control, long size)
+            {
+                control_ = control;
+                data_ = control + ControlSize;
+                size_ = size;
+            }
+
+            private long Head
+            {
+                get { long value = Marshal.ReadInt64(control_, 0); Thread.MemoryBarrier(); return value; }
+                set { Thread.MemoryBarrier(); Marshal.WriteInt64(control_, 0, value); }
+            }
+
+            private long Tail
+            {
+                get { long value = Marshal.ReadInt64(control_, 64); Thread.MemoryBarrier(); return value; }
+                set { Thread.MemoryBarrier(); Marshal.WriteInt64(control_, 64, value); }
+            }
+
+            public bool Fits(long bodySize)
+            {
+                return FrameSize(bodySize) <= size_ / 2;
+            }
+
+            public bool TryWrite(uint code, ulong requestId, byte[] body)
+            {
+                long head = Head;
+                long size = FrameSize(body.Length);
+                long remaining = size_ - (head & (size_ - 1));
+                long padding = remaining < size ? remaining : 0;
+                if (size_ - (head - Tail) < padding + size)
+                    return false;
+
+                if (padding >= FrameHeaderSize)
+                    WriteFrameHeader(head, 0, WrapMarker, 0);
+                head += padding;
+
+                WriteFrameHeader(head, (uint)body.Length, code, requestId);
+                Marshal.Copy(body, 0, Address(head) + FrameHeaderSize, body.Length);
+
+                Head = head + size;
+                return true;
+            }
+
+            public bool TryRead(out uint code, out ulong requestId, out byte[] body)
+            {
+                long tail = Tail;
+                long head = Head;
+
+                // Sizes come from the other process and are checked before they are used
+                if (head - tail < 0 || head - tail > size_)
+                    throw new InvalidDataException("Shared memory ring has an invalid head");
+
+                while (tail != head)
+                {
+                    long published = head - tail;
+                    long remaining = size_ - (tail & (size_ - 1));
+                    if (remaining < FrameHeaderSize)
+                    {
+                        CheckFrame(remaining <= published);
+                        tail += remaining;
+                        continue;
+                    }
+
+                    IntPtr frame = Address(tail);
+                    uint bodySize = (uint)Marshal.ReadInt32(frame, 0);
+                    code = (uint)Marshal.ReadInt32(frame, 4);
+                    if (WrapMarker == code)
+                    {
+                        CheckFrame(remaining <= published);
+                        tail += remaining;
+                        continue;
+                    }
+
+                    long frameSize = FrameSize(bodySize);
+                    CheckFrame(frameSize <= size_ / 2 && frameSize <= remaining && frameSize <= published);
+
+                    requestId = (ulong)Marshal.ReadInt64(frame, 8);
+                    body = new byte[bodySize];
+                    Marshal.Copy(frame + FrameHeaderSize, body, 0, body.Length);
+
+                    Tail = tail + frameSize;
+                    return true;
+                }
+
+                code = 0;
+                requestId = 0;
+                body = null;
+                return false;
+            }
+
+            private void WriteFrameHeader(long position, uint bodySize, uint code, ulong requestId)
+            {
+                IntPtr frame = Address(position);
+                Marshal.WriteInt32(frame, 0, (int)bodySize);
+                Marshal.WriteInt32(frame, 4, (int)code);
+                Marshal.WriteInt64(frame, 8, (long)requestId);
+            }
+
+            private IntPtr Address(long position)
+            {
+                return new IntPtr(data_.ToInt64() + (position & (size_ - 1)));
+            }
+
+            private static void CheckFrame(bool valid)
+            {
+                if (!valid)
+                    throw new InvalidDataException("Shared memory ring holds an invalid frame");
+            }
+
+            private static long FrameSize(long bodySize)
+            {
+                return (FrameHeaderSize + bodySize + 7) & ~7L;
+            }
+        }
+    }
+}
@@ -0,0 +1,470 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.using System;
+
+// apsibenchmark.cpp : Benchmarks the native APSIServer/APSIClient exports end to end.
+
+// STD
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// APSINative
+#include "apsiclientnative.h"
+#include "apsiservernative.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+    const char* default_params = R"({
+        "table_params": {
+            "hash_func_count": 3,
+            "table_size": 512,
+            "max_items_per_bin": 92
+        },
+        "item_params": {
+            "felts_per_item": 8
+        },
+        "query_params": {
+            "ps_low_degree": 0,
+            "query_powers": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+        },
+        "seal_params": {
+            "plain_modulus": 40961,
+            "poly_modulus_degree": 4096,
+            "coeff_modulus_bits": [ 40, 32, 32 ]
+        }
+    })";
+
+    struct Options
+    {
+        string params = default_params;
+        uint64_t db_size = 65536;
+        uint64_t query_size = 10;
+        double match_rate = 0.5;
+        uint64_t threads = 0;
+        uint64_t iterations = 10;
+        uint64_t seed = 0;
+        string db_file = "/tmp/apsibenchmark.db";
+        bool mapped = false;
+        string compression = "default";
+        int compr_mode = -1;
+    };
+
+    void PrintUsage(const char* program)
+    {
+        cout << "Usage: " << program << " [options]" << endl
+             << "  --params <file>       PSI parameters JSON (default: 64K DB parameters used by the tests)" << endl
+             << "  --db-size <n>         Number of items in the server DB (default: 65536)" << endl
+             << "  --query-size <n>      Number of items in each query (default: 10)" << endl
+             << "  --match-rate <r>      Fraction of query items that are in the DB, 0 to 1 (default: 0.5)" << endl
+             << "  --threads <n>         APSI thread count, 0 for all hardware threads (default: 0)" << endl
+             << "  --iterations <n>      Number of measured iterations (default: 10)" << endl
+             << "  --seed <n>            Seed for the generated items (default: 0)" << endl
+             << "  --db-file <path>      File used for the Save and Load phases (default: /tmp/apsibenchmark.db)" << endl
+             << "  --mapped              Load the DB through APSIServer_LoadDBMapped" << endl
+             << "  --compression <mode>  Compression of queries and results: none, zlib or zstd (default: SEAL default)" << endl;
+    }
+
+    /**
+    Compression mode given on the command line, or -1 to keep the SEAL default.
+    */
+    bool ParseCompression(const string& value, int& compr_mode)
+    {
+        if (value == "default")
+            compr_mode = -1;
+        else if (value == "none")
+            compr_mode = APSI_COMPRESSION_NONE;
+        else if (value == "zlib")
+            compr_mode = APSI_COMPRESSION_ZLIB;
+        else if (value == "zstd")
+            compr_mode = APSI_COMPRESSION_ZSTD;
+        else
+            return false;
+
+        return true;
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "--mapped")
+            {
+                options.mapped = true;
+                continue;
+            }
+
+            if (i + 1 >= argc)
+                return false;
+
+            string value = argv[++i];
+            if (arg == "--params")
+            {
+                ifstream params_file(value);
+                if (!params_file)
+                {
+                    cerr << "Cannot open parameter file " << value << endl;
+                    return false;
+                }
+
+                stringstream ss;
+                ss << params_file.rdbuf();
+                options.params = ss.str();
+            }
+            else if (arg == "--db-size")
+                options.db_size = stoull(value);
+            else if (arg == "--query-size")
+                options.query_size = stoull(value);
+            else if (arg == "--match-rate")
+                options.match_rate = stod(value);
+            else if (arg == "--threads")
+                options.threads = stoull(value);
+            else if (arg == "--iterations")
+                options.iterations = stoull(value);
+            else if (arg == "--seed")
+                options.seed = stoull(value);
+            else if (arg == "--db-file")
+                options.db_file = value;
+            else if (arg == "--compression")
+            {
+                options.compression = value;
+                if (!ParseCompression(value, options.compr_mode))
+                    return false;
+            }
+            else
+                return false;
+        }
+
+        return options.db_size > 0 && options.query_size > 0 && options.iterations > 0
+            && options.match_rate >= 0.0 && options.match_rate <= 1.0;
+    }
+
+    void Check(HRESULT hr, const char* operation)
+    {
+        if (hr < 0)
+        {
+            stringstream ss;
+            ss << operation << " failed: 0x" << hex << static_cast<uint32_t>(hr);
+            throw runtime_error(ss.str());
+        }
+    }
+
+    /**
+    Peak resident set size of the process in KB, as reported by the kernel.
+    */
+    uint64_t PeakRssKB()
+    {
+        ifstream status("/proc/self/status");
+        string line;
+        while (getline(status, line))
+        {
+            if (line.compare(0, 6, "VmHWM:") == 0)
+                return stoull(line.substr(6));
+        }
+
+        return 0;
+    }
+
+    /**
+    Reset the peak resident set size so that it can be measured per phase.
+    */
+    void ResetPeakRss()
+    {
+        ofstream clear_refs("/proc/self/clear_refs");
+        clear_refs << "5";
+    }
+
+    class PhaseStats
+    {
+    public:
+        PhaseStats(string name, string unit, bool bytes_throughput = false)
+            : name_(move(name)), unit_(move(unit)), bytes_throughput_(bytes_throughput)
+        {
+        }
+
+        /**
+        Run one measurement of the phase. The function returns the number of bytes of the
+        message produced by the phase; work is the number of units processed.
+        */
+        template <typename F>
+        void measure(uint64_t work, F&& phase)
+        {
+            ResetPeakRss();
+
+            auto start = steady_clock::now();
+            uint64_t bytes = phase();
+            auto elapsed = steady_clock::now() - start;
+
+            latencies_.push_back(duration_cast<nanoseconds>(elapsed).count());
+            bytes_.push_back(bytes);
+            work_ += work;
+            peak_rss_kb_ = max(peak_rss_kb_, PeakRssKB());
+        }
+
+        static void PrintHeader()
+        {
+            cout << left << setw(14) << "Phase"
+                 << right << setw(12) << "p50 ms" << setw(12) << "p90 ms" << setw(12) << "p99 ms" << setw(12) << "max ms"
+                 << setw(16) << "throughput" << setw(14) << "bytes/op" << setw(14) << "peak RSS KB" << endl;
+        }
+
+        void print() const
+        {
+            vector<int64_t> sorted = latencies_;
+            sort(sorted.begin(), sorted.end());
+
+            int64_t total_ns = 0;
+            for (int64_t latency : sorted)
+            {
+                total_ns += latency;
+            }
+
+            uint64_t total_bytes = 0;
+            for (uint64_t bytes : bytes_)
+            {
+                total_bytes += bytes;
+            }
+
+            // Throughput is either in units of work or in MB of the produced messages
+            double work = bytes_throughput_ ? static_cast<double>(total_bytes) / 1e6 : static_cast<double>(work_);
+            double throughput = total_ns > 0 ? work * 1e9 / static_cast<double>(total_ns) : 0.0;
+
+            cout << left << setw(14) << name_ << right << fixed << setprecision(3)
+                 << setw(12) << percentile(sorted, 0.50) << setw(12) << percentile(sorted, 0.90)
+                 << setw(12) << percentile(sorted, 0.99) << setw(12) << percentile(sorted, 1.0)
+                 << setw(10) << setprecision(1) << throughput << ' ' << left << setw(5) << unit_ << right
+                 << setw(14) << (bytes_.empty() ? 0 : total_bytes / bytes_.size())
+                 << setw(14) << peak_rss_kb_ << endl;
+        }
+
+    private:
+        string name_;
+        string unit_;
+        bool bytes_throughput_;
+        vector<int64_t> latencies_;
+        vector<uint64_t> bytes_;
+        uint64_t work_ = 0;
+        uint64_t peak_rss_kb_ = 0;
+
+        static double percentile(const vector<int64_t>& sorted, double p)
+        {
+            if (sorted.empty())
+                return 0.0;
+
+            // Nearest-rank percentile
+            size_t rank = static_cast<size_t>(p * static_cast<double>(sorted.size()) + 0.999999);
+            size_t index = min(sorted.size() - 1, rank > 0 ? rank - 1 : 0);
+            return static_cast<double>(sorted[index]) / 1e6;
+        }
+    };
+
+    uint64_t FileSize(const string& path)
+    {
+        ifstream file(path, ios::binary | ios::ate);
+        return file ? static_cast<uint64_t>(file.tellg()) : 0;
+    }
+
+    void GenerateItems(const Options& options, mt19937_64& rng, vector<uint64_t>& db, vector<uint64_t>& query, uint64_t& match_count)
+    {
+        db.resize(options.db_size * 2);
+        generate(db.begin(), db.end(), ref(rng));
+
+        match_count = min(options.db_size, static_cast<uint64_t>(static_cast<double>(options.query_size) * options.match_rate + 0.5));
+
+        query.resize(options.query_size * 2);
+        generate(query.begin(), query.end(), ref(rng));
+
+        // The first items of the query are taken from distinct DB items
+        uniform_int_distribution<uint64_t> db_index(0, options.db_size - 1);
+        vector<uint64_t> taken;
+        for (uint64_t i = 0; i < match_count; i++)
+        {
+            uint64_t idx;
+            do
+            {
+                idx = db_index(rng);
+            } while (find(taken.begin(), taken.end(), idx) != taken.end());
+
+            taken.push_back(idx);
+            query[2 * i] = db[2 * idx];
+            query[2 * i + 1] = db[2 * idx + 1];
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    PhaseStats set_data_stats("SetData", "it/s");
+    PhaseStats oprf_stats("OPRF", "it/s");
+    PhaseStats create_query_stats("CreateQuery", "it/s");
+    PhaseStats query_stats("Query", "q/s");
+    PhaseStats process_result_stats("ProcessResult", "it/s");
+    PhaseStats save_stats("Save", "MB/s", /* bytes_throughput */ true);
+    PhaseStats load_stats("Load", "MB/s", /* bytes_throughput */ true);
+
+    try
+    {
+        Check(APSI_SetThreads(options.threads), "APSI_SetThreads");
+
+        void* params = nullptr;
+        void* oprf_key = nullptr;
+        Check(APSIParams_Create(&params, options.params.c_str()), "APSIParams_Create");
+        Check(OPRFKey_Create(&oprf_key), "OPRFKey_Create");
+
+        mt19937_64 rng(options.seed);
+        vector<uint64_t> db;
+        vector<uint64_t> query;
+        uint64_t match_count = 0;
+
+        for (uint64_t iteration = 0; iteration < options.iterations; iteration++)
+        {
+            GenerateItems(options, rng, db, query, match_count);
+
+            void* server = nullptr;
+            Check(APSIServer_Create(&server, oprf_key, params), "APSIServer_Create");
+
+            set_data_stats.measure(options.db_size, [&]() {
+                Check(APSIServer_SetData(server, options.db_size, db.data()), "APSIServer_SetData");
+                return uint64_t(0);
+            });
+
+            uint64_t server_params_size = 0;
+            uint8_t* server_params = nullptr;
+            Check(APSIServer_GetParameters(server, &server_params_size, &server_params), "APSIServer_GetParameters");
+
+            void* client = nullptr;
+            Check(APSIClient_Create(&client), "APSIClient_Create");
+            Check(APSIClient_SetParameters(client, server_params_size, server_params), "APSIClient_SetParameters");
+            APSIServer_ReleasePointer(server_params);
+
+            // The server compresses its results like the queries, so this sets the compression of both
+            if (options.compr_mode >= 0)
+                Check(APSIClient_SetCompression(client, options.compr_mode), "APSIClient_SetCompression");
+
+            const apsi_item* query_items = reinterpret_cast<const apsi_item*>(query.data());
+            vector<apsi_item> hashed_items;
+
+            oprf_stats.measure(options.query_size, [&]() {
+                uint64_t request_size = 0;
+                uint8_t* request = nullptr;
+                Check(APSIClient_CreateOPRFRequest(client, options.query_size, query_items, &request_size, &request), "APSIClient_CreateOPRFRequest");
+
+                uint64_t response_size = 0;
+                uint8_t* response = nullptr;
+                HRESULT hr = OPRFSender_RunOPRF(request_size, request, oprf_key, &response_size, &response);
+                APSIClient_ReleaseNativePointer(request);
+                Check(hr, "OPRFSender_RunOPRF");
+
+                uint64_t hashed_count = 0;
+                uint8_t* hashed = nullptr;
+                hr = APSIClient_ExtractHashes(client, response_size, response, &hashed_count, &hashed);
+                APSIServer_ReleasePointer(response);
+                Check(hr, "APSIClient_ExtractHashes");
+
+                hashed_items.resize(hashed_count);
+                memcpy(hashed_items.data(), hashed, hashed_count * sizeof(apsi_item));
+                APSIClient_ReleaseNativePointer(hashed);
+
+                return request_size + response_size;
+            });
+
+            uint64_t encrypted_query_size = 0;
+            uint8_t* encrypted_query = nullptr;
+            create_query_stats.measure(options.query_size, [&]() {
+                Check(APSIClient_CreateQuery(client, hashed_items.size(), hashed_items.data(), &encrypted_query_size, &encrypted_query), "APSIClient_CreateQuery");
+                return encrypted_query_size;
+            });
+
+            uint64_t result_size = 0;
+            uint8_t* result = nullptr;
+            query_stats.measure(1, [&]() {
+                Check(APSIServer_Query(server, encrypted_query_size, encrypted_query, &result_size, &result), "APSIServer_Query");
+                return result_size;
+            });
+            APSIClient_ReleaseNativePointer(encrypted_query);
+
+            uint64_t found = 0;
+            process_result_stats.measure(options.query_size, [&]() {
+                uint64_t intersection_size = 0;
+                uint8_t* intersection = nullptr;
+                HRESULT hr = APSIClient_ProcessResult(client, result_size, result, &intersection_size, &intersection);
+                Check(hr, "APSIClient_ProcessResult");
+
+                found = static_cast<uint64_t>(count_if(intersection, intersection + intersection_size, [](uint8_t b) { return b != 0; }));
+                APSIClient_ReleaseNativePointer(intersection);
+                return uint64_t(0);
+            });
+            APSIServer_ReleasePointer(result);
+            APSIClient_Destroy(client);
+
+            if (found != match_count)
+            {
+                stringstream ss;
+                ss << "iteration " << iteration << ": expected " << match_count << " matches, found " << found;
+                throw runtime_error(ss.str());
+            }
+
+            uint64_t db_file_size = 0;
+            save_stats.measure(0, [&]() {
+                Check(APSIServer_SaveDB2(server, &options.db_file[0]), "APSIServer_SaveDB2");
+                return db_file_size = FileSize(options.db_file);
+            });
+            APSIServer_Destroy(server);
+            server = nullptr;
+
+            load_stats.measure(0, [&]() {
+                if (options.mapped)
+                    Check(APSIServer_LoadDBMapped(&server, &options.db_file[0]), "APSIServer_LoadDBMapped");
+                else
+                    Check(APSIServer_LoadDB2(&server, &options.db_file[0]), "APSIServer_LoadDB2");
+                return db_file_size;
+            });
+            APSIServer_Destroy(server);
+        }
+
+        OPRFKey_Destroy(oprf_key);
+        APSIParams_Destroy(params);
+        remove(options.db_file.c_str());
+    }
+    catch (const exception& ex)
+    {
+        cerr << "Benchmark failed: " << ex.what() << endl;
+        return 1;
+    }
+
+    cout << "DB size: " << options.db_size << ", query size: " << options.query_size
+         << ", match rate: " << options.match_rate << ", threads: " << options.threads
+         << ", iterations: " << options.iterations << ", compression: " << options.compression << endl;
+
+    PhaseStats::PrintHeader();
+    set_data_stats.print();
+    oprf_stats.print();
+    create_query_stats.print();
+    query_stats.print();
+    process_result_stats.print();
+    save_stats.print();
+    load_stats.print();
+
+    return 0;
+}
@@ -2,10 +2,15 @@
 // Licensed under the MIT license.using System;
 
 // STD
+#include <algorithm>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 #include <sstream>
+#include <string>
+#include <unordered_map>
 #include <random>
 
 // APSINative
@@ -15,6 +20,7 @@
 // APSI
 #include "apsi/item.h"
 #include "apsi/receiver.h"
+#include "apsi/network/sender_operation.h"
 #include "apsi/network/stream_channel.h"
 #include "apsi/log.h"
 #include "apsi/oprf/oprf_receiver.h"
@@ -23,6 +29,8 @@
 #include "seal/publickey.h"
 #include "seal/relinkeys.h"
 #include "seal/ciphertext.h"
+#include "seal/serialization.h"
+#include "seal/util/streambuf.h"
 
 
 using namespace std;
@@ -35,26 +43,99 @@ using namespace seal::util;
 static int client_instance_count_s = 0;
 
 
+struct APSIClient::SharedReceiver
+{
+    SharedReceiver(const PSIParams& params) : receiver(params), key_parms_id(params.seal_params().parms_id())
+    {
+    }
+
+    Receiver receiver;
+
+    // Used for the empty relinearization keys of queries sent without keys
+    seal::parms_id_type key_parms_id;
+
+    // Receiver::create_query is not const, so Sessions create their queries one at a time
+    mutex create_query_mutex;
+};
+
 namespace
 {
-    void CreateReceiver(const PSIParams& params, unique_ptr<Receiver> &receiver)
+    // Receivers shared by all Clients that reuse keys, by serialized parameters
+    mutex receiver_cache_mutex;
+    unordered_map<string, shared_ptr<APSIClient::SharedReceiver>> receiver_cache;
+
+    shared_ptr<APSIClient::SharedReceiver> CreateReceiver(const PSIParams& params)
     {
         Log::SetLogLevel(Log::Level::info);
 
-        // Client is single threaded to avoid CPU spikes
-        ThreadPoolMgr::SetThreadCount(1);
-        receiver.reset(new Receiver(params));
+        // The APSI thread pool is shared by the whole process and is left alone here. To avoid
+        // CPU spikes the client decrypts results on the calling thread instead (see DecryptResult).
+        return make_shared<APSIClient::SharedReceiver>(params);
+    }
+
+    void MergeMatches(vector<MatchRecord>& part_result, vector<MatchRecord>& query_result)
+    {
+        for (size_t i = 0; i < part_result.size(); i++)
+        {
+            if (part_result[i].found)
+            {
+                query_result[i] = move(part_result[i]);
+            }
+        }
+    }
+
+    bool IsSupportedComprMode(int compr_mode)
+    {
+        return compr_mode >= 0 && compr_mode <= numeric_limits<uint8_t>::max()
+            && seal::Serialization::IsSupportedComprMode(static_cast<uint8_t>(compr_mode));
     }
+
+    void CopyIntersection(const vector<MatchRecord>& query_result, vector<bool>& intersection)
+    {
+        intersection.resize(query_result.size());
+
+        // Copy result
+        for (size_t i = 0; i < intersection.size(); i++)
+        {
+            intersection[i] = query_result[i].found;
+        }
+    }
+
+    void CopyLabels(const vector<MatchRecord>& query_result, size_t label_byte_count, vector<uint8_t>& labels)
+    {
+        // Labels are laid out one after another; items that were not found get a label of all zeros
+        labels.assign(query_result.size() * label_byte_count, 0);
+
+        for (size_t i = 0; i < query_result.size(); i++)
+        {
+            if (!query_result[i].found)
+                continue;
+
+            const auto& label = query_result[i].label;
+            copy_n(label.begin(), min(label.size(), label_byte_count), labels.begin() + i * label_byte_count);
+        }
+    }
+}
+
+APSIClient::Session::Session(shared_ptr<SharedReceiver> receiver, int compr_mode) : receiver_(move(receiver)), compr_mode_(compr_mode)
+{
+}
+
+APSIClient::Session::~Session()
+{
+    Terminate();
 }
 
 APSIClient::Client::Client()
+    : compr_mode_(static_cast<int>(seal::Serialization::compr_mode_default)), session_(new Session(nullptr, compr_mode_))
 {
     client_instance_count_s++;
 }
 
 APSIClient::Client::~Client()
 {
-    Terminate();
+    session_ = nullptr;
+    receiver_ = nullptr;
 
     client_instance_count_s--;
     if (client_instance_count_s <= 0)
@@ -65,25 +146,136 @@ APSIClient::Client::~Client()
 
 HRESULT APSIClient::Client::SetParameters(const vector<uint8_t>& parameters)
 {
-    stringstream ss;
-    ss.write(reinterpret_cast<const char*>(parameters.data()), parameters.size());
+    return SetParameters(parameters, /* reuse_keys */ false);
+}
 
-    auto params = PSIParams::Load(ss);
+HRESULT APSIClient::Client::SetParameters(const vector<uint8_t>& parameters, bool reuse_keys)
+{
+    auto load_receiver = [&parameters]() {
+        stringstream ss;
+        ss.write(reinterpret_cast<const char*>(parameters.data()), parameters.size());
+
+        auto params = PSIParams::Load(ss);
+        return CreateReceiver(params.first);
+    };
 
     // New parameters means new receiver
-    receiver_ = nullptr;
-    CreateReceiver(params.first, receiver_);
+    if (reuse_keys)
+    {
+        string cache_key(parameters.begin(), parameters.end());
+        shared_ptr<SharedReceiver> receiver;
+        {
+            lock_guard<mutex> lock(receiver_cache_mutex);
+            auto cached = receiver_cache.find(cache_key);
+            if (cached != receiver_cache.end())
+                receiver = cached->second;
+        }
+
+        // Keys are generated without holding the lock, so clients with other parameters are not held up.
+        // When two clients miss at the same time the first one to finish wins and the other keys are dropped.
+        if (nullptr == receiver)
+        {
+            receiver = load_receiver();
+
+            lock_guard<mutex> lock(receiver_cache_mutex);
+            receiver = receiver_cache.emplace(move(cache_key), move(receiver)).first->second;
+        }
+
+        receiver_ = move(receiver);
+    }
+    else
+    {
+        receiver_ = load_receiver();
+    }
+
+    session_->receiver_ = receiver_;
+
+    return S_OK;
+}
+
+void APSIClient::Client::ClearReceiverCache()
+{
+    lock_guard<mutex> lock(receiver_cache_mutex);
+    receiver_cache.clear();
+}
+
+HRESULT APSIClient::Client::CreateSession(unique_ptr<Session>& session)
+{
+    IfNullRet(receiver_, E_NOT_VALID_STATE);
+
+    session.reset(new Session(receiver_, compr_mode_));
 
     return S_OK;
 }
 
 HRESULT APSIClient::Client::CreateOPRFRequest(const vector<apsi_item>& items, vector<uint8_t>& oprf_request)
+{
+    return session_->CreateOPRFRequest(items, oprf_request);
+}
+
+HRESULT APSIClient::Client::ExtractHashes(const vector<uint8_t>& oprf_response, vector<apsi_item>& hashed_items)
+{
+    return session_->ExtractHashes(oprf_response, hashed_items);
+}
+
+HRESULT APSIClient::Client::CreateQuery(const vector<apsi_item>& items, vector<uint8_t>& encrypted_query)
+{
+    return session_->CreateQuery(items, encrypted_query);
+}
+
+HRESULT APSIClient::Client::CreateQuery(const vector<apsi_item>& items, vector<uint8_t>& encrypted_query, bool include_relin_keys)
+{
+    return session_->CreateQuery(items, encrypted_query, include_relin_keys);
+}
+
+HRESULT APSIClient::Client::CreateQuery(const vector<apsi_item>& items, vector<uint8_t>& encrypted_query, bool include_relin_keys, int compr_mode)
+{
+    return session_->CreateQuery(items, encrypted_query, include_relin_keys, compr_mode);
+}
+
+HRESULT APSIClient::Client::SetCompression(int compr_mode)
+{
+    HRESULT hr = session_->SetCompression(compr_mode);
+    if (S_OK != hr)
+        return hr;
+
+    compr_mode_ = compr_mode;
+
+    return S_OK;
+}
+
+HRESULT APSIClient::Client::ProcessResult(const vector<uint8_t>& encrypted_result, vector<bool>& intersection)
+{
+    return session_->ProcessResult(encrypted_result, intersection);
+}
+
+HRESULT APSIClient::Client::ProcessResult(const vector<uint8_t>& encrypted_result, vector<bool>& intersection, vector<uint8_t>& labels, size_t& label_byte_count)
+{
+    return session_->ProcessResult(encrypted_result, intersection, labels, label_byte_count);
+}
+
+HRESULT APSIClient::Client::ProcessResultPart(const vector<uint8_t>& result_part)
+{
+    return session_->ProcessResultPart(result_part);
+}
+
+HRESULT APSIClient::Client::FinalizeResult(vector<bool>& intersection)
+{
+    return session_->FinalizeResult(intersection);
+}
+
+HRESULT APSIClient::Client::FinalizeResult(vector<bool>& intersection, vector<uint8_t>& labels, size_t& label_byte_count)
+{
+    return session_->FinalizeResult(intersection, labels, label_byte_count);
+}
+
+HRESULT APSIClient::Session::CreateOPRFRequest(const vector<apsi_item>& items, vector<uint8_t>& oprf_request)
 {
     // Max max_query_elements items supported
     if (items.size() == 0)
         return E_INVALIDARG;
 
-    // Terminate any previously existing Receiver
+    // Release the state of any previous query
     Terminate();
 
     {
@@ -113,7 +305,7 @@ HRESULT APSIClient::Client::CreateOPRFRequest(const vector<apsi_item>& items, ve
     return S_OK;
 }
 
-HRESULT APSIClient::Client::ExtractHashes(const vector<uint8_t>& oprf_response, vector<apsi_item>& hashed_items)
+HRESULT APSIClient::Session::ExtractHashes(const vector<uint8_t>& oprf_response, vector<apsi_item>& hashed_items)
 {
     IfNullRet(oprf_receiver_, E_NOT_VALID_STATE);
 
@@ -137,11 +329,21 @@ HRESULT APSIClient::Client::ExtractHashes(const vector<uint8_t>& oprf_response,
     return S_OK;
 }
 
-HRESULT APSIClient::Client::CreateQuery(const vector<apsi_item>& items, vector<uint8_t>& encrypted_query)
+HRESULT APSIClient::Session::CreateQuery(const vector<apsi_item>& items, vector<uint8_t>& encrypted_query)
+{
+    return CreateQuery(items, encrypted_query, /* include_relin_keys */ true);
+}
+
+HRESULT APSIClient::Session::CreateQuery(const vector<apsi_item>& items, vector<uint8_t>& encrypted_query, bool include_relin_keys)
+{
+    return CreateQuery(items, encrypted_query, include_relin_keys, compr_mode_);
+}
+
+HRESULT APSIClient::Session::CreateQuery(const vector<apsi_item>& items, vector<uint8_t>& encrypted_query, bool include_relin_keys, int compr_mode)
 {
     IfNullRet(receiver_, E_NOT_VALID_STATE);
 
-    if (items.size() == 0)
+    if (items.size() == 0 || !IsSupportedComprMode(compr_mode))
         return E_INVALIDARG;
 
     {
@@ -154,8 +356,24 @@ HRESULT APSIClient::Client::CreateQuery(const vector<apsi_item>& items, vector<u
             hashed_item[1] = items[i][1];
         }
 
-        auto query = receiver_->create_query(hashed_items);
+        unique_lock<mutex> create_query_lock(receiver_->create_query_mutex);
+        auto query = receiver_->receiver.create_query(hashed_items);
+        create_query_lock.unlock();
+
         itt_ = make_unique<IndexTranslationTable>(move(query.second));
+        ResetPartialResult();
+
+        if (!include_relin_keys)
+        {
+            // The server uses the keys it cached for the session. Empty keys keep the query loadable.
+            seal::RelinKeys no_relin_keys;
+            no_relin_keys.parms_id() = receiver_->key_parms_id;
+            dynamic_cast<SenderOperationQuery&>(*query.first).relin_keys = no_relin_keys;
+        }
+
+        // The ciphertexts are saved with this compression, and the server compresses its result packages
+        // the way the query says unless it overrides it
+        dynamic_cast<SenderOperationQuery&>(*query.first).compr_mode = static_cast<seal::compr_mode_type>(compr_mode);
 
         stringstream ss;
         query.first->save(ss);
@@ -168,40 +386,169 @@ HRESULT APSIClient::Client::CreateQuery(const vector<apsi_item>& items, vector<u
     return S_OK;
 }
 
-HRESULT APSIClient::Client::ProcessResult(const vector<uint8_t>& encrypted_result, vector<bool>& intersection)
+HRESULT APSIClient::Session::SetCompression(int compr_mode)
+{
+    if (!IsSupportedComprMode(compr_mode))
+        return E_INVALIDARG;
+
+    compr_mode_ = compr_mode;
+
+    return S_OK;
+}
+
+HRESULT APSIClient::Session::ProcessResult(const vector<uint8_t>& encrypted_result, vector<bool>& intersection)
+{
+    vector<MatchRecord> query_result;
+    uint32_t label_byte_count = 0;
+
+    HRESULT hr = DecryptResult(encrypted_result, query_result, label_byte_count);
+    if (S_OK != hr)
+        return hr;
+
+    CopyIntersection(query_result, intersection);
+
+    return S_OK;
+}
+
+HRESULT APSIClient::Session::ProcessResult(const vector<uint8_t>& encrypted_result, vector<bool>& intersection, vector<uint8_t>& labels, size_t& label_byte_count)
+{
+    vector<MatchRecord> query_result;
+    uint32_t result_label_byte_count = 0;
+
+    HRESULT hr = DecryptResult(encrypted_result, query_result, result_label_byte_count);
+    if (S_OK != hr)
+        return hr;
+
+    CopyIntersection(query_result, intersection);
+    CopyLabels(query_result, result_label_byte_count, labels);
+    label_byte_count = result_label_byte_count;
+
+    return S_OK;
+}
+
+HRESULT APSIClient::Session::ProcessResultPart(const vector<uint8_t>& result_part)
 {
     IfNullRet(receiver_, E_NOT_VALID_STATE);
+    IfNullRet(itt_, E_NOT_VALID_STATE);
+    IfNullRet(label_keys_, E_NOT_VALID_STATE);
 
     {
-        stringstream ss;
-        ss.write(reinterpret_cast<const char*>(encrypted_result.data()), encrypted_result.size());
+        ArrayGetBuffer agbuf(reinterpret_cast<const char*>(result_part.data()), result_part.size());
+        iostream stream(&agbuf);
+        StreamChannel channel(stream);
+
+        while (stream.peek() != char_traits<char>::eof())
+        {
+            if (!partial_result_)
+            {
+                // The first message is the response header
+                QueryResponse query_response = to_query_response(channel.receive_response());
+                if (!query_response)
+                    return E_INVALIDARG;
+
+                expected_parts_ = query_response->package_count;
+                received_parts_ = 0;
+                partial_result_ = make_unique<vector<MatchRecord>>(itt_->item_count());
+                continue;
+            }
+
+            if (received_parts_ >= expected_parts_)
+                return E_INVALIDARG;
+
+            ResultPart part = channel.receive_result(receiver_->receiver.get_seal_context());
+            if (!part)
+                return E_INVALIDARG;
+
+            vector<MatchRecord> part_result = receiver_->receiver.process_result_part(*label_keys_, *itt_, part);
+            received_parts_++;
+
+            MergeMatches(part_result, *partial_result_);
+
+            partial_label_byte_count_ = part->label_byte_count;
+        }
+    }
+
+    return S_OK;
+}
+
+HRESULT APSIClient::Session::FinalizeResult(vector<bool>& intersection)
+{
+    IfNullRet(partial_result_, E_NOT_VALID_STATE);
+
+    if (received_parts_ != expected_parts_)
+        return E_NOT_VALID_STATE;
+
+    CopyIntersection(*partial_result_, intersection);
+    ResetPartialResult();
+
+    return S_OK;
+}
+
+HRESULT APSIClient::Session::FinalizeResult(vector<bool>& intersection, vector<uint8_t>& labels, size_t& label_byte_count)
+{
+    IfNullRet(partial_result_, E_NOT_VALID_STATE);
+
+    if (received_parts_ != expected_parts_)
+        return E_NOT_VALID_STATE;
+
+    CopyIntersection(*partial_result_, intersection);
+    CopyLabels(*partial_result_, partial_label_byte_count_, labels);
+    label_byte_count = partial_label_byte_count_;
+    ResetPartialResult();
+
+    return S_OK;
+}
+
+HRESULT APSIClient::Session::DecryptResult(const vector<uint8_t>& encrypted_result, vector<MatchRecord>& query_result, uint32_t& label_byte_count)
+{
+    IfNullRet(receiver_, E_NOT_VALID_STATE);
+    IfNullRet(itt_, E_NOT_VALID_STATE);
+    IfNullRet(label_keys_, E_NOT_VALID_STATE);
 
-        StreamChannel channel(ss);
+    {
+        ArrayGetBuffer agbuf(reinterpret_cast<const char*>(encrypted_result.data()), encrypted_result.size());
+        iostream stream(&agbuf);
+
+        StreamChannel channel(stream);
 
         QueryResponse query_response = to_query_response(channel.receive_response());
-        vector<ResultPart> result_parts(query_response->package_count);
+        if (!query_response)
+            return E_INVALIDARG;
+
+        // Parts are decrypted one by one on this thread; Receiver::process_result would
+        // dispatch them to the process-wide APSI thread pool.
+        query_result.clear();
+        query_result.resize(itt_->item_count());
+        label_byte_count = 0;
 
         for (uint32_t i = 0; i < query_response->package_count; i++)
         {
-            result_parts[i] = channel.receive_result(receiver_->get_seal_context());
-        }
-        auto query_result = receiver_->process_result(*label_keys_, *itt_, result_parts);
+            ResultPart part = channel.receive_result(receiver_->receiver.get_seal_context());
+            if (!part)
+                return E_INVALIDARG;
 
-        intersection.resize(query_result.size());
+            vector<MatchRecord> part_result = receiver_->receiver.process_result_part(*label_keys_, *itt_, part);
+            MergeMatches(part_result, query_result);
 
-        // Copy result
-        for (size_t i = 0; i < intersection.size(); i++)
-        {
-            intersection[i] = query_result[i].found;
+            label_byte_count = part->label_byte_count;
         }
     }
 
     return S_OK;
 }
 
-void APSIClient::Client::Terminate()
+void APSIClient::Session::ResetPartialResult()
+{
+    partial_result_ = nullptr;
+    expected_parts_ = 0;
+    received_parts_ = 0;
+    partial_label_byte_count_ = 0;
+}
+
+void APSIClient::Session::Terminate()
 {
     oprf_receiver_ = nullptr;
     itt_ = nullptr;
     label_keys_ = nullptr;
+    ResetPartialResult();
 }
@@ -17,6 +17,7 @@ namespace apsi
     {
         class Receiver;
         class IndexTranslationTable;
+        class MatchRecord;
     }
 
     namespace oprf {
@@ -31,19 +32,22 @@ namespace APSIClient
     using apsi_item = std::array<std::uint64_t, 2>;
 
     /**
-    APSI Client
+    Receiver shared by a Client and the Sessions created from it.
     */
-    class Client
+    struct SharedReceiver;
+
+    /**
+    State of a single query: the OPRF receiver, the index translation table, the label keys and the
+    partially processed result.
+
+    A Session uses the Receiver, and so the keys, of the Client that created it. Many Sessions can
+    have queries in flight at the same time and can be used from different threads, but a single
+    Session must not be used from more than one thread at a time.
+    */
+    class Session
     {
     public:
-        Client();
-        ~Client();
-
-        /**
-        Set parameters for the Client.
-        Parameters need to be set before creating a Query.
-        */
-        HRESULT SetParameters(const std::vector<std::uint8_t>& parameters);
+        ~Session();
 
         /**
         Create an OPRF request for the given items.
@@ -66,6 +70,29 @@ namespace APSIClient
         */
         HRESULT CreateQuery(const std::vector<apsi_item>& items, std::vector<std::uint8_t>& encrypted_query);
 
+        /**
+        Create a Query for the given items, optionally without the relinearization keys.
+
+        Relinearization keys are several MB and do not change for a given Client. A server that caches them
+        per session (see APSIServer_QueryWithSession) only needs them in the first query of the session.
+        */
+        HRESULT CreateQuery(const std::vector<apsi_item>& items, std::vector<std::uint8_t>& encrypted_query, bool include_relin_keys);
+
+        /**
+        Create a Query for the given items with the given compression instead of the one of the Session.
+        See SetCompression.
+        */
+        HRESULT CreateQuery(const std::vector<apsi_item>& items, std::vector<std::uint8_t>& encrypted_query, bool include_relin_keys, int compr_mode);
+
+        /**
+        Set the compression of the queries of this Session, one of the values of seal::compr_mode_type. The
+        server compresses its results the same way unless it is set to use its own compression. OPRF
+        requests are random curve points and are never compressed.
+
+        Returns E_INVALIDARG for a mode the SEAL build does not support.
+        */
+        HRESULT SetCompression(int compr_mode);
+
         /**
         Process the result of a query and get the intersection
 
@@ -74,15 +101,174 @@ namespace APSIClient
         */
         HRESULT ProcessResult(const std::vector<std::uint8_t>& encrypted_result, std::vector<bool>& intersection);
 
+        /**
+        Process the result of a query against a labeled database and get the intersection and the labels
+
+        NOTE: After a successful call, labels will hold one label of label_byte_count bytes for each item that was
+        passed to the CreateQuery method, in the same order. Labels of items that were not found are all zeros.
+        */
+        HRESULT ProcessResult(const std::vector<std::uint8_t>& encrypted_result, std::vector<bool>& intersection, std::vector<std::uint8_t>& labels, std::size_t& label_byte_count);
+
+        /**
+        Process part of the result of a query as soon as it is received.
+
+        The first call must contain the response header, and following calls the result parts, in the order
+        produced by the Server. A buffer can contain more than one message. Each result part is decrypted
+        right away, so the full encrypted result never needs to be held in memory.
+        */
+        HRESULT ProcessResultPart(const std::vector<std::uint8_t>& result_part);
+
+        /**
+        Get the intersection after all result parts have been given to ProcessResultPart.
+
+        NOTE: After a successful call, the resulting intersection vector will have been resized to the actual size
+        intersection, which will be the same number of items that were passed to the CreateQuery method.
+        */
+        HRESULT FinalizeResult(std::vector<bool>& intersection);
+
+        /**
+        Get the intersection and the labels after all result parts have been given to ProcessResultPart.
+        Labels are laid out as in the labeled ProcessResult.
+        */
+        HRESULT FinalizeResult(std::vector<bool>& intersection, std::vector<std::uint8_t>& labels, std::size_t& label_byte_count);
+
     private:
-        std::unique_ptr<apsi::receiver::Receiver> receiver_;
+        friend class Client;
+
+        Session(std::shared_ptr<SharedReceiver> receiver, int compr_mode);
+
+        std::shared_ptr<SharedReceiver> receiver_;
         std::unique_ptr<apsi::oprf::OPRFReceiver> oprf_receiver_;
         std::unique_ptr<apsi::receiver::IndexTranslationTable> itt_;
         std::unique_ptr<std::vector<apsi::LabelKey>> label_keys_;
 
+        // Result of a query being processed one part at a time
+        std::unique_ptr<std::vector<apsi::receiver::MatchRecord>> partial_result_;
+        std::uint32_t expected_parts_ = 0;
+        std::uint32_t received_parts_ = 0;
+        std::uint32_t partial_label_byte_count_ = 0;
+
+        // Compression of the queries, a seal::compr_mode_type
+        int compr_mode_;
+
         /**
-        Release Receiver.
+        Decrypt a complete query result.
+        */
+        HRESULT DecryptResult(const std::vector<std::uint8_t>& encrypted_result, std::vector<apsi::receiver::MatchRecord>& query_result, std::uint32_t& label_byte_count);
+
+        /**
+        Release the result of a query being processed one part at a time.
+        */
+        void ResetPartialResult();
+
+        /**
+        Release the state of the current query.
         */
         void Terminate();
     };
+
+    /**
+    APSI Client
+
+    The query methods of the Client work on a single built-in Session. Use CreateSession to have
+    several queries in flight at once with the same keys.
+    */
+    class Client
+    {
+    public:
+        Client();
+        ~Client();
+
+        /**
+        Set parameters for the Client.
+        Parameters need to be set before creating a Query. Sessions created before the call keep
+        using the previous parameters and keys.
+        */
+        HRESULT SetParameters(const std::vector<std::uint8_t>& parameters);
+
+        /**
+        Set parameters for the Client.
+        If reuse_keys is true, the Receiver and keys are taken from a process-wide cache keyed by the
+        serialized parameters, so only the first Client using a parameter set generates keys. All Clients
+        that reuse keys for the same parameters share them until ClearReceiverCache is called.
+        */
+        HRESULT SetParameters(const std::vector<std::uint8_t>& parameters, bool reuse_keys);
+
+        /**
+        Drop all cached Receivers. Clients and Sessions that already use them are not affected;
+        the next Client that reuses keys generates new ones.
+        */
+        static void ClearReceiverCache();
+
+        /**
+        Create a Session that shares the keys of this Client.
+        The Session can outlive the Client.
+        */
+        HRESULT CreateSession(std::unique_ptr<Session>& session);
+
+        /**
+        Create an OPRF request for the given items. See Session::CreateOPRFRequest.
+        */
+        HRESULT CreateOPRFRequest(const std::vector<apsi_item>& items, std::vector<std::uint8_t>& oprf_request);
+
+        /**
+        Extract hashed items from an OPRF response. See Session::ExtractHashes.
+        */
+        HRESULT ExtractHashes(const std::vector<std::uint8_t>& oprf_response, std::vector<apsi_item>& hashed_items);
+
+        /**
+        Create a Query for the given items. See Session::CreateQuery.
+        */
+        HRESULT CreateQuery(const std::vector<apsi_item>& items, std::vector<std::uint8_t>& encrypted_query);
+
+        /**
+        Create a Query for the given items, optionally without the relinearization keys. See Session::CreateQuery.
+        */
+        HRESULT CreateQuery(const std::vector<apsi_item>& items, std::vector<std::uint8_t>& encrypted_query, bool include_relin_keys);
+
+        /**
+        Create a Query for the given items with the given compression. See Session::CreateQuery.
+        */
+        HRESULT CreateQuery(const std::vector<apsi_item>& items, std::vector<std::uint8_t>& encrypted_query, bool include_relin_keys, int compr_mode);
+
+        /**
+        Set the compression of the queries of this Client and of the Sessions created after the call.
+        See Session::SetCompression.
+        */
+        HRESULT SetCompression(int compr_mode);
+
+        /**
+        Process the result of a query and get the intersection. See Session::ProcessResult.
+        */
+        HRESULT ProcessResult(const std::vector<std::uint8_t>& encrypted_result, std::vector<bool>& intersection);
+
+        /**
+        Process the result of a query against a labeled database. See Session::ProcessResult.
+        */
+        HRESULT ProcessResult(const std::vector<std::uint8_t>& encrypted_result, std::vector<bool>& intersection, std::vector<std::uint8_t>& labels, std::size_t& label_byte_count);
+
+        /**
+        Process part of the result of a query. See Session::ProcessResultPart.
+        */
+        HRESULT ProcessResultPart(const std::vector<std::uint8_t>& result_part);
+
+        /**
+        Get the intersection after all result parts have been processed. See Session::FinalizeResult.
+        */
+        HRESULT FinalizeResult(std::vector<bool>& intersection);
+
+        /**
+        Get the intersection and the labels after all result parts have been processed. See Session::FinalizeResult.
+        */
+        HRESULT FinalizeResult(std::vector<bool>& intersection, std::vector<std::uint8_t>& labels, std::size_t& label_byte_count);
+
+    private:
+        std::shared_ptr<SharedReceiver> receiver_;
+
+        // Compression given to new Sessions
+        int compr_mode_;
+
+        // Session used by the query methods of the Client
+        std::unique_ptr<Session> session_;
+    };
 }
@@ -17,20 +17,23 @@
 
 #else // _MSC_VER
 
+#include <cstdint>
+
 #define FACILITY_WIN32                   7
 #define ERROR_INSUFFICIENT_BUFFER        122L    // dderror
 #define ERROR_INVALID_STATE              5023L
 
-typedef long HRESULT;
+// HRESULT is 32 bits wide like on Windows, so that error codes are negative
+typedef int32_t HRESULT;
 
 HRESULT AC_HRESULT_FROM_WIN32(unsigned long x);
 
-#define E_FAIL                           0x80004005L
-#define E_POINTER                        0x80004003L
-#define E_INVALIDARG                     0x80070057L
+#define E_FAIL                           ((HRESULT)0x80004005L)
+#define E_POINTER                        ((HRESULT)0x80004003L)
+#define E_INVALIDARG                     ((HRESULT)0x80070057L)
 #define E_NOT_SUFFICIENT_BUFFER          AC_HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER)
 #define E_NOT_VALID_STATE                AC_HRESULT_FROM_WIN32(ERROR_INVALID_STATE)
-#define E_UNEXPECTED                     0x8000FFFFL
+#define E_UNEXPECTED                     ((HRESULT)0x8000FFFFL)
 
 #define S_OK                             ((HRESULT)0L)
 #define S_FALSE                          ((HRESULT)1L)
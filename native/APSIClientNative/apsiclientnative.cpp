@@ -5,9 +5,15 @@
 
 #include <stdexcept>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
 #include "apsiclientnative.h"
 #include "apsiclient.h"
 
+// APSI
+#include "apsi/log.h"
+
 using namespace std;
 using namespace APSIClient;
 
@@ -30,6 +36,469 @@ namespace {
             count,
             reinterpret_cast<unsigned char*>(dst));
     }
+
+    /**
+    Size-classed pool of the buffers handed to callers, so that creating many queries does not allocate and free
+    multi-MB buffers for each of them. Buffers come in power of two sizes from 4 KB to 256 MB, and released ones
+    are kept for reuse up to a total size. This library is loaded independently of APSIServerNative and keeps
+    its own pool, which works like the one there.
+    */
+    class BufferPool
+    {
+    public:
+        static BufferPool& instance()
+        {
+            // Never destroyed, as buffers may still be released while the library is unloaded
+            static BufferPool* pool = new BufferPool();
+            return *pool;
+        }
+
+        uint8_t* acquire(size_t size)
+        {
+            size_t size_class = class_of(size);
+            size_t capacity = size_class < class_count_ ? class_size(size_class) : size;
+
+            uint8_t* buffer = nullptr;
+            if (size_class < class_count_)
+            {
+                SizeClass& free_buffers = classes_[size_class];
+                lock_guard<mutex> lock(free_buffers.mutex);
+                if (!free_buffers.buffers.empty())
+                {
+                    buffer = free_buffers.buffers.back();
+                    free_buffers.buffers.pop_back();
+                    retained_bytes_ -= capacity;
+                }
+            }
+
+            if (nullptr == buffer)
+                buffer = static_cast<uint8_t*>(::operator new(capacity));
+
+            lock_guard<mutex> lock(leased_mutex_);
+            leased_.emplace(buffer, capacity);
+            return buffer;
+        }
+
+        /**
+        Return a leased buffer. Returns false if the buffer is not currently leased from the pool.
+        */
+        bool release(uint8_t* buffer)
+        {
+            if (nullptr == buffer)
+                return true;
+
+            size_t capacity = 0;
+            {
+                lock_guard<mutex> lock(leased_mutex_);
+                auto leased = leased_.find(buffer);
+                if (leased == leased_.end())
+                    return false;
+
+                capacity = leased->second;
+                leased_.erase(leased);
+            }
+
+            size_t size_class = class_of(capacity);
+            if (size_class < class_count_)
+            {
+                if (retained_bytes_.fetch_add(capacity) + capacity <= max_retained_bytes_)
+                {
+                    SizeClass& free_buffers = classes_[size_class];
+                    lock_guard<mutex> lock(free_buffers.mutex);
+                    free_buffers.buffers.push_back(buffer);
+                    return true;
+                }
+
+                retained_bytes_ -= capacity;
+            }
+
+            ::operator delete(buffer);
+            return true;
+        }
+
+        void set_max_retained_bytes(uint64_t max_retained_bytes)
+        {
+            max_retained_bytes_ = max_retained_bytes;
+
+            for (size_t size_class = class_count_; size_class-- > 0 && retained_bytes_ > max_retained_bytes_;)
+            {
+                SizeClass& free_buffers = classes_[size_class];
+                lock_guard<mutex> lock(free_buffers.mutex);
+                while (!free_buffers.buffers.empty() && retained_bytes_ > max_retained_bytes_)
+                {
+                    ::operator delete(free_buffers.buffers.back());
+                    free_buffers.buffers.pop_back();
+                    retained_bytes_ -= class_size(size_class);
+                }
+            }
+        }
+
+    private:
+        struct SizeClass
+        {
+            std::mutex mutex;
+            vector<uint8_t*> buffers;
+        };
+
+        static constexpr size_t min_class_bits_ = 12;
+        static constexpr size_t class_count_ = 17;
+
+        SizeClass classes_[class_count_];
+        atomic<uint64_t> retained_bytes_{ 0 };
+        atomic<uint64_t> max_retained_bytes_{ 256ull * 1024 * 1024 };
+
+        // Buffers currently leased to callers, with their capacity
+        std::mutex leased_mutex_;
+        unordered_map<uint8_t*, size_t> leased_;
+
+        static size_t class_size(size_t size_class)
+        {
+            return size_t(1) << (min_class_bits_ + size_class);
+        }
+
+        static size_t class_of(size_t size)
+        {
+            size_t size_class = 0;
+            while (size_class < class_count_ && class_size(size_class) < size)
+                size_class++;
+
+            return size_class;
+        }
+    };
+
+    /**
+    Lease a buffer for an output of count elements, following the output protocol in apsiclientnative.h.
+    *size is in elements.
+    */
+    HRESULT reserve_output(size_t count, size_t element_size, uint64_t* size, uint8_t** buffer)
+    {
+        *buffer = BufferPool::instance().acquire(count * element_size);
+        *size = count;
+        return S_OK;
+    }
+
+    HRESULT write_output(const void* data, size_t count, size_t element_size, uint64_t* size, uint8_t** buffer)
+    {
+        HRESULT hr = reserve_output(count, element_size, size, buffer);
+        if (SUCCEEDED(hr))
+            copy_bytes(*buffer, data, count * element_size);
+
+        return hr;
+    }
+
+    /**
+    Copy an output to the caller's buffer destination if it fits, and set *leased_buffer to nullptr. Otherwise
+    the output is copied to a leased buffer, which is returned in *leased_buffer. *size is in bytes.
+    */
+    HRESULT write_output_into(const vector<uint8_t>& data, uint64_t destination_capacity, uint8_t* destination, uint64_t* size, uint8_t** leased_buffer)
+    {
+        if (nullptr != destination && data.size() <= destination_capacity)
+        {
+            copy_bytes(destination, data.data(), data.size());
+            *size = data.size();
+            *leased_buffer = nullptr;
+            return S_OK;
+        }
+
+        return write_output(data.data(), data.size(), 1, size, leased_buffer);
+    }
+
+    HRESULT copy_intersection(const vector<bool>& intersection_a, uint64_t* intersection_size, uint8_t** intersection)
+    {
+        HRESULT hr = reserve_output(intersection_a.size(), 1, intersection_size, intersection);
+        if (FAILED(hr))
+            return hr;
+
+        for (size_t i = 0; i < intersection_a.size(); i++)
+        {
+            (*intersection)[i] = (intersection_a[i] ? 1 : 0);
+        }
+
+        return S_OK;
+    }
+
+    void copy_labeled_result(
+        const vector<bool>& intersection_a,
+        const vector<uint8_t>& labels_a,
+        size_t label_byte_count_a,
+        uint64_t* intersection_size,
+        uint8_t** intersection,
+        uint64_t* label_byte_count,
+        uint8_t** labels)
+    {
+        copy_intersection(intersection_a, intersection_size, intersection);
+
+        uint64_t labels_size = 0;
+        *label_byte_count = label_byte_count_a;
+        write_output(labels_a.data(), labels_a.size(), 1, &labels_size, labels);
+    }
+
+    /**
+    The query exports work the same on a Client and on a Session, so they are implemented once here.
+    */
+    template <typename T>
+    HRESULT create_oprf_request(void* thisptr, const uint64_t item_count, const apsi_item* items, uint64_t* oprf_request_size, uint8_t** oprf_request)
+    {
+        IfNullRet(thisptr, E_POINTER);
+        IfNullRet(items, E_POINTER);
+        IfNullRet(oprf_request_size, E_POINTER);
+        IfNullRet(oprf_request, E_POINTER);
+
+        T* target = reinterpret_cast<T*>(thisptr);
+
+        try
+        {
+            vector<apsi_item> items_a(item_count);
+            copy_bytes(items_a.data(), items, sizeof(apsi_item) * item_count);
+
+            vector<uint8_t> oprf_bf;
+            HRESULT hr = target->CreateOPRFRequest(items_a, oprf_bf);
+            if (FAILED(hr))
+                return hr;
+
+            return write_output(oprf_bf.data(), oprf_bf.size(), 1, oprf_request_size, oprf_request);
+        }
+        catch (const std::exception& ex)
+        {
+            APSI_LOG_ERROR("APSIClient::CreateOPRFRequest: " << ex.what());
+            return E_FAIL;
+        }
+        catch (...)
+        {
+            APSI_LOG_ERROR("APSIClient::CreateOPRFRequest: unknown exception");
+            return E_FAIL;
+        }
+    }
+
+    template <typename T>
+    HRESULT extract_hashes(void* thisptr, const uint64_t oprf_response_size, const uint8_t* oprf_response, uint64_t* hashed_item_count, uint8_t** hashed_items)
+    {
+        IfNullRet(thisptr, E_POINTER);
+        IfNullRet(oprf_response, E_POINTER);
+        IfNullRet(hashed_item_count, E_POINTER);
+        IfNullRet(hashed_items, E_POINTER);
+
+        T* target = reinterpret_cast<T*>(thisptr);
+
+        try
+        {
+            vector<uint8_t> prequery_bf(oprf_response_size);
+            copy_bytes(prequery_bf.data(), oprf_response, oprf_response_size);
+
+            vector<apsi_item> items_a;
+            HRESULT hr = target->ExtractHashes(prequery_bf, items_a);
+            if (FAILED(hr))
+                return hr;
+
+            return write_output(items_a.data(), items_a.size(), sizeof(apsi_item), hashed_item_count, hashed_items);
+        }
+        catch (const std::exception& ex)
+        {
+            APSI_LOG_ERROR("APSIClient::ExtractHashes: " << ex.what());
+            return E_FAIL;
+        }
+        catch (...)
+        {
+            APSI_LOG_ERROR("APSIClient::ExtractHashes: unknown exception");
+            return E_FAIL;
+        }
+    }
+
+    template <typename T, typename... Args>
+    HRESULT create_query(void* thisptr, const uint64_t item_count, const apsi_item* items, uint64_t* encrypted_query_size, uint8_t** encrypted_query, Args... args)
+    {
+        IfNullRet(thisptr, E_POINTER);
+        IfNullRet(items, E_POINTER);
+        IfNullRet(encrypted_query_size, E_POINTER);
+        IfNullRet(encrypted_query, E_POINTER);
+
+        T* target = reinterpret_cast<T*>(thisptr);
+
+        try
+        {
+            vector<apsi_item> items_a(item_count);
+            copy_bytes(items_a.data(), items, sizeof(apsi_item) * item_count);
+
+            vector<uint8_t> encrypted_query_bf;
+            HRESULT hr = target->CreateQuery(items_a, encrypted_query_bf, args...);
+            if (FAILED(hr))
+                return hr;
+
+            return write_output(encrypted_query_bf.data(), encrypted_query_bf.size(), 1, encrypted_query_size, encrypted_query);
+        }
+        catch (const std::exception& ex)
+        {
+            APSI_LOG_ERROR("APSIClient::CreateQuery: " << ex.what());
+            return E_FAIL;
+        }
+        catch (...)
+        {
+            APSI_LOG_ERROR("APSIClient::CreateQuery: unknown exception");
+            return E_FAIL;
+        }
+    }
+
+    template <typename T>
+    HRESULT process_result(void* thisptr, const uint64_t result_buffer_size, const uint8_t* encrypted_result, uint64_t* intersection_size, uint8_t** intersection)
+    {
+        IfNullRet(thisptr, E_POINTER);
+        IfNullRet(encrypted_result, E_POINTER);
+        IfNullRet(intersection_size, E_POINTER);
+        IfNullRet(intersection, E_POINTER);
+        T* target = reinterpret_cast<T*>(thisptr);
+
+        try
+        {
+            vector<uint8_t> result_bf(result_buffer_size);
+            copy_bytes(result_bf.data(), encrypted_result, result_buffer_size);
+
+            vector<bool> intersection_a;
+
+            HRESULT hr = target->ProcessResult(result_bf, intersection_a);
+            if (FAILED(hr))
+                return hr;
+
+            return copy_intersection(intersection_a, intersection_size, intersection);
+        }
+        catch (const std::exception& ex)
+        {
+            APSI_LOG_ERROR("APSIClient::ProcessResult: " << ex.what());
+            return E_FAIL;
+        }
+        catch (...)
+        {
+            APSI_LOG_ERROR("APSIClient::ProcessResult: unknown exception");
+            return E_FAIL;
+        }
+    }
+
+    template <typename T>
+    HRESULT process_labeled_result(void* thisptr, const uint64_t result_buffer_size, const uint8_t* encrypted_result, uint64_t* intersection_size, uint8_t** intersection, uint64_t* label_byte_count, uint8_t** labels)
+    {
+        IfNullRet(thisptr, E_POINTER);
+        IfNullRet(encrypted_result, E_POINTER);
+        IfNullRet(intersection_size, E_POINTER);
+        IfNullRet(intersection, E_POINTER);
+        IfNullRet(label_byte_count, E_POINTER);
+        IfNullRet(labels, E_POINTER);
+        T* target = reinterpret_cast<T*>(thisptr);
+
+        try
+        {
+            vector<uint8_t> result_bf(result_buffer_size);
+            copy_bytes(result_bf.data(), encrypted_result, result_buffer_size);
+
+            vector<bool> intersection_a;
+            vector<uint8_t> labels_a;
+            size_t label_byte_count_a = 0;
+
+            HRESULT hr = target->ProcessResult(result_bf, intersection_a, labels_a, label_byte_count_a);
+
+            copy_labeled_result(intersection_a, labels_a, label_byte_count_a, intersection_size, intersection, label_byte_count, labels);
+
+            return hr;
+        }
+        catch (const std::exception& ex)
+        {
+            APSI_LOG_ERROR("APSIClient::ProcessLabeledResult: " << ex.what());
+            return E_FAIL;
+        }
+        catch (...)
+        {
+            APSI_LOG_ERROR("APSIClient::ProcessLabeledResult: unknown exception");
+            return E_FAIL;
+        }
+    }
+
+    template <typename T>
+    HRESULT process_result_part(void* thisptr, const uint64_t result_part_size, const uint8_t* result_part)
+    {
+        IfNullRet(thisptr, E_POINTER);
+        IfNullRet(result_part, E_POINTER);
+        T* target = reinterpret_cast<T*>(thisptr);
+
+        try
+        {
+            vector<uint8_t> result_part_bf(result_part_size);
+            copy_bytes(result_part_bf.data(), result_part, result_part_size);
+
+            return target->ProcessResultPart(result_part_bf);
+        }
+        catch (const std::exception& ex)
+        {
+            APSI_LOG_ERROR("APSIClient::ProcessResultPart: " << ex.what());
+            return E_FAIL;
+        }
+        catch (...)
+        {
+            APSI_LOG_ERROR("APSIClient::ProcessResultPart: unknown exception");
+            return E_FAIL;
+        }
+    }
+
+    template <typename T>
+    HRESULT finalize_result(void* thisptr, uint64_t* intersection_size, uint8_t** intersection)
+    {
+        IfNullRet(thisptr, E_POINTER);
+        IfNullRet(intersection_size, E_POINTER);
+        IfNullRet(intersection, E_POINTER);
+        T* target = reinterpret_cast<T*>(thisptr);
+
+        try
+        {
+            vector<bool> intersection_a;
+
+            HRESULT hr = target->FinalizeResult(intersection_a);
+            if (FAILED(hr))
+                return hr;
+
+            return copy_intersection(intersection_a, intersection_size, intersection);
+        }
+        catch (const std::exception& ex)
+        {
+            APSI_LOG_ERROR("APSIClient::FinalizeResult: " << ex.what());
+            return E_FAIL;
+        }
+        catch (...)
+        {
+            APSI_LOG_ERROR("APSIClient::FinalizeResult: unknown exception");
+            return E_FAIL;
+        }
+    }
+
+    template <typename T>
+    HRESULT finalize_labeled_result(void* thisptr, uint64_t* intersection_size, uint8_t** intersection, uint64_t* label_byte_count, uint8_t** labels)
+    {
+        IfNullRet(thisptr, E_POINTER);
+        IfNullRet(intersection_size, E_POINTER);
+        IfNullRet(intersection, E_POINTER);
+        IfNullRet(label_byte_count, E_POINTER);
+        IfNullRet(labels, E_POINTER);
+        T* target = reinterpret_cast<T*>(thisptr);
+
+        try
+        {
+            vector<bool> intersection_a;
+            vector<uint8_t> labels_a;
+            size_t label_byte_count_a = 0;
+
+            HRESULT hr = target->FinalizeResult(intersection_a, labels_a, label_byte_count_a);
+
+            copy_labeled_result(intersection_a, labels_a, label_byte_count_a, intersection_size, intersection, label_byte_count, labels);
+
+            return hr;
+        }
+        catch (const std::exception& ex)
+        {
+            APSI_LOG_ERROR("APSIClient::FinalizeLabeledResult: " << ex.what());
+            return E_FAIL;
+        }
+        catch (...)
+        {
+            APSI_LOG_ERROR("APSIClient::FinalizeLabeledResult: unknown exception");
+            return E_FAIL;
+        }
+    }
 }
 
 /**
@@ -39,8 +508,21 @@ APSIEXPORT HRESULT APSICALL APSIClient_Create(void** thisptr)
 {
     IfNullRet(thisptr, E_POINTER);
 
-    Client* client = new Client();
-    *thisptr = client;
+    try
+    {
+        Client* client = new Client();
+        *thisptr = client;
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIClient::Create: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIClient::Create: unknown exception");
+        return E_FAIL;
+    }
 
     return S_OK;
 }
@@ -62,125 +544,386 @@ APSIEXPORT HRESULT APSICALL APSIClient_Destroy(void* thisptr)
 Set parameters for the client
 */
 APSIEXPORT HRESULT APSICALL APSIClient_SetParameters(void* thisptr, const uint64_t params_size, const uint8_t* parameters)
+{
+    return APSIClient_SetParameters2(thisptr, params_size, parameters, /* reuse_keys */ FALSE);
+}
+
+/**
+Set parameters for the client, optionally reusing the keys of earlier clients with the same parameters
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_SetParameters2(void* thisptr, const uint64_t params_size, const uint8_t* parameters, int reuse_keys)
 {
     IfNullRet(thisptr, E_POINTER);
     IfNullRet(parameters, E_POINTER);
 
-    Client* client = reinterpret_cast<Client*>(thisptr);
-    vector<uint8_t> params(params_size);
-    copy_bytes(params.data(), parameters, params_size);
+    try
+    {
+        Client* client = reinterpret_cast<Client*>(thisptr);
+        vector<uint8_t> params(params_size);
+        copy_bytes(params.data(), parameters, params_size);
 
-    return client->SetParameters(params);
+        return client->SetParameters(params, reuse_keys != FALSE);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIClient::SetParameters: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIClient::SetParameters: unknown exception");
+        return E_FAIL;
+    }
+}
+
+/**
+Drop the keys cached for reuse by APSIClient_SetParameters2
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_ClearKeyCache()
+{
+    try
+    {
+        Client::ClearReceiverCache();
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIClient::ClearKeyCache: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIClient::ClearKeyCache: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
 }
 
 /**
 Perform OPRF for the given items
 */
 APSIEXPORT HRESULT APSICALL APSIClient_CreateOPRFRequest(void* thisptr, const uint64_t item_count, const apsi_item* items, uint64_t* oprf_request_size, uint8_t** oprf_request)
+{
+    return create_oprf_request<Client>(thisptr, item_count, items, oprf_request_size, oprf_request);
+}
+
+/**
+Decode OPRF result from Server
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_ExtractHashes(void* thisptr, const uint64_t oprf_response_size, const uint8_t* oprf_response, uint64_t* hashed_item_count, uint8_t** hashed_items)
+{
+    return extract_hashes<Client>(thisptr, oprf_response_size, oprf_response, hashed_item_count, hashed_items);
+}
+
+/**
+Perform a Query for the given items.
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_CreateQuery(void* thisptr, const uint64_t item_count, const apsi_item* items, uint64_t* encrypted_query_size, uint8_t** encrypted_query)
+{
+    return create_query<Client>(thisptr, item_count, items, encrypted_query_size, encrypted_query, /* include_relin_keys */ true);
+}
+
+APSIEXPORT HRESULT APSICALL APSIClient_CreateQuery2(void* thisptr, const uint64_t item_count, const apsi_item* items, int include_relin_keys, uint64_t* encrypted_query_size, uint8_t** encrypted_query)
+{
+    return create_query<Client>(thisptr, item_count, items, encrypted_query_size, encrypted_query, include_relin_keys != FALSE);
+}
+
+APSIEXPORT HRESULT APSICALL APSIClient_CreateQuery3(
+    void* thisptr, const uint64_t item_count, const apsi_item* items, int include_relin_keys, int compr_mode, uint64_t* encrypted_query_size, uint8_t** encrypted_query)
+{
+    return create_query<Client>(thisptr, item_count, items, encrypted_query_size, encrypted_query, include_relin_keys != FALSE, compr_mode);
+}
+
+/**
+Perform a Query for the given items, written to the caller's buffer if it fits
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_CreateQueryInto(
+    void* thisptr,
+    const uint64_t item_count,
+    const apsi_item* items,
+    int include_relin_keys,
+    const uint64_t destination_capacity,
+    uint8_t* destination,
+    uint64_t* encrypted_query_size,
+    uint8_t** leased_query)
 {
     IfNullRet(thisptr, E_POINTER);
     IfNullRet(items, E_POINTER);
-    IfNullRet(oprf_request_size, E_POINTER);
-    IfNullRet(oprf_request, E_POINTER);
-
-    Client* client = reinterpret_cast<Client*>(thisptr);
-    vector<apsi_item> items_a(item_count);
-    copy_bytes(items_a.data(), items, sizeof(apsi_item) * item_count);
+    IfNullRet(encrypted_query_size, E_POINTER);
+    IfNullRet(leased_query, E_POINTER);
 
-    vector<uint8_t> oprf_bf;
-    HRESULT hr = client->CreateOPRFRequest(items_a, oprf_bf);
+    try
+    {
+        Client* client = reinterpret_cast<Client*>(thisptr);
+        vector<apsi_item> items_a(items, items + item_count);
 
-    *oprf_request_size = oprf_bf.size();
-    *oprf_request = new uint8_t[oprf_bf.size()];
+        vector<uint8_t> encrypted_query_bf;
+        HRESULT hr = client->CreateQuery(items_a, encrypted_query_bf, include_relin_keys != FALSE);
+        if (FAILED(hr))
+            return hr;
 
-    copy_bytes(*oprf_request, oprf_bf.data(), oprf_bf.size());
-    return hr;
+        return write_output_into(encrypted_query_bf, destination_capacity, destination, encrypted_query_size, leased_query);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIClient::CreateQueryInto: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIClient::CreateQueryInto: unknown exception");
+        return E_FAIL;
+    }
 }
 
 /**
-Decode OPRF result from Server
+Set the compression of the queries of the client and of the sessions created after the call
 */
-APSIEXPORT HRESULT APSICALL APSIClient_ExtractHashes(void* thisptr, const uint64_t oprf_response_size, const uint8_t* oprf_response, uint64_t* hashed_item_count, uint8_t** hashed_items)
+APSIEXPORT HRESULT APSICALL APSIClient_SetCompression(void* thisptr, int compr_mode)
 {
     IfNullRet(thisptr, E_POINTER);
-    IfNullRet(oprf_response, E_POINTER);
-    IfNullRet(hashed_item_count, E_POINTER);
-    IfNullRet(hashed_items, E_POINTER);
 
-    Client* client = reinterpret_cast<Client*>(thisptr);
+    try
+    {
+        Client* client = reinterpret_cast<Client*>(thisptr);
+        return client->SetCompression(compr_mode);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIClient::SetCompression: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIClient::SetCompression: unknown exception");
+        return E_FAIL;
+    }
+}
 
-    vector<uint8_t> prequery_bf(oprf_response_size);
-    copy_bytes(prequery_bf.data(), oprf_response, oprf_response_size);
+/**
+Decrypt the result of a query
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_ProcessResult(void* thisptr, const uint64_t result_buffer_size, const uint8_t* encrypted_result, uint64_t *intersection_size, uint8_t **intersection)
+{
+    return process_result<Client>(thisptr, result_buffer_size, encrypted_result, intersection_size, intersection);
+}
 
-    vector<apsi_item> items_a;
-    HRESULT hr = client->ExtractHashes(prequery_bf, items_a);
+/**
+Decrypt the result of a query against a labeled database
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_ProcessLabeledResult(void* thisptr, const uint64_t result_buffer_size, const uint8_t* encrypted_result, uint64_t* intersection_size, uint8_t** intersection, uint64_t* label_byte_count, uint8_t** labels)
+{
+    return process_labeled_result<Client>(thisptr, result_buffer_size, encrypted_result, intersection_size, intersection, label_byte_count, labels);
+}
+
+/**
+Decrypt part of the result of a query as soon as it is received
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_ProcessResultPart(void* thisptr, const uint64_t result_part_size, const uint8_t* result_part)
+{
+    return process_result_part<Client>(thisptr, result_part_size, result_part);
+}
 
-    *hashed_item_count = items_a.size();
-    *hashed_items = new uint8_t[sizeof(apsi_item) * items_a.size()];
-    copy_bytes(*hashed_items, items_a.data(), sizeof(apsi_item) * items_a.size());
+/**
+Get the intersection after all result parts have been processed
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_FinalizeResult(void* thisptr, uint64_t* intersection_size, uint8_t** intersection)
+{
+    return finalize_result<Client>(thisptr, intersection_size, intersection);
+}
 
-    return hr;
+/**
+Get the intersection and the labels after all result parts have been processed
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_FinalizeLabeledResult(void* thisptr, uint64_t* intersection_size, uint8_t** intersection, uint64_t* label_byte_count, uint8_t** labels)
+{
+    return finalize_labeled_result<Client>(thisptr, intersection_size, intersection, label_byte_count, labels);
 }
 
 /**
-Perform a Query for the given items.
+Create a session that shares the keys of the client
 */
-APSIEXPORT HRESULT APSICALL APSIClient_CreateQuery(void* thisptr, const uint64_t item_count, const apsi_item* items, uint64_t* encrypted_query_size, uint8_t** encrypted_query)
+APSIEXPORT HRESULT APSICALL APSIClient_CreateSession(void* thisptr, void** session)
 {
     IfNullRet(thisptr, E_POINTER);
-    IfNullRet(items, E_POINTER);
-    IfNullRet(encrypted_query_size, E_POINTER);
-    IfNullRet(encrypted_query, E_POINTER);
+    IfNullRet(session, E_POINTER);
 
-    Client* client = reinterpret_cast<Client*>(thisptr);
+    try
+    {
+        Client* client = reinterpret_cast<Client*>(thisptr);
 
-    vector<apsi_item> items_a(item_count);
-    copy_bytes(items_a.data(), items, sizeof(apsi_item) * item_count);
+        unique_ptr<Session> new_session;
+        HRESULT hr = client->CreateSession(new_session);
+        if (S_OK != hr)
+            return hr;
 
-    vector<uint8_t> encrypted_query_bf;
-    HRESULT hr = client->CreateQuery(items_a, encrypted_query_bf);
+        *session = new_session.release();
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIClient::CreateSession: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIClient::CreateSession: unknown exception");
+        return E_FAIL;
+    }
 
-    *encrypted_query_size = encrypted_query_bf.size();
-    *encrypted_query = new uint8_t[encrypted_query_bf.size()];
+    return S_OK;
+}
+
+/**
+Destroy session instance
+*/
+APSIEXPORT HRESULT APSICALL APSIClientSession_Destroy(void* thisptr)
+{
+    IfNullRet(thisptr, E_POINTER);
 
-    copy_bytes(*encrypted_query, encrypted_query_bf.data(), encrypted_query_bf.size());
+    Session* session = reinterpret_cast<Session*>(thisptr);
+    delete session;
 
-    return hr;
+    return S_OK;
 }
 
 /**
-Decrypt the result of a query
+Perform OPRF for the given items in a session
 */
-APSIEXPORT HRESULT APSICALL APSIClient_ProcessResult(void* thisptr, const uint64_t result_buffer_size, const uint8_t* encrypted_result, uint64_t *intersection_size, uint8_t **intersection)
+APSIEXPORT HRESULT APSICALL APSIClientSession_CreateOPRFRequest(void* thisptr, const uint64_t item_count, const apsi_item* items, uint64_t* oprf_request_size, uint8_t** oprf_request)
 {
-    IfNullRet(thisptr, E_POINTER);
-    IfNullRet(intersection_size, E_POINTER);
-    IfNullRet(intersection, E_POINTER);
-    Client* client = reinterpret_cast<Client*>(thisptr);
+    return create_oprf_request<Session>(thisptr, item_count, items, oprf_request_size, oprf_request);
+}
 
-    vector<uint8_t> result_bf(result_buffer_size);
-    copy_bytes(result_bf.data(), encrypted_result, result_buffer_size);
+/**
+Decode OPRF result from Server in a session
+*/
+APSIEXPORT HRESULT APSICALL APSIClientSession_ExtractHashes(void* thisptr, const uint64_t oprf_response_size, const uint8_t* oprf_response, uint64_t* hashed_item_count, uint8_t** hashed_items)
+{
+    return extract_hashes<Session>(thisptr, oprf_response_size, oprf_response, hashed_item_count, hashed_items);
+}
+
+/**
+Perform a Query for the given items in a session
+*/
+APSIEXPORT HRESULT APSICALL APSIClientSession_CreateQuery(void* thisptr, const uint64_t item_count, const apsi_item* items, uint64_t* encrypted_query_size, uint8_t** encrypted_query)
+{
+    return create_query<Session>(thisptr, item_count, items, encrypted_query_size, encrypted_query, /* include_relin_keys */ true);
+}
 
-    vector<bool> intersection_a;
+APSIEXPORT HRESULT APSICALL APSIClientSession_CreateQuery2(void* thisptr, const uint64_t item_count, const apsi_item* items, int include_relin_keys, uint64_t* encrypted_query_size, uint8_t** encrypted_query)
+{
+    return create_query<Session>(thisptr, item_count, items, encrypted_query_size, encrypted_query, include_relin_keys != FALSE);
+}
 
-    HRESULT hr = client->ProcessResult(result_bf, intersection_a);
+APSIEXPORT HRESULT APSICALL APSIClientSession_CreateQuery3(
+    void* thisptr, const uint64_t item_count, const apsi_item* items, int include_relin_keys, int compr_mode, uint64_t* encrypted_query_size, uint8_t** encrypted_query)
+{
+    return create_query<Session>(thisptr, item_count, items, encrypted_query_size, encrypted_query, include_relin_keys != FALSE, compr_mode);
+}
 
-    *intersection_size = intersection_a.size();
-    *intersection = new uint8_t[intersection_a.size()];
+/**
+Set the compression of the queries of a session
+*/
+APSIEXPORT HRESULT APSICALL APSIClientSession_SetCompression(void* thisptr, int compr_mode)
+{
+    IfNullRet(thisptr, E_POINTER);
 
-    for (size_t i = 0; i < intersection_a.size(); i++)
+    try
+    {
+        Session* session = reinterpret_cast<Session*>(thisptr);
+        return session->SetCompression(compr_mode);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIClientSession::SetCompression: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
     {
-        (*intersection)[i] = (intersection_a[i] ? 1 : 0);
+        APSI_LOG_ERROR("APSIClientSession::SetCompression: unknown exception");
+        return E_FAIL;
     }
+}
 
-    return hr;
+/**
+Decrypt the result of the query of a session
+*/
+APSIEXPORT HRESULT APSICALL APSIClientSession_ProcessResult(void* thisptr, const uint64_t result_buffer_size, const uint8_t* encrypted_result, uint64_t* intersection_size, uint8_t** intersection)
+{
+    return process_result<Session>(thisptr, result_buffer_size, encrypted_result, intersection_size, intersection);
+}
+
+/**
+Decrypt the result of the query of a session against a labeled database
+*/
+APSIEXPORT HRESULT APSICALL APSIClientSession_ProcessLabeledResult(void* thisptr, const uint64_t result_buffer_size, const uint8_t* encrypted_result, uint64_t* intersection_size, uint8_t** intersection, uint64_t* label_byte_count, uint8_t** labels)
+{
+    return process_labeled_result<Session>(thisptr, result_buffer_size, encrypted_result, intersection_size, intersection, label_byte_count, labels);
+}
+
+/**
+Decrypt part of the result of the query of a session
+*/
+APSIEXPORT HRESULT APSICALL APSIClientSession_ProcessResultPart(void* thisptr, const uint64_t result_part_size, const uint8_t* result_part)
+{
+    return process_result_part<Session>(thisptr, result_part_size, result_part);
+}
+
+/**
+Get the intersection of a session after all result parts have been processed
+*/
+APSIEXPORT HRESULT APSICALL APSIClientSession_FinalizeResult(void* thisptr, uint64_t* intersection_size, uint8_t** intersection)
+{
+    return finalize_result<Session>(thisptr, intersection_size, intersection);
+}
+
+/**
+Get the intersection and the labels of a session after all result parts have been processed
+*/
+APSIEXPORT HRESULT APSICALL APSIClientSession_FinalizeLabeledResult(void* thisptr, uint64_t* intersection_size, uint8_t** intersection, uint64_t* label_byte_count, uint8_t** labels)
+{
+    return finalize_labeled_result<Session>(thisptr, intersection_size, intersection, label_byte_count, labels);
 }
 
 APSIEXPORT HRESULT APSICALL APSIClient_ReleaseNativePointer(uint8_t* native_ptr)
 {
-    if (nullptr != native_ptr)
+    try
+    {
+        if (!BufferPool::instance().release(native_ptr))
+            return E_INVALIDARG;
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIClient::ReleaseNativePointer: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIClient::ReleaseNativePointer: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+/**
+Set the total size of the released buffers kept for reuse
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_SetBufferPoolLimit(const uint64_t max_retained_bytes)
+{
+    try
+    {
+        BufferPool::instance().set_max_retained_bytes(max_retained_bytes);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIClient::SetBufferPoolLimit: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
     {
-        delete[] native_ptr;
+        APSI_LOG_ERROR("APSIClient::SetBufferPoolLimit: unknown exception");
+        return E_FAIL;
     }
 
     return S_OK;
@@ -44,6 +44,20 @@
 
 using apsi_item = std::array<uint64_t, 2>;
 
+// Compression of queries, with the values of seal::compr_mode_type
+#define APSI_COMPRESSION_NONE 0
+#define APSI_COMPRESSION_ZLIB 1
+#define APSI_COMPRESSION_ZSTD 2
+
+/**
+Exports that return a buffer through a size and a buffer pointer write the output to a buffer leased from a native
+pool of reusable buffers, which must be released with APSIClient_ReleaseNativePointer. Sizes are in bytes, except
+for hashed items, which are counted in items.
+*/
+/**
+Clients never resize the APSI thread pool, which is shared by the whole process and sized for servers with
+APSI_SetThreads. Results and result parts are decrypted one part at a time on the calling thread instead.
+*/
 /**
 Create client instance
 */
@@ -59,6 +73,16 @@ Set parameters for the client
 */
 APSIEXPORT HRESULT APSICALL APSIClient_SetParameters(void* thisptr, const std::uint64_t params_size, const std::uint8_t* parameters);
 
+/**
+Set parameters for the client, optionally reusing the keys of earlier clients with the same parameters
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_SetParameters2(void* thisptr, const std::uint64_t params_size, const std::uint8_t* parameters, int reuse_keys);
+
+/**
+Drop the keys cached for reuse by APSIClient_SetParameters2
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_ClearKeyCache();
+
 /**
 Perform OPRF for the given items
 */
@@ -74,12 +98,115 @@ Perform a Query for the given items.
 */
 APSIEXPORT HRESULT APSICALL APSIClient_CreateQuery(void* thisptr, const std::uint64_t item_count, const apsi_item* items, std::uint64_t* encrypted_query_size, std::uint8_t** encrypted_query);
 
+/**
+Same as APSIClient_CreateQuery. With include_relin_keys set to FALSE the query leaves out the relinearization
+keys and can only be run by a server that cached them for the session (see APSIServer_QueryWithSession).
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_CreateQuery2(void* thisptr, const std::uint64_t item_count, const apsi_item* items, int include_relin_keys, std::uint64_t* encrypted_query_size, std::uint8_t** encrypted_query);
+
+/**
+Same as APSIClient_CreateQuery2, with the given compression, one of the APSI_COMPRESSION_ values, instead of the
+one set with APSIClient_SetCompression.
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_CreateQuery3(
+    void* thisptr, const std::uint64_t item_count, const apsi_item* items, int include_relin_keys, int compr_mode, std::uint64_t* encrypted_query_size, std::uint8_t** encrypted_query);
+
+/**
+Same as APSIClient_CreateQuery2, but the query is copied to the caller's buffer destination, with a capacity of
+destination_capacity bytes, and *leased_query is set to nullptr. A query that does not fit is returned in a leased
+buffer in *leased_query instead. *encrypted_query_size is the size of the query.
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_CreateQueryInto(
+    void* thisptr,
+    const std::uint64_t item_count,
+    const apsi_item* items,
+    int include_relin_keys,
+    const std::uint64_t destination_capacity,
+    std::uint8_t* destination,
+    std::uint64_t* encrypted_query_size,
+    std::uint8_t** leased_query);
+
+/**
+Set the compression of the queries of the client and of the sessions it creates afterwards, one of the
+APSI_COMPRESSION_ values. The default is the SEAL default, zstd when SEAL is built with it. Servers compress
+their results like the query unless set otherwise (see APSIServer_SetResultCompression). OPRF requests are
+random curve points and are never compressed. SEAL has no compression level.
+Returns E_INVALIDARG for a mode the SEAL build does not support.
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_SetCompression(void* thisptr, int compr_mode);
+
 /**
 Decrypt the result of a query
 */
 APSIEXPORT HRESULT APSICALL APSIClient_ProcessResult(void* thisptr, const std::uint64_t encrypted_result_size, const std::uint8_t* encrypted_result, std::uint64_t* intersection_size, std::uint8_t** intersection);
 
 /**
-Free encrypted query memory
+Decrypt the result of a query against a labeled database.
+labels holds intersection_size labels of label_byte_count bytes each; labels of items that were not found are all zeros.
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_ProcessLabeledResult(void* thisptr, const std::uint64_t encrypted_result_size, const std::uint8_t* encrypted_result, std::uint64_t* intersection_size, std::uint8_t** intersection, std::uint64_t* label_byte_count, std::uint8_t** labels);
+
+/**
+Decrypt part of the result of a query as soon as it is received.
+The first call must contain the response header, and following calls the result parts.
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_ProcessResultPart(void* thisptr, const std::uint64_t result_part_size, const std::uint8_t* result_part);
+
+/**
+Get the intersection after all result parts have been processed
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_FinalizeResult(void* thisptr, std::uint64_t* intersection_size, std::uint8_t** intersection);
+
+/**
+Get the intersection and the labels after all result parts have been processed
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_FinalizeLabeledResult(void* thisptr, std::uint64_t* intersection_size, std::uint8_t** intersection, std::uint64_t* label_byte_count, std::uint8_t** labels);
+
+/**
+Create a session that shares the keys of the client, so that several queries can be in flight at once.
+The session has to be destroyed with APSIClientSession_Destroy, and can outlive the client.
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_CreateSession(void* thisptr, void** session);
+
+/**
+Destroy session instance
+*/
+APSIEXPORT HRESULT APSICALL APSIClientSession_Destroy(void* thisptr);
+
+/**
+The following functions work like the APSIClient_ functions with the same name, on the query of a session.
+Different sessions can be used concurrently, but a single session must not be used from several threads at once.
+*/
+APSIEXPORT HRESULT APSICALL APSIClientSession_CreateOPRFRequest(void* thisptr, const std::uint64_t item_count, const apsi_item* items, std::uint64_t* oprf_request_size, std::uint8_t** oprf_request);
+
+APSIEXPORT HRESULT APSICALL APSIClientSession_ExtractHashes(void* thisptr, const std::uint64_t oprf_response_size, const std::uint8_t* oprf_response, std::uint64_t* hashed_item_count, std::uint8_t** hashed_items);
+
+APSIEXPORT HRESULT APSICALL APSIClientSession_CreateQuery(void* thisptr, const std::uint64_t item_count, const apsi_item* items, std::uint64_t* encrypted_query_size, std::uint8_t** encrypted_query);
+
+APSIEXPORT HRESULT APSICALL APSIClientSession_CreateQuery2(void* thisptr, const std::uint64_t item_count, const apsi_item* items, int include_relin_keys, std::uint64_t* encrypted_query_size, std::uint8_t** encrypted_query);
+
+APSIEXPORT HRESULT APSICALL APSIClientSession_CreateQuery3(
+    void* thisptr, const std::uint64_t item_count, const apsi_item* items, int include_relin_keys, int compr_mode, std::uint64_t* encrypted_query_size, std::uint8_t** encrypted_query);
+
+APSIEXPORT HRESULT APSICALL APSIClientSession_SetCompression(void* thisptr, int compr_mode);
+
+APSIEXPORT HRESULT APSICALL APSIClientSession_ProcessResult(void* thisptr, const std::uint64_t encrypted_result_size, const std::uint8_t* encrypted_result, std::uint64_t* intersection_size, std::uint8_t** intersection);
+
+APSIEXPORT HRESULT APSICALL APSIClientSession_ProcessLabeledResult(void* thisptr, const std::uint64_t encrypted_result_size, const std::uint8_t* encrypted_result, std::uint64_t* intersection_size, std::uint8_t** intersection, std::uint64_t* label_byte_count, std::uint8_t** labels);
+
+APSIEXPORT HRESULT APSICALL APSIClientSession_ProcessResultPart(void* thisptr, const std::uint64_t result_part_size, const std::uint8_t* result_part);
+
+APSIEXPORT HRESULT APSICALL APSIClientSession_FinalizeResult(void* thisptr, std::uint64_t* intersection_size, std::uint8_t** intersection);
+
+APSIEXPORT HRESULT APSICALL APSIClientSession_FinalizeLabeledResult(void* thisptr, std::uint64_t* intersection_size, std::uint8_t** intersection, std::uint64_t* label_byte_count, std::uint8_t** labels);
+
+/**
+Return a buffer leased by an export to the pool
 */
 APSIEXPORT HRESULT APSICALL APSIClient_ReleaseNativePointer(std::uint8_t* native_ptr);
+
+/**
+Set the total size of the released buffers the pool keeps for reuse, 256 MB by default.
+0 frees every buffer when it is released.
+*/
+APSIEXPORT HRESULT APSICALL APSIClient_SetBufferPoolLimit(const std::uint64_t max_retained_bytes);
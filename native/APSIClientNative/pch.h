@@ -17,17 +17,23 @@
 
 #else // _MSC_VER
 
+#include <cstdint>
+
 #define FACILITY_WIN32                   7
 #define ERROR_INSUFFICIENT_BUFFER        122L    // dderror
 #define ERROR_INVALID_STATE              5023L
 
-typedef long HRESULT;
+// HRESULT is 32 bits wide like on Windows, so that error codes are negative
+typedef int32_t HRESULT;
 
 HRESULT ACDL_HRESULT_FROM_WIN32(unsigned long x);
 
-#define E_FAIL                           0x80004005L
-#define E_POINTER                        0x80004003L
-#define E_INVALIDARG                     0x80070057L
+#define SUCCEEDED(hr)                    (((HRESULT)(hr)) >= 0)
+#define FAILED(hr)                       (((HRESULT)(hr)) < 0)
+
+#define E_FAIL                           ((HRESULT)0x80004005L)
+#define E_POINTER                        ((HRESULT)0x80004003L)
+#define E_INVALIDARG                     ((HRESULT)0x80070057L)
 #define E_NOT_SUFFICIENT_BUFFER          ACDL_HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER)
 #define E_NOT_VALID_STATE                ACDL_HRESULT_FROM_WIN32(ERROR_INVALID_STATE)
 
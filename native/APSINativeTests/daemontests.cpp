@@ -0,0 +1,383 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+// Runs apsiserverdaemon, built against serverstub.cpp instead of apsiservernative, on a Unix domain socket and
+// checks its framing: pipelined requests answered by request id, malformed and oversized frames, and clients that
+// disconnect in the middle of a request.
+//
+// Usage: daemontests <path to the stub daemon>
+
+// STD
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// POSIX
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// APSINative
+#include "pch.h"
+
+using namespace std;
+
+namespace
+{
+    int failures = 0;
+
+    void Check(bool condition, const char* description)
+    {
+        if (!condition)
+        {
+            cerr << "FAILED: " << description << endl;
+            failures++;
+        }
+    }
+
+    // Same layout as in apsiserverdaemon.cpp
+    struct FrameHeader
+    {
+        uint32_t body_size;
+        uint32_t code;
+        uint64_t request_id;
+    };
+
+    enum RequestType : uint32_t
+    {
+        GetParameters = 1,
+        RunOPRF = 2,
+        RunQuery = 3
+    };
+
+    constexpr uint32_t max_request_size = 4096;
+
+    struct Response
+    {
+        FrameHeader header;
+        vector<uint8_t> body;
+    };
+
+    vector<uint8_t> Frame(uint32_t code, uint64_t request_id, const vector<uint8_t>& body)
+    {
+        FrameHeader header{ static_cast<uint32_t>(body.size()), code, request_id };
+
+        vector<uint8_t> frame(sizeof(header) + body.size());
+        memcpy(frame.data(), &header, sizeof(header));
+        if (!body.empty())
+            memcpy(frame.data() + sizeof(header), body.data(), body.size());
+
+        return frame;
+    }
+
+    vector<uint8_t> QueryBody(uint8_t first, size_t size)
+    {
+        vector<uint8_t> body(size);
+        for (size_t i = 0; i < size; i++)
+        {
+            body[i] = static_cast<uint8_t>(first + i);
+        }
+
+        return body;
+    }
+
+    vector<uint8_t> Incremented(vector<uint8_t> bytes)
+    {
+        for (uint8_t& byte : bytes)
+        {
+            byte++;
+        }
+
+        return bytes;
+    }
+
+    class Connection
+    {
+    public:
+        explicit Connection(const string& socket_path)
+        {
+            sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+            strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+            // The daemon needs a moment to start listening
+            for (int attempt = 0; attempt < 100 && fd_ < 0; attempt++)
+            {
+                fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (0 == connect(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)))
+                    break;
+
+                close(fd_);
+                fd_ = -1;
+                usleep(50 * 1000);
+            }
+
+            // A daemon that stops answering fails the test instead of hanging it
+            timeval timeout{ 10, 0 };
+            if (fd_ >= 0)
+                setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        }
+
+        ~Connection()
+        {
+            disconnect();
+        }
+
+        bool connected() const
+        {
+            return fd_ >= 0;
+        }
+
+        bool send_bytes(const vector<uint8_t>& bytes)
+        {
+            size_t sent = 0;
+            while (sent < bytes.size())
+            {
+                ssize_t count = send(fd_, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+                if (count <= 0)
+                    return false;
+
+                sent += static_cast<size_t>(count);
+            }
+
+            return true;
+        }
+
+        /**
+        Read the next response. Returns false when the daemon closed the connection, in which case closed() is
+        true, or when no response arrived in time.
+        */
+        bool receive(Response& response)
+        {
+            if (!receive_bytes(&response.header, sizeof(response.header)))
+                return false;
+
+            response.body.resize(response.header.body_size);
+            return receive_bytes(response.body.data(), response.body.size());
+        }
+
+        bool closed() const
+        {
+            return closed_;
+        }
+
+        void disconnect()
+        {
+            if (fd_ >= 0)
+                close(fd_);
+
+            fd_ = -1;
+        }
+
+    private:
+        int fd_ = -1;
+        bool closed_ = false;
+
+        bool receive_bytes(void* data, size_t size)
+        {
+            size_t received = 0;
+            while (received < size)
+            {
+                ssize_t count = recv(fd_, static_cast<uint8_t*>(data) + received, size - received, 0);
+                if (0 == count)
+                    closed_ = true;
+                if (count <= 0)
+                    return false;
+
+                received += static_cast<size_t>(count);
+            }
+
+            return true;
+        }
+    };
+
+    /**
+    Send parameter, OPRF and query requests in a single write, along with a failing query and a request of an
+    unknown type, and check that every response reaches its request.
+    */
+    void PipelinedRequestsTest(const string& socket_path)
+    {
+        Connection connection(socket_path);
+        Check(connection.connected(), "PipelinedRequestsTest: connect");
+
+        const vector<uint8_t> oprf_request = { 1, 2, 3, 4 };
+        constexpr uint64_t first_query_id = 10;
+        constexpr uint64_t query_count = 24;
+        constexpr uint64_t failing_query_id = 100;
+        constexpr uint64_t unknown_type_id = 101;
+
+        vector<uint8_t> frames;
+        auto append = [&frames](const vector<uint8_t>& frame) { frames.insert(frames.end(), frame.begin(), frame.end()); };
+        append(Frame(GetParameters, 1, {}));
+        append(Frame(RunOPRF, 2, oprf_request));
+        for (uint64_t i = 0; i < query_count; i++)
+        {
+            append(Frame(RunQuery, first_query_id + i, QueryBody(static_cast<uint8_t>(i), 100 + i)));
+        }
+        append(Frame(RunQuery, failing_query_id, { 0xFF }));
+        append(Frame(42, unknown_type_id, { 1 }));
+
+        Check(connection.send_bytes(frames), "PipelinedRequestsTest: send");
+
+        map<uint64_t, Response> responses;
+        for (uint64_t i = 0; i < query_count + 4; i++)
+        {
+            Response response;
+            if (!connection.receive(response))
+                break;
+
+            responses[response.header.request_id] = move(response);
+        }
+
+        Check(responses.size() == query_count + 4, "PipelinedRequestsTest: one response per request");
+
+        const string parameters = "stub parameters";
+        Check(S_OK == static_cast<HRESULT>(responses[1].header.code), "PipelinedRequestsTest: parameters succeed");
+        Check(vector<uint8_t>(parameters.begin(), parameters.end()) == responses[1].body, "PipelinedRequestsTest: parameters");
+
+        Check(S_OK == static_cast<HRESULT>(responses[2].header.code), "PipelinedRequestsTest: OPRF succeeds");
+        Check(vector<uint8_t>(oprf_request.rbegin(), oprf_request.rend()) == responses[2].body, "PipelinedRequestsTest: OPRF response");
+
+        for (uint64_t i = 0; i < query_count; i++)
+        {
+            const Response& response = responses[first_query_id + i];
+            Check(S_OK == static_cast<HRESULT>(response.header.code), "PipelinedRequestsTest: query succeeds");
+            Check(Incremented(QueryBody(static_cast<uint8_t>(i), 100 + i)) == response.body, "PipelinedRequestsTest: query result");
+        }
+
+        Check(E_FAIL == static_cast<HRESULT>(responses[failing_query_id].header.code), "PipelinedRequestsTest: failing query reports E_FAIL");
+        Check(responses[failing_query_id].body.empty(), "PipelinedRequestsTest: failing query has no result");
+        Check(E_INVALIDARG == static_cast<HRESULT>(responses[unknown_type_id].header.code), "PipelinedRequestsTest: unknown type reports E_INVALIDARG");
+    }
+
+    /**
+    A frame announcing a body larger than --max-request-size closes its connection without a response.
+    */
+    void OversizedFrameTest(const string& socket_path)
+    {
+        Connection connection(socket_path);
+        Check(connection.connected(), "OversizedFrameTest: connect");
+
+        FrameHeader header{ max_request_size + 1, RunQuery, 1 };
+        vector<uint8_t> bytes(sizeof(header));
+        memcpy(bytes.data(), &header, sizeof(header));
+        connection.send_bytes(bytes);
+
+        Response response;
+        Check(!connection.receive(response) && connection.closed(), "OversizedFrameTest: connection closed");
+    }
+
+    /**
+    Clients that disconnect after part of a frame, or while their request is being processed, do not affect the
+    other connections.
+    */
+    void DisconnectTest(const string& socket_path)
+    {
+        Connection connection(socket_path);
+        Check(connection.connected(), "DisconnectTest: connect");
+
+        {
+            Connection partial(socket_path);
+            vector<uint8_t> frame = Frame(RunQuery, 1, QueryBody(1, 100));
+            frame.resize(sizeof(FrameHeader) + 50);
+            Check(partial.send_bytes(frame), "DisconnectTest: send part of a frame");
+        }
+
+        {
+            Connection early(socket_path);
+            Check(early.send_bytes(Frame(RunQuery, 2, QueryBody(3, 100))), "DisconnectTest: send a slow query");
+        }
+
+        Check(connection.send_bytes(Frame(RunQuery, 3, QueryBody(5, 10))), "DisconnectTest: send");
+
+        Response response;
+        Check(connection.receive(response), "DisconnectTest: other connections are still served");
+        Check(3 == response.header.request_id && S_OK == static_cast<HRESULT>(response.header.code), "DisconnectTest: response");
+        Check(Incremented(QueryBody(5, 10)) == response.body, "DisconnectTest: query result");
+
+        Connection fresh(socket_path);
+        Check(fresh.send_bytes(Frame(GetParameters, 4, {})) && fresh.receive(response), "DisconnectTest: new connections are accepted");
+    }
+
+    bool WriteFile(const string& path, const string& contents)
+    {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (nullptr == file)
+            return false;
+
+        bool written = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+        return 0 == fclose(file) && written;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        cerr << "Usage: " << argv[0] << " <path to the stub daemon>" << endl;
+        return 1;
+    }
+
+    char directory[] = "/tmp/apsidaemontestsXXXXXX";
+    if (nullptr == mkdtemp(directory))
+    {
+        cerr << "Cannot create a temporary directory" << endl;
+        return 1;
+    }
+
+    // The stub ignores the contents of the DB and the key, but the daemon reads the key file
+    string db_file = string(directory) + "/db";
+    string key_file = string(directory) + "/key";
+    string socket_path = string(directory) + "/daemon.sock";
+    if (!WriteFile(db_file, "db") || !WriteFile(key_file, "key"))
+    {
+        cerr << "Cannot write the test files" << endl;
+        return 1;
+    }
+
+    string max_request_size_arg = to_string(max_request_size);
+    pid_t daemon = fork();
+    if (0 == daemon)
+    {
+        execl(argv[1], argv[1],
+            "--db", db_file.c_str(),
+            "--oprf-key", key_file.c_str(),
+            "--socket", socket_path.c_str(),
+            "--threads", "2",
+            "--workers", "2",
+            "--max-request-size", max_request_size_arg.c_str(),
+            static_cast<char*>(nullptr));
+        _exit(127);
+    }
+
+    Check(daemon > 0, "fork");
+    if (daemon > 0)
+    {
+        PipelinedRequestsTest(socket_path);
+        OversizedFrameTest(socket_path);
+        DisconnectTest(socket_path);
+
+        // The daemon shuts down cleanly on SIGTERM
+        int status = 0;
+        kill(daemon, SIGTERM);
+        Check(waitpid(daemon, &status, 0) == daemon && WIFEXITED(status) && 0 == WEXITSTATUS(status), "daemon exits cleanly");
+    }
+
+    unlink(db_file.c_str());
+    unlink(key_file.c_str());
+    unlink(socket_path.c_str());
+    rmdir(directory);
+
+    if (failures == 0)
+        cout << "All daemon checks passed" << endl;
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,63 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+// Checks the HRESULT definitions that pch.h provides outside of Windows. The file is built once for every
+// native project, with that project's directory on the include path.
+
+// STD
+#include <cstdint>
+#include <iostream>
+#include <type_traits>
+
+// APSINative
+#include "pch.h"
+
+#ifndef FAILED
+#define SUCCEEDED(hr)                    (((HRESULT)(hr)) >= 0)
+#define FAILED(hr)                       (((HRESULT)(hr)) < 0)
+#endif
+
+namespace
+{
+    int failures = 0;
+
+    void Check(bool condition, const char* description)
+    {
+        if (!condition)
+        {
+            std::cerr << "FAILED: " << description << std::endl;
+            failures++;
+        }
+    }
+}
+
+#define CHECK(condition) Check((condition), #condition)
+
+int main()
+{
+    static_assert(std::is_same<HRESULT, std::int32_t>::value, "HRESULT must be a 32-bit signed integer");
+
+    CHECK(FAILED(E_FAIL));
+    CHECK(FAILED(E_POINTER));
+    CHECK(FAILED(E_INVALIDARG));
+    CHECK(FAILED(E_NOT_SUFFICIENT_BUFFER));
+    CHECK(FAILED(E_NOT_VALID_STATE));
+    CHECK(!SUCCEEDED(E_FAIL));
+    CHECK(SUCCEEDED(S_OK));
+    CHECK(SUCCEEDED(S_FALSE));
+
+    CHECK(static_cast<std::uint32_t>(E_FAIL) == 0x80004005U);
+    CHECK(static_cast<std::uint32_t>(E_NOT_SUFFICIENT_BUFFER) == 0x8007007AU);
+    CHECK(static_cast<std::uint32_t>(E_NOT_VALID_STATE) == 0x8007139FU);
+
+#ifdef HRESULT_FROM_WIN32
+    CHECK(HRESULT_FROM_WIN32(0) == S_OK);
+    CHECK(FAILED(HRESULT_FROM_WIN32(ERROR_BUSY)));
+    CHECK(static_cast<std::uint32_t>(HRESULT_FROM_WIN32(ERROR_TIMEOUT)) == 0x800705B4U);
+#endif
+
+    if (failures == 0)
+        std::cout << "All HRESULT checks passed" << std::endl;
+
+    return failures == 0 ? 0 : 1;
+}
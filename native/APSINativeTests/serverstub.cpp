@@ -0,0 +1,137 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.
+
+// Stand-in for the exports of apsiservernative that apsiserverdaemon uses, so that the daemon's transport can be
+// tested without APSI. Responses are derived from the request bytes, which lets daemontests check that every
+// response reaches the request it belongs to.
+
+// STD
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+// APSINative
+#include "pch.h"
+#include "apsiservernative.h"
+
+namespace
+{
+    int server_instance = 0;
+    int oprf_key_instance = 0;
+
+    const char stub_parameters[] = "stub parameters";
+
+    HRESULT make_response(std::uint64_t size, std::uint64_t* response_size, std::uint8_t** response)
+    {
+        *response = new std::uint8_t[size > 0 ? size : 1];
+        *response_size = size;
+        return S_OK;
+    }
+}
+
+APSIEXPORT HRESULT APSICALL APSI_SetThreads(std::uint64_t threads)
+{
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_LoadDB2(void** thisptr, char* file_path)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(file_path, E_POINTER);
+
+    *thisptr = &server_instance;
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_LoadDBMapped(void** thisptr, char* file_path)
+{
+    return APSIServer_LoadDB2(thisptr, file_path);
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_Destroy(void* thisptr)
+{
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_SetResultCompression(void* thisptr, const int compr_mode)
+{
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_ReleasePointer(std::uint8_t* ptr)
+{
+    delete[] ptr;
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL OPRFKey_Create(void** thisptr)
+{
+    IfNullRet(thisptr, E_POINTER);
+
+    *thisptr = &oprf_key_instance;
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL OPRFKey_Destroy(void* thisptr)
+{
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL OPRFKey_Load(void* thisptr, const std::uint64_t key_size, const std::uint8_t* oprf_key_buffer)
+{
+    return S_OK;
+}
+
+/**
+The parameters are a fixed string.
+*/
+APSIEXPORT HRESULT APSICALL APSIServer_GetParameters(void* thisptr, std::uint64_t* parameters_size, std::uint8_t** parameters)
+{
+    IfNullRet(thisptr, E_POINTER);
+
+    make_response(sizeof(stub_parameters) - 1, parameters_size, parameters);
+    std::memcpy(*parameters, stub_parameters, sizeof(stub_parameters) - 1);
+    return S_OK;
+}
+
+/**
+The OPRF response is the request reversed.
+*/
+APSIEXPORT HRESULT APSICALL OPRFSender_RunOPRF(const std::uint64_t encoded_items_size, const std::uint8_t* encoded_items, void* oprf_key, std::uint64_t* result_buffer_size, std::uint8_t** result_buffer)
+{
+    IfNullRet(oprf_key, E_POINTER);
+
+    make_response(encoded_items_size, result_buffer_size, result_buffer);
+    for (std::uint64_t i = 0; i < encoded_items_size; i++)
+    {
+        (*result_buffer)[i] = encoded_items[encoded_items_size - 1 - i];
+    }
+
+    return S_OK;
+}
+
+/**
+The result is the query with every byte incremented. Queries take up to 15 ms depending on their first byte, so
+that pipelined queries complete out of order, and a query starting with 0xFF fails with E_FAIL.
+*/
+APSIEXPORT HRESULT APSICALL APSIServer_Query(void* thisptr, const std::uint64_t encrypted_query_size, const std::uint8_t* encrypted_query, std::uint64_t* result_buffer_size, std::uint8_t** result_buffer)
+{
+    IfNullRet(thisptr, E_POINTER);
+
+    if (encrypted_query_size > 0)
+    {
+        if (0xFF == encrypted_query[0])
+            return E_FAIL;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(encrypted_query[0] % 4 * 5));
+    }
+
+    make_response(encrypted_query_size, result_buffer_size, result_buffer);
+    for (std::uint64_t i = 0; i < encrypted_query_size; i++)
+    {
+        (*result_buffer)[i] = static_cast<std::uint8_t>(encrypted_query[i] + 1);
+    }
+
+    return S_OK;
+}
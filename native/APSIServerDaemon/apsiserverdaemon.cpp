@@ -0,0 +1,1211 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT license.using System;
+
+// apsiserverdaemon.cpp : Serves OPRF and query requests against a saved DB over a Unix domain socket,
+// or as the worker process of a .NET SharedMemoryServer through rings in shared memory.
+
+// STD
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// APSINative
+#include "pch.h"
+#include "apsiservernative.h"
+
+using namespace std;
+
+namespace
+{
+    /**
+    Every message starts with this header, in host byte order, followed by body_size bytes. A request holds its
+    RequestType in code, and the response to it holds the HRESULT of the request and the same request_id. Clients
+    can send several requests without waiting; responses are sent as soon as they are ready, in any order.
+    */
+    struct FrameHeader
+    {
+        uint32_t body_size;
+        uint32_t code;
+        uint64_t request_id;
+    };
+
+    static_assert(sizeof(FrameHeader) == 16, "FrameHeader must not have padding");
+
+    enum RequestType : uint32_t
+    {
+        // Empty body; the response holds the parameters of the DB, see APSIServer_GetParameters
+        GetParameters = 1,
+
+        // The body is an OPRF request; the response holds the OPRF response
+        RunOPRF = 2,
+
+        // The body is an encrypted query; the response holds the encrypted result
+        RunQuery = 3
+    };
+
+    struct Options
+    {
+        string db_file;
+        string oprf_key_file;
+        string socket_path = "/tmp/apsiserver.sock";
+        string shm_file;
+        bool mapped = false;
+        uint64_t threads = 0;
+        uint64_t workers = 0;
+        uint64_t max_pending = 256;
+        uint64_t max_inflight = 16;
+        uint64_t max_request_size = uint64_t(256) * 1024 * 1024;
+        int result_compression = APSI_COMPRESSION_AS_REQUESTED;
+    };
+
+    void PrintUsage(const char* program)
+    {
+        cout << "Usage: " << program << " --db <file> [options]" << endl
+             << "  --db <file>               DB saved with APSIServer_SaveDB2" << endl
+             << "  --oprf-key <file>         OPRF key saved with OPRFKey_Save; without it OPRF requests fail" << endl
+             << "  --socket <path>           Unix domain socket to listen on (default: /tmp/apsiserver.sock)" << endl
+             << "  --shm <file>              Serve the rings in this shared memory file instead of a socket" << endl
+             << "  --mapped                  Load the DB through APSIServer_LoadDBMapped" << endl
+             << "  --threads <n>             APSI thread count, 0 for all hardware threads (default: 0)" << endl
+             << "  --workers <n>             Requests processed at the same time, 0 for the APSI thread count (default: 0)" << endl
+             << "  --max-pending <n>         Requests waiting for a worker before new ones are rejected (default: 256)" << endl
+             << "  --max-inflight <n>        Requests per connection before reading from it pauses (default: 16)" << endl
+             << "  --max-request-size <n>    Largest accepted request body in bytes (default: 268435456)" << endl
+             << "  --compression <mode>      Compression of query results: none, zlib, zstd or query to compress them" << endl
+             << "                            like each query (default: query)" << endl;
+    }
+
+    bool ParseCompression(const string& value, int& compr_mode)
+    {
+        if (value == "none")
+            compr_mode = APSI_COMPRESSION_NONE;
+        else if (value == "zlib")
+            compr_mode = APSI_COMPRESSION_ZLIB;
+        else if (value == "zstd")
+            compr_mode = APSI_COMPRESSION_ZSTD;
+        else if (value == "query")
+            compr_mode = APSI_COMPRESSION_AS_REQUESTED;
+        else
+            return false;
+
+        return true;
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "--mapped")
+            {
+                options.mapped = true;
+                continue;
+            }
+
+            if (i + 1 >= argc)
+                return false;
+
+            string value = argv[++i];
+            if (arg == "--db")
+                options.db_file = value;
+            else if (arg == "--oprf-key")
+                options.oprf_key_file = value;
+            else if (arg == "--socket")
+                options.socket_path = value;
+            else if (arg == "--shm")
+                options.shm_file = value;
+            else if (arg == "--threads")
+                options.threads = stoull(value);
+            else if (arg == "--workers")
+                options.workers = stoull(value);
+            else if (arg == "--max-pending")
+                options.max_pending = stoull(value);
+            else if (arg == "--max-inflight")
+                options.max_inflight = stoull(value);
+            else if (arg == "--max-request-size")
+                options.max_request_size = stoull(value);
+            else if (arg == "--compression")
+            {
+                if (!ParseCompression(value, options.result_compression))
+                    return false;
+            }
+            else
+                return false;
+        }
+
+        return !options.db_file.empty() && !options.socket_path.empty() && options.max_inflight > 0
+            && options.max_request_size <= numeric_limits<uint32_t>::max();
+    }
+
+    void Check(HRESULT hr, const char* operation)
+    {
+        if (hr < 0)
+        {
+            stringstream ss;
+            ss << operation << " failed: 0x" << hex << static_cast<uint32_t>(hr);
+            throw runtime_error(ss.str());
+        }
+    }
+
+    void CheckErrno(bool succeeded, const char* operation)
+    {
+        if (!succeeded)
+        {
+            stringstream ss;
+            ss << operation << " failed: " << strerror(errno);
+            throw runtime_error(ss.str());
+        }
+    }
+
+    /**
+    A response waiting to be written. The body is a buffer returned by the native server, released once written.
+    */
+    struct Response
+    {
+        FrameHeader header{};
+        uint8_t* body = nullptr;
+        uint64_t written = 0;
+
+        Response() = default;
+
+        Response(Response&& other) noexcept
+            : header(other.header), body(other.body), written(other.written)
+        {
+            other.body = nullptr;
+        }
+
+        Response& operator=(Response&& other) noexcept
+        {
+            swap(header, other.header);
+            swap(body, other.body);
+            swap(written, other.written);
+            return *this;
+        }
+
+        ~Response()
+        {
+            APSIServer_ReleasePointer(body);
+        }
+
+        uint64_t size() const
+        {
+            return sizeof(FrameHeader) + header.body_size;
+        }
+    };
+
+    struct Request
+    {
+        // Connection the request came from, or the end of the request in the shared request ring
+        uint64_t connection_id;
+        FrameHeader header;
+
+        // Body read from a socket, or nullptr when the body is used in place in shared memory
+        vector<uint8_t> body;
+        const uint8_t* shared_body = nullptr;
+
+        const uint8_t* data() const
+        {
+            return nullptr != shared_body ? shared_body : body.data();
+        }
+    };
+
+    struct Completion
+    {
+        uint64_t connection_id;
+        Response response;
+    };
+
+    /**
+    Processes requests on a fixed number of threads. Requests wait in a bounded queue, and the event loop is
+    woken through an eventfd whenever a response is ready.
+    */
+    class WorkerPool
+    {
+    public:
+        WorkerPool(void* server, void* oprf_key, size_t worker_count, size_t max_pending, int wake_fd)
+            : server_(server), oprf_key_(oprf_key), max_pending_(max_pending), wake_fd_(wake_fd)
+        {
+            for (size_t i = 0; i < worker_count; i++)
+            {
+                workers_.emplace_back([this]() { work(); });
+            }
+        }
+
+        ~WorkerPool()
+        {
+            {
+                lock_guard<mutex> lock(mutex_);
+                stopping_ = true;
+            }
+
+            pending_cv_.notify_all();
+            for (auto& worker : workers_)
+            {
+                worker.join();
+            }
+        }
+
+        /**
+        Queue a request. Returns false if the queue is full.
+        */
+        bool submit(Request&& request)
+        {
+            {
+                lock_guard<mutex> lock(mutex_);
+                if (pending_.size() >= max_pending_)
+                    return false;
+
+                pending_.push_back(move(request));
+            }
+
+            pending_cv_.notify_one();
+            return true;
+        }
+
+        /**
+        Complete a request without running it, e.g. when it is rejected.
+        */
+        void complete(uint64_t connection_id, const FrameHeader& request_header, HRESULT hr)
+        {
+            Completion completion{ connection_id, Response() };
+            completion.response.header.code = static_cast<uint32_t>(hr);
+            completion.response.header.request_id = request_header.request_id;
+            push_completion(move(completion));
+        }
+
+        vector<Completion> take_completions()
+        {
+            lock_guard<mutex> lock(mutex_);
+            vector<Completion> completions;
+            completions.swap(completions_);
+            return completions;
+        }
+
+    private:
+        void* server_;
+        void* oprf_key_;
+        size_t max_pending_;
+        int wake_fd_;
+
+        mutex mutex_;
+        condition_variable pending_cv_;
+        deque<Request> pending_;
+        vector<Completion> completions_;
+        bool stopping_ = false;
+        vector<thread> workers_;
+
+        void work()
+        {
+            while (true)
+            {
+                Request request;
+                {
+                    unique_lock<mutex> lock(mutex_);
+                    pending_cv_.wait(lock, [this]() { return stopping_ || !pending_.empty(); });
+                    if (stopping_)
+                        return;
+
+                    request = move(pending_.front());
+                    pending_.pop_front();
+                }
+
+                push_completion(run(move(request)));
+            }
+        }
+
+        Completion run(Request request)
+        {
+            Completion completion{ request.connection_id, Response() };
+            FrameHeader& header = completion.response.header;
+            header.request_id = request.header.request_id;
+
+            uint64_t body_size = 0;
+            HRESULT hr = E_INVALIDARG;
+            switch (request.header.code)
+            {
+            case GetParameters:
+                hr = APSIServer_GetParameters(server_, &body_size, &completion.response.body);
+                break;
+
+            case RunOPRF:
+                hr = (nullptr == oprf_key_)
+                    ? E_NOT_VALID_STATE
+                    : OPRFSender_RunOPRF(request.header.body_size, request.data(), oprf_key_, &body_size, &completion.response.body);
+                break;
+
+            case RunQuery:
+                hr = APSIServer_Query(server_, request.header.body_size, request.data(), &body_size, &completion.response.body);
+                break;
+            }
+
+            // Responses larger than a frame can describe are not sent
+            if (SUCCEEDED(hr) && body_size > numeric_limits<uint32_t>::max())
+                hr = E_FAIL;
+
+            if (FAILED(hr))
+            {
+                APSIServer_ReleasePointer(completion.response.body);
+                completion.response.body = nullptr;
+                body_size = 0;
+            }
+
+            header.code = static_cast<uint32_t>(hr);
+            header.body_size = static_cast<uint32_t>(body_size);
+            return completion;
+        }
+
+        void push_completion(Completion&& completion)
+        {
+            {
+                lock_guard<mutex> lock(mutex_);
+                completions_.push_back(move(completion));
+            }
+
+            uint64_t one = 1;
+            ssize_t written = write(wake_fd_, &one, sizeof(one));
+            (void)written;
+        }
+    };
+
+    class Connection
+    {
+    public:
+        Connection(int fd, uint64_t id)
+            : fd_(fd), id_(id)
+        {}
+
+        ~Connection()
+        {
+            close(fd_);
+        }
+
+        int fd() const
+        {
+            return fd_;
+        }
+
+        uint64_t id() const
+        {
+            return id_;
+        }
+
+        size_t inflight() const
+        {
+            return inflight_;
+        }
+
+        bool has_output() const
+        {
+            return !output_.empty();
+        }
+
+        /**
+        Read as many complete requests as are available, up to max_requests. Returns false when the connection
+        was closed by the peer or sent a request that is too large.
+        */
+        bool read_requests(size_t max_requests, uint64_t max_request_size, vector<Request>& requests)
+        {
+            while (requests.size() < max_requests)
+            {
+                uint8_t* target;
+                size_t remaining;
+                if (header_read_ < sizeof(FrameHeader))
+                {
+                    target = reinterpret_cast<uint8_t*>(&header_) + header_read_;
+                    remaining = sizeof(FrameHeader) - header_read_;
+                }
+                else
+                {
+                    target = body_.data() + body_read_;
+                    remaining = body_.size() - body_read_;
+                }
+
+                if (remaining > 0)
+                {
+                    ssize_t count = recv(fd_, target, remaining, 0);
+                    if (count == 0)
+                        return false;
+                    if (count < 0)
+                        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+                    if (header_read_ < sizeof(FrameHeader))
+                    {
+                        header_read_ += static_cast<size_t>(count);
+                        if (header_read_ < sizeof(FrameHeader))
+                            continue;
+
+                        if (header_.body_size > max_request_size)
+                            return false;
+
+                        body_.resize(header_.body_size);
+                        body_read_ = 0;
+                    }
+                    else
+                    {
+                        body_read_ += static_cast<size_t>(count);
+                    }
+                }
+
+                if (header_read_ == sizeof(FrameHeader) && body_read_ == body_.size())
+                {
+                    requests.push_back(Request{ id_, header_, move(body_) });
+                    inflight_++;
+                    header_read_ = 0;
+                    body_read_ = 0;
+                    body_.clear();
+                }
+            }
+
+            return true;
+        }
+
+        void add_response(Response&& response)
+        {
+            inflight_--;
+            output_.push_back(move(response));
+        }
+
+        /**
+        Write queued responses until the socket would block. Returns false on error.
+        */
+        bool write_responses()
+        {
+            while (!output_.empty())
+            {
+                // Several responses are gathered into one call
+                iovec parts[64];
+                int part_count = 0;
+                for (auto it = output_.begin(); it != output_.end() && part_count + 2 <= 64; ++it)
+                {
+                    uint64_t offset = it->written;
+                    if (offset < sizeof(FrameHeader))
+                    {
+                        parts[part_count++] = { reinterpret_cast<uint8_t*>(&it->header) + offset, sizeof(FrameHeader) - offset };
+                        offset = sizeof(FrameHeader);
+                    }
+
+                    uint64_t body_offset = offset - sizeof(FrameHeader);
+                    if (body_offset < it->header.body_size)
+                    {
+                        parts[part_count++] = { it->body + body_offset, it->header.body_size - body_offset };
+                    }
+                }
+
+                // MSG_NOSIGNAL turns a write to a closed peer into EPIPE instead of SIGPIPE
+                msghdr message{};
+                message.msg_iov = parts;
+                message.msg_iovlen = static_cast<size_t>(part_count);
+                ssize_t count = sendmsg(fd_, &message, MSG_NOSIGNAL);
+                if (count < 0)
+                    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+                uint64_t written = static_cast<uint64_t>(count);
+                while (written > 0)
+                {
+                    Response& front = output_.front();
+                    uint64_t step = min(written, front.size() - front.written);
+                    front.written += step;
+                    written -= step;
+                    if (front.written == front.size())
+                        output_.pop_front();
+                }
+
+                // Empty responses consist of the header only and are removed above
+                while (!output_.empty() && output_.front().written == output_.front().size())
+                {
+                    output_.pop_front();
+                }
+            }
+
+            return true;
+        }
+
+    private:
+        int fd_;
+        uint64_t id_;
+        size_t inflight_ = 0;
+
+        FrameHeader header_{};
+        size_t header_read_ = 0;
+        vector<uint8_t> body_;
+        size_t body_read_ = 0;
+
+        deque<Response> output_;
+    };
+
+    /**
+    Single-threaded epoll loop that accepts connections, reads requests, hands them to the worker pool, and
+    writes the responses. Reading from a connection pauses while it has max_inflight requests being processed.
+    */
+    class EventLoop
+    {
+    public:
+        EventLoop(const Options& options, void* server, void* oprf_key, size_t worker_count)
+            : options_(options)
+        {
+            epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+            CheckErrno(epoll_fd_ >= 0, "epoll_create1");
+
+            wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            CheckErrno(wake_fd_ >= 0, "eventfd");
+            watch(wake_fd_, EPOLLIN);
+
+            sigset_t signals;
+            sigemptyset(&signals);
+            sigaddset(&signals, SIGINT);
+            sigaddset(&signals, SIGTERM);
+            CheckErrno(0 == pthread_sigmask(SIG_BLOCK, &signals, nullptr), "pthread_sigmask");
+            signal_fd_ = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+            CheckErrno(signal_fd_ >= 0, "signalfd");
+            watch(signal_fd_, EPOLLIN);
+
+            listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            CheckErrno(listen_fd_ >= 0, "socket");
+
+            sockaddr_un address{};
+            address.sun_family = AF_UNIX;
+            if (options.socket_path.size() >= sizeof(address.sun_path))
+                throw invalid_argument("socket path is too long");
+            strncpy(address.sun_path, options.socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+            unlink(options.socket_path.c_str());
+            CheckErrno(0 == ::bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)), "bind");
+            CheckErrno(0 == listen(listen_fd_, SOMAXCONN), "listen");
+            watch(listen_fd_, EPOLLIN);
+
+            // Workers start last, since their threads must inherit the blocked signals
+            workers_ = make_unique<WorkerPool>(server, oprf_key, worker_count, options.max_pending, wake_fd_);
+        }
+
+        ~EventLoop()
+        {
+            workers_.reset();
+            connections_.clear();
+            close(listen_fd_);
+            unlink(options_.socket_path.c_str());
+            close(signal_fd_);
+            close(wake_fd_);
+            close(epoll_fd_);
+        }
+
+        void run()
+        {
+            epoll_event events[64];
+            while (true)
+            {
+                int count = epoll_wait(epoll_fd_, events, 64, -1);
+                if (count < 0 && errno == EINTR)
+                    continue;
+                CheckErrno(count >= 0, "epoll_wait");
+
+                for (int i = 0; i < count; i++)
+                {
+                    int fd = events[i].data.fd;
+                    if (fd == signal_fd_)
+                    {
+                        if (shutdown_requested())
+                            return;
+                    }
+                    else if (fd == listen_fd_)
+                        accept_connections();
+                    else if (fd == wake_fd_)
+                        deliver_completions();
+                    else
+                        handle_connection(fd, events[i].events);
+                }
+            }
+        }
+
+    private:
+        const Options& options_;
+        int epoll_fd_ = -1;
+        int wake_fd_ = -1;
+        int signal_fd_ = -1;
+        int listen_fd_ = -1;
+        unique_ptr<WorkerPool> workers_;
+
+        uint64_t next_connection_id_ = 0;
+        unordered_map<int, unique_ptr<Connection>> connections_;
+        unordered_map<uint64_t, int> connection_fds_;
+
+        /**
+        Drain the signal descriptor and report whether SIGINT or SIGTERM was received.
+        */
+        bool shutdown_requested()
+        {
+            bool requested = false;
+            signalfd_siginfo info;
+            while (read(signal_fd_, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info)))
+            {
+                if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM)
+                    requested = true;
+            }
+
+            return requested;
+        }
+
+        void watch(int fd, uint32_t events)
+        {
+            epoll_event event{};
+            event.events = events;
+            event.data.fd = fd;
+            CheckErrno(0 == epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event), "epoll_ctl");
+        }
+
+        void update(Connection& connection)
+        {
+            epoll_event event{};
+            event.data.fd = connection.fd();
+            if (connection.inflight() < options_.max_inflight)
+                event.events |= EPOLLIN;
+            if (connection.has_output())
+                event.events |= EPOLLOUT;
+            epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, connection.fd(), &event);
+        }
+
+        void accept_connections()
+        {
+            while (true)
+            {
+                int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0)
+                {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        cerr << "accept failed: " << strerror(errno) << endl;
+                    return;
+                }
+
+                uint64_t id = next_connection_id_++;
+                connections_[fd] = make_unique<Connection>(fd, id);
+                connection_fds_[id] = fd;
+                watch(fd, EPOLLIN);
+            }
+        }
+
+        void close_connection(Connection& connection)
+        {
+            // Responses for requests still being processed are dropped when they complete
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection.fd(), nullptr);
+            connection_fds_.erase(connection.id());
+            connections_.erase(connection.fd());
+        }
+
+        void handle_connection(int fd, uint32_t events)
+        {
+            auto it = connections_.find(fd);
+            if (it == connections_.end())
+                return;
+
+            Connection& connection = *it->second;
+            if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN))
+            {
+                close_connection(connection);
+                return;
+            }
+
+            if (events & EPOLLOUT)
+            {
+                if (!connection.write_responses())
+                {
+                    close_connection(connection);
+                    return;
+                }
+            }
+
+            if (events & EPOLLIN)
+            {
+                vector<Request> requests;
+                size_t max_requests = options_.max_inflight - min(connection.inflight(), size_t(options_.max_inflight));
+                bool open = connection.read_requests(max_requests, options_.max_request_size, requests);
+
+                for (Request& request : requests)
+                {
+                    FrameHeader header = request.header;
+                    if (!workers_->submit(move(request)))
+                        workers_->complete(connection.id(), header, HRESULT_FROM_WIN32(ERROR_BUSY));
+                }
+
+                if (!open)
+                {
+                    close_connection(connection);
+                    return;
+                }
+            }
+
+            update(connection);
+        }
+
+        void deliver_completions()
+        {
+            uint64_t value;
+            ssize_t count = read(wake_fd_, &value, sizeof(value));
+            (void)count;
+
+            for (Completion& completion : workers_->take_completions())
+            {
+                auto fd = connection_fds_.find(completion.connection_id);
+                if (fd == connection_fds_.end())
+                    continue;
+
+                Connection& connection = *connections_[fd->second];
+                connection.add_response(move(completion.response));
+                if (!connection.write_responses())
+                {
+                    close_connection(connection);
+                    continue;
+                }
+
+                update(connection);
+            }
+        }
+    };
+
+    /**
+    Start of the shared memory file used with --shm. The front end creates and sizes the file and fills in the
+    layout; the worker sets worker_state once it serves requests, and stops when stop_requested is set.
+    */
+    struct SharedRegionHeader
+    {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t request_ring_offset;
+        uint64_t request_ring_size;
+        uint64_t response_ring_offset;
+        uint64_t response_ring_size;
+        atomic<uint32_t> worker_state;
+        atomic<uint32_t> stop_requested;
+    };
+
+    constexpr uint64_t shared_region_magic = 0x314D485349535041; // "APSISHM1"
+    constexpr uint32_t shared_region_version = 1;
+    constexpr uint32_t worker_ready = 1;
+    constexpr uint32_t worker_stopped = 2;
+
+    static_assert(sizeof(SharedRegionHeader) == 56, "SharedRegionHeader must match the .NET layout");
+    static_assert(atomic<uint64_t>::is_always_lock_free, "Ring positions must be lock free to be shared between processes");
+
+    /**
+    Single-producer single-consumer ring of frames in shared memory. The control block holds the total number
+    of bytes written (head) and released (tail) on separate cache lines, and the data follows it. Every frame is
+    a FrameHeader and its body, padded to 8 bytes, and is stored contiguously: a frame that does not fit before
+    the end of the data is preceded by a wrap marker, or by fewer than sizeof(FrameHeader) unused bytes.
+    */
+    class SharedRing
+    {
+    public:
+        static constexpr uint64_t control_size = 128;
+        static constexpr uint32_t wrap_marker = 0xFFFFFFFF;
+
+        SharedRing(uint8_t* region, uint64_t region_size, uint64_t offset, uint64_t size)
+        {
+            if (size == 0 || (size & (size - 1)) != 0 || size < 2 * sizeof(FrameHeader))
+                throw invalid_argument("ring size must be a power of two");
+            if (offset % control_size != 0 || offset + control_size + size > region_size || offset + control_size + size < offset)
+                throw invalid_argument("ring does not fit in the shared memory region");
+
+            head_ = reinterpret_cast<atomic<uint64_t>*>(region + offset);
+            tail_ = reinterpret_cast<atomic<uint64_t>*>(region + offset + 64);
+            data_ = region + offset + control_size;
+            size_ = size;
+            read_ = tail_->load(memory_order_acquire);
+        }
+
+        /**
+        Consumer: take the next frame without releasing it. The body stays valid until release passes it.
+        */
+        bool next(FrameHeader& header, const uint8_t*& body, uint64_t& end)
+        {
+            while (true)
+            {
+                uint64_t head = head_->load(memory_order_acquire);
+                if (read_ == head)
+                    return false;
+
+                // Positions and frames come from another process, so everything read must lie within what the
+                // producer published, and a frame must be one the producer can write
+                uint64_t published = head - read_;
+                if (published > size_)
+                    throw runtime_error("shared memory ring has an invalid head");
+
+                uint64_t remaining = size_ - (read_ & (size_ - 1));
+                if (remaining < sizeof(FrameHeader))
+                {
+                    check_frame(remaining <= published);
+                    read_ += remaining;
+                    continue;
+                }
+
+                memcpy(&header, data_ + (read_ & (size_ - 1)), sizeof(FrameHeader));
+                if (wrap_marker == header.code)
+                {
+                    check_frame(remaining <= published);
+                    read_ += remaining;
+                    continue;
+                }
+
+                uint64_t size = frame_size(header.body_size);
+                check_frame(size <= size_ / 2 && size <= remaining && size <= published);
+
+                body = data_ + (read_ & (size_ - 1)) + sizeof(FrameHeader);
+                read_ += size;
+                end = read_;
+                return true;
+            }
+        }
+
+        /**
+        Consumer: give back all frames that end at or before the given position to the producer.
+        */
+        void release(uint64_t end)
+        {
+            tail_->store(end, memory_order_release);
+        }
+
+        /**
+        Producer: whether a frame with the given body size can ever fit.
+        */
+        bool fits(uint64_t body_size) const
+        {
+            return frame_size(body_size) <= size_ / 2;
+        }
+
+        /**
+        Producer: write a frame if there is room for it now.
+        */
+        bool try_write(const FrameHeader& header, const uint8_t* body)
+        {
+            uint64_t head = head_->load(memory_order_relaxed);
+            uint64_t tail = tail_->load(memory_order_acquire);
+            uint64_t size = frame_size(header.body_size);
+            uint64_t remaining = size_ - (head & (size_ - 1));
+            uint64_t padding = remaining < size ? remaining : 0;
+            if (size_ - (head - tail) < padding + size)
+                return false;
+
+            if (padding >= sizeof(FrameHeader))
+            {
+                FrameHeader marker{ 0, wrap_marker, 0 };
+                memcpy(data_ + (head & (size_ - 1)), &marker, sizeof(marker));
+            }
+            head += padding;
+
+            uint8_t* frame = data_ + (head & (size_ - 1));
+            memcpy(frame, &header, sizeof(FrameHeader));
+            if (header.body_size > 0)
+                memcpy(frame + sizeof(FrameHeader), body, header.body_size);
+
+            head_->store(head + size, memory_order_release);
+            return true;
+        }
+
+    private:
+        atomic<uint64_t>* head_;
+        atomic<uint64_t>* tail_;
+        uint8_t* data_;
+        uint64_t size_;
+        uint64_t read_;
+
+        static uint64_t frame_size(uint64_t body_size)
+        {
+            return (sizeof(FrameHeader) + body_size + 7) & ~uint64_t(7);
+        }
+
+        static void check_frame(bool valid)
+        {
+            if (!valid)
+                throw runtime_error("shared memory ring holds an invalid frame");
+        }
+    };
+
+    /**
+    Serves the requests a .NET SharedMemoryServer writes to the request ring, and writes the responses to the
+    response ring. Request bodies are passed to the worker pool in place and released in ring order once their
+    requests completed. Both sides poll; the loop spins briefly and then sleeps for up to a millisecond at a time
+    while there is nothing to do, which is small next to the time taken by a query.
+    */
+    class SharedMemoryTransport
+    {
+    public:
+        SharedMemoryTransport(const Options& options, void* server, void* oprf_key, size_t worker_count)
+            : options_(options)
+        {
+            int fd = open(options.shm_file.c_str(), O_RDWR | O_CLOEXEC);
+            CheckErrno(fd >= 0, "open");
+
+            struct stat file_stat;
+            bool stat_succeeded = 0 == fstat(fd, &file_stat);
+            if (stat_succeeded)
+            {
+                region_size_ = static_cast<uint64_t>(file_stat.st_size);
+                region_ = mmap(nullptr, region_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+            CheckErrno(stat_succeeded, "fstat");
+            CheckErrno(MAP_FAILED != region_, "mmap");
+
+            if (region_size_ < sizeof(SharedRegionHeader))
+                throw invalid_argument("shared memory region is too small");
+
+            header_ = reinterpret_cast<SharedRegionHeader*>(region_);
+            if (header_->magic != shared_region_magic || header_->version != shared_region_version)
+                throw invalid_argument("shared memory region has an unknown layout");
+
+            uint8_t* base = reinterpret_cast<uint8_t*>(region_);
+            requests_ = make_unique<SharedRing>(base, region_size_, header_->request_ring_offset, header_->request_ring_size);
+            responses_ = make_unique<SharedRing>(base, region_size_, header_->response_ring_offset, header_->response_ring_size);
+
+            wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            CheckErrno(wake_fd_ >= 0, "eventfd");
+            workers_ = make_unique<WorkerPool>(server, oprf_key, worker_count, options.max_pending, wake_fd_);
+        }
+
+        ~SharedMemoryTransport()
+        {
+            workers_.reset();
+            header_->worker_state.store(worker_stopped, memory_order_release);
+            close(wake_fd_);
+            munmap(region_, region_size_);
+        }
+
+        void run()
+        {
+            header_->worker_state.store(worker_ready, memory_order_release);
+
+            size_t idle_rounds = 0;
+            while (0 == header_->stop_requested.load(memory_order_acquire))
+            {
+                bool progressed = read_requests();
+                progressed |= collect_completions();
+                progressed |= write_responses();
+
+                if (progressed)
+                {
+                    idle_rounds = 0;
+                    continue;
+                }
+
+                if (++idle_rounds < 64)
+                {
+                    this_thread::yield();
+                    continue;
+                }
+
+                pollfd wake{ wake_fd_, POLLIN, 0 };
+                if (poll(&wake, 1, 1) > 0)
+                {
+                    uint64_t value;
+                    ssize_t count = read(wake_fd_, &value, sizeof(value));
+                    (void)count;
+                }
+            }
+        }
+
+    private:
+        struct InflightRequest
+        {
+            uint64_t end;
+            bool done;
+        };
+
+        const Options& options_;
+        void* region_ = MAP_FAILED;
+        uint64_t region_size_ = 0;
+        SharedRegionHeader* header_ = nullptr;
+        unique_ptr<SharedRing> requests_;
+        unique_ptr<SharedRing> responses_;
+        int wake_fd_ = -1;
+        unique_ptr<WorkerPool> workers_;
+
+        deque<InflightRequest> inflight_;
+        deque<Response> output_;
+
+        bool read_requests()
+        {
+            bool progressed = false;
+            FrameHeader header;
+            const uint8_t* body;
+            uint64_t end;
+            while (inflight_.size() < options_.max_pending && requests_->next(header, body, end))
+            {
+                inflight_.push_back({ end, false });
+
+                Request request{ end, header, {}, body };
+                if (!workers_->submit(move(request)))
+                    workers_->complete(end, header, HRESULT_FROM_WIN32(ERROR_BUSY));
+
+                progressed = true;
+            }
+
+            return progressed;
+        }
+
+        bool collect_completions()
+        {
+            vector<Completion> completions = workers_->take_completions();
+            for (Completion& completion : completions)
+            {
+                for (InflightRequest& request : inflight_)
+                {
+                    if (request.end == completion.connection_id)
+                    {
+                        request.done = true;
+                        break;
+                    }
+                }
+
+                // A response that can never fit in the ring is replaced by an error
+                if (!responses_->fits(completion.response.header.body_size))
+                {
+                    FrameHeader header = completion.response.header;
+                    completion.response = Response();
+                    completion.response.header.request_id = header.request_id;
+                    completion.response.header.code = static_cast<uint32_t>(E_NOT_SUFFICIENT_BUFFER);
+                }
+
+                output_.push_back(move(completion.response));
+            }
+
+            // Request bodies are released in ring order once their requests are done
+            uint64_t released = 0;
+            while (!inflight_.empty() && inflight_.front().done)
+            {
+                released = inflight_.front().end;
+                inflight_.pop_front();
+            }
+            if (released > 0)
+                requests_->release(released);
+
+            return !completions.empty();
+        }
+
+        bool write_responses()
+        {
+            bool progressed = false;
+            while (!output_.empty() && responses_->try_write(output_.front().header, output_.front().body))
+            {
+                output_.pop_front();
+                progressed = true;
+            }
+
+            return progressed;
+        }
+    };
+
+    vector<uint8_t> ReadFile(const string& path)
+    {
+        ifstream file(path, ios::binary);
+        if (!file)
+            throw runtime_error("cannot open " + path);
+
+        return vector<uint8_t>(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    }
+}
+
+int main(int argc, char** argv)
+{
+    pid_t parent = getppid();
+
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    if (!options.shm_file.empty())
+    {
+        // The worker stops with the front end that started it. The signal is sent when the thread that started
+        // the worker exits, not only its process, so the front end must start it from a thread that lives as
+        // long as the worker is needed. A front end that exited before the call is not signalled, in which case
+        // the worker has been reparented already.
+        if (0 != prctl(PR_SET_PDEATHSIG, SIGTERM) || getppid() != parent)
+        {
+            cerr << "Front end exited before the worker started" << endl;
+            return 1;
+        }
+    }
+
+    void* server = nullptr;
+    void* oprf_key = nullptr;
+
+    try
+    {
+        Check(APSI_SetThreads(options.threads), "APSI_SetThreads");
+
+        if (options.mapped)
+            Check(APSIServer_LoadDBMapped(&server, &options.db_file[0]), "APSIServer_LoadDBMapped");
+        else
+            Check(APSIServer_LoadDB2(&server, &options.db_file[0]), "APSIServer_LoadDB2");
+
+        Check(APSIServer_SetResultCompression(server, options.result_compression), "APSIServer_SetResultCompression");
+
+        if (!options.oprf_key_file.empty())
+        {
+            vector<uint8_t> key = ReadFile(options.oprf_key_file);
+            Check(OPRFKey_Create(&oprf_key), "OPRFKey_Create");
+            Check(OPRFKey_Load(oprf_key, key.size(), key.data()), "OPRFKey_Load");
+        }
+
+        // Each query is evaluated on the APSI thread pool, so by default there is one worker per APSI
+        // thread; further requests wait in the pending queue
+        size_t worker_count = options.workers;
+        if (0 == worker_count)
+            worker_count = options.threads > 0 ? options.threads : max(thread::hardware_concurrency(), 1u);
+
+        if (!options.shm_file.empty())
+        {
+            SharedMemoryTransport transport(options, server, oprf_key, worker_count);
+            transport.run();
+        }
+        else
+        {
+            EventLoop loop(options, server, oprf_key, worker_count);
+            cout << "Listening on " << options.socket_path << " with " << worker_count << " workers" << endl;
+            loop.run();
+        }
+    }
+    catch (const exception& ex)
+    {
+        cerr << "Server failed: " << ex.what() << endl;
+        return 1;
+    }
+
+    if (nullptr != oprf_key)
+        OPRFKey_Destroy(oprf_key);
+    if (nullptr != server)
+        APSIServer_Destroy(server);
+
+    return 0;
+}
@@ -6,22 +6,43 @@
 #include "apsiservernative.h"
 
 // STD
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <list>
+#include <memory>
 #include <thread>
 #include <vector>
 #include <sstream>
 #include <mutex>
 #include <fstream>
+#include <functional>
+#include <future>
+#include <unordered_map>
 #include <unordered_set>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // APSI
 #include "apsi/item.h"
 #include "apsi/sender.h"
 #include "apsi/network/stream_channel.h"
 #include "apsi/log.h"
 #include "apsi/oprf/oprf_sender.h"
+#include "apsi/thread_pool_mgr.h"
 
 // SEAL
+#include "seal/ciphertext.h"
 #include "seal/relinkeys.h"
+#include "seal/serialization.h"
 #include "seal/randomgen.h"
 #include "seal/util/streambuf.h"
 
@@ -39,6 +60,762 @@ static int server_instance_count_s = 0;
 
 
 namespace {
+    /**
+    Relinearization keys registered by clients, keyed by a session token that the cache issues. Tokens are
+    random, so a client can only use or replace the keys of a session it was given the token of.
+
+    Entries expire when they have not been used for the configured time to live, and the least
+    recently used entries are evicted when the total size of the cached keys exceeds the budget.
+    */
+    class RelinKeysCache
+    {
+    public:
+        void set_limits(size_t max_bytes, chrono::seconds ttl)
+        {
+            lock_guard<mutex> lock(mutex_);
+            max_bytes_ = max_bytes;
+            ttl_ = ttl;
+            evict(chrono::steady_clock::now());
+        }
+
+        /**
+        Register keys and return the token of their session. Keys registered with the token of a cached session
+        replace the keys of that session; otherwise a new token is issued.
+        */
+        uint64_t put(uint64_t session_id, const RelinKeys& relin_keys)
+        {
+            auto keys = make_shared<const RelinKeys>(relin_keys);
+            size_t size = static_cast<size_t>(keys->save_size(compr_mode_type::none));
+
+            lock_guard<mutex> lock(mutex_);
+            if (entries_.count(session_id) > 0)
+            {
+                remove_entry(session_id);
+            }
+            else
+            {
+                // Zero is never issued, so it can stand for no session
+                do
+                {
+                    session_id = random_uint64();
+                } while (0 == session_id || entries_.count(session_id) > 0);
+            }
+
+            auto now = chrono::steady_clock::now();
+            lru_.push_front({ session_id, move(keys), size, now + ttl_ });
+            entries_[session_id] = lru_.begin();
+            total_bytes_ += size;
+            evict(now);
+            return session_id;
+        }
+
+        shared_ptr<const RelinKeys> get(uint64_t session_id)
+        {
+            lock_guard<mutex> lock(mutex_);
+            auto now = chrono::steady_clock::now();
+            evict(now);
+
+            auto it = entries_.find(session_id);
+            if (it == entries_.end())
+                return nullptr;
+
+            // Move to the front of the LRU list and extend the lifetime of the entry
+            lru_.splice(lru_.begin(), lru_, it->second);
+            it->second->expires = now + ttl_;
+            return it->second->keys;
+        }
+
+        void remove(uint64_t session_id)
+        {
+            lock_guard<mutex> lock(mutex_);
+            remove_entry(session_id);
+        }
+
+    private:
+        struct Entry
+        {
+            uint64_t session_id;
+            shared_ptr<const RelinKeys> keys;
+            size_t size;
+            chrono::steady_clock::time_point expires;
+        };
+
+        void remove_entry(uint64_t session_id)
+        {
+            auto it = entries_.find(session_id);
+            if (it == entries_.end())
+                return;
+
+            total_bytes_ -= it->second->size;
+            lru_.erase(it->second);
+            entries_.erase(it);
+        }
+
+        void evict(chrono::steady_clock::time_point now)
+        {
+            // Expired entries can be anywhere in the list, since the time to live can change
+            for (auto it = lru_.begin(); it != lru_.end();)
+            {
+                auto current = it++;
+                if (current->expires <= now)
+                    remove_entry(current->session_id);
+            }
+
+            while (total_bytes_ > max_bytes_ && !lru_.empty())
+            {
+                remove_entry(lru_.back().session_id);
+            }
+        }
+
+        mutex mutex_;
+        list<Entry> lru_;
+        unordered_map<uint64_t, list<Entry>::iterator> entries_;
+        size_t total_bytes_ = 0;
+        size_t max_bytes_ = size_t(256) * 1024 * 1024;
+        chrono::seconds ttl_ = chrono::minutes(10);
+    };
+
+    /**
+    Chunked construction of a new SenderDB. Chunks are collected into batches, and every full batch is
+    inserted into the database by a background task while the next one is filled, so OPRF hashing and
+    binning overlap with reading the data. At most two batches are held in memory at any time.
+    */
+    class Ingestion
+    {
+    public:
+        Ingestion(shared_ptr<SenderDB> sender_db, size_t batch_size, bool updatable)
+            : sender_db_(move(sender_db)), batch_size_(max<size_t>(batch_size, 1)), updatable_(updatable)
+        {}
+
+        ~Ingestion()
+        {
+            if (pending_.valid())
+                pending_.wait();
+        }
+
+        bool is_labeled() const
+        {
+            return sender_db_->is_labeled();
+        }
+
+        size_t get_label_byte_count() const
+        {
+            return sender_db_->get_label_byte_count();
+        }
+
+        void append(vector<Item>&& items)
+        {
+            lock_guard<mutex> lock(mutex_);
+            move(items.begin(), items.end(), back_inserter(items_));
+            if (items_.size() >= batch_size_)
+            {
+                flush();
+            }
+        }
+
+        void append(vector<pair<Item, Label>>&& items)
+        {
+            lock_guard<mutex> lock(mutex_);
+            move(items.begin(), items.end(), back_inserter(labeled_items_));
+            if (labeled_items_.size() >= batch_size_)
+            {
+                flush();
+            }
+        }
+
+        /**
+        Insert the remaining items and return the finished database.
+        */
+        shared_ptr<SenderDB> finalize()
+        {
+            lock_guard<mutex> lock(mutex_);
+            flush();
+            wait_pending();
+
+            // A stripped DB is smaller, but cannot be modified anymore
+            if (!updatable_)
+            {
+                sender_db_->strip();
+            }
+
+            return sender_db_;
+        }
+
+    private:
+        shared_ptr<SenderDB> sender_db_;
+        size_t batch_size_;
+        bool updatable_;
+
+        mutex mutex_;
+        vector<Item> items_;
+        vector<pair<Item, Label>> labeled_items_;
+        future<void> pending_;
+        exception_ptr error_;
+
+        void wait_pending()
+        {
+            // Once a batch has failed the database is incomplete, so every later call fails too
+            if (pending_.valid())
+            {
+                try
+                {
+                    pending_.get();
+                }
+                catch (...)
+                {
+                    error_ = current_exception();
+                }
+            }
+
+            if (error_)
+                rethrow_exception(error_);
+        }
+
+        void flush()
+        {
+            // Appending threads wait here while the previous batch is still being inserted
+            wait_pending();
+            if (items_.empty() && labeled_items_.empty())
+                return;
+
+            pending_ = async(launch::async, [sender_db = sender_db_, items = move(items_), labeled_items = move(labeled_items_)]() {
+                if (!items.empty())
+                    sender_db->insert_or_assign(items);
+                if (!labeled_items.empty())
+                    sender_db->insert_or_assign(labeled_items);
+            });
+
+            items_.clear();
+            labeled_items_.clear();
+        }
+    };
+
+    /**
+    Histogram of durations with buckets of powers of two microseconds. Recording is lock free.
+    */
+    class LatencyHistogram
+    {
+    public:
+        void record(chrono::steady_clock::duration duration)
+        {
+            uint64_t us = static_cast<uint64_t>(max<int64_t>(chrono::duration_cast<chrono::microseconds>(duration).count(), 0));
+
+            // Bucket i holds durations of at least 2^(i - 1) and less than 2^i microseconds
+            size_t bucket = 0;
+            while (bucket + 1 < APSI_METRICS_BUCKET_COUNT && (us >> bucket) > 0)
+            {
+                bucket++;
+            }
+
+            buckets_[bucket].fetch_add(1, memory_order_relaxed);
+            total_us_.fetch_add(us, memory_order_relaxed);
+            count_.fetch_add(1, memory_order_relaxed);
+        }
+
+        void snapshot(APSIServerLatencyHistogram& histogram) const
+        {
+            histogram.count = count_.load(memory_order_relaxed);
+            histogram.total_us = total_us_.load(memory_order_relaxed);
+            for (size_t i = 0; i < APSI_METRICS_BUCKET_COUNT; i++)
+            {
+                histogram.buckets[i] = buckets_[i].load(memory_order_relaxed);
+            }
+        }
+
+    private:
+        atomic<uint64_t> count_{ 0 };
+        atomic<uint64_t> total_us_{ 0 };
+        atomic<uint64_t> buckets_[APSI_METRICS_BUCKET_COUNT] = {};
+    };
+
+    /**
+    Traffic with one compression mode. Recording is lock free.
+    */
+    class CompressionCounters
+    {
+    public:
+        void record_query(uint64_t bytes, chrono::steady_clock::duration deserialize)
+        {
+            query_count_.fetch_add(1, memory_order_relaxed);
+            query_bytes_.fetch_add(bytes, memory_order_relaxed);
+            deserialize_us_.fetch_add(to_us(deserialize), memory_order_relaxed);
+        }
+
+        void record_response(uint64_t bytes)
+        {
+            response_count_.fetch_add(1, memory_order_relaxed);
+            response_bytes_.fetch_add(bytes, memory_order_relaxed);
+        }
+
+        void record_serialize(chrono::steady_clock::duration serialize)
+        {
+            serialize_us_.fetch_add(to_us(serialize), memory_order_relaxed);
+        }
+
+        void snapshot(APSIServerCompressionMetrics& metrics) const
+        {
+            metrics.query_count = query_count_.load(memory_order_relaxed);
+            metrics.query_bytes = query_bytes_.load(memory_order_relaxed);
+            metrics.deserialize_us = deserialize_us_.load(memory_order_relaxed);
+            metrics.response_count = response_count_.load(memory_order_relaxed);
+            metrics.response_bytes = response_bytes_.load(memory_order_relaxed);
+            metrics.serialize_us = serialize_us_.load(memory_order_relaxed);
+        }
+
+    private:
+        atomic<uint64_t> query_count_{ 0 };
+        atomic<uint64_t> query_bytes_{ 0 };
+        atomic<uint64_t> deserialize_us_{ 0 };
+        atomic<uint64_t> response_count_{ 0 };
+        atomic<uint64_t> response_bytes_{ 0 };
+        atomic<uint64_t> serialize_us_{ 0 };
+
+        static uint64_t to_us(chrono::steady_clock::duration duration)
+        {
+            return static_cast<uint64_t>(max<int64_t>(chrono::duration_cast<chrono::microseconds>(duration).count(), 0));
+        }
+    };
+
+    /**
+    Counters and latency histograms of the queries run by a server.
+    */
+    class ServerMetrics
+    {
+    public:
+        /**
+        Records one query from its start to its end. Phases are timed back to back, each one from the end
+        of the previous one; serialization runs within evaluation on the worker threads and is timed apart.
+        */
+        class QueryScope
+        {
+        public:
+            QueryScope(ServerMetrics& metrics, uint64_t bytes_in)
+                : metrics_(metrics), start_(chrono::steady_clock::now()), phase_start_(start_), bytes_in_(bytes_in)
+            {
+                metrics_.bytes_in_.fetch_add(bytes_in, memory_order_relaxed);
+                metrics_.begin_query(start_);
+            }
+
+            ~QueryScope()
+            {
+                auto end = chrono::steady_clock::now();
+                if (succeeded_)
+                {
+                    metrics_.total_.record(end - start_);
+                    metrics_.queries_completed_.fetch_add(1, memory_order_relaxed);
+                }
+                else
+                {
+                    metrics_.queries_failed_.fetch_add(1, memory_order_relaxed);
+                }
+
+                metrics_.end_query(end);
+            }
+
+            /**
+            Set the compression of the query and of its response, once the query is parsed.
+            */
+            void set_compression(compr_mode_type query_compr_mode, compr_mode_type response_compr_mode)
+            {
+                query_compression_ = metrics_.compression(query_compr_mode);
+                response_compression_ = metrics_.compression(response_compr_mode);
+            }
+
+            void end_deserialize()
+            {
+                deserialize_ = end_phase(metrics_.deserialize_);
+            }
+
+            void end_evaluate()
+            {
+                end_phase(metrics_.evaluate_);
+            }
+
+            /**
+            Run the given function, which serializes part of the response, and record its duration.
+            */
+            template<typename Fun>
+            void serialize(Fun&& fun)
+            {
+                auto start = chrono::steady_clock::now();
+                fun();
+                auto duration = chrono::steady_clock::now() - start;
+                metrics_.serialize_.record(duration);
+                if (nullptr != response_compression_)
+                    response_compression_->record_serialize(duration);
+            }
+
+            void succeed(uint64_t bytes_out)
+            {
+                metrics_.bytes_out_.fetch_add(bytes_out, memory_order_relaxed);
+                if (nullptr != query_compression_)
+                    query_compression_->record_query(bytes_in_, deserialize_);
+                if (nullptr != response_compression_)
+                    response_compression_->record_response(bytes_out);
+                succeeded_ = true;
+            }
+
+        private:
+            ServerMetrics& metrics_;
+            chrono::steady_clock::time_point start_;
+            chrono::steady_clock::time_point phase_start_;
+            uint64_t bytes_in_;
+            chrono::steady_clock::duration deserialize_{ 0 };
+            CompressionCounters* query_compression_ = nullptr;
+            CompressionCounters* response_compression_ = nullptr;
+            bool succeeded_ = false;
+
+            chrono::steady_clock::duration end_phase(LatencyHistogram& histogram)
+            {
+                auto now = chrono::steady_clock::now();
+                auto duration = now - phase_start_;
+                histogram.record(duration);
+                phase_start_ = now;
+                return duration;
+            }
+        };
+
+        ServerMetrics()
+            : created_(chrono::steady_clock::now())
+        {}
+
+        void snapshot(APSIServerMetrics& metrics) const
+        {
+            auto now = chrono::steady_clock::now();
+            metrics.uptime_us = static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(now - created_).count());
+            metrics.queries_completed = queries_completed_.load(memory_order_relaxed);
+            metrics.queries_failed = queries_failed_.load(memory_order_relaxed);
+            metrics.bytes_in = bytes_in_.load(memory_order_relaxed);
+            metrics.bytes_out = bytes_out_.load(memory_order_relaxed);
+
+            {
+                lock_guard<mutex> lock(busy_mutex_);
+                metrics.active_queries = active_queries_;
+                auto busy = busy_;
+                if (active_queries_ > 0)
+                    busy += now - busy_since_;
+                metrics.busy_us = static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(busy).count());
+            }
+
+            deserialize_.snapshot(metrics.deserialize);
+            evaluate_.snapshot(metrics.evaluate);
+            serialize_.snapshot(metrics.serialize);
+            total_.snapshot(metrics.total);
+
+            for (size_t i = 0; i < APSI_COMPRESSION_MODE_COUNT; i++)
+            {
+                compression_[i].snapshot(metrics.compression[i]);
+            }
+        }
+
+    private:
+        chrono::steady_clock::time_point created_;
+        atomic<uint64_t> queries_completed_{ 0 };
+        atomic<uint64_t> queries_failed_{ 0 };
+        atomic<uint64_t> bytes_in_{ 0 };
+        atomic<uint64_t> bytes_out_{ 0 };
+        LatencyHistogram deserialize_;
+        LatencyHistogram evaluate_;
+        LatencyHistogram serialize_;
+        LatencyHistogram total_;
+        CompressionCounters compression_[APSI_COMPRESSION_MODE_COUNT];
+
+        // Time during which at least one query was running
+        mutable mutex busy_mutex_;
+        uint64_t active_queries_ = 0;
+        chrono::steady_clock::time_point busy_since_;
+        chrono::steady_clock::duration busy_{ 0 };
+
+        /**
+        Counters of the given compression mode, or nullptr for a mode that is not known.
+        */
+        CompressionCounters* compression(compr_mode_type compr_mode)
+        {
+            size_t index = static_cast<size_t>(compr_mode);
+            return index < APSI_COMPRESSION_MODE_COUNT ? &compression_[index] : nullptr;
+        }
+
+        void begin_query(chrono::steady_clock::time_point now)
+        {
+            lock_guard<mutex> lock(busy_mutex_);
+            if (0 == active_queries_++)
+                busy_since_ = now;
+        }
+
+        void end_query(chrono::steady_clock::time_point now)
+        {
+            lock_guard<mutex> lock(busy_mutex_);
+            if (0 == --active_queries_)
+                busy_ += now - busy_since_;
+        }
+    };
+
+    /**
+    Limits the queries a server runs at the same time, by their number and by their total estimated cost.
+
+    A query that does not fit within the limits waits in a first-in first-out queue. It is rejected right away
+    when the queue is full, and after waiting longer than the queue timeout. A query whose cost alone exceeds
+    the cost budget runs once no other query is running. A limit on the running queries or their cost, or a
+    queue timeout, of 0 means no limit.
+    */
+    class AdmissionControl
+    {
+    public:
+        /**
+        Holds the resources of an admitted query, and gives them back when it is destroyed.
+        */
+        class Ticket
+        {
+        public:
+            Ticket() = default;
+
+            Ticket(Ticket&& other) noexcept
+                : owner_(other.owner_), cost_(other.cost_)
+            {
+                other.owner_ = nullptr;
+            }
+
+            Ticket& operator=(Ticket&& other) noexcept
+            {
+                swap(owner_, other.owner_);
+                swap(cost_, other.cost_);
+                return *this;
+            }
+
+            ~Ticket()
+            {
+                if (nullptr != owner_)
+                    owner_->release(cost_);
+            }
+
+        private:
+            friend class AdmissionControl;
+
+            AdmissionControl* owner_ = nullptr;
+            uint64_t cost_ = 0;
+        };
+
+        void set_limits(uint64_t max_queries, uint64_t max_cost, uint64_t max_queued_queries, uint64_t queue_timeout_ms)
+        {
+            {
+                lock_guard<mutex> lock(mutex_);
+                max_queries_ = max_queries;
+                max_cost_ = max_cost;
+                max_queued_queries_ = max_queued_queries;
+                queue_timeout_ = chrono::milliseconds(queue_timeout_ms);
+            }
+
+            // Queued queries may fit within the new limits
+            admitted_.notify_all();
+        }
+
+        /**
+        Wait until a query of the given cost can run. Returns HRESULT_FROM_WIN32(ERROR_BUSY) when the query
+        is rejected because the queue is full, and HRESULT_FROM_WIN32(ERROR_TIMEOUT) when it waited too long.
+        */
+        HRESULT admit(uint64_t cost, Ticket& ticket)
+        {
+            return admit(cost, ticket, chrono::steady_clock::time_point::max(), []() { return S_OK; });
+        }
+
+        /**
+        Same as above for a query that stops waiting in the queue once check returns a failure, which is then
+        returned. check is called when the query starts to wait, whenever waiting queries are woken up with
+        wake_waiting, and once the given deadline passes.
+        */
+        HRESULT admit(uint64_t cost, Ticket& ticket, chrono::steady_clock::time_point deadline, const function<HRESULT()>& check)
+        {
+            unique_lock<mutex> lock(mutex_);
+
+            if (!queue_.empty() || !fits(cost))
+            {
+                if (queue_.size() >= max_queued_queries_)
+                {
+                    rejected_queries_++;
+                    return HRESULT_FROM_WIN32(ERROR_BUSY);
+                }
+
+                auto position = queue_.insert(queue_.end(), cost);
+                auto can_run = [&]() { return queue_.begin() == position && fits(cost); };
+
+                chrono::steady_clock::time_point queue_deadline = chrono::steady_clock::time_point::max();
+                if (queue_timeout_.count() > 0)
+                    queue_deadline = chrono::steady_clock::now() + queue_timeout_;
+
+                HRESULT hr = S_OK;
+                while (!can_run())
+                {
+                    hr = check();
+                    if (FAILED(hr))
+                        break;
+
+                    chrono::steady_clock::time_point wait_deadline = min(deadline, queue_deadline);
+                    if (chrono::steady_clock::time_point::max() == wait_deadline)
+                    {
+                        admitted_.wait(lock);
+                    }
+                    else if (cv_status::timeout == admitted_.wait_until(lock, wait_deadline) && !can_run())
+                    {
+                        hr = check();
+                        if (SUCCEEDED(hr) && chrono::steady_clock::now() >= queue_deadline)
+                        {
+                            rejected_queries_++;
+                            hr = HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+                        }
+
+                        if (FAILED(hr))
+                            break;
+                    }
+                }
+
+                queue_.erase(position);
+
+                // The next query in the queue may fit as well, or may now be first
+                admitted_.notify_all();
+
+                if (FAILED(hr))
+                    return hr;
+            }
+
+            running_queries_++;
+            running_cost_ += cost;
+
+            ticket = Ticket();
+            ticket.owner_ = this;
+            ticket.cost_ = cost;
+            return S_OK;
+        }
+
+        /**
+        Wake up the waiting queries so that they check whether they should stop waiting.
+        */
+        void wake_waiting()
+        {
+            lock_guard<mutex> lock(mutex_);
+            admitted_.notify_all();
+        }
+
+        void snapshot(APSIServerMetrics& metrics)
+        {
+            lock_guard<mutex> lock(mutex_);
+            metrics.queued_queries = queue_.size();
+            metrics.queries_rejected = rejected_queries_;
+        }
+
+    private:
+        mutex mutex_;
+        condition_variable admitted_;
+        list<uint64_t> queue_;
+        uint64_t running_queries_ = 0;
+        uint64_t running_cost_ = 0;
+        uint64_t rejected_queries_ = 0;
+        uint64_t max_queries_ = 0;
+        uint64_t max_cost_ = 0;
+        uint64_t max_queued_queries_ = numeric_limits<uint64_t>::max();
+        chrono::milliseconds queue_timeout_{ 0 };
+
+        bool fits(uint64_t cost) const
+        {
+            if (0 != max_queries_ && running_queries_ >= max_queries_)
+                return false;
+
+            return 0 == max_cost_ || 0 == running_queries_ || running_cost_ + cost <= max_cost_;
+        }
+
+        void release(uint64_t cost)
+        {
+            {
+                lock_guard<mutex> lock(mutex_);
+                running_queries_--;
+                running_cost_ -= cost;
+            }
+
+            admitted_.notify_all();
+        }
+    };
+
+    /**
+    Fixed set of threads that run the submitted tasks in order. The destructor waits until all tasks submitted
+    before have run, so a task must not destroy the owner of the pool.
+    */
+    class WorkerPool
+    {
+    public:
+        WorkerPool(size_t thread_count)
+        {
+            for (size_t i = 0; i < thread_count; i++)
+            {
+                try
+                {
+                    threads_.emplace_back([this]() { run(); });
+                }
+                catch (const std::system_error& ex)
+                {
+                    if (threads_.empty())
+                        throw;
+
+                    APSI_LOG_WARNING("WorkerPool: could not start worker: " << ex.what());
+                    break;
+                }
+            }
+        }
+
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        ~WorkerPool()
+        {
+            {
+                lock_guard<mutex> lock(mutex_);
+                stopping_ = true;
+            }
+
+            task_available_.notify_all();
+            for (auto& worker : threads_)
+            {
+                worker.join();
+            }
+        }
+
+        void submit(function<void()> task)
+        {
+            {
+                lock_guard<mutex> lock(mutex_);
+                tasks_.push_back(move(task));
+            }
+
+            task_available_.notify_one();
+        }
+
+    private:
+        mutex mutex_;
+        condition_variable task_available_;
+        deque<function<void()>> tasks_;
+        bool stopping_ = false;
+        vector<thread> threads_;
+
+        void run()
+        {
+            while (true)
+            {
+                function<void()> task;
+                {
+                    unique_lock<mutex> lock(mutex_);
+                    task_available_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+
+                    // Stop only once the queue is drained
+                    if (tasks_.empty())
+                        return;
+
+                    task = move(tasks_.front());
+                    tasks_.pop_front();
+                }
+
+                task();
+            }
+        }
+    };
+
     class APSIServer
     {
     public:
@@ -51,195 +828,2389 @@ namespace {
         {}
 
     public:
-        void create_sender_db()
+        /**
+        Create an empty database without replacing the current one. Servers loaded from a
+        saved database have no OPRF key and parameters, and cannot create new databases.
+        */
+        shared_ptr<SenderDB> new_sender_db(size_t label_byte_count = 0) const
         {
-            sender_db_ = make_shared<SenderDB>(*params_, *oprf_key_, /* label_byte_count */ 0, /* nonce_byte_count */ 16, /* compressed */ true);
+            if (nullptr == params_ || nullptr == oprf_key_)
+                return nullptr;
+
+            return make_shared<SenderDB>(*params_, *oprf_key_, label_byte_count, /* nonce_byte_count */ 16, /* compressed */ true);
         }
 
-        shared_ptr<SenderDB> get_sender_db()
+        /**
+        Replace the database atomically. Queries that already hold the previous database finish
+        on it, and it is freed when the last of them releases it.
+        */
+        void set_sender_db(shared_ptr<SenderDB> sender_db)
         {
-            return sender_db_;
+            atomic_store(&sender_db_, move(sender_db));
+        }
+
+        shared_ptr<SenderDB> get_sender_db() const
+        {
+            return atomic_load(&sender_db_);
+        }
+
+        /**
+        Exchange the databases of two servers. Each server switches atomically.
+        */
+        void swap_sender_db(APSIServer& other)
+        {
+            auto sender_db = get_sender_db();
+            set_sender_db(other.get_sender_db());
+            other.set_sender_db(move(sender_db));
+        }
+
+        RelinKeysCache& relin_keys_cache()
+        {
+            return relin_keys_cache_;
+        }
+
+        unique_ptr<Ingestion>& ingestion()
+        {
+            return ingestion_;
+        }
+
+        /**
+        Asynchronous queries share the admission control and the metrics, so they outlive the server while
+        the queries run.
+        */
+        const shared_ptr<AdmissionControl>& admission_control() const
+        {
+            return admission_control_;
+        }
+
+        const shared_ptr<ServerMetrics>& metrics() const
+        {
+            return metrics_;
+        }
+
+        /**
+        Workers of the asynchronous queries, one per hardware thread, started with the first query. They are
+        stopped before the rest of the server is destroyed, once the queries that were started have completed.
+        */
+        WorkerPool& async_workers()
+        {
+            lock_guard<mutex> lock(async_workers_mutex_);
+            if (nullptr == async_workers_)
+                async_workers_ = make_unique<WorkerPool>(max<size_t>(thread::hardware_concurrency(), 1));
+
+            return *async_workers_;
+        }
+
+        /**
+        Compression of the responses, or APSI_COMPRESSION_AS_REQUESTED to compress them like their queries.
+        */
+        int result_compression() const
+        {
+            return result_compression_.load(memory_order_relaxed);
+        }
+
+        void set_result_compression(int compr_mode)
+        {
+            result_compression_.store(compr_mode, memory_order_relaxed);
         }
 
         void save(ostream& stream)
         {
             // Save basic data
-            sender_db_->save(stream);
+            get_sender_db()->save(stream);
         }
 
         static APSIServer* Load(istream& stream)
         {
             APSIServer* server = new APSIServer();
-            server->sender_db_ = make_shared<SenderDB>(SenderDB::Load(stream).first);
+            server->sender_db_ = LoadSenderDB(stream);
+            return server;
+        }
+
+        static APSIServer* Load(shared_ptr<SenderDB> sender_db)
+        {
+            APSIServer* server = new APSIServer();
+            server->sender_db_ = move(sender_db);
             return server;
         }
 
+        static shared_ptr<SenderDB> LoadSenderDB(istream& stream)
+        {
+            return make_shared<SenderDB>(SenderDB::Load(stream).first);
+        }
+
     private:
         shared_ptr<SenderDB> sender_db_;
         shared_ptr<OPRFKey> oprf_key_;
         shared_ptr<PSIParams> params_;
+        RelinKeysCache relin_keys_cache_;
+        unique_ptr<Ingestion> ingestion_;
+        shared_ptr<AdmissionControl> admission_control_ = make_shared<AdmissionControl>();
+        shared_ptr<ServerMetrics> metrics_ = make_shared<ServerMetrics>();
+        atomic<int> result_compression_{ APSI_COMPRESSION_AS_REQUESTED };
+
+        // Declared last so that it is destroyed first
+        mutex async_workers_mutex_;
+        unique_ptr<WorkerPool> async_workers_;
     };
 
-    void copy_bytes(void* dst, const void* src, size_t count)
+    /**
+    A database split into shards, each held by its own APSIServer. Every item belongs to exactly
+    one shard, chosen by a hash of its value, and queries are run against all shards.
+    */
+    class ShardedServer
+    {
+    public:
+        ShardedServer(OPRFKey* oprf_key, PSIParams* params, size_t shard_count)
+        {
+            for (size_t i = 0; i < shard_count; i++)
+            {
+                shards_.push_back(make_unique<APSIServer>(oprf_key, params));
+            }
+        }
+
+        ShardedServer(vector<unique_ptr<APSIServer>> shards) : shards_(move(shards))
+        {}
+
+        size_t shard_count() const
+        {
+            return shards_.size();
+        }
+
+        APSIServer& shard(size_t index)
+        {
+            return *shards_[index];
+        }
+
+        /**
+        Returns the databases of all shards, or an empty vector if any shard has no data yet.
+        */
+        vector<shared_ptr<SenderDB>> get_sender_dbs()
+        {
+            vector<shared_ptr<SenderDB>> sender_dbs;
+            for (auto& shard : shards_)
+            {
+                auto sender_db = shard->get_sender_db();
+                if (nullptr == sender_db)
+                    return {};
+
+                sender_dbs.push_back(move(sender_db));
+            }
+
+            return sender_dbs;
+        }
+
+        /**
+        Shard of an item. This must stay the same across builds, as shards may be built and saved separately.
+        */
+        static size_t shard_index(const uint64_t* item, size_t shard_count)
+        {
+            // SplitMix64 finalizer over both halves of the item
+            uint64_t x = item[0] ^ (item[1] * 0x9E3779B97F4A7C15ULL);
+            x ^= x >> 30;
+            x *= 0xBF58476D1CE4E5B9ULL;
+            x ^= x >> 27;
+            x *= 0x94D049BB133111EBULL;
+            x ^= x >> 31;
+            return static_cast<size_t>(x % shard_count);
+        }
+
+    private:
+        vector<unique_ptr<APSIServer>> shards_;
+    };
+
+    /**
+    Read-only memory mapping of a whole file.
+    */
+    class MappedFile
+    {
+    public:
+        MappedFile(const char* file_path)
+        {
+#ifdef _WIN32
+            file_ = CreateFileA(file_path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (INVALID_HANDLE_VALUE == file_)
+                throw runtime_error("failed to open file");
+
+            LARGE_INTEGER file_size;
+            if (!GetFileSizeEx(file_, &file_size) || 0 == file_size.QuadPart)
+            {
+                close();
+                throw runtime_error("failed to get file size or file is empty");
+            }
+            size_ = static_cast<size_t>(file_size.QuadPart);
+
+            mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (nullptr == mapping_)
+            {
+                close();
+                throw runtime_error("failed to create file mapping");
+            }
+
+            data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+            if (nullptr == data_)
+            {
+                close();
+                throw runtime_error("failed to map file");
+            }
+#else
+            fd_ = open(file_path, O_RDONLY);
+            if (fd_ < 0)
+                throw runtime_error("failed to open file");
+
+            struct stat file_stat;
+            if (fstat(fd_, &file_stat) != 0 || 0 == file_stat.st_size)
+            {
+                close();
+                throw runtime_error("failed to get file size or file is empty");
+            }
+            size_ = static_cast<size_t>(file_stat.st_size);
+
+            data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+            if (MAP_FAILED == data_)
+            {
+                data_ = nullptr;
+                close();
+                throw runtime_error("failed to map file");
+            }
+
+            // The DB is read once from start to end
+            madvise(data_, size_, MADV_SEQUENTIAL);
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile()
+        {
+            close();
+        }
+
+        const char* data() const
+        {
+            return reinterpret_cast<const char*>(data_);
+        }
+
+        size_t size() const
+        {
+            return size_;
+        }
+
+    private:
+        void* data_ = nullptr;
+        size_t size_ = 0;
+
+#ifdef _WIN32
+        HANDLE file_ = INVALID_HANDLE_VALUE;
+        HANDLE mapping_ = nullptr;
+
+        void close()
+        {
+            if (nullptr != data_)
+                UnmapViewOfFile(data_);
+            if (nullptr != mapping_)
+                CloseHandle(mapping_);
+            if (INVALID_HANDLE_VALUE != file_)
+                CloseHandle(file_);
+
+            data_ = nullptr;
+            mapping_ = nullptr;
+            file_ = INVALID_HANDLE_VALUE;
+        }
+#else
+        int fd_ = -1;
+
+        void close()
+        {
+            if (nullptr != data_)
+                munmap(data_, size_);
+            if (fd_ >= 0)
+                ::close(fd_);
+
+            data_ = nullptr;
+            fd_ = -1;
+        }
+#endif
+    };
+
+    /**
+    Load a saved database, optionally deserializing it straight from a memory mapping of the file. SenderDB::Load
+    copies everything it reads onto the heap, so the mapping is closed as soon as the database is loaded; mapping
+    only saves the copy through the ifstream buffer.
+    */
+    shared_ptr<SenderDB> load_sender_db(const char* file_path, bool memory_mapped)
+    {
+        if (memory_mapped)
+        {
+            MappedFile file(file_path);
+            ArrayGetBuffer agbuf(file.data(), static_cast<streamsize>(file.size()));
+            istream db_stream(&agbuf);
+            return APSIServer::LoadSenderDB(db_stream);
+        }
+
+        ifstream input(file_path, ios::binary | ios::in);
+        input.exceptions(ios::badbit | ios::failbit);
+        return APSIServer::LoadSenderDB(input);
+    }
+
+    /**
+    Estimate the cost of running queries for item_count items against a database, in plaintext-ciphertext
+    multiplications.
+
+    Every query covers the whole hash table of the receiver, so its cost does not depend on how many items it
+    holds; more items than the table has room for take several queries. Each query computes the powers of its
+    ciphertexts for every bundle index, and then evaluates the matching and label polynomials of every bin
+    bundle, each of which has one coefficient more than the maximum number of items per bin.
+    */
+    uint64_t estimate_query_cost(const SenderDB& sender_db, uint64_t item_count)
+    {
+        // A relinearized ciphertext multiplication costs about this many plaintext multiplications
+        constexpr uint64_t ciphertext_multiply_cost = 16;
+
+        const PSIParams& params = sender_db.get_params();
+        uint64_t table_size = params.table_params().table_size;
+        uint64_t query_count = max<uint64_t>((item_count + table_size - 1) / table_size, 1);
+
+        uint64_t polynomial_count = 1;
+        if (sender_db.is_labeled())
+        {
+            // Labels are encrypted together with a nonce and split into parts of the size of an item
+            uint64_t label_bit_count = (sender_db.get_label_byte_count() + sender_db.get_nonce_byte_count()) * 8;
+            polynomial_count += (label_bit_count + params.item_bit_count() - 1) / params.item_bit_count();
+        }
+
+        uint64_t degree = params.table_params().max_items_per_bin;
+        uint64_t powers_cost = uint64_t(params.bundle_idx_count()) * degree * ciphertext_multiply_cost;
+        uint64_t evaluation_cost = uint64_t(sender_db.get_bin_bundle_count()) * polynomial_count * (degree + 1);
+
+        return query_count * (powers_cost + evaluation_cost);
+    }
+
+    vector<Item> to_apsi_items(uint64_t count, const uint64_t* data)
+    {
+        vector<Item> apsidata(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t idx = i * 2;
+            auto apsidata64 = apsidata[i].get_as<uint64_t>();
+            apsidata64[0] = data[idx];
+            apsidata64[1] = data[idx + 1];
+        }
+
+        return apsidata;
+    }
+
+    vector<pair<Item, Label>> to_apsi_labeled_items(uint64_t count, const uint64_t* data, uint64_t label_byte_count, const uint8_t* labels)
+    {
+        vector<pair<Item, Label>> apsidata(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t idx = i * 2;
+            auto apsidata64 = apsidata[i].first.get_as<uint64_t>();
+            apsidata64[0] = data[idx];
+            apsidata64[1] = data[idx + 1];
+
+            const uint8_t* label = labels + i * label_byte_count;
+            apsidata[i].second.assign(label, label + label_byte_count);
+        }
+
+        return apsidata;
+    }
+
+    void copy_bytes(void* dst, const void* src, size_t count)
+    {
+        if (!count) {
+            return;
+        }
+        if (!src) {
+            throw invalid_argument("cannot copy data: source is null");
+        }
+        if (!dst) {
+            throw invalid_argument("cannot copy data: destination is null");
+        }
+        copy_n(
+            reinterpret_cast<const unsigned char*>(src),
+            count,
+            reinterpret_cast<unsigned char*>(dst));
+    }
+
+    /**
+    Size-classed pool of the buffers handed to callers. Buffers come in power of two sizes from 4 KB to 256 MB,
+    and released ones are kept for reuse up to a total size, so that a server answering many queries does not
+    allocate and free multi-MB buffers for each of them. The pool records every buffer it leases with its
+    capacity, which lets APSIServer_ReleasePointer reject pointers that it did not hand out.
+    */
+    class BufferPool
+    {
+    public:
+        static BufferPool& instance()
+        {
+            // Never destroyed, as buffers may still be released while the library is unloaded
+            static BufferPool* pool = new BufferPool();
+            return *pool;
+        }
+
+        /**
+        Lease a buffer of at least the given size, and return its actual capacity.
+        */
+        uint8_t* acquire(size_t size, size_t& capacity)
+        {
+            size_t size_class = class_of(size);
+            capacity = size_class < class_count_ ? class_size(size_class) : size;
+
+            uint8_t* buffer = nullptr;
+            if (size_class < class_count_)
+            {
+                SizeClass& free_buffers = classes_[size_class];
+                lock_guard<mutex> lock(free_buffers.mutex);
+                if (!free_buffers.buffers.empty())
+                {
+                    buffer = free_buffers.buffers.back();
+                    free_buffers.buffers.pop_back();
+                    retained_bytes_ -= capacity;
+                }
+            }
+
+            if (nullptr == buffer)
+                buffer = static_cast<uint8_t*>(::operator new(capacity));
+
+            lock_guard<mutex> lock(leased_mutex_);
+            leased_.emplace(buffer, capacity);
+            return buffer;
+        }
+
+        /**
+        Return a leased buffer. Returns false if the buffer is not currently leased from the pool.
+        */
+        bool release(uint8_t* buffer)
+        {
+            if (nullptr == buffer)
+                return true;
+
+            size_t capacity = 0;
+            {
+                lock_guard<mutex> lock(leased_mutex_);
+                auto leased = leased_.find(buffer);
+                if (leased == leased_.end())
+                    return false;
+
+                capacity = leased->second;
+                leased_.erase(leased);
+            }
+
+            size_t size_class = class_of(capacity);
+            if (size_class < class_count_)
+            {
+                if (retained_bytes_.fetch_add(capacity) + capacity <= max_retained_bytes_)
+                {
+                    SizeClass& free_buffers = classes_[size_class];
+                    lock_guard<mutex> lock(free_buffers.mutex);
+                    free_buffers.buffers.push_back(buffer);
+                    return true;
+                }
+
+                retained_bytes_ -= capacity;
+            }
+
+            ::operator delete(buffer);
+            return true;
+        }
+
+        /**
+        Set the total size of the released buffers kept for reuse, and free the buffers above it.
+        */
+        void set_max_retained_bytes(uint64_t max_retained_bytes)
+        {
+            max_retained_bytes_ = max_retained_bytes;
+
+            // Free the largest buffers first
+            for (size_t size_class = class_count_; size_class-- > 0 && retained_bytes_ > max_retained_bytes_;)
+            {
+                SizeClass& free_buffers = classes_[size_class];
+                lock_guard<mutex> lock(free_buffers.mutex);
+                while (!free_buffers.buffers.empty() && retained_bytes_ > max_retained_bytes_)
+                {
+                    ::operator delete(free_buffers.buffers.back());
+                    free_buffers.buffers.pop_back();
+                    retained_bytes_ -= class_size(size_class);
+                }
+            }
+        }
+
+    private:
+        struct SizeClass
+        {
+            std::mutex mutex;
+            vector<uint8_t*> buffers;
+        };
+
+        static constexpr size_t min_class_bits_ = 12;
+        static constexpr size_t class_count_ = 17;
+
+        SizeClass classes_[class_count_];
+        atomic<uint64_t> retained_bytes_{ 0 };
+        atomic<uint64_t> max_retained_bytes_{ 256ull * 1024 * 1024 };
+
+        // Buffers currently leased to callers, with their capacity
+        std::mutex leased_mutex_;
+        unordered_map<uint8_t*, size_t> leased_;
+
+        static size_t class_size(size_t size_class)
+        {
+            return size_t(1) << (min_class_bits_ + size_class);
+        }
+
+        /**
+        Smallest size class that fits the given size, or class_count_ if the size is too large for the pool.
+        */
+        static size_t class_of(size_t size)
+        {
+            size_t size_class = 0;
+            while (size_class < class_count_ && class_size(size_class) < size)
+                size_class++;
+
+            return size_class;
+        }
+    };
+
+    /**
+    Stream buffer that writes into a single growing buffer leased from the BufferPool. The buffer is handed
+    to the caller as is and released with APSIServer_ReleasePointer, so data written through it is not
+    copied again after serialization.
+    */
+    class NativeBuffer : public streambuf
+    {
+    public:
+        NativeBuffer(size_t capacity = 0)
+        {
+            reserve(capacity);
+        }
+
+        /**
+        Buffer for the output of an export that takes a caller's buffer. Data is written directly to the
+        caller's buffer, and moves to a pooled buffer once it does not fit there anymore.
+        */
+        NativeBuffer(uint8_t* caller_buffer, uint64_t caller_capacity)
+            : buffer_(caller_buffer), capacity_(nullptr == caller_buffer ? 0 : static_cast<size_t>(caller_capacity)), caller_buffer_(caller_buffer)
+        {}
+
+        NativeBuffer(const NativeBuffer&) = delete;
+        NativeBuffer& operator=(const NativeBuffer&) = delete;
+
+        ~NativeBuffer()
+        {
+            if (buffer_ != caller_buffer_)
+                BufferPool::instance().release(buffer_);
+        }
+
+        const uint8_t* data() const
+        {
+            return buffer_;
+        }
+
+        size_t size() const
+        {
+            return size_;
+        }
+
+        /**
+        Discard the contents but keep the allocated memory for reuse.
+        */
+        void clear()
+        {
+            size_ = pos_ = 0;
+        }
+
+        /**
+        Transfer ownership of the buffer to the caller.
+        */
+        uint8_t* release(uint64_t& size)
+        {
+            uint8_t* buffer = buffer_;
+            size = size_;
+            buffer_ = nullptr;
+            capacity_ = size_ = pos_ = 0;
+            return buffer;
+        }
+
+        /**
+        Hand the contents to the caller of an export. Contents that are still in the caller's buffer stay
+        there and *leased_buffer is set to nullptr; otherwise *leased_buffer receives the pooled buffer that
+        holds them. *size is the size of the contents in both cases.
+        */
+        HRESULT hand_out(uint64_t* size, uint8_t** leased_buffer)
+        {
+            if (nullptr != caller_buffer_ && buffer_ == caller_buffer_)
+            {
+                *size = size_;
+                *leased_buffer = nullptr;
+                return S_OK;
+            }
+
+            *leased_buffer = release(*size);
+            return S_OK;
+        }
+
+    protected:
+        int_type overflow(int_type ch) override
+        {
+            if (traits_type::eq_int_type(ch, traits_type::eof()))
+                return traits_type::not_eof(ch);
+
+            char_type c = traits_type::to_char_type(ch);
+            xsputn(&c, 1);
+            return ch;
+        }
+
+        streamsize xsputn(const char_type* s, streamsize count) override
+        {
+            size_t ucount = static_cast<size_t>(count);
+            if (pos_ + ucount > capacity_)
+            {
+                reserve(max({ pos_ + ucount, capacity_ * 2, min_capacity_ }));
+            }
+
+            copy_bytes(buffer_ + pos_, s, ucount);
+            pos_ += ucount;
+            size_ = max(size_, pos_);
+            return count;
+        }
+
+        pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which) override
+        {
+            off_type base = (dir == ios_base::beg) ? 0 : (dir == ios_base::cur) ? static_cast<off_type>(pos_) : static_cast<off_type>(size_);
+            return seekpos(pos_type(base + off), which);
+        }
+
+        pos_type seekpos(pos_type pos, ios_base::openmode which) override
+        {
+            off_type new_pos = static_cast<off_type>(pos);
+            if (!(which & ios_base::out) || new_pos < 0 || new_pos > static_cast<off_type>(size_))
+                return pos_type(off_type(-1));
+
+            pos_ = static_cast<size_t>(new_pos);
+            return pos;
+        }
+
+    private:
+        static constexpr size_t min_capacity_ = 4096;
+
+        uint8_t* buffer_ = nullptr;
+        size_t capacity_ = 0;
+        size_t size_ = 0;
+        size_t pos_ = 0;
+        uint8_t* caller_buffer_ = nullptr;
+
+        void reserve(size_t capacity)
+        {
+            if (capacity <= capacity_)
+                return;
+
+            size_t new_capacity = 0;
+            uint8_t* new_buffer = BufferPool::instance().acquire(capacity, new_capacity);
+            copy_bytes(new_buffer, buffer_, size_);
+            if (buffer_ != caller_buffer_)
+                BufferPool::instance().release(buffer_);
+
+            buffer_ = new_buffer;
+            capacity_ = new_capacity;
+        }
+    };
+
+    /**
+    Output stream buffer that hands fixed-size chunks to a caller-provided callback.
+    Two chunks are used in turns: while one is being written by the callback on a
+    writer thread, the other one is filled by the serializer. The writer thread is
+    started with the first chunk and runs until the buffer is destroyed.
+    */
+    class CallbackWriteBuffer : public streambuf
+    {
+    public:
+        CallbackWriteBuffer(APSIServer_WriteCallback callback, void* context, size_t chunk_size = default_chunk_size_)
+            : callback_(callback), context_(context), chunk_size_(chunk_size)
+        {
+            chunks_[0].reset(new char[chunk_size_]);
+            chunks_[1].reset(new char[chunk_size_]);
+            setp(chunks_[0].get(), chunks_[0].get() + chunk_size_);
+        }
+
+        CallbackWriteBuffer(const CallbackWriteBuffer&) = delete;
+        CallbackWriteBuffer& operator=(const CallbackWriteBuffer&) = delete;
+
+        ~CallbackWriteBuffer()
+        {
+            if (!writer_.joinable())
+                return;
+
+            // The writer finishes the pending chunk, which references one of the chunks, before it stops
+            {
+                lock_guard<mutex> lock(mutex_);
+                stopping_ = true;
+            }
+
+            changed_.notify_all();
+            writer_.join();
+        }
+
+        /**
+        Write out any buffered bytes and wait until the callback has consumed them.
+        */
+        HRESULT finish()
+        {
+            if (flush_chunk())
+                wait_pending();
+
+            return hr_;
+        }
+
+        /**
+        The first failure returned by the callback, or S_OK.
+        */
+        HRESULT result() const
+        {
+            return hr_;
+        }
+
+    protected:
+        int_type overflow(int_type ch) override
+        {
+            if (!flush_chunk())
+                return traits_type::eof();
+
+            if (!traits_type::eq_int_type(ch, traits_type::eof()))
+            {
+                *pptr() = traits_type::to_char_type(ch);
+                pbump(1);
+            }
+
+            return traits_type::not_eof(ch);
+        }
+
+        int sync() override
+        {
+            return flush_chunk() ? 0 : -1;
+        }
+
+    private:
+        static constexpr size_t default_chunk_size_ = 4 * 1024 * 1024;
+
+        APSIServer_WriteCallback callback_;
+        void* context_;
+        size_t chunk_size_;
+        unique_ptr<char[]> chunks_[2];
+        size_t current_ = 0;
+        HRESULT hr_ = S_OK;
+
+        // Chunk handed to the writer thread, guarded by mutex_
+        mutex mutex_;
+        condition_variable changed_;
+        const uint8_t* pending_chunk_ = nullptr;
+        size_t pending_size_ = 0;
+        HRESULT callback_hr_ = S_OK;
+        bool stopping_ = false;
+        thread writer_;
+
+        void write_chunks()
+        {
+            unique_lock<mutex> lock(mutex_);
+            while (true)
+            {
+                changed_.wait(lock, [this]() { return stopping_ || nullptr != pending_chunk_; });
+                if (nullptr == pending_chunk_)
+                    return;
+
+                lock.unlock();
+                HRESULT hr = callback_(context_, pending_size_, pending_chunk_);
+                lock.lock();
+
+                if (FAILED(hr) && SUCCEEDED(callback_hr_))
+                    callback_hr_ = hr;
+                pending_chunk_ = nullptr;
+                changed_.notify_all();
+            }
+        }
+
+        bool wait_pending()
+        {
+            unique_lock<mutex> lock(mutex_);
+            changed_.wait(lock, [this]() { return nullptr == pending_chunk_; });
+            if (FAILED(callback_hr_) && SUCCEEDED(hr_))
+                hr_ = callback_hr_;
+
+            return SUCCEEDED(hr_);
+        }
+
+        bool flush_chunk()
+        {
+            size_t size = static_cast<size_t>(pptr() - pbase());
+            if (!wait_pending())
+                return false;
+            if (0 == size)
+                return true;
+
+            if (!writer_.joinable())
+                writer_ = thread([this]() { write_chunks(); });
+
+            {
+                lock_guard<mutex> lock(mutex_);
+                pending_chunk_ = reinterpret_cast<const uint8_t*>(chunks_[current_].get());
+                pending_size_ = size;
+            }
+
+            changed_.notify_all();
+            current_ ^= 1;
+            setp(chunks_[current_].get(), chunks_[current_].get() + chunk_size_);
+            return true;
+        }
+    };
+
+    /**
+    Run the OPRF on a request read directly from the caller's buffer and write the response to the given buffer.
+    */
+    void run_oprf(uint64_t oprf_request_size, const uint8_t* oprf_request_data, const OPRFKey& oprf_key, NativeBuffer& response_buffer)
+    {
+        ArrayGetBuffer agbuf(reinterpret_cast<const char*>(oprf_request_data), static_cast<streamsize>(oprf_request_size));
+        istream request_stream(&agbuf);
+
+        OPRFRequest oprf_request = make_unique<SenderOperationOPRF>();
+        oprf_request->load(request_stream);
+
+        iostream response_stream(&response_buffer);
+        StreamChannel channel(response_stream);
+        Sender::RunOPRF(oprf_request, oprf_key, channel);
+    }
+
+    /**
+    Threads shared by all OPRF batches in the process. The pool is never destroyed, so that it is not joined
+    while the library unloads.
+    */
+    WorkerPool& oprf_workers()
+    {
+        static WorkerPool* workers = new WorkerPool(max<size_t>(thread::hardware_concurrency(), 1));
+        return *workers;
+    }
+
+    /**
+    Run work on the calling thread and on up to helper_count threads of the OPRF pool at the same time. Returns
+    once every call of work has returned. Helpers that only start after the calling thread is done are skipped,
+    so a batch does not wait behind the tasks of other batches.
+    */
+    void run_on_oprf_workers(uint64_t helper_count, const function<void()>& work)
+    {
+        struct Helpers
+        {
+            std::mutex mutex;
+            condition_variable finished;
+            uint64_t running = 0;
+            bool closed = false;
+        };
+        auto helpers = make_shared<Helpers>();
+
+        for (uint64_t i = 0; i < helper_count; i++)
+        {
+            oprf_workers().submit([helpers, &work]() {
+                {
+                    lock_guard<mutex> lock(helpers->mutex);
+                    if (helpers->closed)
+                        return;
+
+                    helpers->running++;
+                }
+
+                work();
+
+                lock_guard<mutex> lock(helpers->mutex);
+                if (0 == --helpers->running)
+                    helpers->finished.notify_all();
+            });
+        }
+
+        work();
+
+        unique_lock<mutex> lock(helpers->mutex);
+        helpers->closed = true;
+        helpers->finished.wait(lock, [&helpers]() { return 0 == helpers->running; });
+    }
+
+    /**
+    Parse a query directly from the caller's buffer.
+    */
+    QueryRequest load_query_request(const shared_ptr<SenderDB>& sender_db, uint64_t encrypted_query_size, const uint8_t* encrypted_query)
+    {
+        ArrayGetBuffer agbuf(reinterpret_cast<const char*>(encrypted_query), static_cast<streamsize>(encrypted_query_size));
+        istream query_stream(&agbuf);
+
+        QueryRequest query_request = make_unique<SenderOperationQuery>();
+        query_request->load(query_stream, sender_db->get_seal_context());
+        return query_request;
+    }
+
+    /**
+    Apply the result compression of a server to a parsed query, whose result packages are compressed
+    like the query says, and record the compression of the query and of its response.
+    */
+    void set_result_compression(SenderOperationQuery& query_request, int result_compression, ServerMetrics::QueryScope& scope)
+    {
+        compr_mode_type query_compr_mode = query_request.compr_mode;
+        if (APSI_COMPRESSION_AS_REQUESTED != result_compression)
+            query_request.compr_mode = static_cast<compr_mode_type>(result_compression);
+
+        scope.set_compression(query_compr_mode, query_request.compr_mode);
+    }
+
+    /**
+    Run a parsed query and serialize its response into the given buffer.
+    */
+    void run_query(
+        const shared_ptr<SenderDB>& sender_db, QueryRequest query_request, int result_compression, ServerMetrics::QueryScope& scope, NativeBuffer& response_buffer)
+    {
+        set_result_compression(*query_request, result_compression, scope);
+        Query query(move(query_request), sender_db);
+        scope.end_deserialize();
+
+        // Serialize the response directly into the buffer that is returned to the caller
+        iostream response_stream(&response_buffer);
+        StreamChannel channel_response(response_stream);
+        Sender::RunQuery(
+            query,
+            channel_response,
+            [&scope](Channel& chl, Response response) { scope.serialize([&]() { chl.send(move(response)); }); },
+            [&scope](Channel& chl, ResultPart rp) { scope.serialize([&]() { chl.send(move(rp)); }); });
+        scope.end_evaluate();
+
+        scope.succeed(response_buffer.size());
+    }
+
+    /**
+    Build the databases of the given shards, keeping only the items that belong to them. labels is
+    nullptr for an unlabeled database.
+    */
+    void set_shard_data(
+        ShardedServer& server, const vector<size_t>& shard_indices, uint64_t count, const uint64_t* data, uint64_t label_byte_count, const uint8_t* labels)
+    {
+        size_t shard_count = server.shard_count();
+        vector<vector<uint64_t>> shard_items(shard_count);
+        for (uint64_t i = 0; i < count; i++)
+        {
+            shard_items[ShardedServer::shard_index(data + i * 2, shard_count)].push_back(i);
+        }
+
+        // Shards are built at the same time. Their OPRF and bin bundle tasks all go to the APSI thread pool.
+        vector<future<void>> builds;
+        for (size_t shard_index : shard_indices)
+        {
+            builds.push_back(async(launch::async, [&, shard_index]() {
+                const vector<uint64_t>& indices = shard_items[shard_index];
+                APSIServer& shard = server.shard(shard_index);
+                auto sender_db = shard.new_sender_db(static_cast<size_t>(label_byte_count));
+                if (nullptr == sender_db)
+                    throw logic_error("loaded shards cannot be rebuilt");
+
+                if (nullptr == labels)
+                {
+                    vector<Item> apsidata(indices.size());
+                    for (size_t i = 0; i < indices.size(); i++)
+                    {
+                        auto apsidata64 = apsidata[i].get_as<uint64_t>();
+                        apsidata64[0] = data[indices[i] * 2];
+                        apsidata64[1] = data[indices[i] * 2 + 1];
+                    }
+
+                    sender_db->set_data(apsidata);
+                }
+                else
+                {
+                    vector<pair<Item, Label>> apsidata(indices.size());
+                    for (size_t i = 0; i < indices.size(); i++)
+                    {
+                        auto apsidata64 = apsidata[i].first.get_as<uint64_t>();
+                        apsidata64[0] = data[indices[i] * 2];
+                        apsidata64[1] = data[indices[i] * 2 + 1];
+
+                        const uint8_t* label = labels + indices[i] * label_byte_count;
+                        apsidata[i].second.assign(label, label + label_byte_count);
+                    }
+
+                    sender_db->set_data(apsidata);
+                }
+
+                sender_db->strip();
+                shard.set_sender_db(move(sender_db));
+            }));
+        }
+
+        // Wait for all builds before rethrowing the first error, since they use the data given by the caller
+        for (auto& build : builds)
+        {
+            build.wait();
+        }
+        for (auto& build : builds)
+        {
+            build.get();
+        }
+    }
+
+    /**
+    Run a query against every shard and merge the results into a single response, as if the query
+    had been run against one database holding all items.
+    */
+    void run_sharded_query(const vector<shared_ptr<SenderDB>>& sender_dbs, uint64_t encrypted_query_size, const uint8_t* encrypted_query, NativeBuffer& response_buffer)
+    {
+        // The query is parsed once and copied for every shard
+        QueryRequest query_request = load_query_request(sender_dbs[0], encrypted_query_size, encrypted_query);
+        compr_mode_type compr_mode = query_request->compr_mode;
+        RelinKeys relin_keys = query_request->relin_keys.extract_local();
+        unordered_map<uint32_t, vector<Ciphertext>> query_data;
+        for (auto& powers : query_request->data)
+        {
+            auto& ciphertexts = query_data[powers.first];
+            for (auto& ciphertext : powers.second)
+            {
+                ciphertexts.push_back(ciphertext.extract_local());
+            }
+        }
+
+        iostream response_stream(&response_buffer);
+        StreamChannel channel(response_stream);
+
+        // A single header announces the result packages of all shards
+        auto response_query = make_unique<SenderOperationResponseQuery>();
+        response_query->package_count = 0;
+        for (auto& sender_db : sender_dbs)
+        {
+            response_query->package_count += static_cast<uint32_t>(sender_db->get_bin_bundle_count());
+        }
+        channel.send(Response(move(response_query)));
+
+        mutex channel_mutex;
+        auto run_shard = [&](const shared_ptr<SenderDB>& sender_db) {
+            QueryRequest shard_request = make_unique<SenderOperationQuery>();
+            shard_request->compr_mode = compr_mode;
+            shard_request->relin_keys = relin_keys;
+            for (auto& powers : query_data)
+            {
+                auto& ciphertexts = shard_request->data[powers.first];
+                ciphertexts.resize(powers.second.size());
+                for (size_t i = 0; i < powers.second.size(); i++)
+                {
+                    ciphertexts[i] = powers.second[i];
+                }
+            }
+
+            Query query(move(shard_request), sender_db);
+            Sender::RunQuery(
+                query,
+                channel,
+                [](Channel&, Response) {},
+                [&channel_mutex](Channel& chl, ResultPart rp) {
+                    lock_guard<mutex> lock(channel_mutex);
+                    chl.send(move(rp));
+                });
+        };
+
+        vector<future<void>> shard_queries;
+        for (size_t i = 1; i < sender_dbs.size(); i++)
+        {
+            shard_queries.push_back(async(launch::async, run_shard, cref(sender_dbs[i])));
+        }
+
+        exception_ptr first_error;
+        try
+        {
+            run_shard(sender_dbs[0]);
+        }
+        catch (...)
+        {
+            first_error = current_exception();
+        }
+        for (auto& shard_query : shard_queries)
+        {
+            try
+            {
+                shard_query.get();
+            }
+            catch (...)
+            {
+                if (!first_error)
+                    first_error = current_exception();
+            }
+        }
+        if (first_error)
+            rethrow_exception(first_error);
+    }
+
+    /**
+    Run a single query and serialize its response into the given buffer.
+    */
+    void run_query(
+        const shared_ptr<SenderDB>& sender_db,
+        uint64_t encrypted_query_size,
+        const uint8_t* encrypted_query,
+        int result_compression,
+        ServerMetrics::QueryScope& scope,
+        NativeBuffer& response_buffer)
+    {
+        run_query(sender_db, load_query_request(sender_db, encrypted_query_size, encrypted_query), result_compression, scope, response_buffer);
+    }
+
+    /**
+    A query started with APSIServer_QueryAsync. It is shared by the worker running the query and the
+    caller, and is deleted once both have released it.
+    */
+    class AsyncQuery
+    {
+    public:
+        AsyncQuery(uint64_t timeout_ms, shared_ptr<AdmissionControl> admission_control)
+            : deadline_(0 == timeout_ms ? chrono::steady_clock::time_point::max() : chrono::steady_clock::now() + chrono::milliseconds(timeout_ms)),
+            admission_control_(move(admission_control))
+        {}
+
+        void cancel()
+        {
+            cancelled_ = true;
+
+            // The query may be waiting for admission
+            admission_control_->wake_waiting();
+        }
+
+        chrono::steady_clock::time_point deadline() const
+        {
+            return deadline_;
+        }
+
+        /**
+        Returns S_OK while the query should go on, or the HRESULT the query ends with otherwise.
+        */
+        HRESULT check() const
+        {
+            if (cancelled_)
+                return E_ABORT;
+            if (chrono::steady_clock::now() >= deadline_)
+                return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+            return S_OK;
+        }
+
+        void release()
+        {
+            if (0 == --references_)
+                delete this;
+        }
+
+    private:
+        atomic<bool> cancelled_{ false };
+        chrono::steady_clock::time_point deadline_;
+        shared_ptr<AdmissionControl> admission_control_;
+        atomic<int> references_{ 2 };
+    };
+
+    /**
+    Run a query that stops at the next checkpoint once it is cancelled or its deadline passes.
+
+    APSI evaluates all bin bundles of a query within Sender::RunQuery, so evaluation that already started
+    runs to its end. The checkpoints are before and after parsing, before the evaluation, and before every
+    result package is serialized and compressed, which is skipped once the query stopped.
+    */
+    HRESULT run_async_query(
+        const shared_ptr<SenderDB>& sender_db,
+        const vector<uint8_t>& encrypted_query,
+        int result_compression,
+        const AsyncQuery& state,
+        ServerMetrics::QueryScope& scope,
+        uint8_t*& result,
+        uint64_t& result_size)
+    {
+        HRESULT hr = state.check();
+        if (FAILED(hr))
+            return hr;
+
+        QueryRequest query_request = load_query_request(sender_db, encrypted_query.size(), encrypted_query.data());
+        hr = state.check();
+        if (FAILED(hr))
+            return hr;
+
+        set_result_compression(*query_request, result_compression, scope);
+        Query query(move(query_request), sender_db);
+        scope.end_deserialize();
+        hr = state.check();
+        if (FAILED(hr))
+            return hr;
+
+        NativeBuffer response_buffer;
+        iostream response_stream(&response_buffer);
+        StreamChannel channel_response(response_stream);
+        Sender::RunQuery(
+            query,
+            channel_response,
+            [&scope](Channel& chl, Response response) { scope.serialize([&]() { chl.send(move(response)); }); },
+            [&state, &scope](Channel& chl, ResultPart rp) {
+                if (SUCCEEDED(state.check()))
+                    scope.serialize([&]() { chl.send(move(rp)); });
+            });
+        scope.end_evaluate();
+
+        hr = state.check();
+        if (FAILED(hr))
+            return hr;
+
+        result = response_buffer.release(result_size);
+        scope.succeed(result_size);
+        return S_OK;
+    }
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_GetParameters(void* thisptr, uint64_t* parameters_size, uint8_t** parameters)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(parameters_size, E_POINTER);
+    IfNullRet(parameters, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    auto sender_db = server->get_sender_db();
+
+    IfNullRet(sender_db, E_INVALIDARG);
+
+    PSIParams params = sender_db->get_params();
+
+    NativeBuffer params_buffer;
+    ostream params_stream(&params_buffer);
+    params.save(params_stream);
+
+    return params_buffer.hand_out(parameters_size, parameters);
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_Query(void* thisptr, const uint64_t encrypted_query_size, const uint8_t* encrypted_query, uint64_t* result_buffer_size, uint8_t** result_buffer)
+{
+    // Without a buffer of the caller the result is always leased
+    return APSIServer_QueryInto(thisptr, encrypted_query_size, encrypted_query, 0, nullptr, result_buffer_size, result_buffer);
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_QueryInto(
+    void* thisptr,
+    const uint64_t encrypted_query_size,
+    const uint8_t* encrypted_query,
+    const uint64_t destination_capacity,
+    uint8_t* destination,
+    uint64_t* result_size,
+    uint8_t** leased_result)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(encrypted_query, E_POINTER);
+    IfNullRet(result_size, E_POINTER);
+    IfNullRet(leased_result, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    auto sender_db = server->get_sender_db();
+
+    IfNullRet(sender_db, E_INVALIDARG);
+
+    try
+    {
+        AdmissionControl::Ticket ticket;
+        HRESULT hr = server->admission_control()->admit(estimate_query_cost(*sender_db, /* item_count */ 1), ticket);
+        if (FAILED(hr))
+            return hr;
+
+        ServerMetrics::QueryScope scope(*server->metrics(), encrypted_query_size);
+        NativeBuffer response_buffer(destination, destination_capacity);
+        run_query(sender_db, encrypted_query_size, encrypted_query, server->result_compression(), scope, response_buffer);
+        return response_buffer.hand_out(result_size, leased_result);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::Query: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::Query: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_QueryWithSession(void* thisptr, uint64_t* session_token, const uint64_t encrypted_query_size, const uint8_t* encrypted_query, uint64_t* result_buffer_size, uint8_t** result_buffer)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(session_token, E_POINTER);
+    IfNullRet(encrypted_query, E_POINTER);
+    IfNullRet(result_buffer_size, E_POINTER);
+    IfNullRet(result_buffer, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    auto sender_db = server->get_sender_db();
+
+    IfNullRet(sender_db, E_INVALIDARG);
+
+    try
+    {
+        AdmissionControl::Ticket ticket;
+        HRESULT hr = server->admission_control()->admit(estimate_query_cost(*sender_db, /* item_count */ 1), ticket);
+        if (FAILED(hr))
+            return hr;
+
+        ServerMetrics::QueryScope scope(*server->metrics(), encrypted_query_size);
+        QueryRequest query_request = load_query_request(sender_db, encrypted_query_size, encrypted_query);
+
+        // A query that carries relinearization keys registers them for the session. A query without
+        // them uses the keys that were registered before.
+        RelinKeys relin_keys = query_request->relin_keys.extract_local();
+        if (relin_keys.size() > 0)
+        {
+            // The cache keeps its own copy; the query takes the keys it was sent
+            *session_token = server->relin_keys_cache().put(*session_token, relin_keys);
+            query_request->relin_keys = move(relin_keys);
+        }
+        else
+        {
+            auto cached_keys = server->relin_keys_cache().get(*session_token);
+            if (nullptr == cached_keys)
+                return E_NOT_SET;
+
+            // The query owns its keys, so the cached keys are copied once per query
+            query_request->relin_keys = *cached_keys;
+        }
+
+        NativeBuffer response_buffer;
+        run_query(sender_db, move(query_request), server->result_compression(), scope, response_buffer);
+        return response_buffer.hand_out(result_buffer_size, result_buffer);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::QueryWithSession: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::QueryWithSession: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_SetKeyCacheLimits(void* thisptr, const uint64_t max_bytes, const uint64_t ttl_seconds)
+{
+    IfNullRet(thisptr, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    server->relin_keys_cache().set_limits(static_cast<size_t>(max_bytes), chrono::seconds(ttl_seconds));
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_RemoveSessionKeys(void* thisptr, const uint64_t session_token)
+{
+    IfNullRet(thisptr, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    server->relin_keys_cache().remove(session_token);
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_SetResultCompression(void* thisptr, const int compr_mode)
+{
+    IfNullRet(thisptr, E_POINTER);
+
+    if (APSI_COMPRESSION_AS_REQUESTED != compr_mode
+        && (compr_mode < 0 || compr_mode > numeric_limits<uint8_t>::max()
+            || !Serialization::IsSupportedComprMode(static_cast<uint8_t>(compr_mode))))
+        return E_INVALIDARG;
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    server->set_result_compression(compr_mode);
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_GetMetrics(void* thisptr, APSIServerMetrics* metrics)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(metrics, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    auto sender_db = server->get_sender_db();
+
+    try
+    {
+        *metrics = {};
+        server->metrics()->snapshot(*metrics);
+        server->admission_control()->snapshot(*metrics);
+        metrics->thread_count = ThreadPoolMgr::GetThreadCount();
+
+        if (nullptr != sender_db)
+        {
+            metrics->item_count = sender_db->get_item_count();
+            metrics->bin_bundle_count = sender_db->get_bin_bundle_count();
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::GetMetrics: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::GetMetrics: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_EstimateQueryCost(void* thisptr, const uint64_t item_count, uint64_t* cost)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(cost, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    auto sender_db = server->get_sender_db();
+
+    IfNullRet(sender_db, E_INVALIDARG);
+
+    try
+    {
+        *cost = estimate_query_cost(*sender_db, item_count);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::EstimateQueryCost: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::EstimateQueryCost: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_SetAdmissionLimits(
+    void* thisptr,
+    const uint64_t max_queries,
+    const uint64_t max_cost,
+    const uint64_t max_queued_queries,
+    const uint64_t queue_timeout_ms)
+{
+    IfNullRet(thisptr, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    server->admission_control()->set_limits(max_queries, max_cost, max_queued_queries, queue_timeout_ms);
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_QueryBatch(
+    void* thisptr,
+    const uint64_t query_count,
+    const uint64_t* encrypted_query_sizes,
+    const uint8_t* const* encrypted_queries,
+    uint64_t* result_buffer_sizes,
+    uint8_t** result_buffers,
+    HRESULT* query_results)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(encrypted_query_sizes, E_POINTER);
+    IfNullRet(encrypted_queries, E_POINTER);
+    IfNullRet(result_buffer_sizes, E_POINTER);
+    IfNullRet(result_buffers, E_POINTER);
+    IfNullRet(query_results, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    auto sender_db = server->get_sender_db();
+
+    IfNullRet(sender_db, E_INVALIDARG);
+
+    try
+    {
+        // All queries of the batch use the result compression set when it started
+        int result_compression = server->result_compression();
+
+        for (uint64_t i = 0; i < query_count; i++)
+        {
+            result_buffers[i] = nullptr;
+            result_buffer_sizes[i] = 0;
+            query_results[i] = E_FAIL;
+        }
+
+        // Queries are started in order by a fixed number of drivers. The drivers only wait on the
+        // bin bundle tasks of their query, which all go to the shared APSI thread pool, so the work
+        // of concurrent queries is interleaved there without creating any extra compute threads.
+        atomic<uint64_t> next_query{ 0 };
+        auto drive = [&]() {
+            for (uint64_t i = next_query++; i < query_count; i = next_query++)
+            {
+                try
+                {
+                    if (nullptr == encrypted_queries[i])
+                    {
+                        query_results[i] = E_POINTER;
+                        continue;
+                    }
+
+                    // Every query of the batch is admitted on its own, so a rejected query fails alone
+                    AdmissionControl::Ticket ticket;
+                    HRESULT hr = server->admission_control()->admit(estimate_query_cost(*sender_db, /* item_count */ 1), ticket);
+                    if (FAILED(hr))
+                    {
+                        query_results[i] = hr;
+                        continue;
+                    }
+
+                    ServerMetrics::QueryScope scope(*server->metrics(), encrypted_query_sizes[i]);
+                    NativeBuffer response_buffer;
+                    run_query(sender_db, encrypted_query_sizes[i], encrypted_queries[i], result_compression, scope, response_buffer);
+                    result_buffers[i] = response_buffer.release(result_buffer_sizes[i]);
+                    query_results[i] = S_OK;
+                }
+                catch (const std::exception& ex)
+                {
+                    APSI_LOG_ERROR("APSIServer::QueryBatch: query " << i << ": " << ex.what());
+                }
+                catch (...)
+                {
+                    APSI_LOG_ERROR("APSIServer::QueryBatch: query " << i << ": unknown exception");
+                }
+            }
+        };
+
+        uint64_t driver_count = min<uint64_t>(query_count, max<size_t>(ThreadPoolMgr::GetThreadCount(), 1));
+        {
+            vector<future<void>> drivers;
+            for (uint64_t i = 1; i < driver_count; i++)
+            {
+                try
+                {
+                    drivers.push_back(async(launch::async, drive));
+                }
+                catch (const std::system_error& ex)
+                {
+                    // Fewer drivers only means fewer queries in flight
+                    APSI_LOG_WARNING("APSIServer::QueryBatch: could not start driver: " << ex.what());
+                    break;
+                }
+            }
+
+            drive();
+
+            for (auto& driver : drivers)
+            {
+                driver.wait();
+            }
+        }
+
+        bool all_succeeded = all_of(query_results, query_results + query_count, [](HRESULT hr) { return SUCCEEDED(hr); });
+        return all_succeeded ? S_OK : S_FALSE;
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::QueryBatch: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::QueryBatch: unknown exception");
+        return E_FAIL;
+    }
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_QueryStreamed(void* thisptr, const uint64_t encrypted_query_size, const uint8_t* encrypted_query, APSIServer_ResultPartCallback callback, void* context)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(encrypted_query, E_POINTER);
+    IfNullRet(callback, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    auto sender_db = server->get_sender_db();
+
+    IfNullRet(sender_db, E_INVALIDARG);
+
+    HRESULT callback_hr = S_OK;
+
+    try
+    {
+        AdmissionControl::Ticket ticket;
+        HRESULT hr = server->admission_control()->admit(estimate_query_cost(*sender_db, /* item_count */ 1), ticket);
+        if (FAILED(hr))
+            return hr;
+
+        ServerMetrics::QueryScope scope(*server->metrics(), encrypted_query_size);
+
+        ArrayGetBuffer agbuf(reinterpret_cast<const char*>(encrypted_query), encrypted_query_size);
+        istream query_stream(&agbuf);
+
+        QueryRequest query_request = make_unique<SenderOperationQuery>();
+
+        query_request->load(query_stream, sender_db->get_seal_context());
+
+        set_result_compression(*query_request, server->result_compression(), scope);
+        Query query(move(query_request), sender_db);
+        scope.end_deserialize();
+
+        // Result parts are sent from the worker threads. Each message is serialized on its own
+        // and then handed to the caller; calls to the callback never overlap. Once the callback
+        // fails the remaining parts are dropped, but the query still runs to completion.
+        mutex callback_mutex;
+        uint64_t bytes_out = 0;
+        auto deliver = [&](auto send_message) {
+            NativeBuffer part_buffer;
+            ostream part_stream(&part_buffer);
+            StreamChannel part_channel(query_stream, part_stream);
+            scope.serialize([&]() { send_message(part_channel); });
+
+            lock_guard<mutex> lock(callback_mutex);
+            if (FAILED(callback_hr))
+                return;
+
+            callback_hr = callback(context, part_buffer.size(), part_buffer.data());
+            bytes_out += part_buffer.size();
+        };
+
+        // Everything is sent through deliver, so nothing is ever written to this channel
+        NativeBuffer unused_buffer;
+        ostream unused_stream(&unused_buffer);
+        StreamChannel channel(query_stream, unused_stream);
+
+        Sender::RunQuery(
+            query,
+            channel,
+            [&](Channel&, Response response) {
+                deliver([&](Channel& part_channel) { part_channel.send(move(response)); });
+            },
+            [&](Channel&, ResultPart result_part) {
+                deliver([&](Channel& part_channel) { part_channel.send(move(result_part)); });
+            });
+        scope.end_evaluate();
+
+        if (SUCCEEDED(callback_hr))
+            scope.succeed(bytes_out);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::QueryStreamed: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::QueryStreamed: unknown exception");
+        return E_FAIL;
+    }
+
+    if (FAILED(callback_hr))
+    {
+        APSI_LOG_ERROR("APSIServer::QueryStreamed: callback failed: " << callback_hr);
+        return callback_hr;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_QueryAsync(
+    void* thisptr,
+    const uint64_t encrypted_query_size,
+    const uint8_t* encrypted_query,
+    const uint64_t timeout_ms,
+    APSIServer_QueryCompletedCallback callback,
+    void* context,
+    void** query_handle)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(encrypted_query, E_POINTER);
+    IfNullRet(callback, E_POINTER);
+    IfNullRet(query_handle, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    auto sender_db = server->get_sender_db();
+
+    IfNullRet(sender_db, E_INVALIDARG);
+
+    AsyncQuery* state = new AsyncQuery(timeout_ms, server->admission_control());
+
+    try
+    {
+        // The query is copied, so the caller does not need to keep its buffer alive
+        vector<uint8_t> query(encrypted_query, encrypted_query + encrypted_query_size);
+
+        server->async_workers().submit([sender_db, admission_control = server->admission_control(), metrics = server->metrics(), result_compression = server->result_compression(), query = move(query), state, callback, context]() {
+            uint8_t* result = nullptr;
+            uint64_t result_size = 0;
+            HRESULT hr = E_FAIL;
+
+            try
+            {
+                // A query stops waiting for admission once it is cancelled or its deadline passes
+                AdmissionControl::Ticket ticket;
+                hr = admission_control->admit(estimate_query_cost(*sender_db, /* item_count */ 1), ticket, state->deadline(), [state]() { return state->check(); });
+                if (SUCCEEDED(hr))
+                {
+                    ServerMetrics::QueryScope scope(*metrics, query.size());
+                    hr = run_async_query(sender_db, query, result_compression, *state, scope, result, result_size);
+                }
+            }
+            catch (const std::exception& ex)
+            {
+                APSI_LOG_ERROR("APSIServer::QueryAsync: " << ex.what());
+            }
+            catch (...)
+            {
+                APSI_LOG_ERROR("APSIServer::QueryAsync: unknown exception");
+            }
+
+            callback(context, hr, result_size, result);
+            state->release();
+        });
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::QueryAsync: " << ex.what());
+        delete state;
+        return E_FAIL;
+    }
+
+    *query_handle = state;
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_CancelQuery(void* query_handle)
+{
+    IfNullRet(query_handle, E_POINTER);
+
+    reinterpret_cast<AsyncQuery*>(query_handle)->cancel();
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_ReleaseQuery(void* query_handle)
+{
+    IfNullRet(query_handle, E_POINTER);
+
+    reinterpret_cast<AsyncQuery*>(query_handle)->release();
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_ReleasePointer(std::uint8_t* ptr)
+{
+    if (!BufferPool::instance().release(ptr))
+        return E_INVALIDARG;
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_SetBufferPoolLimit(const std::uint64_t max_retained_bytes)
+{
+    BufferPool::instance().set_max_retained_bytes(max_retained_bytes);
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_SetData(void* thisptr, std::uint64_t count, std::uint64_t* data)
+{
+    return APSIServer_SetData2(thisptr, count, data, /* updatable */ FALSE);
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_SetData2(void* thisptr, std::uint64_t count, std::uint64_t* data, int updatable)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(data, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+
+    try
+    {
+        vector<Item> apsidata = to_apsi_items(count, data);
+
+        // The new database is built next to the current one, which keeps serving queries until it is replaced
+        auto sender_db = server->new_sender_db();
+        IfNullRet(sender_db, E_NOT_VALID_STATE);
+
+        sender_db->set_data(apsidata);
+
+        // A stripped DB is smaller, but cannot be modified anymore
+        if (!updatable)
+        {
+            sender_db->strip();
+        }
+
+        server->set_sender_db(move(sender_db));
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::SetData: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::SetData: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_SetLabeledData(void* thisptr, std::uint64_t count, std::uint64_t* data, std::uint64_t label_byte_count, std::uint8_t* labels, int updatable)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(data, E_POINTER);
+    IfNullRet(labels, E_POINTER);
+
+    if (0 == label_byte_count)
+        return E_INVALIDARG;
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+
+    try
+    {
+        vector<pair<Item, Label>> apsidata = to_apsi_labeled_items(count, data, label_byte_count, labels);
+
+        auto sender_db = server->new_sender_db(label_byte_count);
+        IfNullRet(sender_db, E_NOT_VALID_STATE);
+
+        sender_db->set_data(apsidata);
+
+        // A stripped DB is smaller, but cannot be modified anymore
+        if (!updatable)
+        {
+            sender_db->strip();
+        }
+
+        server->set_sender_db(move(sender_db));
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::SetLabeledData: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::SetLabeledData: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_BeginData(void* thisptr, std::uint64_t label_byte_count, std::uint64_t batch_size, int updatable)
+{
+    IfNullRet(thisptr, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+
+    try
+    {
+        auto sender_db = server->new_sender_db(static_cast<size_t>(label_byte_count));
+        IfNullRet(sender_db, E_NOT_VALID_STATE);
+
+        // An unfinished previous ingestion is discarded
+        server->ingestion() = make_unique<Ingestion>(move(sender_db), static_cast<size_t>(batch_size), updatable != FALSE);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::BeginData: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::BeginData: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_AppendData(void* thisptr, std::uint64_t count, std::uint64_t* data, std::uint8_t* labels)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(data, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    Ingestion* ingestion = server->ingestion().get();
+
+    IfNullRet(ingestion, E_NOT_VALID_STATE);
+
+    if (ingestion->is_labeled() != (nullptr != labels))
+        return E_INVALIDARG;
+
+    try
+    {
+        // Chunks are converted on the calling threads, before they are queued for insertion
+        if (ingestion->is_labeled())
+        {
+            ingestion->append(to_apsi_labeled_items(count, data, ingestion->get_label_byte_count(), labels));
+        }
+        else
+        {
+            ingestion->append(to_apsi_items(count, data));
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::AppendData: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::AppendData: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_FinalizeData(void* thisptr)
+{
+    IfNullRet(thisptr, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    unique_ptr<Ingestion> ingestion = move(server->ingestion());
+
+    IfNullRet(ingestion, E_NOT_VALID_STATE);
+
+    try
+    {
+        server->set_sender_db(ingestion->finalize());
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::FinalizeData: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::FinalizeData: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_InsertOrAssign(void* thisptr, std::uint64_t count, std::uint64_t* data)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(data, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    auto sender_db = server->get_sender_db();
+
+    IfNullRet(sender_db, E_INVALIDARG);
+
+    if (sender_db->is_stripped())
+    {
+        APSI_LOG_ERROR("APSIServer::InsertOrAssign: cannot modify a stripped DB");
+        return E_NOT_VALID_STATE;
+    }
+
+    if (sender_db->is_labeled())
+    {
+        APSI_LOG_ERROR("APSIServer::InsertOrAssign: items in a labeled DB need labels");
+        return E_INVALIDARG;
+    }
+
+    try
+    {
+        vector<Item> apsidata = to_apsi_items(count, data);
+        sender_db->insert_or_assign(apsidata);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::InsertOrAssign: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::InsertOrAssign: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_InsertOrAssignLabeled(void* thisptr, std::uint64_t count, std::uint64_t* data, std::uint64_t label_byte_count, std::uint8_t* labels)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(data, E_POINTER);
+    IfNullRet(labels, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    auto sender_db = server->get_sender_db();
+
+    IfNullRet(sender_db, E_INVALIDARG);
+
+    if (sender_db->is_stripped())
+    {
+        APSI_LOG_ERROR("APSIServer::InsertOrAssignLabeled: cannot modify a stripped DB");
+        return E_NOT_VALID_STATE;
+    }
+
+    if (!sender_db->is_labeled() || label_byte_count != sender_db->get_label_byte_count())
+    {
+        APSI_LOG_ERROR("APSIServer::InsertOrAssignLabeled: label size does not match DB label size " << sender_db->get_label_byte_count());
+        return E_INVALIDARG;
+    }
+
+    try
+    {
+        vector<pair<Item, Label>> apsidata = to_apsi_labeled_items(count, data, label_byte_count, labels);
+        sender_db->insert_or_assign(apsidata);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::InsertOrAssignLabeled: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::InsertOrAssignLabeled: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_Remove(void* thisptr, std::uint64_t count, std::uint64_t* data)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(data, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    auto sender_db = server->get_sender_db();
+
+    IfNullRet(sender_db, E_INVALIDARG);
+
+    if (sender_db->is_stripped())
+    {
+        APSI_LOG_ERROR("APSIServer::Remove: cannot modify a stripped DB");
+        return E_NOT_VALID_STATE;
+    }
+
+    try
+    {
+        vector<Item> apsidata = to_apsi_items(count, data);
+        sender_db->remove(apsidata);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::Remove: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::Remove: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_Strip(void* thisptr)
+{
+    IfNullRet(thisptr, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    auto sender_db = server->get_sender_db();
+
+    IfNullRet(sender_db, E_INVALIDARG);
+
+    try
+    {
+        if (!sender_db->is_stripped())
+        {
+            sender_db->strip();
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer::Strip: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer::Strip: unknown exception");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_Create(void** thisptr, void* poprf_key, void* params)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(poprf_key, E_POINTER);
+    IfNullRet(params, E_POINTER);
+
+    Log::SetLogLevel(Log::Level::info);
+    server_instance_count_s++;
+
+    OPRFKey* oprf_key = reinterpret_cast<OPRFKey*>(poprf_key);
+    PSIParams* parameters = reinterpret_cast<PSIParams*>(params);
+
+    APSIServer* server = new APSIServer(oprf_key, parameters);
+    *thisptr = server;
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_Destroy(void* thisptr)
+{
+    IfNullRet(thisptr, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    delete server;
+
+    server_instance_count_s--;
+    if (server_instance_count_s <= 0)
+    {
+        Log::Terminate();
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_SaveDB1(void* thisptr, uint64_t* db_buffer_size, uint8_t** db_buffer)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(db_buffer_size, E_POINTER);
+    IfNullRet(db_buffer, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    auto sender_db = server->get_sender_db();
+
+    if (nullptr == sender_db)
+        return E_INVALIDARG;
+
+    try
+    {
+        // Serialize directly into the buffer that is handed to the caller
+        NativeBuffer db_output;
+        ostream db_stream(&db_output);
+        server->save(db_stream);
+
+        return db_output.hand_out(db_buffer_size, db_buffer);
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer_SaveDB: Error saving DB: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
     {
-        if (!count) {
-            return;
-        }
-        if (!src) {
-            throw invalid_argument("cannot copy data: source is null");
-        }
-        if (!dst) {
-            throw invalid_argument("cannot copy data: destination is null");
-        }
-        copy_n(
-            reinterpret_cast<const unsigned char*>(src),
-            count,
-            reinterpret_cast<unsigned char*>(dst));
+        APSI_LOG_ERROR("APSIServer_SaveDB: Unknown error saving DB");
+        return E_FAIL;
     }
+
+    return S_OK;
 }
 
-APSIEXPORT HRESULT APSICALL APSIServer_GetParameters(void* thisptr, uint64_t* parameters_size, uint8_t** parameters)
+APSIEXPORT HRESULT APSICALL APSIServer_SaveDB2(void* thisptr, char* file_path)
 {
     IfNullRet(thisptr, E_POINTER);
-    IfNullRet(parameters_size, E_POINTER);
-    IfNullRet(parameters, E_POINTER);
+    IfNullRet(file_path, E_POINTER);
 
     APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
     auto sender_db = server->get_sender_db();
 
-    IfNullRet(sender_db, E_INVALIDARG);
-
-    PSIParams params = sender_db->get_params();
-
-    stringstream ss;
-    params.save(ss);
+    if (nullptr == sender_db)
+        return E_INVALIDARG;
 
-    string params_str = ss.str();
-    *parameters_size = params_str.size();
-    *parameters = new uint8_t[params_str.size()];
-    copy_bytes(*parameters, params_str.c_str(), params_str.size());
+    try {
+        ofstream output(file_path, ios::binary | ios::out | ios::trunc);
+        server->save(output);
+        output.close();
+    }
+    catch (const std::exception& ex) {
+        APSI_LOG_ERROR("APSIServer_SaveDB2: Error saving DB: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...) {
+        APSI_LOG_ERROR("APSIServer_SaveDB2: Unknown error saving DB");
+        return E_FAIL;
+    }
 
     return S_OK;
 }
 
-APSIEXPORT HRESULT APSICALL APSIServer_Query(void* thisptr, const uint64_t encrypted_query_size, const uint8_t* encrypted_query, uint64_t* result_buffer_size, uint8_t** result_buffer)
+APSIEXPORT HRESULT APSICALL APSIServer_SaveDBStreamed(void* thisptr, APSIServer_WriteCallback callback, void* context)
 {
     IfNullRet(thisptr, E_POINTER);
-    IfNullRet(encrypted_query, E_POINTER);
-    IfNullRet(result_buffer_size, E_POINTER);
-    IfNullRet(result_buffer, E_POINTER);
+    IfNullRet(callback, E_POINTER);
 
     APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
     auto sender_db = server->get_sender_db();
 
-    IfNullRet(sender_db, E_INVALIDARG);
+    if (nullptr == sender_db)
+        return E_INVALIDARG;
+
+    HRESULT hr = S_OK;
+    CallbackWriteBuffer db_output(callback, context);
 
     try
     {
-        stringstream ss;
-        ss.write(reinterpret_cast<const char*>(encrypted_query), encrypted_query_size);
-
-        QueryRequest query_request = make_unique<SenderOperationQuery>();
+        ostream db_stream(&db_output);
+        server->save(db_stream);
 
-        query_request->load(ss, sender_db->get_seal_context());
+        hr = db_output.finish();
+        if (SUCCEEDED(hr) && db_stream.bad())
+            hr = E_FAIL;
+    }
+    catch (const std::exception& ex)
+    {
+        // A failing callback makes the serializer throw; report the callback error instead
+        hr = FAILED(db_output.result()) ? db_output.result() : E_FAIL;
+        APSI_LOG_ERROR("APSIServer_SaveDBStreamed: Error saving DB: " << ex.what());
+    }
+    catch (...)
+    {
+        hr = FAILED(db_output.result()) ? db_output.result() : E_FAIL;
+        APSI_LOG_ERROR("APSIServer_SaveDBStreamed: Unknown error saving DB");
+    }
 
-        Query query(move(query_request), sender_db);
+    return hr;
+}
 
-        stringstream ss_response;
-        StreamChannel channel_response(ss_response);
-        Sender::RunQuery(query, channel_response);
+APSIEXPORT HRESULT APSICALL APSIServer_LoadDB1(void** thisptr, uint64_t db_buffer_size, uint8_t* db_buffer)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(db_buffer, E_POINTER);
 
-        string str = ss_response.str();
+    try
+    {
+        ArrayGetBuffer agbuf(reinterpret_cast<const char*>(db_buffer), db_buffer_size);
+        istream db_stream(&agbuf);
 
-        *result_buffer_size = str.size();
-        *result_buffer = new uint8_t[str.size()];
-        copy_bytes(*result_buffer, str.data(), str.size());
+        APSIServer* server = APSIServer::Load(db_stream);
+        *thisptr = server;
     }
     catch (const std::exception& ex)
     {
-        APSI_LOG_ERROR("APSIServer::Query: " << ex.what());
+        APSI_LOG_ERROR("APSIServer_LoadDB1: Error loading DB: " << ex.what());
         return E_FAIL;
     }
     catch (...)
     {
-        APSI_LOG_ERROR("APSIServer::Query: unknown exception");
+        APSI_LOG_ERROR("APSIServer_LoadDB1: Uknown error loading DB");
         return E_FAIL;
     }
 
     return S_OK;
 }
 
-APSIEXPORT HRESULT APSICALL APSIServer_ReleasePointer(std::uint8_t* ptr)
+APSIEXPORT HRESULT APSICALL APSIServer_LoadDB2(void** thisptr, char* file_path)
 {
-    if (nullptr != ptr)
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(file_path, E_POINTER);
+
+    try
+    {
+        ifstream input(file_path, ios::binary | ios::in);
+        APSIServer* server = APSIServer::Load(input);
+        input.close();
+        *thisptr = server;
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer_LoadDB2: Error loading DB: " << ex.what());
+    }
+    catch (...)
     {
-        delete[] ptr;
+        APSI_LOG_ERROR("APSIServer_LoadDB2: Unknown error loading DB");
+        return E_FAIL;
     }
 
     return S_OK;
 }
 
-APSIEXPORT HRESULT APSICALL APSIServer_SetData(void* thisptr, std::uint64_t count, std::uint64_t* data)
+APSIEXPORT HRESULT APSICALL APSIServer_LoadDBMapped(void** thisptr, char* file_path)
 {
     IfNullRet(thisptr, E_POINTER);
-    IfNullRet(data, E_POINTER);
-
-    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    IfNullRet(file_path, E_POINTER);
 
     try
     {
-        vector<Item> apsidata(count);
-        for (size_t i = 0; i < count; i++)
-        {
-            size_t idx = i * 2;
-            auto apsidata64 = apsidata[i].get_as<uint64_t>();
-            apsidata64[0] = data[idx];
-            apsidata64[1] = data[idx + 1];
-        }
+        APSIServer* server = APSIServer::Load(load_sender_db(file_path, /* memory_mapped */ true));
+        *thisptr = server;
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIServer_LoadDBMapped: Error loading DB: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIServer_LoadDBMapped: Unknown error loading DB");
+        return E_FAIL;
+    }
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIServer_ReloadDB(void* thisptr, char* file_path, int memory_mapped)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(file_path, E_POINTER);
 
-        server->create_sender_db();
-        auto sender_db = server->get_sender_db();
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
 
-        sender_db->set_data(apsidata);
-        sender_db->strip();
+    try
+    {
+        // Queries keep using the current database while the new one is loaded
+        server->set_sender_db(load_sender_db(file_path, memory_mapped != FALSE));
     }
     catch (const std::exception& ex)
     {
-        APSI_LOG_ERROR("APSIServer::SetData: " << ex.what());
+        APSI_LOG_ERROR("APSIServer_ReloadDB: Error loading DB: " << ex.what());
         return E_FAIL;
     }
     catch (...)
     {
-        APSI_LOG_ERROR("APSIServer::SetData: unknown exception");
+        APSI_LOG_ERROR("APSIServer_ReloadDB: Unknown error loading DB");
         return E_FAIL;
     }
 
     return S_OK;
 }
 
-APSIEXPORT HRESULT APSICALL APSIServer_Create(void** thisptr, void* poprf_key, void* params)
+APSIEXPORT HRESULT APSICALL APSIServer_SwapDB(void* thisptr, void* other)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(other, E_POINTER);
+
+    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    APSIServer* other_server = reinterpret_cast<APSIServer*>(other);
+
+    server->swap_sender_db(*other_server);
+
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIShardedServer_Create(void** thisptr, void* poprf_key, void* params, uint64_t shard_count)
 {
     IfNullRet(thisptr, E_POINTER);
     IfNullRet(poprf_key, E_POINTER);
     IfNullRet(params, E_POINTER);
 
+    if (0 == shard_count)
+        return E_INVALIDARG;
+
     Log::SetLogLevel(Log::Level::info);
     server_instance_count_s++;
 
     OPRFKey* oprf_key = reinterpret_cast<OPRFKey*>(poprf_key);
     PSIParams* parameters = reinterpret_cast<PSIParams*>(params);
 
-    APSIServer* server = new APSIServer(oprf_key, parameters);
+    ShardedServer* server = new ShardedServer(oprf_key, parameters, static_cast<size_t>(shard_count));
     *thisptr = server;
 
     return S_OK;
 }
 
-APSIEXPORT HRESULT APSICALL APSIServer_Destroy(void* thisptr)
+APSIEXPORT HRESULT APSICALL APSIShardedServer_Destroy(void* thisptr)
 {
     IfNullRet(thisptr, E_POINTER);
 
-    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
+    ShardedServer* server = reinterpret_cast<ShardedServer*>(thisptr);
     delete server;
 
     server_instance_count_s--;
@@ -251,121 +3222,180 @@ APSIEXPORT HRESULT APSICALL APSIServer_Destroy(void* thisptr)
     return S_OK;
 }
 
-APSIEXPORT HRESULT APSICALL APSIServer_SaveDB1(void* thisptr, uint64_t* db_buffer_size, uint8_t** db_buffer)
+APSIEXPORT HRESULT APSICALL APSIShardedServer_GetShardCount(void* thisptr, uint64_t* shard_count)
 {
     IfNullRet(thisptr, E_POINTER);
-    IfNullRet(db_buffer_size, E_POINTER);
-    IfNullRet(db_buffer, E_POINTER);
+    IfNullRet(shard_count, E_POINTER);
 
-    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
-    auto sender_db = server->get_sender_db();
+    ShardedServer* server = reinterpret_cast<ShardedServer*>(thisptr);
+    *shard_count = server->shard_count();
 
-    if (nullptr == sender_db)
+    return S_OK;
+}
+
+APSIEXPORT HRESULT APSICALL APSIShardedServer_GetParameters(void* thisptr, uint64_t* parameters_size, uint8_t** parameters)
+{
+    IfNullRet(thisptr, E_POINTER);
+
+    ShardedServer* server = reinterpret_cast<ShardedServer*>(thisptr);
+    return APSIServer_GetParameters(&server->shard(0), parameters_size, parameters);
+}
+
+APSIEXPORT HRESULT APSICALL APSIShardedServer_SetData(void* thisptr, uint64_t count, uint64_t* data, uint64_t label_byte_count, uint8_t* labels)
+{
+    IfNullRet(thisptr, E_POINTER);
+    IfNullRet(data, E_POINTER);
+
+    if ((0 == label_byte_count) != (nullptr == labels))
         return E_INVALIDARG;
 
+    ShardedServer* server = reinterpret_cast<ShardedServer*>(thisptr);
+
     try
     {
-        string str;
+        vector<size_t> shard_indices(server->shard_count());
+        for (size_t i = 0; i < shard_indices.size(); i++)
         {
-            // Keep ss in this block so its memory will be released at the end of the block
-            stringstream ss;
-            server->save(ss);
-            str = ss.str();
+            shard_indices[i] = i;
         }
 
-        *db_buffer_size = str.size();
-        *db_buffer = new uint8_t[str.size()];
-        copy_bytes(*db_buffer, str.data(), str.size());
+        set_shard_data(*server, shard_indices, count, data, label_byte_count, labels);
     }
     catch (const std::exception& ex)
     {
-        APSI_LOG_ERROR("APSIServer_SaveDB: Error saving DB: " << ex.what());
+        APSI_LOG_ERROR("APSIShardedServer::SetData: " << ex.what());
         return E_FAIL;
     }
     catch (...)
     {
-        APSI_LOG_ERROR("APSIServer_SaveDB: Unknown error saving DB");
+        APSI_LOG_ERROR("APSIShardedServer::SetData: unknown exception");
         return E_FAIL;
     }
 
     return S_OK;
 }
 
-APSIEXPORT HRESULT APSICALL APSIServer_SaveDB2(void* thisptr, char* file_path)
+APSIEXPORT HRESULT APSICALL APSIShardedServer_SetShardData(void* thisptr, uint64_t shard_index, uint64_t count, uint64_t* data, uint64_t label_byte_count, uint8_t* labels)
 {
     IfNullRet(thisptr, E_POINTER);
-    IfNullRet(file_path, E_POINTER);
+    IfNullRet(data, E_POINTER);
 
-    APSIServer* server = reinterpret_cast<APSIServer*>(thisptr);
-    auto sender_db = server->get_sender_db();
+    if ((0 == label_byte_count) != (nullptr == labels))
+        return E_INVALIDARG;
 
-    if (nullptr == sender_db)
+    ShardedServer* server = reinterpret_cast<ShardedServer*>(thisptr);
+    if (shard_index >= server->shard_count())
         return E_INVALIDARG;
 
-    try {
-        ofstream output(file_path, ios::binary | ios::out | ios::trunc);
-        server->save(output);
-        output.close();
+    try
+    {
+        set_shard_data(*server, { static_cast<size_t>(shard_index) }, count, data, label_byte_count, labels);
     }
-    catch (const std::exception& ex) {
-        APSI_LOG_ERROR("APSIServer_SaveDB2: Error saving DB: " << ex.what());
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("APSIShardedServer::SetShardData: " << ex.what());
         return E_FAIL;
     }
-    catch (...) {
-        APSI_LOG_ERROR("APSIServer_SaveDB2: Unknown error saving DB");
+    catch (...)
+    {
+        APSI_LOG_ERROR("APSIShardedServer::SetShardData: unknown exception");
         return E_FAIL;
     }
 
     return S_OK;
 }
 
+APSIEXPORT HRESULT APSICALL APSIShardedServer_SaveShard(void* thisptr, uint64_t shard_index, char* file_path)
+{
+    IfNullRet(thisptr, E_POINTER);
 
-APSIEXPORT HRESULT APSICALL APSIServer_LoadDB1(void** thisptr, uint64_t db_buffer_size, uint8_t* db_buffer)
+    ShardedServer* server = reinterpret_cast<ShardedServer*>(thisptr);
+    if (shard_index >= server->shard_count())
+        return E_INVALIDARG;
+
+    return APSIServer_SaveDB2(&server->shard(static_cast<size_t>(shard_index)), file_path);
+}
+
+APSIEXPORT HRESULT APSICALL APSIShardedServer_Load(void** thisptr, uint64_t shard_count, char** file_paths)
 {
     IfNullRet(thisptr, E_POINTER);
-    IfNullRet(db_buffer, E_POINTER);
+    IfNullRet(file_paths, E_POINTER);
+
+    if (0 == shard_count)
+        return E_INVALIDARG;
+
+    for (uint64_t i = 0; i < shard_count; i++)
+    {
+        IfNullRet(file_paths[i], E_POINTER);
+    }
 
     try
     {
-        ArrayGetBuffer agbuf(reinterpret_cast<const char*>(db_buffer), db_buffer_size);
-        istream db_stream(&agbuf);
+        vector<future<unique_ptr<APSIServer>>> loads;
+        for (uint64_t i = 0; i < shard_count; i++)
+        {
+            loads.push_back(async(launch::async, [file_path = file_paths[i]]() {
+                ifstream input(file_path, ios::binary | ios::in);
+                input.exceptions(ios::badbit | ios::failbit);
+                return unique_ptr<APSIServer>(APSIServer::Load(input));
+            }));
+        }
 
-        APSIServer* server = APSIServer::Load(db_stream);
-        *thisptr = server;
+        for (auto& load : loads)
+        {
+            load.wait();
+        }
+
+        vector<unique_ptr<APSIServer>> shards;
+        for (auto& load : loads)
+        {
+            shards.push_back(load.get());
+        }
+
+        *thisptr = new ShardedServer(move(shards));
     }
     catch (const std::exception& ex)
     {
-        APSI_LOG_ERROR("APSIServer_LoadDB1: Error loading DB: " << ex.what());
+        APSI_LOG_ERROR("APSIShardedServer_Load: Error loading shards: " << ex.what());
         return E_FAIL;
     }
     catch (...)
     {
-        APSI_LOG_ERROR("APSIServer_LoadDB1: Uknown error loading DB");
+        APSI_LOG_ERROR("APSIShardedServer_Load: Unknown error loading shards");
         return E_FAIL;
     }
 
+    server_instance_count_s++;
     return S_OK;
 }
 
-APSIEXPORT HRESULT APSICALL APSIServer_LoadDB2(void** thisptr, char* file_path)
+APSIEXPORT HRESULT APSICALL APSIShardedServer_Query(void* thisptr, const uint64_t encrypted_query_size, const uint8_t* encrypted_query, uint64_t* result_buffer_size, uint8_t** result_buffer)
 {
     IfNullRet(thisptr, E_POINTER);
-    IfNullRet(file_path, E_POINTER);
+    IfNullRet(encrypted_query, E_POINTER);
+    IfNullRet(result_buffer_size, E_POINTER);
+    IfNullRet(result_buffer, E_POINTER);
+
+    ShardedServer* server = reinterpret_cast<ShardedServer*>(thisptr);
+    auto sender_dbs = server->get_sender_dbs();
+
+    if (sender_dbs.empty())
+        return E_NOT_VALID_STATE;
 
     try
     {
-        ifstream input(file_path, ios::binary | ios::in);
-        APSIServer* server = APSIServer::Load(input);
-        input.close();
-        *thisptr = server;
+        NativeBuffer response_buffer;
+        run_sharded_query(sender_dbs, encrypted_query_size, encrypted_query, response_buffer);
+        return response_buffer.hand_out(result_buffer_size, result_buffer);
     }
     catch (const std::exception& ex)
     {
-        APSI_LOG_ERROR("APSIServer_LoadDB2: Error loading DB: " << ex.what());
+        APSI_LOG_ERROR("APSIShardedServer::Query: " << ex.what());
+        return E_FAIL;
     }
     catch (...)
     {
-        APSI_LOG_ERROR("APSIServer_LoadDB2: Unknown error loading DB");
+        APSI_LOG_ERROR("APSIShardedServer::Query: unknown exception");
         return E_FAIL;
     }
 
@@ -452,24 +3482,12 @@ APSIEXPORT HRESULT APSICALL OPRFSender_RunOPRF(const std::uint64_t encoded_items
 
     try
     {
-        stringstream ss;
-        ss.write(reinterpret_cast<const char*>(encoded_items), encoded_items_size);
-
-        OPRFRequest oprf_request = make_unique<SenderOperationOPRF>();
-        oprf_request->load(ss);
-
-        size_t oprf_count = oprf_request->data.size() / oprf_query_size;
         OPRFKey* poprfKey = reinterpret_cast<OPRFKey*>(oprf_key);
 
-        stringstream ss_response;
-        StreamChannel channel(ss_response);
-        Sender::RunOPRF(oprf_request, *poprfKey, channel);
+        NativeBuffer response_buffer;
+        run_oprf(encoded_items_size, encoded_items, *poprfKey, response_buffer);
 
-        string str = ss_response.str();
-
-        *result_buffer_size = str.size();
-        *result_buffer = new uint8_t[str.size()];
-        copy_bytes(*result_buffer, str.data(), str.length());
+        return response_buffer.hand_out(result_buffer_size, result_buffer);
     }
     catch (const std::exception& ex)
     {
@@ -485,6 +3503,81 @@ APSIEXPORT HRESULT APSICALL OPRFSender_RunOPRF(const std::uint64_t encoded_items
     return S_OK;
 }
 
+APSIEXPORT HRESULT APSICALL OPRFSender_RunOPRFBatch(
+    const uint64_t request_count,
+    const uint64_t* oprf_request_sizes,
+    const uint8_t* const* oprf_requests,
+    void* oprf_key,
+    const uint64_t thread_count,
+    uint64_t* response_buffer_sizes,
+    uint8_t** response_buffers,
+    uint8_t** leased_responses,
+    HRESULT* request_results)
+{
+    IfNullRet(oprf_request_sizes, E_POINTER);
+    IfNullRet(oprf_requests, E_POINTER);
+    IfNullRet(oprf_key, E_POINTER);
+    IfNullRet(response_buffer_sizes, E_POINTER);
+    IfNullRet(response_buffers, E_POINTER);
+    IfNullRet(leased_responses, E_POINTER);
+    IfNullRet(request_results, E_POINTER);
+
+    try
+    {
+        OPRFKey* poprfKey = reinterpret_cast<OPRFKey*>(oprf_key);
+
+        for (uint64_t i = 0; i < request_count; i++)
+        {
+            leased_responses[i] = nullptr;
+            request_results[i] = E_FAIL;
+        }
+
+        // Responses that do not fit in the caller's buffer are handed out in a pooled buffer instead
+        atomic<uint64_t> next_request{ 0 };
+        auto work = [&]() {
+            for (uint64_t i = next_request++; i < request_count; i = next_request++)
+            {
+                try
+                {
+                    if (nullptr == oprf_requests[i])
+                    {
+                        request_results[i] = E_POINTER;
+                        continue;
+                    }
+
+                    NativeBuffer response_buffer(response_buffers[i], response_buffer_sizes[i]);
+                    run_oprf(oprf_request_sizes[i], oprf_requests[i], *poprfKey, response_buffer);
+                    request_results[i] = response_buffer.hand_out(&response_buffer_sizes[i], &leased_responses[i]);
+                }
+                catch (const std::exception& ex)
+                {
+                    APSI_LOG_ERROR("OPRFSender::RunOPRFBatch: request " << i << ": " << ex.what());
+                }
+                catch (...)
+                {
+                    APSI_LOG_ERROR("OPRFSender::RunOPRFBatch: request " << i << ": unknown exception");
+                }
+            }
+        };
+
+        uint64_t max_threads = (0 == thread_count) ? max<uint64_t>(thread::hardware_concurrency(), 1) : thread_count;
+        run_on_oprf_workers(min<uint64_t>(request_count, max_threads) - (0 == request_count ? 0 : 1), work);
+
+        bool all_succeeded = all_of(request_results, request_results + request_count, [](HRESULT hr) { return SUCCEEDED(hr); });
+        return all_succeeded ? S_OK : S_FALSE;
+    }
+    catch (const std::exception& ex)
+    {
+        APSI_LOG_ERROR("OPRFSender::RunOPRFBatch: " << ex.what());
+        return E_FAIL;
+    }
+    catch (...)
+    {
+        APSI_LOG_ERROR("OPRFSender::RunOPRFBatch: unknown exception");
+        return E_FAIL;
+    }
+}
+
 APSIEXPORT HRESULT APSICALL APSIParams_Create(void** thisptr, const char* params)
 {
     IfNullRet(thisptr, E_POINTER);
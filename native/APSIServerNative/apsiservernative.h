@@ -13,6 +13,9 @@
 // 
 ///////////////////////////////////////////////////////////////////////////
 
+// Exports that return a buffer through a size and a buffer pointer write the output to a buffer leased from a
+// native pool of reusable buffers. It must be released with APSIServer_ReleasePointer.
+
 #ifdef _MSC_VER
 
 #ifdef APSISERVERNATIVEDLL
@@ -25,7 +28,7 @@
 
 #else
 
-#define APSIEXPORT
+#define APSIEXPORT extern "C" __attribute__((visibility("default")))
 #define APSICALL
 
 #define TRUE 1
@@ -33,14 +36,201 @@
 
 #endif
 
+#define APSI_METRICS_BUCKET_COUNT 32
+
+// Compression of queries and responses, with the values of seal::compr_mode_type
+#define APSI_COMPRESSION_NONE 0
+#define APSI_COMPRESSION_ZLIB 1
+#define APSI_COMPRESSION_ZSTD 2
+#define APSI_COMPRESSION_MODE_COUNT 3
+
+// Responses are compressed the way the client asked in its query
+#define APSI_COMPRESSION_AS_REQUESTED -1
+
+// Durations recorded by a server. Bucket i counts durations of at least 2^(i - 1) and less than 2^i
+// microseconds; bucket 0 counts durations below one microsecond, and the last bucket all longer durations.
+struct APSIServerLatencyHistogram
+{
+    std::uint64_t count;
+    std::uint64_t total_us;
+    std::uint64_t buckets[APSI_METRICS_BUCKET_COUNT];
+};
+
+// Traffic of a server with one compression mode. Queries are counted under the compression they were sent with,
+// responses under the compression of their result packages. Times are summed over the worker threads.
+struct APSIServerCompressionMetrics
+{
+    std::uint64_t query_count;
+    std::uint64_t query_bytes;
+    std::uint64_t deserialize_us;
+    std::uint64_t response_count;
+    std::uint64_t response_bytes;
+    std::uint64_t serialize_us;
+};
+
+// Snapshot of the metrics of a server. Counters and histograms accumulate since the server was created.
+struct APSIServerMetrics
+{
+    std::uint64_t uptime_us;
+    std::uint64_t queries_completed;
+    std::uint64_t queries_failed;
+    std::uint64_t queries_rejected;
+    std::uint64_t active_queries;
+    std::uint64_t queued_queries;
+    std::uint64_t bytes_in;
+    std::uint64_t bytes_out;
+    std::uint64_t item_count;
+    std::uint64_t bin_bundle_count;
+    std::uint64_t thread_count;
+
+    // Time during which at least one query was running
+    std::uint64_t busy_us;
+
+    // Parsing the query, evaluating it including serialization, serializing the response summed over
+    // the worker threads, and the whole query
+    APSIServerLatencyHistogram deserialize;
+    APSIServerLatencyHistogram evaluate;
+    APSIServerLatencyHistogram serialize;
+    APSIServerLatencyHistogram total;
+
+    // Queries and responses by compression mode, indexed by APSI_COMPRESSION_NONE, _ZLIB and _ZSTD
+    APSIServerCompressionMetrics compression[APSI_COMPRESSION_MODE_COUNT];
+};
+
 APSIEXPORT HRESULT APSICALL APSIServer_GetParameters(void* thisptr, std::uint64_t* parameters_size, std::uint8_t** parameters);
 
 APSIEXPORT HRESULT APSICALL APSIServer_Query(void* thisptr, const std::uint64_t encrypted_query_size, const std::uint8_t* encrypted_query, std::uint64_t* result_buffer_size, std::uint8_t** result_buffer);
 
+// Same as APSIServer_Query, but the result is serialized directly into the caller's buffer destination, with a
+// capacity of destination_capacity bytes, and *leased_result is set to nullptr. A result that does not fit is
+// kept in a leased buffer instead, which is returned in *leased_result. *result_size is the size of the result.
+APSIEXPORT HRESULT APSICALL APSIServer_QueryInto(
+    void* thisptr,
+    const std::uint64_t encrypted_query_size,
+    const std::uint8_t* encrypted_query,
+    const std::uint64_t destination_capacity,
+    std::uint8_t* destination,
+    std::uint64_t* result_size,
+    std::uint8_t** leased_result);
+
+// Runs a query for a client session. Sessions are identified by tokens that this server issues. A query that
+// includes relinearization keys registers them: under *session_token if it names a cached session of this server,
+// otherwise under a new token, which is returned in *session_token. A query created without keys uses the keys
+// registered under *session_token. Returns E_NOT_SET if the query has no keys and none are cached for the
+// session, in which case the client must send its keys again. A query that uses cached keys still copies them
+// once, since an APSI query owns its keys; the copy is a memory copy of the key size, which is much cheaper than
+// sending and deserializing the keys.
+APSIEXPORT HRESULT APSICALL APSIServer_QueryWithSession(void* thisptr, std::uint64_t* session_token, const std::uint64_t encrypted_query_size, const std::uint8_t* encrypted_query, std::uint64_t* result_buffer_size, std::uint8_t** result_buffer);
+
+// Limits the memory used by cached session keys. Keys unused for ttl_seconds expire, and the least
+// recently used keys are evicted once the cache exceeds max_bytes.
+APSIEXPORT HRESULT APSICALL APSIServer_SetKeyCacheLimits(void* thisptr, const std::uint64_t max_bytes, const std::uint64_t ttl_seconds);
+
+APSIEXPORT HRESULT APSICALL APSIServer_RemoveSessionKeys(void* thisptr, const std::uint64_t session_token);
+
+// Sets the compression of the responses of this server, one of the APSI_COMPRESSION_ values. By default
+// (APSI_COMPRESSION_AS_REQUESTED) a response is compressed like the query it answers, so the client chooses
+// per query. Returns E_INVALIDARG for a mode the SEAL build does not support. SEAL has no compression level.
+APSIEXPORT HRESULT APSICALL APSIServer_SetResultCompression(void* thisptr, const int compr_mode);
+
+APSIEXPORT HRESULT APSICALL APSIServer_GetMetrics(void* thisptr, APSIServerMetrics* metrics);
+
+// Estimates the cost of the queries needed for item_count items against the current database, in
+// plaintext-ciphertext multiplications. The same estimate is used by admission control, which counts
+// every query as one for a single item.
+APSIEXPORT HRESULT APSICALL APSIServer_EstimateQueryCost(void* thisptr, const std::uint64_t item_count, std::uint64_t* cost);
+
+// Limits the queries that run at the same time to max_queries, and their total estimated cost to max_cost.
+// Other queries wait in a queue of at most max_queued_queries for up to queue_timeout_ms. A query that
+// cannot be queued fails right away with HRESULT_FROM_WIN32(ERROR_BUSY), and a query that waited too long
+// fails with HRESULT_FROM_WIN32(ERROR_TIMEOUT). A max_queries, max_cost or queue_timeout_ms of 0 means no limit,
+// while a max_queued_queries of 0 rejects every query that cannot run right away. There are no limits by default.
+APSIEXPORT HRESULT APSICALL APSIServer_SetAdmissionLimits(
+    void* thisptr,
+    const std::uint64_t max_queries,
+    const std::uint64_t max_cost,
+    const std::uint64_t max_queued_queries,
+    const std::uint64_t queue_timeout_ms);
+
+// Runs several queries against the same database. Queries are given in encrypted_queries, with their sizes
+// in encrypted_query_sizes. For each query the response buffer and its size, or nullptr and 0 on failure, are
+// returned together with the query's own HRESULT, which is HRESULT_FROM_WIN32(ERROR_BUSY) or
+// HRESULT_FROM_WIN32(ERROR_TIMEOUT) if the admission limits rejected it. Returns S_FALSE if any query failed.
+// The response buffers must be released with APSIServer_ReleasePointer.
+APSIEXPORT HRESULT APSICALL APSIServer_QueryBatch(
+    void* thisptr,
+    const std::uint64_t query_count,
+    const std::uint64_t* encrypted_query_sizes,
+    const std::uint8_t* const* encrypted_queries,
+    std::uint64_t* result_buffer_sizes,
+    std::uint8_t** result_buffers,
+    HRESULT* query_results);
+
+// Receives one serialized message of a query response. The first call carries the response header and
+// every following call one result part; concatenated they are identical to the output of APSIServer_Query.
+// The buffer is only valid during the call. Calls may come from worker threads, but never overlap.
+typedef HRESULT(APSICALL* APSIServer_ResultPartCallback)(void* context, std::uint64_t part_size, const std::uint8_t* part);
+
+APSIEXPORT HRESULT APSICALL APSIServer_QueryStreamed(void* thisptr, const std::uint64_t encrypted_query_size, const std::uint8_t* encrypted_query, APSIServer_ResultPartCallback callback, void* context);
+
+// Receives the outcome of a query started with APSIServer_QueryAsync: hr is S_OK with the response, which must be released
+// with APSIServer_ReleasePointer, E_ABORT if the query was cancelled, HRESULT_FROM_WIN32(ERROR_TIMEOUT) if its
+// deadline passed, or another error. Called exactly once, on a worker thread.
+typedef void(APSICALL* APSIServer_QueryCompletedCallback)(void* context, HRESULT hr, std::uint64_t result_size, std::uint8_t* result);
+
+// Queues a query for the workers of the server, one per hardware thread, and returns immediately. The query stops
+// early, also while it waits for admission, once it is cancelled with APSIServer_CancelQuery or timeout_ms have
+// passed (0 for no timeout). The returned handle must be released with APSIServer_ReleaseQuery; it stays valid
+// until then, also after the callback was called. APSIServer_Destroy waits for the queued queries to complete,
+// and must not be called from the callback.
+APSIEXPORT HRESULT APSICALL APSIServer_QueryAsync(
+    void* thisptr,
+    const std::uint64_t encrypted_query_size,
+    const std::uint8_t* encrypted_query,
+    const std::uint64_t timeout_ms,
+    APSIServer_QueryCompletedCallback callback,
+    void* context,
+    void** query_handle);
+
+APSIEXPORT HRESULT APSICALL APSIServer_CancelQuery(void* query_handle);
+
+APSIEXPORT HRESULT APSICALL APSIServer_ReleaseQuery(void* query_handle);
+
 APSIEXPORT HRESULT APSICALL APSIServer_ReleasePointer(std::uint8_t* ptr);
 
+// Sets the total size of the released buffers the pool keeps for reuse, 256 MB by default. 0 frees every
+// buffer when it is released.
+APSIEXPORT HRESULT APSICALL APSIServer_SetBufferPoolLimit(const std::uint64_t max_retained_bytes);
+
 APSIEXPORT HRESULT APSICALL APSIServer_SetData(void* thisptr, const std::uint64_t count, std::uint64_t* data);
 
+// When updatable is non-zero the DB is not stripped, so items can later be added or removed
+// with APSIServer_InsertOrAssign / APSIServer_Remove without rebuilding the whole DB.
+APSIEXPORT HRESULT APSICALL APSIServer_SetData2(void* thisptr, const std::uint64_t count, std::uint64_t* data, int updatable);
+
+// labels holds count labels of label_byte_count bytes each, in the same order as the items in data.
+APSIEXPORT HRESULT APSICALL APSIServer_SetLabeledData(void* thisptr, const std::uint64_t count, std::uint64_t* data, const std::uint64_t label_byte_count, std::uint8_t* labels, int updatable);
+
+// Chunked alternative to APSIServer_SetData and APSIServer_SetLabeledData. BeginData starts a new database with
+// labels of label_byte_count bytes (0 for no labels). AppendData may be called any number of times, also from
+// several threads at once; labels is nullptr for an unlabeled database. Items are inserted in the background
+// in batches of batch_size items, while further chunks are appended. FinalizeData waits for the last batch and
+// replaces the current database, which keeps serving queries until then. BeginData and FinalizeData must not
+// be called while AppendData calls are in progress.
+APSIEXPORT HRESULT APSICALL APSIServer_BeginData(void* thisptr, std::uint64_t label_byte_count, std::uint64_t batch_size, int updatable);
+
+APSIEXPORT HRESULT APSICALL APSIServer_AppendData(void* thisptr, std::uint64_t count, std::uint64_t* data, std::uint8_t* labels);
+
+APSIEXPORT HRESULT APSICALL APSIServer_FinalizeData(void* thisptr);
+
+APSIEXPORT HRESULT APSICALL APSIServer_InsertOrAssign(void* thisptr, const std::uint64_t count, std::uint64_t* data);
+
+APSIEXPORT HRESULT APSICALL APSIServer_InsertOrAssignLabeled(void* thisptr, const std::uint64_t count, std::uint64_t* data, const std::uint64_t label_byte_count, std::uint8_t* labels);
+
+APSIEXPORT HRESULT APSICALL APSIServer_Remove(void* thisptr, const std::uint64_t count, std::uint64_t* data);
+
+APSIEXPORT HRESULT APSICALL APSIServer_Strip(void* thisptr);
+
 APSIEXPORT HRESULT APSICALL APSIServer_Create(void** thisptr, void *oprf_key, void* params);
 
 APSIEXPORT HRESULT APSICALL APSIServer_Destroy(void* thisptr);
@@ -49,10 +239,54 @@ APSIEXPORT HRESULT APSICALL APSIServer_SaveDB1(void* thisptr, std::uint64_t* db_
 
 APSIEXPORT HRESULT APSICALL APSIServer_SaveDB2(void* thisptr, char* file_path);
 
+// Callback receiving consecutive chunks of the serialized DB. The buffer is only valid during the call.
+// Calls come from one writer thread per save, one at a time and in order; returning a failure stops the save.
+typedef HRESULT(APSICALL* APSIServer_WriteCallback)(void* context, std::uint64_t chunk_size, const std::uint8_t* chunk);
+
+APSIEXPORT HRESULT APSICALL APSIServer_SaveDBStreamed(void* thisptr, APSIServer_WriteCallback callback, void* context);
+
 APSIEXPORT HRESULT APSICALL APSIServer_LoadDB1(void** thisptr, std::uint64_t db_buffer_size, std::uint8_t* db_buffer);
 
 APSIEXPORT HRESULT APSICALL APSIServer_LoadDB2(void** thisptr, char* file_path);
 
+// Same as APSIServer_LoadDB2, but the DB is deserialized directly from a read-only memory mapping of the file.
+// The only gain is skipping the copy through the ifstream buffer: the DB is still fully copied onto the heap and
+// the mapping is closed once it is loaded, so nothing is loaded lazily or shared through the page cache.
+APSIEXPORT HRESULT APSICALL APSIServer_LoadDBMapped(void** thisptr, char* file_path);
+
+// Loads a saved database into an existing server. The server keeps answering queries with its current database
+// while the new one loads, then switches atomically. Queries in flight finish on the previous database, which is
+// freed when the last of them completes.
+APSIEXPORT HRESULT APSICALL APSIServer_ReloadDB(void* thisptr, char* file_path, int memory_mapped);
+
+// Exchanges the databases of two servers, e.g. a serving one and one where a new database was built with
+// APSIServer_SetData. Each server switches atomically, as in APSIServer_ReloadDB.
+APSIEXPORT HRESULT APSICALL APSIServer_SwapDB(void* thisptr, void* other);
+
+// A sharded server splits its items by hash into shard_count databases, which are built, saved and loaded
+// independently. A query runs against all shards and returns a single response, so clients are unchanged.
+APSIEXPORT HRESULT APSICALL APSIShardedServer_Create(void** thisptr, void* oprf_key, void* params, std::uint64_t shard_count);
+
+APSIEXPORT HRESULT APSICALL APSIShardedServer_Destroy(void* thisptr);
+
+APSIEXPORT HRESULT APSICALL APSIShardedServer_GetShardCount(void* thisptr, std::uint64_t* shard_count);
+
+APSIEXPORT HRESULT APSICALL APSIShardedServer_GetParameters(void* thisptr, std::uint64_t* parameters_size, std::uint8_t** parameters);
+
+// Builds all shards in parallel. labels is nullptr and label_byte_count 0 for an unlabeled database.
+APSIEXPORT HRESULT APSICALL APSIShardedServer_SetData(void* thisptr, std::uint64_t count, std::uint64_t* data, std::uint64_t label_byte_count, std::uint8_t* labels);
+
+// Builds a single shard from the items given that belong to it; all other items are ignored. This lets each
+// shard be built on its own, e.g. on different machines, from the same full data set.
+APSIEXPORT HRESULT APSICALL APSIShardedServer_SetShardData(void* thisptr, std::uint64_t shard_index, std::uint64_t count, std::uint64_t* data, std::uint64_t label_byte_count, std::uint8_t* labels);
+
+APSIEXPORT HRESULT APSICALL APSIShardedServer_SaveShard(void* thisptr, std::uint64_t shard_index, char* file_path);
+
+// Loads the shards saved with APSIShardedServer_SaveShard, in parallel. file_paths must be in shard order.
+APSIEXPORT HRESULT APSICALL APSIShardedServer_Load(void** thisptr, std::uint64_t shard_count, char** file_paths);
+
+APSIEXPORT HRESULT APSICALL APSIShardedServer_Query(void* thisptr, const std::uint64_t encrypted_query_size, const std::uint8_t* encrypted_query, std::uint64_t* result_buffer_size, std::uint8_t** result_buffer);
+
 APSIEXPORT HRESULT APSICALL OPRFKey_Create(void** thisptr);
 
 APSIEXPORT HRESULT APSICALL OPRFKey_Destroy(void* thisptr);
@@ -63,8 +297,28 @@ APSIEXPORT HRESULT APSICALL OPRFKey_Load(void* thisptr, const std::uint64_t key_
 
 APSIEXPORT HRESULT APSICALL OPRFSender_RunOPRF(const std::uint64_t encoded_items_size, const std::uint8_t* encoded_items, void* oprf_key, std::uint64_t* result_buffer_size, std::uint8_t** result_buffer);
 
+// Runs the OPRF on several requests, given in oprf_requests with their sizes in oprf_request_sizes, on the
+// calling thread and threads of a pool shared by all batches, up to thread_count threads in total (0 for one per
+// hardware thread). Each response is written to the caller's buffer in response_buffers, whose capacity is given
+// in response_buffer_sizes and which may be null. A response that does not fit there is returned in a leased
+// buffer in leased_responses instead, which must be released with APSIServer_ReleasePointer; otherwise the
+// leased response is null. On return response_buffer_sizes holds the response sizes, and request_results the
+// HRESULT of each request. Returns S_FALSE if any request failed.
+APSIEXPORT HRESULT APSICALL OPRFSender_RunOPRFBatch(
+    const std::uint64_t request_count,
+    const std::uint64_t* oprf_request_sizes,
+    const std::uint8_t* const* oprf_requests,
+    void* oprf_key,
+    const std::uint64_t thread_count,
+    std::uint64_t* response_buffer_sizes,
+    std::uint8_t** response_buffers,
+    std::uint8_t** leased_responses,
+    HRESULT* request_results);
+
 APSIEXPORT HRESULT APSICALL APSIParams_Create(void** thisptr, const char* params);
 
 APSIEXPORT HRESULT APSICALL APSIParams_Destroy(void* thisptr);
 
+// Sets the size of the APSI thread pool, which is shared by all server instances in the process.
+// A thread count of 0 uses the number of hardware threads.
 APSIEXPORT HRESULT APSICALL APSI_SetThreads(std::uint64_t threads);
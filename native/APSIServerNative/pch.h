@@ -10,9 +10,45 @@
 #ifndef PCH_H
 #define PCH_H
 
+#if defined(_MSC_VER)
+
 // add headers that you want to pre-compile here
 #include "framework.h"
 
+#else // _MSC_VER
+
+#include <cstdint>
+
+#define FACILITY_WIN32                   7
+#define ERROR_INSUFFICIENT_BUFFER        122L    // dderror
+#define ERROR_BUSY                       170L
+#define ERROR_NOT_FOUND                  1168L
+#define ERROR_TIMEOUT                    1460L
+#define ERROR_INVALID_STATE              5023L
+
+// HRESULT is 32 bits wide like on Windows, so that error codes are negative
+typedef int32_t HRESULT;
+
+HRESULT AS_HRESULT_FROM_WIN32(unsigned long x);
+
+#define HRESULT_FROM_WIN32(x)            AS_HRESULT_FROM_WIN32(x)
+
+#define SUCCEEDED(hr)                    (((HRESULT)(hr)) >= 0)
+#define FAILED(hr)                       (((HRESULT)(hr)) < 0)
+
+#define E_ABORT                          ((HRESULT)0x80004004L)
+#define E_FAIL                           ((HRESULT)0x80004005L)
+#define E_POINTER                        ((HRESULT)0x80004003L)
+#define E_INVALIDARG                     ((HRESULT)0x80070057L)
+#define E_NOT_SUFFICIENT_BUFFER          AS_HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER)
+#define E_NOT_SET                        AS_HRESULT_FROM_WIN32(ERROR_NOT_FOUND)
+#define E_NOT_VALID_STATE                AS_HRESULT_FROM_WIN32(ERROR_INVALID_STATE)
+
+#define S_OK                             ((HRESULT)0L)
+#define S_FALSE                          ((HRESULT)1L)
+
+#endif // _MSC_VER
+
 #define IfNullRet(exp, ret) if (nullptr == (exp)) { return ret; }
 
 #endif //PCH_H
@@ -1,8 +1,12 @@
 using Microsoft.Research.APSI.Client;
+using Microsoft.Research.APSI.Common;
 using Microsoft.Research.APSI.Server;
 using System;
+using System.Collections.Generic;
 using System.Diagnostics;
 using System.IO;
+using System.Threading;
+using System.Threading.Tasks;
 using Xunit;
 using Xunit.Abstractions;
 
@@ -1125,5 +1129,1593 @@ namespace APSILibraryTests
                 server.Dispose();
             }
         }
+
+        [Fact]
+        public void InsertRemoveTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                ulong[,] data = {
+                { 10, 0 },
+                { 20, 0 },
+                { 30, 0 },
+                { 40, 0 } };
+
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(data, updatable: true);
+
+                ulong[,] items = {
+                    { 20, 0 },  // match, removed later
+                    { 50, 0 },  // inserted later
+                    { 60, 0 } };
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                bool[] intersection = RunQuery(server, client, oprfKey, items);
+                Assert.True(intersection[0]);
+                Assert.False(intersection[1]);
+                Assert.False(intersection[2]);
+
+                server.InsertOrAssign(new ulong[,] { { 50, 0 } });
+                server.Remove(new ulong[,] { { 20, 0 } });
+
+                intersection = RunQuery(server, client, oprfKey, items);
+                Assert.False(intersection[0]);
+                Assert.True(intersection[1]);
+                Assert.False(intersection[2]);
+
+                // A stripped DB cannot be updated anymore
+                server.Strip();
+                Assert.Throws<InvalidOperationException>(() => server.InsertOrAssign(new ulong[,] { { 60, 0 } }));
+
+                intersection = RunQuery(server, client, oprfKey, items);
+                Assert.False(intersection[0]);
+                Assert.True(intersection[1]);
+                Assert.False(intersection[2]);
+            }
+        }
+
+        private static bool[] RunQuery(APSIServer server, APSIClient client, OPRFKey oprfKey, ulong[,] items)
+        {
+            byte[] oprfRequest = client.CreateOPRFRequest(items);
+            byte[] oprfResponse = OPRFSender.RunOPRF(oprfRequest, oprfKey);
+            ulong[,] hashedItems = client.ExtractHashes(oprfResponse);
+
+            byte[] encryptedQuery = client.CreateQuery(hashedItems);
+            Assert.NotNull(encryptedQuery);
+
+            byte[] queryResult = server.Query(encryptedQuery);
+            bool[] intersection = client.ProcessResult(queryResult);
+            Assert.Equal(items.GetLength(dimension: 0), intersection.Length);
+
+            return intersection;
+        }
+
+        [Fact]
+        public void QueryToStreamTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                ulong[,] data = {
+                { 10, 0 },
+                { 20, 0 },
+                { 30, 0 },
+                { 40, 0 } };
+
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(data);
+
+                ulong[,] items = {
+                    { 30, 0 },  // match
+                    { 50, 0 } };
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                byte[] oprfRequest = client.CreateOPRFRequest(items);
+                byte[] oprfResponse = OPRFSender.RunOPRF(oprfRequest, oprfKey);
+                ulong[,] hashedItems = client.ExtractHashes(oprfResponse);
+                byte[] encryptedQuery = client.CreateQuery(hashedItems);
+
+                using MemoryStream queryResult = new();
+                server.Query(encryptedQuery, queryResult);
+
+                bool[] intersection = client.ProcessResult(queryResult.ToArray());
+
+                Assert.Equal(items.GetLength(dimension: 0), intersection.Length);
+                Assert.True(intersection[0]);
+                Assert.False(intersection[1]);
+            }
+        }
+
+        [Fact]
+        public void QueryPartsTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                ulong[,] data = {
+                { 10, 0 },
+                { 20, 0 },
+                { 30, 0 },
+                { 40, 0 } };
+
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(data);
+
+                ulong[,] items = {
+                    { 10, 0 },  // match
+                    { 15, 0 },
+                    { 40, 0 } }; // match
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                byte[] oprfRequest = client.CreateOPRFRequest(items);
+                byte[] oprfResponse = OPRFSender.RunOPRF(oprfRequest, oprfKey);
+                ulong[,] hashedItems = client.ExtractHashes(oprfResponse);
+                byte[] encryptedQuery = client.CreateQuery(hashedItems);
+
+                // Header plus at least one result part
+                List<byte[]> parts = CollectParts(server.QueryParts(encryptedQuery));
+                Assert.True(parts.Count >= 2);
+
+                using MemoryStream queryResult = new();
+                foreach (byte[] part in parts)
+                {
+                    queryResult.Write(part, offset: 0, count: part.Length);
+                }
+
+                bool[] intersection = client.ProcessResult(queryResult.ToArray());
+
+                Assert.Equal(items.GetLength(dimension: 0), intersection.Length);
+                Assert.True(intersection[0]);
+                Assert.False(intersection[1]);
+                Assert.True(intersection[2]);
+
+                // Same result when decrypting each part as it arrives
+                foreach (byte[] part in parts)
+                {
+                    client.ProcessResultPart(part);
+                }
+
+                intersection = client.FinalizeResult();
+
+                Assert.Equal(items.GetLength(dimension: 0), intersection.Length);
+                Assert.True(intersection[0]);
+                Assert.False(intersection[1]);
+                Assert.True(intersection[2]);
+
+                // Stopping after the first part drops the rest instead of leaving the query waiting
+                IAsyncEnumerator<byte[]> partial = server.QueryParts(encryptedQuery).GetAsyncEnumerator();
+                Assert.True(partial.MoveNextAsync().AsTask().GetAwaiter().GetResult());
+                partial.DisposeAsync().AsTask().GetAwaiter().GetResult();
+                Assert.Equal(parts.Count, CollectParts(server.QueryParts(encryptedQuery)).Count);
+            }
+        }
+
+        private static List<byte[]> CollectParts(IAsyncEnumerable<byte[]> parts)
+        {
+            List<byte[]> result = new();
+            IAsyncEnumerator<byte[]> enumerator = parts.GetAsyncEnumerator();
+            try
+            {
+                while (enumerator.MoveNextAsync().AsTask().GetAwaiter().GetResult())
+                {
+                    result.Add(enumerator.Current);
+                }
+            }
+            finally
+            {
+                enumerator.DisposeAsync().AsTask().GetAwaiter().GetResult();
+            }
+
+            return result;
+        }
+
+        [Fact]
+        public void LabeledQueryTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                const int labelByteCount = 10;
+
+                ulong[,] data = {
+                { 10, 0 },
+                { 20, 0 },
+                { 30, 0 },
+                { 40, 0 } };
+
+                // Label of each item is its index repeated
+                byte[] labels = new byte[data.GetLength(dimension: 0) * labelByteCount];
+                for (int i = 0; i < labels.Length; i++)
+                {
+                    labels[i] = (byte)(i / labelByteCount + 1);
+                }
+
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(data, labels, labelByteCount, updatable: true);
+
+                ulong[,] items = {
+                    { 30, 0 },  // match, label 3
+                    { 50, 0 },  // inserted later with label 9
+                    { 10, 0 } }; // match, label 1
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                byte[] oprfRequest = client.CreateOPRFRequest(items);
+                byte[] oprfResponse = OPRFSender.RunOPRF(oprfRequest, oprfKey);
+                ulong[,] hashedItems = client.ExtractHashes(oprfResponse);
+                byte[] encryptedQuery = client.CreateQuery(hashedItems);
+                byte[] queryResult = server.Query(encryptedQuery);
+
+                bool[] intersection = client.ProcessResult(queryResult, out byte[] resultLabels, out int resultLabelByteCount);
+
+                Assert.Equal(labelByteCount, resultLabelByteCount);
+                Assert.Equal(items.GetLength(dimension: 0) * labelByteCount, resultLabels.Length);
+                Assert.True(intersection[0]);
+                Assert.False(intersection[1]);
+                Assert.True(intersection[2]);
+                for (int i = 0; i < labelByteCount; i++)
+                {
+                    Assert.Equal(3, resultLabels[i]);
+                    Assert.Equal(0, resultLabels[labelByteCount + i]);
+                    Assert.Equal(1, resultLabels[2 * labelByteCount + i]);
+                }
+
+                byte[] newLabel = new byte[labelByteCount];
+                Array.Fill(newLabel, (byte)9);
+                server.InsertOrAssign(new ulong[,] { { 50, 0 } }, newLabel, labelByteCount);
+
+                oprfRequest = client.CreateOPRFRequest(items);
+                oprfResponse = OPRFSender.RunOPRF(oprfRequest, oprfKey);
+                hashedItems = client.ExtractHashes(oprfResponse);
+                encryptedQuery = client.CreateQuery(hashedItems);
+
+                foreach (byte[] part in CollectParts(server.QueryParts(encryptedQuery)))
+                {
+                    client.ProcessResultPart(part);
+                }
+
+                intersection = client.FinalizeResult(out resultLabels, out resultLabelByteCount);
+
+                Assert.Equal(labelByteCount, resultLabelByteCount);
+                Assert.True(intersection[0]);
+                Assert.True(intersection[1]);
+                Assert.True(intersection[2]);
+                for (int i = 0; i < labelByteCount; i++)
+                {
+                    Assert.Equal(3, resultLabels[i]);
+                    Assert.Equal(9, resultLabels[labelByteCount + i]);
+                    Assert.Equal(1, resultLabels[2 * labelByteCount + i]);
+                }
+            }
+        }
+
+        [Fact]
+        public void LoadDBMappedTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                ulong[,] data = {
+                { 10, 0 },
+                { 20, 0 },
+                { 30, 0 } };
+
+                string dbFile = Path.GetTempFileName();
+
+                try
+                {
+                    OPRFKey oprfKey = new();
+                    APSIParams parameters = new(paramsString);
+                    using (APSIServer server = new(parameters, oprfKey))
+                    {
+                        server.SetData(data);
+                        server.SaveDB(dbFile);
+                    }
+
+                    using APSIServer server2 = APSIServer.LoadDB(dbFile, memoryMapped: true);
+                    using APSIClient client = new();
+                    client.SetParameters(server2.GetParameters());
+
+                    bool[] intersection = RunQuery(server2, client, oprfKey, new ulong[,] { { 20, 0 }, { 40, 0 } });
+                    Assert.True(intersection[0]);
+                    Assert.False(intersection[1]);
+                }
+                finally
+                {
+                    DeleteIfExists(dbFile);
+                }
+            }
+        }
+
+        [Fact]
+        public void QueryBatchTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                ulong[,] data = {
+                { 10, 0 },
+                { 20, 0 },
+                { 30, 0 } };
+
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(data);
+
+                ulong[][,] items = {
+                    new ulong[,] { { 10, 0 }, { 40, 0 } },
+                    new ulong[,] { { 50, 0 }, { 30, 0 }, { 20, 0 } } };
+
+                APSIClient[] clients = new APSIClient[items.Length];
+                byte[][] queries = new byte[items.Length + 1][];
+                for (int i = 0; i < items.Length; i++)
+                {
+                    clients[i] = new APSIClient();
+                    clients[i].SetParameters(server.GetParameters());
+
+                    byte[] oprfRequest = clients[i].CreateOPRFRequest(items[i]);
+                    byte[] oprfResponse = OPRFSender.RunOPRF(oprfRequest, oprfKey);
+                    queries[i] = clients[i].CreateQuery(clients[i].ExtractHashes(oprfResponse));
+                }
+
+                // A malformed query fails on its own without affecting the rest of the batch
+                queries[items.Length] = new byte[] { 1, 2, 3 };
+
+                QueryBatchResult[] results = server.QueryBatch(queries);
+                Assert.Equal(queries.Length, results.Length);
+                Assert.False(results[items.Length].Succeeded);
+                Assert.False(results[items.Length].Rejected);
+                Assert.Null(results[items.Length].Result);
+                Assert.NotNull(results[items.Length].Error);
+
+                Assert.True(results[0].Succeeded);
+                Assert.Null(results[0].Error);
+                bool[] intersection = clients[0].ProcessResult(results[0].Result);
+                Assert.True(intersection[0]);
+                Assert.False(intersection[1]);
+
+                intersection = clients[1].ProcessResult(results[1].Result);
+                Assert.False(intersection[0]);
+                Assert.True(intersection[1]);
+                Assert.True(intersection[2]);
+
+                foreach (APSIClient client in clients)
+                {
+                    client.Dispose();
+                }
+            }
+        }
+
+        [Fact]
+        public void ClientKeepsThreadCountTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                ulong[,] data = {
+                { 10, 0 },
+                { 20, 0 },
+                { 30, 0 },
+                { 40, 0 } };
+
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(data);
+
+                ulong threadCount = server.GetMetrics().ThreadCount;
+                try
+                {
+                    APSIServer.SetThreads(3);
+
+                    ulong[,] items = {
+                        { 10, 0 },  // match
+                        { 15, 0 } };
+
+                    using APSIClient client = new();
+                    client.SetParameters(server.GetParameters());
+
+                    byte[] oprfRequest = client.CreateOPRFRequest(items);
+                    byte[] oprfResponse = OPRFSender.RunOPRF(oprfRequest, oprfKey);
+                    ulong[,] hashedItems = client.ExtractHashes(oprfResponse);
+                    byte[] encryptedQuery = client.CreateQuery(hashedItems);
+                    List<byte[]> parts = CollectParts(server.QueryParts(encryptedQuery));
+
+                    // New clients and result decryption run while the server answers queries
+                    Task serverQueries = Task.Run(() =>
+                    {
+                        for (int i = 0; i < 3; i++)
+                        {
+                            server.Query(encryptedQuery);
+                        }
+                    });
+                    Task clientCalls = Task.Run(() =>
+                    {
+                        for (int i = 0; i < 3; i++)
+                        {
+                            using APSIClient otherClient = new();
+                            otherClient.SetParameters(server.GetParameters());
+                        }
+
+                        foreach (byte[] part in parts)
+                        {
+                            client.ProcessResultPart(part);
+                        }
+
+                        bool[] intersection = client.FinalizeResult();
+                        Assert.True(intersection[0]);
+                        Assert.False(intersection[1]);
+                    });
+                    Task.WaitAll(serverQueries, clientCalls);
+
+                    Assert.Equal(3ul, server.GetMetrics().ThreadCount);
+                }
+                finally
+                {
+                    APSIServer.SetThreads((uint)threadCount);
+                }
+            }
+        }
+
+        [Fact]
+        public void ClientSessionsTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                ulong[,] data = {
+                { 10, 0 },
+                { 20, 0 },
+                { 30, 0 } };
+
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(data);
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                using APSIClientSession session1 = client.CreateSession();
+                using APSIClientSession session2 = client.CreateSession();
+
+                ulong[,] items1 = { { 10, 0 }, { 40, 0 } };
+                ulong[,] items2 = { { 50, 0 }, { 30, 0 }, { 20, 0 } };
+
+                // Both queries are in flight at the same time
+                byte[] oprfRequest1 = session1.CreateOPRFRequest(items1);
+                byte[] oprfRequest2 = session2.CreateOPRFRequest(items2);
+                ulong[,] hashedItems2 = session2.ExtractHashes(OPRFSender.RunOPRF(oprfRequest2, oprfKey));
+                ulong[,] hashedItems1 = session1.ExtractHashes(OPRFSender.RunOPRF(oprfRequest1, oprfKey));
+                byte[] query1 = session1.CreateQuery(hashedItems1);
+                byte[] query2 = session2.CreateQuery(hashedItems2);
+
+                bool[] intersection2 = session2.ProcessResult(server.Query(query2));
+                bool[] intersection1 = session1.ProcessResult(server.Query(query1));
+
+                Assert.True(intersection1[0]);
+                Assert.False(intersection1[1]);
+                Assert.False(intersection2[0]);
+                Assert.True(intersection2[1]);
+                Assert.True(intersection2[2]);
+
+                // The client itself still works next to its sessions
+                bool[] intersection = RunQuery(server, client, oprfKey, items1);
+                Assert.True(intersection[0]);
+                Assert.False(intersection[1]);
+            }
+        }
+
+        [Fact]
+        public void ReuseKeysTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                ulong[,] data = {
+                { 10, 0 },
+                { 20, 0 } };
+
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(data);
+
+                ulong[,] items = { { 20, 0 }, { 40, 0 } };
+
+                try
+                {
+                    // The second client gets the keys generated by the first one
+                    for (int i = 0; i < 2; i++)
+                    {
+                        using APSIClient client = new();
+                        client.SetParameters(server.GetParameters(), reuseKeys: true);
+
+                        bool[] intersection = RunQuery(server, client, oprfKey, items);
+                        Assert.True(intersection[0]);
+                        Assert.False(intersection[1]);
+                    }
+                }
+                finally
+                {
+                    APSIClient.ClearKeyCache();
+                }
+            }
+        }
+
+
+        [Fact]
+        public void SessionKeysTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                ulong[,] data = {
+                { 10, 0 },
+                { 20, 0 } };
+
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(data);
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                ulong[,] items = { { 20, 0 }, { 40, 0 } };
+                ulong[,] hashedItems = client.ExtractHashes(OPRFSender.RunOPRF(client.CreateOPRFRequest(items), oprfKey));
+
+                // The first query registers the keys of the session, and the server issues its token
+                ulong sessionToken = 0;
+                byte[] queryWithKeys = client.CreateQuery(hashedItems, includeRelinKeys: true);
+                bool[] intersection = client.ProcessResult(server.Query(queryWithKeys, ref sessionToken));
+                Assert.NotEqual(0UL, sessionToken);
+                Assert.True(intersection[0]);
+                Assert.False(intersection[1]);
+
+                byte[] queryWithoutKeys = client.CreateQuery(hashedItems, includeRelinKeys: false);
+                Assert.True(queryWithoutKeys.Length < queryWithKeys.Length);
+
+                ulong token = sessionToken;
+                intersection = client.ProcessResult(server.Query(queryWithoutKeys, ref token));
+                Assert.Equal(sessionToken, token);
+                Assert.True(intersection[0]);
+                Assert.False(intersection[1]);
+
+                // Sending keys again with the token keeps the session, while keys sent without it start another one
+                token = sessionToken;
+                server.Query(queryWithKeys, ref token);
+                Assert.Equal(sessionToken, token);
+                ulong otherToken = 0;
+                server.Query(queryWithKeys, ref otherToken);
+                Assert.NotEqual(sessionToken, otherToken);
+
+                // Tokens the server did not issue, and sessions whose keys were removed, need to send their keys again
+                token = sessionToken + 1;
+                Assert.Null(server.Query(queryWithoutKeys, ref token));
+                server.RemoveSessionKeys(sessionToken);
+                token = sessionToken;
+                Assert.Null(server.Query(queryWithoutKeys, ref token));
+            }
+        }
+
+
+        [Fact]
+        public void RunOPRFBatchTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                ulong[,] data = {
+                { 10, 0 },
+                { 20, 0 },
+                { 30, 0 } };
+
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(data);
+
+                using APSIClient client1 = new();
+                using APSIClient client2 = new();
+                client1.SetParameters(server.GetParameters());
+                client2.SetParameters(server.GetParameters());
+
+                ulong[,] items1 = { { 10, 0 }, { 40, 0 } };
+                ulong[,] items2 = { { 50, 0 }, { 60, 0 }, { 30, 0 } };
+                byte[][] oprfRequests = { client1.CreateOPRFRequest(items1), client2.CreateOPRFRequest(items2) };
+
+                byte[][] oprfResponses = OPRFSender.RunOPRFBatch(oprfRequests, oprfKey, threadCount: 2);
+                Assert.Equal(2, oprfResponses.Length);
+                Assert.Equal(OPRFSender.RunOPRF(oprfRequests[0], oprfKey), oprfResponses[0]);
+                Assert.Equal(OPRFSender.RunOPRF(oprfRequests[1], oprfKey), oprfResponses[1]);
+
+                bool[] intersection1 = client1.ProcessResult(server.Query(client1.CreateQuery(client1.ExtractHashes(oprfResponses[0]))));
+                bool[] intersection2 = client2.ProcessResult(server.Query(client2.CreateQuery(client2.ExtractHashes(oprfResponses[1]))));
+
+                Assert.True(intersection1[0]);
+                Assert.False(intersection1[1]);
+                Assert.False(intersection2[0]);
+                Assert.False(intersection2[1]);
+                Assert.True(intersection2[2]);
+            }
+        }
+
+
+        [Fact]
+        public void ShardedServerTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                ulong[,] data = {
+                { 10, 0 },
+                { 20, 0 },
+                { 30, 0 },
+                { 40, 0 },
+                { 50, 0 } };
+                ulong[,] items = { { 10, 0 }, { 60, 0 }, { 30, 0 }, { 50, 0 } };
+
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                string[] shardFiles = { Path.GetTempFileName(), Path.GetTempFileName(), Path.GetTempFileName() };
+
+                try
+                {
+                    using (APSIShardedServer server = new(parameters, oprfKey, shardCount: 3))
+                    {
+                        server.SetData(data);
+
+                        using APSIClient client = new();
+                        client.SetParameters(server.GetParameters());
+
+                        bool[] intersection = RunShardedQuery(server, client, oprfKey, items);
+                        Assert.Equal(new[] { true, false, true, true }, intersection);
+                    }
+
+                    // Every shard is built and saved on its own, then all are loaded together
+                    using (APSIShardedServer builder = new(parameters, oprfKey, shardCount: 3))
+                    {
+                        for (int i = 0; i < 3; i++)
+                        {
+                            builder.SetShardData(i, data);
+                            builder.SaveShard(i, shardFiles[i]);
+                        }
+                    }
+
+                    using APSIShardedServer server2 = APSIShardedServer.Load(shardFiles);
+                    Assert.Equal(3, server2.ShardCount);
+
+                    using APSIClient client2 = new();
+                    client2.SetParameters(server2.GetParameters());
+
+                    bool[] intersection2 = RunShardedQuery(server2, client2, oprfKey, items);
+                    Assert.Equal(new[] { true, false, true, true }, intersection2);
+                }
+                finally
+                {
+                    foreach (string shardFile in shardFiles)
+                    {
+                        DeleteIfExists(shardFile);
+                    }
+                }
+            }
+        }
+
+        private static bool[] RunShardedQuery(APSIShardedServer server, APSIClient client, OPRFKey oprfKey, ulong[,] items)
+        {
+            byte[] oprfResponse = OPRFSender.RunOPRF(client.CreateOPRFRequest(items), oprfKey);
+            byte[] encryptedQuery = client.CreateQuery(client.ExtractHashes(oprfResponse));
+
+            return client.ProcessResult(server.Query(encryptedQuery));
+        }
+
+
+        [Fact]
+        public void AppendDataTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(new ulong[,] { { 100, 0 } });
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                ulong[][,] chunks = {
+                    new ulong[,] { { 10, 0 }, { 20, 0 }, { 30, 0 } },
+                    new ulong[,] { { 40, 0 } },
+                    new ulong[,] { { 50, 0 }, { 60, 0 } },
+                    new ulong[,] { { 70, 0 }, { 80, 0 } } };
+
+                server.BeginData(batchSize: 2);
+                Parallel.ForEach(chunks, chunk => server.AppendData(chunk));
+
+                // The previous data is used until the new database is finalized
+                ulong[,] items = { { 100, 0 }, { 20, 0 }, { 80, 0 }, { 90, 0 } };
+                Assert.Equal(new[] { true, false, false, false }, RunQuery(server, client, oprfKey, items));
+
+                server.FinalizeData();
+                Assert.Equal(new[] { false, true, true, false }, RunQuery(server, client, oprfKey, items));
+
+                Assert.Throws<InvalidOperationException>(() => server.AppendData(chunks[0]));
+            }
+        }
+
+
+        [Fact]
+        public void SwapDBTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(new ulong[,] { { 10, 0 } });
+
+                using APSIServer staging = new(parameters, oprfKey);
+                staging.SetData(new ulong[,] { { 20, 0 } });
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                ulong[,] items = { { 10, 0 }, { 20, 0 } };
+                Assert.Equal(new[] { true, false }, RunQuery(server, client, oprfKey, items));
+
+                server.SwapDB(staging);
+                Assert.Equal(new[] { false, true }, RunQuery(server, client, oprfKey, items));
+                Assert.Equal(new[] { true, false }, RunQuery(staging, client, oprfKey, items));
+
+                string dbFile = Path.GetTempFileName();
+                try
+                {
+                    staging.SaveDB(dbFile);
+
+                    // Queries keep being answered while the database is reloaded
+                    byte[] encryptedQuery = client.CreateQuery(client.ExtractHashes(OPRFSender.RunOPRF(client.CreateOPRFRequest(items), oprfKey)));
+                    Task reload = Task.Run(() => server.ReloadDB(dbFile, memoryMapped: true));
+                    while (!reload.IsCompleted)
+                    {
+                        bool[] intersection = client.ProcessResult(server.Query(encryptedQuery));
+                        Assert.True(intersection[0] ^ intersection[1]);
+                    }
+                    reload.Wait();
+
+                    Assert.Equal(new[] { true, false }, RunQuery(server, client, oprfKey, items));
+                }
+                finally
+                {
+                    DeleteIfExists(dbFile);
+                }
+            }
+        }
+
+        [Fact]
+        public void QueryAsyncTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(new ulong[,] { { 10, 0 }, { 20, 0 } });
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                ulong[,] items = { { 10, 0 }, { 30, 0 }, { 20, 0 } };
+                byte[] encryptedQuery = client.CreateQuery(client.ExtractHashes(OPRFSender.RunOPRF(client.CreateOPRFRequest(items), oprfKey)));
+
+                byte[] result = server.QueryAsync(encryptedQuery).GetAwaiter().GetResult();
+                Assert.Equal(new[] { true, false, true }, client.ProcessResult(result));
+
+                Task<byte[]>[] queries = new Task<byte[]>[4];
+                for (int i = 0; i < queries.Length; i++)
+                {
+                    queries[i] = server.QueryAsync(encryptedQuery, TimeSpan.FromMinutes(5));
+                }
+                Task.WaitAll(queries);
+                foreach (Task<byte[]> query in queries)
+                {
+                    Assert.Equal(new[] { true, false, true }, client.ProcessResult(query.Result));
+                }
+
+                using CancellationTokenSource cancelled = new();
+                cancelled.Cancel();
+                Task<byte[]> cancelledQuery = server.QueryAsync(encryptedQuery, cancelled.Token);
+                Assert.ThrowsAny<OperationCanceledException>(() => cancelledQuery.GetAwaiter().GetResult());
+                Assert.True(cancelledQuery.IsCanceled);
+
+                // A cancellation that arrives after the query completed does not affect its result
+                using CancellationTokenSource late = new();
+                result = server.QueryAsync(encryptedQuery, late.Token).GetAwaiter().GetResult();
+                late.Cancel();
+                Assert.Equal(new[] { true, false, true }, client.ProcessResult(result));
+
+                Assert.Throws<ArgumentNullException>(() => server.QueryAsync(null));
+                Assert.Throws<ArgumentOutOfRangeException>(() => server.QueryAsync(encryptedQuery, TimeSpan.FromSeconds(-5)));
+            }
+        }
+
+
+        [Fact]
+        public void AdmissionControlTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(new ulong[,] { { 10, 0 }, { 20, 0 } });
+
+                // Items that do not fit in one hash table take several queries
+                ulong cost = server.EstimateQueryCost(itemCount: 1);
+                Assert.True(cost > 0);
+                Assert.Equal(cost, server.EstimateQueryCost(itemCount: 512));
+                Assert.Equal(3 * cost, server.EstimateQueryCost(itemCount: 1025));
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                ulong[,] items = { { 10, 0 }, { 30, 0 } };
+                byte[] encryptedQuery = client.CreateQuery(client.ExtractHashes(OPRFSender.RunOPRF(client.CreateOPRFRequest(items), oprfKey)));
+
+                // A query that costs more than the budget still runs on its own
+                server.SetAdmissionLimits(maxConcurrentQueries: 1, maxCost: cost / 2, maxQueuedQueries: -1, Timeout.InfiniteTimeSpan);
+                Assert.True(server.TryQuery(encryptedQuery, out byte[] result));
+                Assert.Equal(new[] { true, false }, client.ProcessResult(result));
+
+                // Queued queries all run in the end
+                Task<byte[]>[] queries = new Task<byte[]>[4];
+                for (int i = 0; i < queries.Length; i++)
+                {
+                    queries[i] = server.QueryAsync(encryptedQuery);
+                }
+                Task.WaitAll(queries);
+                foreach (Task<byte[]> query in queries)
+                {
+                    Assert.Equal(new[] { true, false }, client.ProcessResult(query.Result));
+                }
+
+                // Queued queries stop waiting once they are cancelled
+                using (CancellationTokenSource cancellation = new())
+                {
+                    for (int i = 0; i < queries.Length; i++)
+                    {
+                        queries[i] = server.QueryAsync(encryptedQuery, cancellation.Token);
+                    }
+                    cancellation.Cancel();
+
+                    try
+                    {
+                        Task.WaitAll(queries);
+                    }
+                    catch (AggregateException)
+                    {
+                    }
+                    foreach (Task<byte[]> query in queries)
+                    {
+                        Assert.True(query.IsCompletedSuccessfully || query.IsCanceled);
+                    }
+                }
+
+                // Without a queue, queries that arrive while another one runs are rejected
+                server.SetAdmissionLimits(maxConcurrentQueries: 1, maxCost: 0, maxQueuedQueries: 0, Timeout.InfiniteTimeSpan);
+                Task<bool>[] attempts = new Task<bool>[8];
+                for (int i = 0; i < attempts.Length; i++)
+                {
+                    attempts[i] = Task.Run(() => server.TryQuery(encryptedQuery, out byte[] _));
+                }
+                Task.WaitAll(attempts);
+                Assert.Contains(attempts, attempt => attempt.Result);
+                Assert.True(server.TryQuery(encryptedQuery, out result));
+                Assert.Equal(new[] { true, false }, client.ProcessResult(result));
+
+                server.SetAdmissionLimits(maxConcurrentQueries: 0, maxCost: 0, maxQueuedQueries: -1, Timeout.InfiniteTimeSpan);
+                Assert.Throws<ArgumentOutOfRangeException>(() => server.SetAdmissionLimits(-1, 0, 0, TimeSpan.Zero));
+                Assert.Throws<ArgumentOutOfRangeException>(() => server.SetAdmissionLimits(1, 0, -2, TimeSpan.Zero));
+            }
+        }
+
+
+        [Fact]
+        public void MetricsTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+
+                ServerMetrics metrics = server.GetMetrics();
+                Assert.Equal(0ul, metrics.QueriesCompleted);
+                Assert.Equal(0ul, metrics.ItemCount);
+                Assert.Equal(0ul, metrics.Total.Count);
+
+                server.SetData(new ulong[,] { { 10, 0 }, { 20, 0 }, { 30, 0 } });
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                ulong[,] items = { { 10, 0 }, { 40, 0 } };
+                byte[] encryptedQuery = client.CreateQuery(client.ExtractHashes(OPRFSender.RunOPRF(client.CreateOPRFRequest(items), oprfKey)));
+                byte[] result = server.Query(encryptedQuery);
+                Assert.Throws<InvalidOperationException>(() => server.Query(new byte[] { 1, 2, 3 }));
+
+                metrics = server.GetMetrics();
+                Assert.Equal(1ul, metrics.QueriesCompleted);
+                Assert.Equal(1ul, metrics.QueriesFailed);
+                Assert.Equal(0ul, metrics.ActiveQueries);
+                Assert.Equal((ulong)(encryptedQuery.Length + 3), metrics.BytesIn);
+                Assert.Equal((ulong)result.Length, metrics.BytesOut);
+                Assert.Equal(3ul, metrics.ItemCount);
+                Assert.True(metrics.BinBundleCount > 0);
+                Assert.True(metrics.Busy > TimeSpan.Zero);
+                Assert.True(metrics.Busy <= metrics.Uptime);
+
+                Assert.Equal(1ul, metrics.Evaluate.Count);
+                Assert.Equal(1ul, metrics.Total.Count);
+                Assert.True(metrics.Serialize.Count > 1);
+                Assert.True(metrics.Total.Total >= metrics.Evaluate.Total);
+                Assert.True(metrics.Total.GetQuantile(0.5) > TimeSpan.Zero);
+            }
+        }
+
+        [Fact]
+        public void SharedMemoryServerArgumentsTest()
+        {
+            // The worker is only started once the arguments are valid
+            Assert.Throws<ArgumentNullException>(() => new SharedMemoryServer(workerPath: null, dbFile: "server.db"));
+            Assert.Throws<ArgumentNullException>(() => new SharedMemoryServer("apsiserverdaemon", dbFile: null));
+            Assert.Throws<ArgumentOutOfRangeException>(() => new SharedMemoryServer("apsiserverdaemon", "server.db", ringSize: 3 * 1024 * 1024));
+            Assert.Throws<ArgumentOutOfRangeException>(() => new SharedMemoryServer("apsiserverdaemon", "server.db", ringSize: 1024));
+        }
+
+        [Fact]
+        public void SharedMemoryServerQueryTest()
+        {
+            // Needs a built apsiserverdaemon, which only runs on Linux
+            string workerPath = Environment.GetEnvironmentVariable("APSI_SERVER_DAEMON");
+            if (!OperatingSystem.IsLinux() || string.IsNullOrEmpty(workerPath) || !File.Exists(workerPath))
+            {
+                OutputStr("APSI_SERVER_DAEMON is not set: skipping the shared memory rings");
+                return;
+            }
+
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                ulong[,] data = {
+                { 10, 0 },
+                { 20, 0 },
+                { 30, 0 } };
+
+                string dbFile = Path.GetTempFileName();
+                string oprfKeyFile = Path.GetTempFileName();
+
+                try
+                {
+                    OPRFKey oprfKey = new();
+                    APSIParams parameters = new(paramsString);
+                    using (APSIServer server = new(parameters, oprfKey))
+                    {
+                        server.SetData(data);
+                        server.SaveDB(dbFile);
+                    }
+                    using (FileStream stream = File.Create(oprfKeyFile))
+                    {
+                        oprfKey.Save(stream);
+                    }
+
+                    using SharedMemoryServer sharedServer = new(workerPath, dbFile, oprfKeyFile);
+                    using APSIClient client = new();
+                    client.SetParameters(sharedServer.GetParameters());
+
+                    // Every request type goes through the rings and back
+                    ulong[,] items = { { 20, 0 }, { 40, 0 } };
+                    byte[] oprfRequest = client.CreateOPRFRequest(items);
+                    byte[] oprfResponse = sharedServer.RunOPRF(oprfRequest);
+                    ulong[,] hashedItems = client.ExtractHashes(oprfResponse);
+
+                    byte[] query = client.CreateQuery(hashedItems);
+                    bool[] intersection = client.ProcessResult(sharedServer.Query(query));
+                    Assert.True(intersection[0]);
+                    Assert.False(intersection[1]);
+
+                    // Concurrent requests are matched to their responses
+                    Task<byte[]>[] results = new Task<byte[]>[4];
+                    for (int i = 0; i < results.Length; i++)
+                        results[i] = sharedServer.QueryAsync(query);
+                    foreach (Task<byte[]> result in results)
+                    {
+                        intersection = client.ProcessResult(result.GetAwaiter().GetResult());
+                        Assert.True(intersection[0]);
+                        Assert.False(intersection[1]);
+                    }
+                }
+                finally
+                {
+                    DeleteIfExists(dbFile);
+                    DeleteIfExists(oprfKeyFile);
+                }
+            }
+        }
+
+        [Fact]
+        public void NativeBufferTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+
+                // Items are pairs of ulongs, here a slice of a larger array
+                ulong[] data = { 0, 0, 10, 0, 20, 0, 30, 0 };
+                server.SetData(new ReadOnlySpan<ulong>(data, 2, 6));
+                Assert.Throws<ArgumentException>(() => server.SetData(new ReadOnlySpan<ulong>(data, 0, 3)));
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                ulong[] items = { 10, 0, 40, 0, 30, 0 };
+                using NativeBuffer oprfRequest = client.CreateOPRFRequest(items);
+                using NativeBuffer oprfResponse = OPRFSender.RunOPRF(oprfRequest.Span, oprfKey);
+                using NativeBuffer hashes = client.ExtractHashes(oprfResponse.Span);
+                Assert.Equal(6, hashes.AsSpan<ulong>().Length);
+
+                // Both interfaces produce the same hashes
+                ulong[,] arrayHashes = client.ExtractHashes(oprfResponse.ToArray());
+                Assert.Equal(arrayHashes[1, 0], hashes.AsSpan<ulong>()[2]);
+                Assert.Equal(arrayHashes[1, 1], hashes.AsSpan<ulong>()[3]);
+
+                using NativeBuffer encryptedQuery = client.CreateQuery(hashes.AsSpan<ulong>());
+                using NativeBuffer result = server.Query(encryptedQuery.Span);
+                using NativeBuffer intersection = client.ProcessResult(result.Span);
+                Assert.Equal(new byte[] { 1, 0, 1 }, intersection.ToArray());
+                Assert.Equal(new[] { true, false, true }, client.ProcessResult(result.ToArray()));
+
+                intersection.Dispose();
+                Assert.True(intersection.IsClosed);
+                Assert.Throws<ObjectDisposedException>(() => intersection.ToArray());
+            }
+        }
+
+        [Fact]
+        public void CallerBufferTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(new ulong[] { 10, 0, 20, 0, 30, 0 });
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                ulong[] items = { 10, 0, 40, 0 };
+                using NativeBuffer oprfRequest = client.CreateOPRFRequest(items);
+                using NativeBuffer oprfResponse = OPRFSender.RunOPRF(oprfRequest.Span, oprfKey);
+                using NativeBuffer hashes = client.ExtractHashes(oprfResponse.Span);
+
+                // A query that does not fit in the destination is kept in a native buffer
+                byte[] query = new byte[16];
+                Assert.False(client.CreateQueryInto(hashes.AsSpan<ulong>(), query, out int querySize, out NativeBuffer leasedQuery));
+                using (leasedQuery)
+                {
+                    Assert.Equal((ulong)querySize, leasedQuery.Length);
+                    query = new byte[querySize + 1024];
+                    leasedQuery.Span.CopyTo(query);
+                }
+                Assert.True(client.CreateQueryInto(hashes.AsSpan<ulong>(), query, out querySize, out leasedQuery));
+                Assert.Null(leasedQuery);
+                Assert.True(querySize <= query.Length);
+
+                byte[] result = new byte[16];
+                Assert.False(server.QueryInto(new ReadOnlySpan<byte>(query, 0, querySize), result, out int resultSize, out NativeBuffer leasedResult));
+                using (leasedResult)
+                {
+                    Assert.Equal((ulong)resultSize, leasedResult.Length);
+                    Assert.Equal(new[] { true, false }, client.ProcessResult(leasedResult.ToArray()));
+                }
+
+                result = new byte[resultSize + 1024];
+                Assert.True(server.QueryInto(new ReadOnlySpan<byte>(query, 0, querySize), result, out resultSize, out leasedResult));
+                Assert.Null(leasedResult);
+                Assert.True(resultSize <= result.Length);
+                Assert.Equal(new[] { true, false }, client.ProcessResult(result.AsSpan(0, resultSize).ToArray()));
+
+                // Releasing everything back to the system does not affect later calls
+                APSIServer.SetBufferPoolLimit(0);
+                APSIClient.SetBufferPoolLimit(0);
+                using NativeBuffer pooledResult = server.Query(new ReadOnlySpan<byte>(query, 0, querySize));
+                Assert.Equal(new[] { true, false }, client.ProcessResult(pooledResult.ToArray()));
+                APSIServer.SetBufferPoolLimit(256UL << 20);
+                APSIClient.SetBufferPoolLimit(256UL << 20);
+            }
+        }
+
+        [Fact]
+        public void CompressionTest()
+        {
+            string paramsString = @"{
+                ""table_params"": {
+                    ""hash_func_count"": 3,
+                    ""table_size"": 512,
+                    ""max_items_per_bin"": 92
+                },
+                ""item_params"": {
+                    ""felts_per_item"": 8
+                },
+                ""query_params"": {
+                    ""ps_low_degree"": 0,
+                    ""query_powers"": [ 1, 3, 4, 5, 8, 14, 20, 26, 32, 38, 41, 42, 43, 45, 46 ]
+                },
+                ""seal_params"": {
+                    ""plain_modulus"": 40961,
+                    ""poly_modulus_degree"": 4096,
+                    ""coeff_modulus_bits"": [ 40, 32, 32 ]
+                }
+            }";
+
+            lock (_lockObj)
+            {
+                OPRFKey oprfKey = new();
+                APSIParams parameters = new(paramsString);
+                using APSIServer server = new(parameters, oprfKey);
+                server.SetData(new ulong[,] { { 10, 0 }, { 20, 0 }, { 30, 0 } });
+
+                using APSIClient client = new();
+                client.SetParameters(server.GetParameters());
+
+                ulong[,] items = { { 10, 0 }, { 40, 0 } };
+                ulong[,] hashes = client.ExtractHashes(OPRFSender.RunOPRF(client.CreateOPRFRequest(items), oprfKey));
+
+                // Results are compressed like their queries
+                client.SetCompression(Compression.None);
+                byte[] plainQuery = client.CreateQuery(hashes);
+                byte[] plainResult = server.Query(plainQuery);
+                Assert.Equal(new[] { true, false }, client.ProcessResult(plainResult));
+
+                byte[] compressedQuery = client.CreateQuery(hashes, includeRelinKeys: true, Compression.Zstd);
+                byte[] compressedResult = server.Query(compressedQuery);
+                Assert.Equal(new[] { true, false }, client.ProcessResult(compressedResult));
+                Assert.True(compressedQuery.Length < plainQuery.Length);
+                Assert.True(compressedResult.Length < plainResult.Length);
+
+                // The server can override the compression of its results
+                server.SetResultCompression(Compression.None);
+                byte[] overriddenResult = server.Query(compressedQuery);
+                Assert.Equal(new[] { true, false }, client.ProcessResult(overriddenResult));
+                server.SetResultCompression(null);
+
+                ServerMetrics metrics = server.GetMetrics();
+                CompressionMetrics none = metrics.Compression[Compression.None];
+                CompressionMetrics zstd = metrics.Compression[Compression.Zstd];
+                Assert.Equal(1ul, none.QueryCount);
+                Assert.Equal((ulong)plainQuery.Length, none.QueryBytes);
+                Assert.Equal(2ul, none.ResultCount);
+                Assert.Equal((ulong)(plainResult.Length + overriddenResult.Length), none.ResultBytes);
+                Assert.Equal(2ul, zstd.QueryCount);
+                Assert.Equal(1ul, zstd.ResultCount);
+                Assert.Equal((ulong)compressedResult.Length, zstd.ResultBytes);
+                Assert.True(zstd.Serialize > TimeSpan.Zero);
+                Assert.Equal(0ul, metrics.Compression[Compression.Zlib].QueryCount);
+
+                // Sessions start with the compression of their client
+                using APSIClientSession session = client.CreateSession();
+                ulong[,] sessionHashes = session.ExtractHashes(OPRFSender.RunOPRF(session.CreateOPRFRequest(items), oprfKey));
+                Assert.Equal(plainQuery.Length, session.CreateQuery(sessionHashes).Length);
+                session.SetCompression(Compression.Zstd);
+                Assert.True(session.CreateQuery(sessionHashes).Length < plainQuery.Length);
+            }
+        }
     }
 }